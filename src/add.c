@@ -59,10 +59,12 @@ const char *fossil_reserved_name(int N, int omitRepo){
      "_FOSSIL_-journal",
      "_FOSSIL_-wal",
      "_FOSSIL_-shm",
+     "_FOSSIL_-fsmonitor",
      ".fslckout",
      ".fslckout-journal",
      ".fslckout-wal",
      ".fslckout-shm",
+     ".fslckout-fsmonitor",
 
      /* The use of ".fos" as the name of the checkout database is
      ** deprecated.  Use ".fslckout" instead.  At some point, the following
@@ -71,6 +73,7 @@ const char *fossil_reserved_name(int N, int omitRepo){
      ".fos-journal",
      ".fos-wal",
      ".fos-shm",
+     ".fos-fsmonitor",
   };
 
   /* Possible names of auxiliary files generated when the "manifest" property
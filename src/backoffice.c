@@ -22,6 +22,7 @@
 **    *  Sending alerts and notifications
 **    *  Processing the email queue
 **    *  Automatically syncing to peer repositories
+**    *  Bringing the full-text search index up to date
 **
 ** Backoffice processing is automatically started whenever there are
 ** changes to the repository.  The backoffice process dies off after
@@ -80,6 +81,7 @@
 # include <signal.h>
 # include <errno.h>
 # include <fcntl.h>
+# include <sys/wait.h>
 # define GETPID getpid
 #endif
 #include <time.h>
@@ -405,6 +407,33 @@ void backoffice_disable(void){
   backofficeDb = "x";
 }
 
+/*
+** Return true if backoffice_run_if_needed() will start backoffice
+** processing once the database is closed.
+*/
+int backoffice_pending(void){
+  return backofficeDb!=0 && strcmp(backofficeDb,"x")!=0;
+}
+
+/*
+** Get ready to check for backoffice work again, after the work found by
+** backoffice_check_if_needed() has been started by closing the database.
+** This is for a process that goes on to handle further web pages.
+**
+** Backoffice processes that this process started earlier and that have
+** since finished are also collected.  A finished process that has not
+** been collected still exists as far as backofficeProcessExists() can
+** tell, and so would prevent any new backoffice work for the lease time.
+*/
+void backoffice_reset(void){
+  if( backoffice_pending() ) fossil_free(backofficeDb);
+  backofficeDb = 0;
+  backofficeNoDelay = 0;
+#if !defined(_WIN32)
+  while( waitpid(-1, 0, WNOHANG)>0 ){}
+#endif
+}
+
 /*
 ** Check for errors prior to running backoffice_thread() or backoffice_run().
 */
@@ -538,6 +567,8 @@ void backoffice_work(void){
   /* Here is where the actual work of the backoffice happens */
   alert_backoffice(0);
   smtp_cleanup();
+  search_backoffice();
+  trigram_backoffice();
 }
 
 /*
@@ -15,7 +15,8 @@
 *******************************************************************************
 **
 ** This file implements a cache for expense operations such as
-** /zip and /tarball.
+** /zip and /tarball, and a cache of fully expanded artifacts that
+** is shared by all processes using the same repository.
 */
 #include "config.h"
 #include <sqlite3.h>
@@ -38,6 +39,16 @@ static char *cacheName(void){
   return mprintf("%.*s.cache", i, g.zRepositoryName);
 }
 
+/*
+** Return true if the cache database exists.
+*/
+int cache_exists(void){
+  char *zDbName = cacheName();
+  int rc = zDbName!=0 && file_size(zDbName, ExtFILE)>0;
+  fossil_free(zDbName);
+  return rc;
+}
+
 /*
 ** Attempt to open the cache database, if such a database exists.
 ** Make sure the cache table exists within that database.
@@ -77,7 +88,42 @@ static sqlite3 *cacheOpen(int bForce){
        ");"
        "CREATE TRIGGER IF NOT EXISTS cacheDel AFTER DELETE ON cache BEGIN"
        "  DELETE FROM blob WHERE id=OLD.id;"
-       "END;",
+       "END;"
+       "CREATE TABLE IF NOT EXISTS artifact("
+         "hash TEXT PRIMARY KEY,"    /* Artifact hash */
+         "sz INT,"                   /* Size of content in bytes */
+         "tm INT,"                   /* Time of insertion (unix timestamp) */
+         "data BLOB"                 /* Fully expanded artifact content */
+       ");"
+       "CREATE TABLE IF NOT EXISTS artifactsz("
+         "id INTEGER PRIMARY KEY,"   /* Always 1 */
+         "total INT"                 /* Sum of artifact.sz */
+       ");"
+       "INSERT INTO artifactsz(id,total)"
+       "  SELECT 1, (SELECT total(sz) FROM artifact)"
+       "   WHERE NOT EXISTS(SELECT 1 FROM artifactsz);"
+       "CREATE TRIGGER IF NOT EXISTS artifactIns AFTER INSERT ON artifact"
+       " BEGIN"
+       "  UPDATE artifactsz SET total=total+NEW.sz;"
+       "END;"
+       "CREATE TRIGGER IF NOT EXISTS artifactDel AFTER DELETE ON artifact"
+       " BEGIN"
+       "  UPDATE artifactsz SET total=total-OLD.sz;"
+       "END;"
+       "CREATE TABLE IF NOT EXISTS clonepack("
+         "key TEXT,"                 /* Identifies the pack.  See xfer.c */
+         "minrid INT,"               /* First RID covered by this chunk */
+         "maxrid INT,"               /* Last RID covered by this chunk */
+         "tm INT,"                   /* Time of insertion (unix timestamp) */
+         "data BLOB,"                /* Pack records.  See send_clone_pack() */
+         "PRIMARY KEY(key,minrid)"
+       ");"
+       "CREATE TABLE IF NOT EXISTS annotation("
+         "key TEXT PRIMARY KEY,"     /* Check-in, flags and filename */
+         "tm INT,"                   /* Last access time (unix timestamp) */
+         "vers TEXT,"                /* Hashes of the versions analyzed */
+         "lines TEXT"                /* Version index for each line */
+       ");",
        0, 0, 0
     );
     if( rc!=SQLITE_OK ){
@@ -241,6 +287,354 @@ cache_read_done:
   return rc;
 }
 
+/*
+** SETTING: artifact-cache-size width=25 default=0
+** If this setting is greater than zero and the cache file for the
+** repository exists (see "fossil cache init"), then artifacts that are
+** stored as deltas are saved in fully expanded form in the cache file
+** after they are first reconstructed, so that other processes, such as
+** the many children of "fossil server", can reuse them without having to
+** expand the delta chain again.  The value is an upper bound on the total
+** number of bytes of artifact content held in the cache file.
+*/
+
+/*
+** State information for the shared artifact cache.  The connection
+** to the cache database is opened on first use and held until the
+** process exits.  Because the cache file uses WAL mode, readers in
+** any number of processes never block each other or the writer.
+*/
+static struct {
+  int isInit;              /* True if initialization has been attempted */
+  sqlite3 *db;             /* Cache database.  NULL if cache is disabled */
+  i64 szLimit;             /* Value of the artifact-cache-size setting */
+  sqlite3_stmt *pRead;     /* Statement to read an artifact */
+  sqlite3_stmt *pWrite;    /* Statement to save an artifact */
+} artCache;
+
+/*
+** Return the cache database connection to use for the shared artifact
+** cache, or NULL if the shared artifact cache is disabled.
+*/
+static sqlite3 *artifact_cache_db(void){
+  if( artCache.isInit ) return artCache.db;
+  artCache.isInit = 1;
+  artCache.szLimit = db_get_int("artifact-cache-size", 0);
+  if( artCache.szLimit<=0 ) return 0;
+  artCache.db = cacheOpen(0);
+  if( artCache.db==0 ) return 0;
+  sqlite3_busy_timeout(artCache.db, 100);
+  sqlite3_exec(artCache.db, "PRAGMA journal_mode=WAL", 0, 0, 0);
+  artCache.pRead = cacheStmt(artCache.db,
+      "SELECT data FROM artifact WHERE hash=?1");
+  artCache.pWrite = cacheStmt(artCache.db,
+      "INSERT OR IGNORE INTO artifact(hash,sz,tm,data)"
+      "VALUES(?1,?2,strftime('%s','now'),?3)");
+  if( artCache.pRead==0 || artCache.pWrite==0 ){
+    sqlite3_finalize(artCache.pRead);
+    sqlite3_finalize(artCache.pWrite);
+    sqlite3_close(artCache.db);
+    memset(&artCache, 0, sizeof(artCache));
+    artCache.isInit = 1;
+  }
+  return artCache.db;
+}
+
+/*
+** Return the artifact hash for rid, or NULL if there is no such
+** artifact.  The string is obtained from fossil_malloc().
+*/
+static char *artifact_cache_key(int rid){
+  static Stmt q;
+  char *zHash = 0;
+  db_static_prepare(&q, "SELECT uuid FROM blob WHERE rid=:rid");
+  db_bind_int(&q, ":rid", rid);
+  if( db_step(&q)==SQLITE_ROW ){
+    zHash = fossil_strdup(db_column_text(&q, 0));
+  }
+  db_reset(&q);
+  return zHash;
+}
+
+/*
+** Attempt to read the fully expanded content of artifact rid from the
+** shared artifact cache into pContent, which must be empty.  Return
+** non-zero on success and zero if the shared artifact cache is disabled
+** or does not hold the artifact.
+*/
+int cache_artifact_read(int rid, Blob *pContent){
+  sqlite3 *db = artifact_cache_db();
+  char *zHash;
+  int rc = 0;
+  if( db==0 ) return 0;
+  zHash = artifact_cache_key(rid);
+  if( zHash==0 ) return 0;
+  sqlite3_bind_text(artCache.pRead, 1, zHash, -1, SQLITE_STATIC);
+  if( sqlite3_step(artCache.pRead)==SQLITE_ROW ){
+    blob_append(pContent, sqlite3_column_blob(artCache.pRead, 0),
+                          sqlite3_column_bytes(artCache.pRead, 0));
+    rc = 1;
+  }
+  sqlite3_reset(artCache.pRead);
+  fossil_free(zHash);
+  return rc;
+}
+
+/*
+** Save the fully expanded content of artifact rid in the shared
+** artifact cache.  This is a no-op if the shared artifact cache is
+** disabled, if the cache database is busy, or if the artifact is larger
+** than a quarter of the artifact-cache-size setting.  The oldest entries
+** are removed as necessary to keep the total size of the content below
+** the artifact-cache-size setting.
+*/
+void cache_artifact_write(int rid, Blob *pContent){
+  sqlite3 *db = artifact_cache_db();
+  char *zHash;
+  int rc;
+  if( db==0 || blob_size(pContent)>artCache.szLimit/4 ) return;
+  zHash = artifact_cache_key(rid);
+  if( zHash==0 ) return;
+  if( sqlite3_exec(db, "BEGIN IMMEDIATE", 0, 0, 0)!=SQLITE_OK ){
+    fossil_free(zHash);
+    return;
+  }
+  sqlite3_bind_text(artCache.pWrite, 1, zHash, -1, SQLITE_STATIC);
+  sqlite3_bind_int(artCache.pWrite, 2, blob_size(pContent));
+  sqlite3_bind_blob(artCache.pWrite, 3, blob_buffer(pContent),
+                    blob_size(pContent), SQLITE_STATIC);
+  rc = sqlite3_step(artCache.pWrite);
+  sqlite3_reset(artCache.pWrite);
+  if( rc==SQLITE_DONE && sqlite3_changes(db) ){
+    /* Remove the oldest entries, in order of insertion, until the total
+    ** kept up to date by triggers on the artifact table fits the limit */
+    sqlite3_stmt *pStmt;
+    pStmt = cacheStmt(db,
+        "DELETE FROM artifact"
+        " WHERE rowid=(SELECT min(rowid) FROM artifact)"
+        "   AND (SELECT total FROM artifactsz)>?1");
+    if( pStmt ){
+      sqlite3_bind_int64(pStmt, 1, artCache.szLimit);
+      while( sqlite3_step(pStmt)==SQLITE_DONE && sqlite3_changes(db)>0 ){
+        sqlite3_reset(pStmt);
+      }
+      sqlite3_finalize(pStmt);
+    }
+  }
+  sqlite3_exec(db, rc==SQLITE_DONE ? "COMMIT" : "ROLLBACK", 0, 0, 0);
+  fossil_free(zHash);
+}
+
+/*
+** Close the shared artifact cache, if it is open.
+*/
+void cache_artifact_close(void){
+  if( artCache.db ){
+    sqlite3_finalize(artCache.pRead);
+    sqlite3_finalize(artCache.pWrite);
+    sqlite3_close(artCache.db);
+  }
+  memset(&artCache, 0, sizeof(artCache));
+}
+
+/*
+** Attempt to read the chunk of the clone pack zKey that begins with
+** artifact minRid.  Append the chunk to pData and write the last RID it
+** covers into *pMaxRid.  Return non-zero on success and zero if the
+** cache does not exist or does not hold the chunk.
+*/
+int cache_clonepack_read(
+  const char *zKey,      /* Key of the pack */
+  int minRid,            /* First RID of the chunk */
+  int *pMaxRid,          /* OUT: Last RID of the chunk */
+  Blob *pData            /* Append the chunk here */
+){
+  sqlite3 *db;
+  sqlite3_stmt *pStmt;
+  int rc = 0;
+
+  db = cacheOpen(0);
+  if( db==0 ) return 0;
+  pStmt = cacheStmt(db,
+    "SELECT maxrid, data FROM clonepack WHERE key=?1 AND minrid=?2");
+  if( pStmt ){
+    sqlite3_bind_text(pStmt, 1, zKey, -1, SQLITE_STATIC);
+    sqlite3_bind_int(pStmt, 2, minRid);
+    if( sqlite3_step(pStmt)==SQLITE_ROW ){
+      *pMaxRid = sqlite3_column_int(pStmt, 0);
+      blob_append(pData, sqlite3_column_blob(pStmt, 1),
+                         sqlite3_column_bytes(pStmt, 1));
+      rc = 1;
+    }
+    sqlite3_finalize(pStmt);
+  }
+  sqlite3_close(db);
+  return rc;
+}
+
+/*
+** Return the key of the clone pack that was most recently started in
+** the cache, or NULL if there is none.  The string is obtained from
+** fossil_malloc().
+*/
+char *cache_clonepack_key(void){
+  sqlite3 *db;
+  sqlite3_stmt *pStmt;
+  char *zKey = 0;
+
+  db = cacheOpen(0);
+  if( db==0 ) return 0;
+  pStmt = cacheStmt(db,
+    "SELECT key FROM clonepack WHERE minrid=1 ORDER BY tm DESC LIMIT 1");
+  if( pStmt ){
+    if( sqlite3_step(pStmt)==SQLITE_ROW ){
+      zKey = fossil_strdup((const char*)sqlite3_column_text(pStmt, 0));
+    }
+    sqlite3_finalize(pStmt);
+  }
+  sqlite3_close(db);
+  return zKey;
+}
+
+/*
+** Save a chunk of the clone pack zKey in the cache, if the cache
+** exists.  Only the two most recently written packs are kept, so that
+** clients still fetching the previous pack do not evict the current
+** one.
+*/
+void cache_clonepack_write(
+  const char *zKey,      /* Key of the pack */
+  int minRid,            /* First RID of the chunk */
+  int maxRid,            /* Last RID of the chunk */
+  Blob *pData            /* Content of the chunk */
+){
+  sqlite3 *db;
+  sqlite3_stmt *pStmt;
+  int rc = 0;
+
+  db = cacheOpen(0);
+  if( db==0 ) return;
+  sqlite3_busy_timeout(db, 10000);
+  sqlite3_exec(db, "BEGIN IMMEDIATE", 0, 0, 0);
+  pStmt = cacheStmt(db,
+      "INSERT OR IGNORE INTO clonepack(key,minrid,maxrid,tm,data)"
+      "VALUES(?1,?2,?3,strftime('%s','now'),?4)");
+  if( pStmt==0 ) goto clonepack_write_end;
+  sqlite3_bind_text(pStmt, 1, zKey, -1, SQLITE_STATIC);
+  sqlite3_bind_int(pStmt, 2, minRid);
+  sqlite3_bind_int(pStmt, 3, maxRid);
+  sqlite3_bind_blob(pStmt, 4, blob_buffer(pData), blob_size(pData),
+                    SQLITE_STATIC);
+  rc = sqlite3_step(pStmt)==SQLITE_DONE;
+  sqlite3_finalize(pStmt);
+  if( rc ){
+    sqlite3_exec(db,
+      "DELETE FROM clonepack WHERE key NOT IN ("
+      "  SELECT key FROM clonepack GROUP BY key ORDER BY max(tm) DESC"
+      "  LIMIT 2)", 0, 0, 0);
+  }
+
+clonepack_write_end:
+  sqlite3_exec(db, rc ? "COMMIT" : "ROLLBACK", 0, 0, 0);
+  sqlite3_close(db);
+}
+
+/*
+** Maximum number of annotations held in the cache.  The least recently
+** used are removed first.
+*/
+#define ANNOTATION_CACHE_MAX 2000
+
+/*
+** Look for a saved annotation under each of the nKey keys in azKey[],
+** in order.  If one is found, append its list of versions to pVers and
+** its list of line origins to pLines and return the index of its key.
+** Return -1 if the cache does not exist or holds none of the keys.
+*/
+int cache_annotation_read(
+  char **azKey,          /* Keys to try, most preferred first */
+  int nKey,              /* Number of keys in azKey[] */
+  Blob *pVers,           /* Append the versions analyzed here */
+  Blob *pLines           /* Append the origin of each line here */
+){
+  sqlite3 *db;
+  sqlite3_stmt *pStmt;
+  int i;
+  int iFound = -1;
+
+  db = cacheOpen(0);
+  if( db==0 ) return -1;
+  pStmt = cacheStmt(db, "SELECT vers, lines FROM annotation WHERE key=?1");
+  for(i=0; pStmt && i<nKey; i++){
+    sqlite3_bind_text(pStmt, 1, azKey[i], -1, SQLITE_STATIC);
+    if( sqlite3_step(pStmt)==SQLITE_ROW ){
+      blob_append(pVers, (const char*)sqlite3_column_text(pStmt, 0),
+                         sqlite3_column_bytes(pStmt, 0));
+      blob_append(pLines, (const char*)sqlite3_column_text(pStmt, 1),
+                          sqlite3_column_bytes(pStmt, 1));
+      iFound = i;
+      break;
+    }
+    sqlite3_reset(pStmt);
+  }
+  sqlite3_finalize(pStmt);
+  if( iFound>=0 ){
+    pStmt = cacheStmt(db,
+        "UPDATE annotation SET tm=strftime('%s','now') WHERE key=?1");
+    if( pStmt ){
+      sqlite3_bind_text(pStmt, 1, azKey[iFound], -1, SQLITE_STATIC);
+      sqlite3_step(pStmt);
+      sqlite3_finalize(pStmt);
+    }
+  }
+  sqlite3_close(db);
+  return iFound;
+}
+
+/*
+** Save an annotation in the cache under key zKey, if the cache exists.
+*/
+void cache_annotation_write(
+  const char *zKey,      /* Key for the annotation */
+  Blob *pVers,           /* The versions analyzed */
+  Blob *pLines           /* The origin of each line */
+){
+  sqlite3 *db;
+  sqlite3_stmt *pStmt;
+  int rc = 0;
+
+  db = cacheOpen(0);
+  if( db==0 ) return;
+  sqlite3_busy_timeout(db, 10000);
+  sqlite3_exec(db, "BEGIN IMMEDIATE", 0, 0, 0);
+  pStmt = cacheStmt(db,
+      "REPLACE INTO annotation(key,tm,vers,lines)"
+      "VALUES(?1,strftime('%s','now'),?2,?3)");
+  if( pStmt==0 ) goto annotation_write_end;
+  sqlite3_bind_text(pStmt, 1, zKey, -1, SQLITE_STATIC);
+  sqlite3_bind_text(pStmt, 2, blob_buffer(pVers), blob_size(pVers),
+                    SQLITE_STATIC);
+  sqlite3_bind_text(pStmt, 3, blob_buffer(pLines), blob_size(pLines),
+                    SQLITE_STATIC);
+  rc = sqlite3_step(pStmt)==SQLITE_DONE;
+  sqlite3_finalize(pStmt);
+  if( rc ){
+    pStmt = cacheStmt(db,
+        "DELETE FROM annotation WHERE rowid IN ("
+        "  SELECT rowid FROM annotation ORDER BY tm DESC"
+        "  LIMIT -1 OFFSET ?1)");
+    if( pStmt ){
+      sqlite3_bind_int(pStmt, 1, ANNOTATION_CACHE_MAX);
+      sqlite3_step(pStmt);
+      sqlite3_finalize(pStmt);
+    }
+  }
+
+annotation_write_end:
+  sqlite3_exec(db, rc ? "COMMIT" : "ROLLBACK", 0, 0, 0);
+  sqlite3_close(db);
+}
+
 /*
 ** Create a cache database for the current repository if no such
 ** database already exists.
@@ -255,7 +649,10 @@ void cache_initialize(void){
 ** Usage: %fossil cache SUBCOMMAND
 **
 ** Manage the cache used for potentially expensive web pages such as
-** /zip and /tarball.   SUBCOMMAND can be:
+** /zip and /tarball, for expanded artifacts when the
+** artifact-cache-size setting is enabled, for the pack that is sent
+** to clients by "fossil clone", and for the results of "fossil annotate"
+** and the /annotate page.   SUBCOMMAND can be:
 **
 **    clear        Remove all entries from the cache.
 **
@@ -299,7 +696,10 @@ void cache_cmd(void){
   }else if( strncmp(zCmd, "clear", nCmd)==0 ){
     db = cacheOpen(0);
     if( db ){
-      sqlite3_exec(db, "DELETE FROM cache; DELETE FROM blob; VACUUM;",0,0,0);
+      sqlite3_exec(db, "DELETE FROM cache; DELETE FROM blob;"
+                       " DELETE FROM artifact; DELETE FROM clonepack;"
+                       " DELETE FROM annotation;"
+                       " VACUUM;",0,0,0);
       sqlite3_close(db);
       fossil_print("cache cleared\n");
     }else{
@@ -336,7 +736,40 @@ void cache_cmd(void){
       fossil_free(zDbName);
     }
   }else if( strncmp(zCmd, "status", nCmd)==0 ){
-    fossil_print("TBD...\n");
+    db = cacheOpen(0);
+    if( db==0 ){
+      fossil_print("cache does not exist\n");
+    }else{
+      char *zDbName = cacheName();
+      cache_register_sizename(db);
+      pStmt = cacheStmt(db,
+           "SELECT (SELECT count(*) FROM cache),"
+           "       (SELECT count(*) FROM artifact),"
+           "       (SELECT sizename(total(sz)) FROM artifact),"
+           "       (SELECT count(*) FROM clonepack),"
+           "       (SELECT sizename(total(length(data))) FROM clonepack),"
+           "       (SELECT count(*) FROM annotation),"
+           "       (SELECT sizename(total(length(vers)+length(lines)))"
+           "          FROM annotation)"
+      );
+      if( pStmt && sqlite3_step(pStmt)==SQLITE_ROW ){
+        fossil_print("Web-page entries: %d\n", sqlite3_column_int(pStmt,0));
+        fossil_print("Artifact entries: %d (%s, limit %lld bytes)\n",
+                     sqlite3_column_int(pStmt,1),
+                     sqlite3_column_text(pStmt,2),
+                     (i64)db_get_int("artifact-cache-size",0));
+        fossil_print("Clone-pack chunks: %d (%s)\n",
+                     sqlite3_column_int(pStmt,3),
+                     sqlite3_column_text(pStmt,4));
+        fossil_print("Annotations: %d (%s)\n",
+                     sqlite3_column_int(pStmt,5),
+                     sqlite3_column_text(pStmt,6));
+      }
+      sqlite3_finalize(pStmt);
+      sqlite3_close(db);
+      fossil_print("Cache-file Size: %lld\n", file_size(zDbName, ExtFILE));
+      fossil_free(zDbName);
+    }
   }else{
     fossil_fatal("Unknown subcommand \"%s\"."
                  " Should be one of: clear init list status", zCmd);
@@ -304,15 +304,19 @@ static struct Caps {
     "Debug", "Enable debugging features" },
 };
 
+/*
+** True if the aCap[].nUser values have been computed
+*/
+static int capCountDone = 0;
+
 /*
 ** Populate the aCap[].nUser values based on the current content
 ** of the USER table.
 */
 void capabilities_count(void){
   int i;
-  static int done = 0;
   Stmt q;
-  if( done ) return;
+  if( capCountDone ) return;
   db_prepare(&q, "SELECT fullcap(cap) FROM user");
   while( db_step(&q)==SQLITE_ROW ){
     const char *zCap = db_column_text(&q, 0);
@@ -322,7 +326,21 @@ void capabilities_count(void){
     }
   }
   db_finalize(&q);
-  done = 1;
+  capCountDone = 1;
+}
+
+/*
+** Forget the capabilities of special users and the number of users with
+** each capability, as they might change before the next web page that
+** this process generates.
+*/
+void capabilities_reset(void){
+  int i;
+  capability_expand(0);
+  if( capCountDone ){
+    for(i=0; i<sizeof(aCap)/sizeof(aCap[0]); i++) aCap[i].nUser = 0;
+    capCountDone = 0;
+  }
 }
 
 
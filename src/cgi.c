@@ -31,11 +31,18 @@
 #else
 # include <sys/socket.h>
 # include <netinet/in.h>
+# include <netinet/tcp.h>
 # include <arpa/inet.h>
 # include <sys/times.h>
 # include <sys/time.h>
 # include <sys/wait.h>
 # include <sys/select.h>
+# include <fcntl.h>
+# include <errno.h>
+# include <poll.h>
+# ifdef HAVE_EPOLL_CREATE1
+#  include <sys/epoll.h>
+# endif
 #endif
 #ifdef __EMX__
   typedef int socklen_t;
@@ -246,16 +253,78 @@ static int is_gzippable(void){
 }
 
 /*
-** Do a normal HTTP reply
+** State of a persistent (keep-alive) HTTP connection.  See
+** cgi_http_next_request() for details.
 */
-void cgi_reply(void){
-  int total_size;
+static struct {
+  int nMaxRequest;      /* Maximum requests per connection */
+  int nIdle;            /* Seconds to wait for another request */
+  int nRequest;         /* Requests received on this connection */
+  int nIdleLeft;        /* Milliseconds of idle time left.  -1 for no limit */
+  int nLast;            /* Size of the current request at the start of buf */
+  int isHttp11;         /* The current request is HTTP/1.1 */
+  int bKeepAlive;       /* Keep the connection open after this request */
+  int bNext;            /* The reply is done and another request may follow */
+  FILE *pIn;            /* Reads the current request out of buf */
+  Blob buf;             /* Received on the connection but not yet used */
+} httpConn = { 1, 5, 0, -1, 0, 0, 0, 0, 0, BLOB_INITIALIZER };
+
+/*
+** State of a reply whose body is sent while it is still being generated.
+** See cgi_stream_begin() for details.
+*/
+#define CGI_STREAM_NONE     0   /* Not a streamed reply */
+#define CGI_STREAM_RAW      1   /* The body ends when the connection closes */
+#define CGI_STREAM_CHUNKED  2   /* The body uses chunked transfer coding */
+#define CGI_STREAM_NOBODY   3   /* Reply to a HEAD request.  No body */
+#define CGI_STREAM_DONE     4   /* The reply has been sent */
+#define CGI_STREAM_CHUNK    65536   /* Preferred size of each chunk */
+static struct {
+  int eMode;            /* One of the CGI_STREAM_* values */
+  Blob buf;             /* Body text not yet sent */
+} cgiStream = { CGI_STREAM_NONE, BLOB_INITIALIZER };
+
+/*
+** Return true if the connection is kept open after the current reply.
+** This must be settled before the header of the reply is sent, so that
+** a client that sends further requests without waiting for the reply is
+** told when the connection is going to be closed instead.
+*/
+static int cgi_keep_alive(void){
+  if( !g.fullHttpReply ) return 0;
+  if( httpConn.bKeepAlive && !web_page_can_continue() ){
+    httpConn.bKeepAlive = 0;
+  }
+  return httpConn.bKeepAlive;
+}
+
+/*
+** Call this routine before the reply is sent if the process is going to
+** exit afterwards, so that the reply asks for the connection to be
+** closed.
+*/
+void cgi_close_connection(void){
+  httpConn.bKeepAlive = 0;
+}
+
+/*
+** Output the status line of the reply and all header fields other
+** than those that describe the length and encoding of the body.
+*/
+static void cgi_reply_header(void){
   if( iReplyStatus<=0 ){
     iReplyStatus = 200;
     zReplyStatus = "OK";
   }
 
-  if( g.fullHttpReply ){
+  if( cgi_keep_alive() ){
+    fprintf(g.httpOut, "HTTP/1.%d %d %s\r\n", httpConn.isHttp11,
+            iReplyStatus, zReplyStatus);
+    fprintf(g.httpOut, "Date: %s\r\n", cgi_rfc822_datestamp(time(0)));
+    fprintf(g.httpOut, "Connection: keep-alive\r\n");
+    fprintf(g.httpOut, "Keep-Alive: timeout=%d\r\n", httpConn.nIdle);
+    fprintf(g.httpOut, "X-UA-Compatible: IE=edge\r\n");
+  }else if( g.fullHttpReply ){
     fprintf(g.httpOut, "HTTP/1.0 %d %s\r\n", iReplyStatus, zReplyStatus);
     fprintf(g.httpOut, "Date: %s\r\n", cgi_rfc822_datestamp(time(0)));
     fprintf(g.httpOut, "Connection: close\r\n");
@@ -304,6 +373,38 @@ void cgi_reply(void){
   ** the browser, not some shared location.
   */
   fprintf(g.httpOut, "Content-Type: %s; charset=utf-8\r\n", zContentType);
+}
+
+/*
+** Finish up after the whole reply has been sent.
+*/
+static void cgi_reply_done(void){
+  fflush(g.httpOut);
+  CGIDEBUG(("DONE\n"));
+  if( g.fullHttpReply && httpConn.bKeepAlive ){
+    /* The connection may be used for another request */
+    httpConn.bNext = 1;
+  }
+
+  /* After the webpage has been sent, do any useful background
+  ** processing.
+  */
+  g.cgiOutput = 2;
+  if( g.db!=0 && iReplyStatus==200 ){
+    backoffice_check_if_needed();
+  }
+}
+
+/*
+** Do a normal HTTP reply
+*/
+void cgi_reply(void){
+  int total_size;
+  if( cgiStream.eMode!=CGI_STREAM_NONE ){
+    if( cgiStream.eMode!=CGI_STREAM_DONE ) cgi_stream_end();
+    return;
+  }
+  cgi_reply_header();
   if( fossil_strcmp(zContentType,"application/x-fossil")==0 ){
     cgi_combine_header_and_body();
     blob_compress(&cgiContent[0], &cgiContent[0]);
@@ -339,16 +440,103 @@ void cgi_reply(void){
       }
     }
   }
+  cgi_reply_done();
+}
+
+/*
+** Begin a reply whose body is sent in pieces by cgi_stream_write() as
+** it is generated, rather than accumulated in memory and sent by
+** cgi_reply().  This lets content of any size be served in bounded
+** memory, and the client starts receiving it at once.  The status and
+** the header are sent immediately, so set them first.  Any content
+** accumulated so far is discarded.  Call cgi_stream_end() to finish.
+**
+** On a persistent HTTP/1.1 connection the body is sent with chunked
+** transfer coding.  Otherwise the reply has no Content-Length and the
+** body ends when the connection is closed.
+**
+** Return false for a HEAD request, in which case there is no need to
+** generate the body at all.
+*/
+int cgi_stream_begin(void){
+  int bChunked;
+  assert( cgiStream.eMode==CGI_STREAM_NONE );
+  if( g.fullHttpReply && httpConn.bKeepAlive && !httpConn.isHttp11 ){
+    /* An HTTP/1.0 client cannot find the end of the body unless the
+    ** connection is closed */
+    httpConn.bKeepAlive = 0;
+  }
+  bChunked = cgi_keep_alive();
+  cgi_reply_header();
+  if( bChunked ){
+    fprintf(g.httpOut, "Transfer-Encoding: chunked\r\n");
+  }
+  fprintf(g.httpOut, "\r\n");
   fflush(g.httpOut);
-  CGIDEBUG(("DONE\n"));
+  cgi_reset_content();
+  if( fossil_strcmp(P("REQUEST_METHOD"),"HEAD")==0 ){
+    cgiStream.eMode = CGI_STREAM_NOBODY;
+  }else{
+    cgiStream.eMode = bChunked ? CGI_STREAM_CHUNKED : CGI_STREAM_RAW;
+  }
 
-  /* After the webpage has been sent, do any useful background
-  ** processing.
-  */
+  /* The reply can no longer be replaced by an error page.  An error
+  ** from here on just cuts the body short. */
   g.cgiOutput = 2;
-  if( g.db!=0 && iReplyStatus==200 ){
-    backoffice_check_if_needed();
+  return cgiStream.eMode!=CGI_STREAM_NOBODY;
+}
+
+/*
+** Send n bytes from z as part of the body of a streamed reply.
+*/
+static void cgi_stream_send(const char *z, int n){
+  if( n<=0 ) return;
+  if( cgiStream.eMode==CGI_STREAM_CHUNKED ){
+    fprintf(g.httpOut, "%x\r\n", n);
+    fwrite(z, 1, n, g.httpOut);
+    fprintf(g.httpOut, "\r\n");
+  }else{
+    fwrite(z, 1, n, g.httpOut);
+  }
+  fflush(g.httpOut);
+}
+
+/*
+** Append n bytes from z to the body of a reply started by
+** cgi_stream_begin().  Small writes are gathered into chunks of about
+** CGI_STREAM_CHUNK bytes.
+*/
+void cgi_stream_write(const char *z, int n){
+  int nBuf = blob_size(&cgiStream.buf);
+  if( cgiStream.eMode==CGI_STREAM_NOBODY ) return;
+  assert( cgiStream.eMode==CGI_STREAM_RAW
+       || cgiStream.eMode==CGI_STREAM_CHUNKED );
+  if( nBuf+n<CGI_STREAM_CHUNK ){
+    blob_append(&cgiStream.buf, z, n);
+    return;
+  }
+  if( nBuf>0 ){
+    cgi_stream_send(blob_buffer(&cgiStream.buf), nBuf);
+    blob_resize(&cgiStream.buf, 0);
+  }
+  cgi_stream_send(z, n);
+}
+
+/*
+** Finish a reply started by cgi_stream_begin().
+*/
+void cgi_stream_end(void){
+  if( cgiStream.eMode==CGI_STREAM_RAW
+   || cgiStream.eMode==CGI_STREAM_CHUNKED
+  ){
+    cgi_stream_send(blob_buffer(&cgiStream.buf), blob_size(&cgiStream.buf));
+    if( cgiStream.eMode==CGI_STREAM_CHUNKED ){
+      fprintf(g.httpOut, "0\r\n\r\n");
+    }
   }
+  blob_reset(&cgiStream.buf);
+  cgiStream.eMode = CGI_STREAM_DONE;
+  cgi_reply_done();
 }
 
 /*
@@ -445,8 +633,40 @@ static struct QParam {   /* One entry for each query parameter or cookie */
   int seq;                  /* Order of insertion */
   char isQP;                /* True for query parameters */
   char cTag;                /* Tag on query parameters */
+  char mOwn;                /* QP_OWN_* bits for copies made here */
 } *aParamQP;             /* An array of all parameters and cookies */
 
+/*
+** Allowed values for the QParam.mOwn field.  These record which strings
+** of an entry are copies that cgi_reset_request() should free.
+*/
+#define QP_OWN_NAME   0x01    /* zName was copied by cgi_set_parameter() */
+#define QP_OWN_VALUE  0x02    /* zValue was copied */
+
+/*
+** Forget the current request and its reply, including all CGI
+** parameters, so that the same process can go on to handle another
+** request.  The copies made of parameter names and values are freed.
+*/
+void cgi_reset_request(void){
+  cgi_reset_content();
+  pContent = &cgiContent[0];
+  zContentType = "text/html";
+  zReplyStatus = "OK";
+  iReplyStatus = 200;
+  blob_reset(&extraHeader);
+  while( nUsedQP>0 ){
+    struct QParam *p = &aParamQP[--nUsedQP];
+    if( p->mOwn & QP_OWN_NAME ) fossil_free((char*)p->zName);
+    if( p->mOwn & QP_OWN_VALUE ) fossil_free((char*)p->zValue);
+  }
+  sortQP = 0;
+  seqQP = 0;
+  blob_reset(&cgiStream.buf);
+  cgiStream.eMode = CGI_STREAM_NONE;
+  httpConn.bKeepAlive = 0;
+}
+
 /*
 ** Add another query parameter or cookie to the parameter set.
 ** zName is the name of the query parameter or cookie and zValue
@@ -472,6 +692,7 @@ void cgi_set_parameter_nocopy(const char *zName, const char *zValue, int isQP){
   aParamQP[nUsedQP].seq = seqQP++;
   aParamQP[nUsedQP].isQP = isQP;
   aParamQP[nUsedQP].cTag = 0;
+  aParamQP[nUsedQP].mOwn = 0;
   nUsedQP++;
   sortQP = 1;
 }
@@ -481,13 +702,16 @@ void cgi_set_parameter_nocopy(const char *zName, const char *zValue, int isQP){
 ** zName is the name of the query parameter or cookie and zValue
 ** is its fully decoded value.
 **
-** Copies are made of both the zName and zValue parameters.
+** Copies are made of both the zName and zValue parameters.  They are
+** freed by cgi_reset_request().
 */
 void cgi_set_parameter(const char *zName, const char *zValue){
   cgi_set_parameter_nocopy(mprintf("%s",zName), mprintf("%s",zValue), 0);
+  aParamQP[nUsedQP-1].mOwn = QP_OWN_NAME|QP_OWN_VALUE;
 }
 void cgi_set_query_parameter(const char *zName, const char *zValue){
   cgi_set_parameter_nocopy(mprintf("%s",zName), mprintf("%s",zValue), 1);
+  aParamQP[nUsedQP-1].mOwn = QP_OWN_NAME|QP_OWN_VALUE;
 }
 
 /*
@@ -498,6 +722,7 @@ void cgi_replace_parameter(const char *zName, const char *zValue){
   for(i=0; i<nUsedQP; i++){
     if( fossil_strcmp(aParamQP[i].zName,zName)==0 ){
       aParamQP[i].zValue = zValue;
+      aParamQP[i].mOwn &= ~QP_OWN_VALUE;
       return;
     }
   }
@@ -508,6 +733,7 @@ void cgi_replace_query_parameter(const char *zName, const char *zValue){
   for(i=0; i<nUsedQP; i++){
     if( fossil_strcmp(aParamQP[i].zName,zName)==0 ){
       aParamQP[i].zValue = zValue;
+      aParamQP[i].mOwn &= ~QP_OWN_VALUE;
       assert( aParamQP[i].isQP );
       return;
     }
@@ -550,6 +776,7 @@ void cgi_delete_query_parameter(const char *zName){
 */
 void cgi_setenv(const char *zName, const char *zValue){
   cgi_set_parameter_nocopy(zName, mprintf("%s",zValue), 0);
+  aParamQP[nUsedQP-1].mOwn = QP_OWN_VALUE;
 }
 
 
@@ -1346,6 +1573,7 @@ NORETURN void cgi_panic(const char *zFormat, ...){
     va_start(ap, zFormat);
     vxprintf(pContent,zFormat,ap);
     va_end(ap);
+    cgi_close_connection();
     cgi_reply();
     fossil_exit(1);
   }
@@ -1457,7 +1685,9 @@ void cgi_handle_http_request(const char *zIpAddr){
   cgi_setenv("PATH_INFO", zToken);
   cgi_setenv("QUERY_STRING", &zToken[i]);
   if( zIpAddr==0 ){
-    zIpAddr = cgi_remote_ip(fileno(g.httpIn));
+    /* The connection is on standard input, even when g.httpIn is
+    ** reading a request received by cgi_http_next_request() */
+    zIpAddr = cgi_remote_ip(httpConn.pIn!=0 ? 0 : fileno(g.httpIn));
   }
   if( zIpAddr ){
     cgi_setenv("REMOTE_ADDR", zIpAddr);
@@ -1798,6 +2028,424 @@ void cgi_handle_scgi_request(void){
 # define FOSSIL_MAX_CONNECTIONS 1000
 #endif
 
+/*
+** Maximum number of connections that one worker of the pre-forked pool
+** handles before it exits and is replaced by a new worker.  This bounds
+** the memory that requests leave behind in a long-running worker.
+*/
+#ifndef FOSSIL_MAX_WORKER_CONNECTIONS
+# define FOSSIL_MAX_WORKER_CONNECTIONS 1000
+#endif
+
+/*
+** Settings for the pre-forked worker pool of cgi_http_server().
+*/
+static struct {
+  int nWorker;          /* Number of pre-forked workers.  0 for none */
+  int nBacklog;         /* Length of the listen queue */
+  int listener;         /* Listening socket, in a worker process */
+  int ep;               /* epoll instance of a worker.  -1 if none yet */
+  int nullFd;           /* /dev/null, opened by a worker before any chroot */
+  int nConn;            /* Connections accepted by this worker */
+} httpPool = { 0, 10, -1, -1, -1, 0 };
+
+/*
+** Configure cgi_http_server().  If nWorker is positive, the server
+** starts nWorker worker processes up front and each one accepts
+** connections for itself, rather than forking a new process for every
+** connection.  nBacklog is the length of the queue of connections that
+** have not yet been accepted.  Up to nMaxRequest requests are accepted
+** on each connection, waiting no more than nIdle seconds between
+** requests.  A value of zero or less leaves the corresponding setting
+** unchanged.
+*/
+void cgi_http_server_config(
+  int nWorker,
+  int nBacklog,
+  int nMaxRequest,
+  int nIdle
+){
+  if( nWorker>0 ) httpPool.nWorker = nWorker;
+  if( nBacklog>0 ) httpPool.nBacklog = nBacklog;
+  if( nMaxRequest>0 ) httpConn.nMaxRequest = nMaxRequest;
+  if( nIdle>0 ) httpConn.nIdle = nIdle;
+}
+
+#if !defined(_WIN32)
+/*
+** Run the master process of the pre-forked worker pool.  Start
+** httpPool.nWorker workers and start a replacement whenever one dies.
+**
+** Return 0 in each worker process.  The master never returns.
+*/
+static int cgi_http_pool_master(int listener){
+  int nWorker = httpPool.nWorker;
+  pid_t *aPid = fossil_malloc( sizeof(aPid[0])*nWorker );
+  time_t *aStart = fossil_malloc( sizeof(aStart[0])*nWorker );
+  int i;
+
+  /* Workers race to accept each new connection.  The losers must
+  ** not block in accept(). */
+  fcntl(listener, F_SETFL, fcntl(listener, F_GETFL) | O_NONBLOCK);
+  memset(aPid, 0, sizeof(aPid[0])*nWorker);
+  while( 1 ){
+    int iStatus = 0;
+    pid_t x;
+    for(i=0; i<nWorker; i++){
+      if( aPid[i]>0 ) continue;
+      fflush(stdout);
+      x = fork();
+      if( x==0 ){
+        fossil_free(aPid);
+        fossil_free(aStart);
+        httpPool.listener = listener;
+        /* Opened now, as /dev/null might not exist in a chroot jail */
+        httpPool.nullFd = open("/dev/null", O_RDWR);
+        if( httpPool.nullFd<0 ) fossil_exit(1);
+        return 0;
+      }
+      if( x>0 ){
+        aPid[i] = x;
+        aStart[i] = time(0);
+      }
+    }
+    x = waitpid(-1, &iStatus, 0);
+    if( x<=0 ){
+      /* Unable to fork any workers.  Try again later. */
+      if( errno!=EINTR ) sleep(1);
+      continue;
+    }
+    for(i=0; i<nWorker && aPid[i]!=x; i++){}
+    if( i>=nWorker ) continue;
+    aPid[i] = 0;
+    if( WIFSIGNALED(iStatus) && g.fAnyTrace ){
+      fprintf(stderr, "/***** Worker %d exited on signal %d (%s) *****/\n",
+              x, WTERMSIG(iStatus), strsignal(WTERMSIG(iStatus)));
+    }
+    if( (!WIFEXITED(iStatus) || WEXITSTATUS(iStatus)!=0)
+     && time(0)-aStart[i]<1
+    ){
+      /* Do not spin if workers fail as soon as they start.  A worker
+      ** that exits normally, to be replaced, can be restarted at once. */
+      sleep(1);
+    }
+  }
+  /* NOT REACHED */
+  return 1;
+}
+
+/*
+** Get ready to receive requests on a new connection.  Over the life of
+** the connection, no more than nIdleLeft milliseconds are spent waiting
+** for the client to start another request.  A negative nIdleLeft means
+** no limit other than the idle timeout for each request.
+*/
+static void cgi_http_new_connection(int nIdleLeft){
+  blob_reset(&httpConn.buf);
+  httpConn.nRequest = 0;
+  httpConn.nLast = 0;
+  httpConn.bNext = 0;
+  httpConn.nIdleLeft = nIdleLeft;
+}
+#endif /* !_WIN32 */
+
+/*
+** Return true if this process is a worker of the pre-forked pool
+** started by cgi_http_server() and cgi_http_worker_accept() should be
+** called to receive connections.
+*/
+int cgi_http_is_worker(void){
+  return httpPool.listener>=0;
+}
+
+/*
+** Wait for the next connection in a worker of the pre-forked pool.
+**
+** The worker handles every connection itself, one after another, so
+** that the repository database opened by the worker and its prepared
+** statements are kept from one connection to the next.  The caller must
+** reset all per-request state before it calls this routine again.
+**
+** The previous connection, if any, is released first.  Its descriptors
+** are pointed at /dev/null rather than closed, so that no database file
+** can be opened in their place.  /dev/null was opened when the worker
+** started, before it entered any chroot jail.  After FOSSIL_MAX_WORKER_CONNECTIONS
+** connections the worker exits and the master starts a new one.
+**
+** Return 0 once a new connection is on standard input and output.
+*/
+int cgi_http_worker_accept(void){
+#if defined(_WIN32)
+  fossil_exit(1);
+#else
+  int listener = httpPool.listener;
+#ifdef HAVE_EPOLL_CREATE1
+  struct epoll_event ev;       /* The listener event */
+#endif
+  assert( listener>=0 );
+  if( httpPool.nConn>0 ){
+    fflush(stdout);
+    if( dup2(httpPool.nullFd, 0)!=0 || dup2(httpPool.nullFd, 1)!=1 ){
+      fossil_exit(1);
+    }
+    if( httpPool.nConn>=FOSSIL_MAX_WORKER_CONNECTIONS ) fossil_exit(0);
+  }
+#ifdef HAVE_EPOLL_CREATE1
+  if( httpPool.ep<0 ){
+    httpPool.ep = epoll_create1(EPOLL_CLOEXEC);
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+#ifdef EPOLLEXCLUSIVE
+    /* Wake only one worker for each new connection */
+    ev.events |= EPOLLEXCLUSIVE;
+#endif
+    ev.data.fd = listener;
+    if( httpPool.ep<0
+     || epoll_ctl(httpPool.ep, EPOLL_CTL_ADD, listener, &ev)<0
+    ){
+      fossil_fatal("unable to set up epoll: %s", strerror(errno));
+    }
+  }
+#endif
+  while( 1 ){
+    struct sockaddr_in inaddr;
+    socklen_t lenaddr = sizeof(inaddr);
+    int connection;
+#ifdef HAVE_EPOLL_CREATE1
+    if( epoll_wait(httpPool.ep, &ev, 1, -1)<=0 ) continue;
+#else
+    struct pollfd x;
+    x.fd = listener;
+    x.events = POLLIN;
+    if( poll(&x, 1, -1)<=0 ) continue;
+#endif
+    connection = accept(listener, (struct sockaddr*)&inaddr, &lenaddr);
+    if( connection<0 ) continue;   /* Another worker took the connection */
+    fcntl(connection, F_SETFL, fcntl(connection, F_GETFL) & ~O_NONBLOCK);
+    if( dup2(connection, 0)!=0 || dup2(connection, 1)!=1 ){
+      fossil_exit(1);
+    }
+    close(connection);
+    clearerr(stdout);
+    httpPool.nConn++;
+    g.nPendingRequest = 1;
+    g.nRequest = httpPool.nConn;
+    /* An idle client must not hold on to a worker indefinitely */
+    cgi_http_new_connection(httpConn.nIdle*1000);
+    return 0;
+  }
+#endif
+  /* NOT REACHED */
+  return 1;
+}
+
+#if !defined(_WIN32)
+/*
+** Wait up to nMs milliseconds for more input on fd and append it to
+** pBuf.  Return the number of bytes read, or 0 on end-of-file, timeout
+** or error.
+*/
+static int cgi_http_fill(int fd, Blob *pBuf, int nMs){
+  struct pollfd x;
+  char zBuf[16384];
+  int n;
+  x.fd = fd;
+  x.events = POLLIN;
+  while( (n = poll(&x, 1, nMs))<0 && errno==EINTR ){}
+  if( n<=0 ) return 0;
+  while( (n = read(fd, zBuf, sizeof(zBuf)))<0 && errno==EINTR ){}
+  if( n<=0 ) return 0;
+  blob_append(pBuf, zBuf, n);
+  return n;
+}
+
+/*
+** Read the next complete HTTP request, including any content, from fd.
+** pBuf holds bytes already received but not yet used, and more bytes
+** are appended as they arrive.  Return the size of the request at the
+** start of pBuf, or 0 if the connection should be closed.
+**
+** *pKeepAlive is set to true if the client allows the connection to
+** remain open after this request and *pHttp11 is set to true for an
+** HTTP/1.1 request.
+*/
+static int cgi_http_read_request(
+  int fd,              /* The connection */
+  Blob *pBuf,          /* Bytes received but not yet used */
+  int *pKeepAlive,     /* OUT: True if the connection may stay open */
+  int *pHttp11         /* OUT: True for HTTP/1.1 */
+){
+  const char *z;
+  int i, nHdr = 0, nContent = 0;
+  int nMs = httpConn.nIdle*1000;
+
+  /* Read until the blank line at the end of the header */
+  while( 1 ){
+    z = blob_buffer(pBuf);
+    for(i=0; i<blob_size(pBuf); i++){
+      if( z[i]!='\n' ) continue;
+      if( i+1<blob_size(pBuf) && z[i+1]=='\n' ){ nHdr = i+2; break; }
+      if( i+2<blob_size(pBuf) && z[i+1]=='\r' && z[i+2]=='\n' ){
+        nHdr = i+3;
+        break;
+      }
+    }
+    if( nHdr>0 ) break;
+    if( blob_size(pBuf)>1000000 ) return 0;
+    if( cgi_http_fill(fd, pBuf, nMs)==0 ) return 0;
+  }
+
+  /* Scan the header for the protocol version, the content length and
+  ** the "Connection:" field */
+  *pHttp11 = 0;
+  for(i=0; i<nHdr && z[i]!='\n'; i++){}
+  if( i>=9 && sqlite3_strnicmp(&z[i-9], "HTTP/1.1", 8)==0 ) *pHttp11 = 1;
+  *pKeepAlive = *pHttp11;
+  while( i<nHdr ){
+    const char *zLine = &z[++i];
+    int n;
+    for(n=0; i<nHdr && z[i]!='\n'; i++, n++){}
+    if( n>15 && sqlite3_strnicmp(zLine, "content-length:", 15)==0 ){
+      nContent = atoi(&zLine[15]);
+    }else if( n>11 && sqlite3_strnicmp(zLine, "connection:", 11)==0 ){
+      char *zVal = mprintf("%.*s", n-11, &zLine[11]);
+      if( sqlite3_strglob("*[Cc][Ll][Oo][Ss][Ee]*", zVal)==0 ){
+        *pKeepAlive = 0;
+      }else if( sqlite3_strglob("*[Kk][Ee][Ee][Pp]-[Aa][Ll][Ii][Vv][Ee]*",
+                                zVal)==0 ){
+        *pKeepAlive = 1;
+      }
+      fossil_free(zVal);
+    }else if( n>18 && sqlite3_strnicmp(zLine, "transfer-encoding:", 18)==0 ){
+      /* Chunked request content is not supported.  Do not try to find
+      ** the start of the next request. */
+      *pKeepAlive = 0;
+    }
+  }
+  if( nContent<0 ) return 0;
+
+  /* Read the content */
+  while( blob_size(pBuf)<nHdr+nContent ){
+    if( cgi_http_fill(fd, pBuf, nMs)==0 ) return 0;
+  }
+  return nHdr+nContent;
+}
+#endif /* !_WIN32 */
+
+/*
+** Receive the next HTTP request on the connection on standard input
+** and set g.httpIn to read it.  Return false if there is no further
+** request and the connection should be closed.
+**
+** This routine is called by the process that owns the connection before
+** each request.  Every request is handled by that same process, one
+** after another, so the caller must reset all per-request state between
+** requests.  Up to httpConn.nMaxRequest requests are accepted on each
+** connection.  The connection is closed when the client asks for it to
+** be closed, when the client is idle for longer than the idle timeout,
+** when the limit on requests per connection is reached, or when a reply
+** cannot be followed by another request.
+**
+** Each request is read in full, including its content, before it is
+** handled, which finds where the next request starts.  If only one
+** request per connection is allowed, the request is instead read
+** directly from standard input.
+*/
+int cgi_http_next_request(void){
+#if defined(_WIN32)
+  return httpConn.nRequest++==0;
+#else
+  int n, bKeepAlive, isHttp11;
+
+  /* Discard the previous request */
+  if( httpConn.pIn ){
+    fclose(httpConn.pIn);
+    httpConn.pIn = 0;
+    g.httpIn = stdin;
+  }
+  if( httpConn.nLast>0 ){
+    n = httpConn.nLast;
+    memmove(blob_buffer(&httpConn.buf), blob_buffer(&httpConn.buf)+n,
+            blob_size(&httpConn.buf)-n);
+    blob_resize(&httpConn.buf, blob_size(&httpConn.buf)-n);
+    httpConn.nLast = 0;
+  }
+  if( httpConn.nRequest>0 ){
+    if( !httpConn.bNext || httpConn.nRequest>=httpConn.nMaxRequest ){
+      return 0;
+    }
+  }else if( httpConn.nMaxRequest<=1 ){
+    httpConn.nRequest = 1;
+    if( cgi_http_is_worker() ){
+      /* The stdin stream may still hold input buffered from an earlier
+      ** connection of this worker, so read through a new stream */
+      httpConn.pIn = fdopen(dup(0), "rb");
+      if( httpConn.pIn==0 ) return 0;
+      g.httpIn = httpConn.pIn;
+    }
+    return 1;
+  }else{
+    /* Replies are not followed by a close that would flush the last
+    ** partial segment, so turn off Nagle's algorithm */
+    int opt = 1;
+    setsockopt(0, IPPROTO_TCP, TCP_NODELAY, &opt, sizeof(opt));
+  }
+  httpConn.bNext = 0;
+
+  /* Wait for the client to begin another request.  Time spent waiting
+  ** counts against the idle time left for the connection, if limited. */
+  if( httpConn.nRequest>0 && blob_size(&httpConn.buf)==0 ){
+    int nMs = httpConn.nIdle*1000;
+    sqlite3_int64 iStart = current_time_in_milliseconds();
+    if( httpConn.nIdleLeft>=0 && httpConn.nIdleLeft<nMs ){
+      nMs = httpConn.nIdleLeft;
+    }
+    n = cgi_http_fill(0, &httpConn.buf, nMs);
+    if( httpConn.nIdleLeft>=0 ){
+      httpConn.nIdleLeft -= (int)(current_time_in_milliseconds() - iStart);
+      if( httpConn.nIdleLeft<0 ) httpConn.nIdleLeft = 0;
+    }
+    if( n==0 ) return 0;
+  }
+
+  n = cgi_http_read_request(0, &httpConn.buf, &bKeepAlive, &isHttp11);
+  if( n==0 ) return 0;
+  httpConn.pIn = fmemopen(blob_buffer(&httpConn.buf), n, "rb");
+  if( httpConn.pIn==0 ) return 0;
+  if( httpConn.nRequest>0 ) g.nRequest++;
+  httpConn.nLast = n;
+  httpConn.nRequest++;
+  httpConn.isHttp11 = isHttp11;
+  httpConn.bKeepAlive = bKeepAlive && httpConn.nRequest<httpConn.nMaxRequest;
+  g.httpIn = httpConn.pIn;
+  return 1;
+#endif
+}
+
+/*
+** Close the connection after a reply that offered to keep it open, when
+** the process turns out to be unable to handle another request after
+** all.  Further requests that the client has already sent are read and
+** discarded until the client closes its side of the connection, for up
+** to about a second.  Closing a connection that has unread input resets
+** it, and the reset can destroy the reply before the client reads it.
+*/
+void cgi_http_close(void){
+#if !defined(_WIN32)
+  Blob discard;
+  int nRead = 0;
+  if( !httpConn.bNext ) return;
+  httpConn.bNext = 0;
+  fflush(g.httpOut);
+  shutdown(1, SHUT_WR);
+  blob_init(&discard, 0, 0);
+  while( nRead++<10 && cgi_http_fill(0, &discard, 100)>0 ){
+    blob_reset(&discard);
+  }
+  blob_reset(&discard);
+#endif
+}
+
 /*
 ** Implement an HTTP server daemon listening on port iPort.
 **
@@ -1805,6 +2453,11 @@ void cgi_handle_scgi_request(void){
 ** out of this procedure call.  The child will handle the request.
 ** The parent never returns from this procedure.
 **
+** If a worker pool has been configured using cgi_http_server_config(),
+** then the workers are forked up front instead.  Each worker returns
+** from this procedure before any connection has arrived and should then
+** call cgi_http_worker_accept().
+**
 ** Return 0 to each child as it runs.  If unable to establish a
 ** listening socket, return non-zero.
 */
@@ -1869,7 +2522,7 @@ int cgi_http_server(
     }
   }
   if( iPort>mxPort ) return 1;
-  listen(listener,10);
+  listen(listener, httpPool.nBacklog);
   fossil_print("Listening for %s requests on TCP port %d\n",
      (flags & HTTP_SERVER_SCGI)!=0?"SCGI":"HTTP",  iPort);
   fflush(stdout);
@@ -1890,6 +2543,9 @@ int cgi_http_server(
       fossil_warning("cannot start browser: %s\n", zBrowser);
     }
   }
+  if( httpPool.nWorker>0 ){
+    return cgi_http_pool_master(listener);
+  }
   while( 1 ){
 #if FOSSIL_MAX_CONNECTIONS>0
     while( nchildren>=FOSSIL_MAX_CONNECTIONS ){
@@ -2370,6 +2370,8 @@ void commit_cmd(void){
     const char *zFullname;
     Blob content;
     int crlfOk, binOk, encodingOk;
+    FileSig sig;
+    i64 tSig;
 
     id = db_column_int(&q, 0);
     zFullname = db_column_text(&q, 1);
@@ -2379,6 +2381,7 @@ void commit_cmd(void){
     encodingOk = db_column_int(&q, 5);
 
     blob_zero(&content);
+    tSig = vfile_sig_stat(zFullname, &sig);
     blob_read_from_file(&content, zFullname, RepoFILE);
     /* Do not emit any warnings when they are disabled. */
     if( !noWarningFlag ){
@@ -2402,6 +2405,11 @@ void commit_cmd(void){
     }
     db_multi_exec("UPDATE vfile SET mrid=%d, rid=%d, mhash=NULL WHERE id=%d",
                   nrid,nrid,id);
+    if( sig.isFile ){
+      char *zUuid = db_text(0, "SELECT uuid FROM blob WHERE rid=%d", nrid);
+      vfile_sig_save(zFullname, &sig, tSig, zUuid);
+      fossil_free(zUuid);
+    }
     db_multi_exec("INSERT OR IGNORE INTO unsent VALUES(%d)", nrid);
   }
   db_finalize(&q);
@@ -22,19 +22,37 @@
 #include <assert.h>
 
 /*
-** The artifact retrieval cache
+** The artifact retrieval cache.
+**
+** Cache entries live in the a[] array.  Entries are located by rid
+** using a hash table of chained slot numbers (aHash[]) and are kept on
+** a doubly-linked LRU list (iHead is the most recently used entry and
+** iTail is the least recently used) so that both lookup and eviction
+** are O(1).  Unused slots of a[] are kept on the iFree list.  The total
+** size of all cached content is kept below szLimit bytes, which is
+** taken from the "content-cache-size" setting.
 */
 static struct {
   i64 szTotal;         /* Total size of all entries in the cache */
+  i64 szLimit;         /* Maximum value for szTotal.  0 if not yet known */
   int n;               /* Current number of cache entries */
   int nAlloc;          /* Number of slots allocated in a[] */
-  int nextAge;         /* Age counter for implementing LRU */
+  int nHash;           /* Number of buckets in aHash[] */
+  int *aHash;          /* Hash table.  Slot number plus 1.  0 for empty */
+  int iHead;           /* Most recently used entry.  -1 if none */
+  int iTail;           /* Least recently used entry.  -1 if none */
+  int iFree;           /* First unused slot in a[].  -1 if none */
   struct cacheLine {   /* One instance of this for each cache entry */
     int rid;                  /* Artifact id */
-    int age;                  /* Age.  Newer is larger */
+    int iChain;               /* Next entry on hash chain, plus 1 */
+    int iPrev;                /* Next more recently used entry */
+    int iNext;                /* Next less recently used entry or free slot */
     Blob content;             /* Content of the artifact */
   } *a;                /* The positive cache */
-  Bag inCache;         /* Set of artifacts currently in cache */
+  i64 nHit;            /* Number of cache hits */
+  i64 nMiss;           /* Number of cache misses */
+  i64 nEvict;          /* Number of entries evicted to stay under szLimit */
+  DeltaMap aMap[2];    /* Ping-pong maps for collapsing delta chains */
 
   /*
   ** The missing artifact cache.
@@ -47,30 +65,118 @@ static struct {
   */
   Bag missing;         /* Cache of artifacts that are incomplete */
   Bag available;       /* Cache of artifacts that are complete */
-} contentCache;
+} contentCache = { 0, 0, 0, 0, 0, 0, -1, -1, -1 };
 
 /*
-** Remove the oldest element from the content cache
+** SETTING: content-cache-size width=25 default=50000000
+** The maximum number of bytes of expanded artifact content that is
+** held in memory in order to speed up the reconstruction of artifacts
+** stored as deltas.  Larger values help with repositories that have
+** long delta chains.  A value of zero disables the cache.
 */
-static void content_cache_expire_oldest(void){
+
+/*
+** Return the hash bucket for artifact rid.
+*/
+#define CONTENT_CACHE_HASH(rid) (((unsigned)(rid)*2654435761u) \
+                                     % contentCache.nHash)
+
+/*
+** Return the slot in contentCache.a[] that holds artifact rid, or -1
+** if rid is not in the cache.
+*/
+static int content_cache_find(int rid){
   int i;
-  int mnAge = contentCache.nextAge;
-  int mn = -1;
-  for(i=0; i<contentCache.n; i++){
-    if( contentCache.a[i].age<mnAge ){
-      mnAge = contentCache.a[i].age;
-      mn = i;
-    }
+  if( contentCache.n==0 ) return -1;
+  i = contentCache.aHash[CONTENT_CACHE_HASH(rid)] - 1;
+  while( i>=0 && contentCache.a[i].rid!=rid ){
+    i = contentCache.a[i].iChain - 1;
+  }
+  return i;
+}
+
+/*
+** Unlink slot i from the LRU list.
+*/
+static void content_cache_unlink(int i){
+  struct cacheLine *p = &contentCache.a[i];
+  if( p->iPrev>=0 ){
+    contentCache.a[p->iPrev].iNext = p->iNext;
+  }else{
+    contentCache.iHead = p->iNext;
+  }
+  if( p->iNext>=0 ){
+    contentCache.a[p->iNext].iPrev = p->iPrev;
+  }else{
+    contentCache.iTail = p->iPrev;
+  }
+}
+
+/*
+** Make slot i the most recently used entry of the LRU list.  Slot i
+** must not currently be on the list.
+*/
+static void content_cache_link_head(int i){
+  struct cacheLine *p = &contentCache.a[i];
+  p->iPrev = -1;
+  p->iNext = contentCache.iHead;
+  if( contentCache.iHead>=0 ){
+    contentCache.a[contentCache.iHead].iPrev = i;
+  }else{
+    contentCache.iTail = i;
   }
-  if( mn>=0 ){
-    bag_remove(&contentCache.inCache, contentCache.a[mn].rid);
-    contentCache.szTotal -= blob_size(&contentCache.a[mn].content);
-    blob_reset(&contentCache.a[mn].content);
-    contentCache.n--;
-    contentCache.a[mn] = contentCache.a[contentCache.n];
+  contentCache.iHead = i;
+}
+
+/*
+** Resize the hash table so that it has nNew buckets and rehash
+** every entry that is currently in the cache.
+*/
+static void content_cache_rehash(int nNew){
+  int i;
+  fossil_free(contentCache.aHash);
+  contentCache.nHash = nNew;
+  contentCache.aHash = fossil_malloc( nNew*sizeof(contentCache.aHash[0]) );
+  memset(contentCache.aHash, 0, nNew*sizeof(contentCache.aHash[0]));
+  for(i=contentCache.iHead; i>=0; i=contentCache.a[i].iNext){
+    int h = CONTENT_CACHE_HASH(contentCache.a[i].rid);
+    contentCache.a[i].iChain = contentCache.aHash[h];
+    contentCache.aHash[h] = i+1;
   }
 }
 
+/*
+** Return the maximum number of bytes of content to hold in the cache,
+** or -1 if the cache is disabled.
+*/
+static i64 content_cache_limit(void){
+  if( contentCache.szLimit==0 ){
+    contentCache.szLimit = db_get_int("content-cache-size", 50000000);
+    if( contentCache.szLimit<=0 ) contentCache.szLimit = -1;
+  }
+  return contentCache.szLimit;
+}
+
+/*
+** Remove the oldest element from the content cache
+*/
+static void content_cache_expire_oldest(void){
+  int i = contentCache.iTail;
+  int *pi;
+  if( i<0 ) return;
+  pi = &contentCache.aHash[CONTENT_CACHE_HASH(contentCache.a[i].rid)];
+  while( *pi!=i+1 ){
+    pi = &contentCache.a[*pi-1].iChain;
+  }
+  *pi = contentCache.a[i].iChain;
+  content_cache_unlink(i);
+  contentCache.szTotal -= blob_size(&contentCache.a[i].content);
+  blob_reset(&contentCache.a[i].content);
+  contentCache.a[i].iNext = contentCache.iFree;
+  contentCache.iFree = i;
+  contentCache.n--;
+}
+
 /*
 ** Add an entry to the content cache.
 **
@@ -79,40 +185,64 @@ static void content_cache_expire_oldest(void){
 */
 void content_cache_insert(int rid, Blob *pBlob){
   struct cacheLine *p;
-  if( contentCache.n>500 || contentCache.szTotal>50000000 ){
-    i64 szBefore;
-    do{
-      szBefore = contentCache.szTotal;
-      content_cache_expire_oldest();
-    }while( contentCache.szTotal>50000000 && contentCache.szTotal<szBefore );
+  int i, h;
+  if( blob_size(pBlob)>content_cache_limit() || content_cache_find(rid)>=0 ){
+    blob_reset(pBlob);
+    return;
   }
-  if( contentCache.n>=contentCache.nAlloc ){
-    contentCache.nAlloc = contentCache.nAlloc*2 + 10;
+  while( contentCache.szTotal+blob_size(pBlob)>contentCache.szLimit ){
+    content_cache_expire_oldest();
+    contentCache.nEvict++;
+  }
+  if( contentCache.iFree<0 ){
+    int nNew = contentCache.nAlloc*2 + 10;
     contentCache.a = fossil_realloc(contentCache.a,
-                             contentCache.nAlloc*sizeof(contentCache.a[0]));
+                                    nNew*sizeof(contentCache.a[0]));
+    for(i=nNew-1; i>=contentCache.nAlloc; i--){
+      contentCache.a[i].iNext = contentCache.iFree;
+      contentCache.iFree = i;
+    }
+    contentCache.nAlloc = nNew;
   }
-  p = &contentCache.a[contentCache.n++];
+  if( contentCache.n>=contentCache.nHash ){
+    content_cache_rehash(contentCache.nHash*2 + 64);
+  }
+  i = contentCache.iFree;
+  p = &contentCache.a[i];
+  contentCache.iFree = p->iNext;
   p->rid = rid;
-  p->age = contentCache.nextAge++;
+  h = CONTENT_CACHE_HASH(rid);
+  p->iChain = contentCache.aHash[h];
+  contentCache.aHash[h] = i+1;
+  content_cache_link_head(i);
   contentCache.szTotal += blob_size(pBlob);
   p->content = *pBlob;
   blob_zero(pBlob);
-  bag_insert(&contentCache.inCache, rid);
+  contentCache.n++;
 }
 
 /*
 ** Clear the content cache.
 */
 void content_clear_cache(void){
-  int i;
-  for(i=0; i<contentCache.n; i++){
-    blob_reset(&contentCache.a[i].content);
+  while( contentCache.iHead>=0 ){
+    content_cache_expire_oldest();
   }
   bag_clear(&contentCache.missing);
   bag_clear(&contentCache.available);
-  bag_clear(&contentCache.inCache);
-  contentCache.n = 0;
   contentCache.szTotal = 0;
+  contentCache.szLimit = 0;
+}
+
+/*
+** Return a one-line human-readable summary of the content cache
+** statistics.  The string is obtained from fossil_malloc().
+*/
+char *content_cache_summary(void){
+  return mprintf("%,d entries, %,lld of %,lld bytes, %,lld hits, "
+                 "%,lld misses, %,lld evictions",
+                 contentCache.n, contentCache.szTotal, content_cache_limit(),
+                 contentCache.nHit, contentCache.nMiss, contentCache.nEvict);
 }
 
 /*
@@ -242,31 +372,42 @@ int content_get(int rid, Blob *pBlob){
   }
 
   /* Look for the artifact in the cache first */
-  if( bag_find(&contentCache.inCache, rid) ){
-    for(i=0; i<contentCache.n; i++){
-      if( contentCache.a[i].rid==rid ){
-        blob_copy(pBlob, &contentCache.a[i].content);
-        contentCache.a[i].age = contentCache.nextAge++;
-        return 1;
-      }
+  if( (i = content_cache_find(rid))>=0 ){
+    blob_copy(pBlob, &contentCache.a[i].content);
+    if( contentCache.iHead!=i ){
+      content_cache_unlink(i);
+      content_cache_link_head(i);
     }
+    contentCache.nHit++;
+    return 1;
   }
+  contentCache.nMiss++;
 
   nextRid = delta_source_rid(rid);
   if( nextRid==0 ){
     rc = content_of_blob(rid, pBlob);
+  }else if( cache_artifact_read(rid, pBlob) ){
+    /* Keep it in memory too, so that it is not read from disk again */
+    if( blob_size(pBlob)<=content_cache_limit() ){
+      Blob x;
+      blob_copy(&x, pBlob);
+      content_cache_insert(rid, &x);
+    }
+    rc = 1;
   }else{
     int n = 1;
     int nAlloc = 10;
     int *a = 0;
     int mx;
-    Blob delta, next;
+    int nDelta = 0;
+    Blob *aDelta;
+    DeltaMap *pMap, *pNext;
 
     a = fossil_malloc( sizeof(a[0])*nAlloc );
     a[0] = rid;
     a[1] = nextRid;
     n = 1;
-    while( !bag_find(&contentCache.inCache, nextRid)
+    while( content_cache_find(nextRid)<0
         && (nextRid = delta_source_rid(nextRid))>0 ){
       n++;
       if( n>=nAlloc ){
@@ -281,25 +422,64 @@ int content_get(int rid, Blob *pBlob){
     mx = n;
     rc = content_get(a[n], pBlob);
     n--;
+
+    /* Collapse the whole chain of deltas into a single map from the
+    ** base artifact, then construct the result in one pass.  Every 8th
+    ** intermediate artifact is still built and cached, provided that
+    ** it is small enough to fit in the cache. */
+    aDelta = fossil_malloc( sizeof(aDelta[0])*mx );
+    pMap = &contentCache.aMap[0];
+    pNext = &contentCache.aMap[1];
+    if( rc ) delta_map_init(pMap, blob_size(pBlob));
     while( rc && n>=0 ){
-      rc = content_of_blob(a[n], &delta);
-      if( rc ){
-        if( blob_delta_apply(pBlob, &delta, &next)<0 ){
-          rc = 1;
-        }else{
-          blob_reset(&delta);
-          if( (mx-n)%8==0 ){
-            content_cache_insert(a[n+1], pBlob);
-          }else{
-            blob_reset(pBlob);
-          }
-          *pBlob = next;
+      DeltaMap *pSwap;
+      rc = content_of_blob(a[n], &aDelta[nDelta]);
+      if( !rc ) break;
+      if( delta_map_compose(pNext, pMap, blob_buffer(&aDelta[nDelta]),
+                            blob_size(&aDelta[nDelta]))<0 ){
+        rc = 0;
+        break;
+      }
+      nDelta++;
+      pSwap = pMap;
+      pMap = pNext;
+      pNext = pSwap;
+      if( n>0 && (mx-n)%8==0 && pMap->nOut<=content_cache_limit()
+       && content_cache_find(a[n])<0
+      ){
+        Blob x;
+        blob_zero(&x);
+        blob_resize(&x, pMap->nOut);
+        if( delta_map_apply(pMap, blob_buffer(pBlob), blob_buffer(&x))<0 ){
+          blob_reset(&x);
+          rc = 0;
+          break;
         }
+        content_cache_insert(a[n], &x);
       }
       n--;
     }
+    if( rc ){
+      Blob x;
+      blob_zero(&x);
+      blob_resize(&x, pMap->nOut);
+      if( delta_map_apply(pMap, blob_buffer(pBlob), blob_buffer(&x))<0 ){
+        blob_reset(&x);
+        rc = 0;
+      }
+      blob_reset(pBlob);
+      *pBlob = x;
+    }
+    while( nDelta>0 ) blob_reset(&aDelta[--nDelta]);
+    fossil_free(aDelta);
     free(a);
-    if( !rc ) blob_reset(pBlob);
+    if( !rc ){
+      blob_reset(pBlob);
+    }else if( mx>1 ){
+      /* Share the result with other processes if it took more than
+      ** one delta to construct it */
+      cache_artifact_write(rid, pBlob);
+    }
   }
   if( rc==0 ){
     bag_insert(&contentCache.missing, rid);
@@ -338,6 +518,67 @@ void artifact_cmd(void){
   blob_write_to_file(&content, zFile);
 }
 
+/*
+** COMMAND: test-content-cache
+**
+** Usage: %fossil test-content-cache ?OPTIONS? ?ARTIFACT ...?
+**
+** Extract each ARTIFACT using content_get() and then show statistics
+** for the artifact retrieval cache.  The content is discarded.
+**
+** Options:
+**    --all                Extract every artifact in the repository
+**    --limit N            Use a cache size limit of N bytes instead
+**                         of the "content-cache-size" setting
+**    --repeat N           Make N passes over the artifacts
+**    -R|--repository FILE Use the repository in FILE
+*/
+void test_content_cache_cmd(void){
+  const char *zLimit;
+  const char *zRepeat;
+  int allFlag;
+  int nRepeat;
+  int i, k;
+  i64 nByte = 0;
+  Blob content;
+  allFlag = find_option("all",0,0)!=0;
+  zLimit = find_option("limit",0,1);
+  zRepeat = find_option("repeat",0,1);
+  nRepeat = zRepeat ? atoi(zRepeat) : 1;
+  db_find_and_open_repository(OPEN_ANY_SCHEMA, 0);
+  verify_all_options();
+  if( zLimit ){
+    contentCache.szLimit = atoi(zLimit);
+    if( contentCache.szLimit<=0 ) contentCache.szLimit = -1;
+  }
+  for(k=0; k<nRepeat; k++){
+    if( allFlag ){
+      Stmt q;
+      db_prepare(&q, "SELECT rid FROM blob WHERE size>=0 ORDER BY rid");
+      while( db_step(&q)==SQLITE_ROW ){
+        content_get(db_column_int(&q,0), &content);
+        nByte += blob_size(&content);
+        blob_reset(&content);
+      }
+      db_finalize(&q);
+    }
+    for(i=2; i<g.argc; i++){
+      int rid = name_to_rid(g.argv[i]);
+      if( rid==0 ) fossil_fatal("%s", g.zErrMsg);
+      content_get(rid, &content);
+      nByte += blob_size(&content);
+      blob_reset(&content);
+    }
+  }
+  fossil_print("bytes-extracted: %lld\n", nByte);
+  fossil_print("entries: %d\n", contentCache.n);
+  fossil_print("bytes: %lld\n", contentCache.szTotal);
+  fossil_print("limit: %lld\n", contentCache.szLimit);
+  fossil_print("hits: %lld\n", contentCache.nHit);
+  fossil_print("misses: %lld\n", contentCache.nMiss);
+  fossil_print("evictions: %lld\n", contentCache.nEvict);
+}
+
 /*
 ** COMMAND: test-content-rawget
 **
@@ -189,6 +189,14 @@ void cookie_render(void){
   cookies.bIsInit = 0;
 }
 
+/* Forget the user preferences cookie of the current web page, so that
+** another web page can be generated by the same process.
+*/
+void cookie_reset(void){
+  fossil_free(cookies.zCookieValue);
+  memset(&cookies, 0, sizeof(cookies));
+}
+
 /* Return the value of a preference cookie.
 */
 const char *cookie_value(const char *zPName, const char *zDefault){
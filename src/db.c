@@ -57,6 +57,7 @@ struct Stmt {
   Stmt *pNext, *pPrev;    /* List of all unfinalized statements */
   int nStep;              /* Number of sqlite3_step() calls */
   int rc;                 /* Error from db_vprepare() */
+  int bPersist;           /* Prepared with DB_PREPARE_PERSISTENT */
 };
 
 /*
@@ -64,7 +65,7 @@ struct Stmt {
 ** is useful to help avoid assertions when performing cleanup in some
 ** error handling cases.
 */
-#define empty_Stmt_m {BLOB_INITIALIZER,NULL, NULL, NULL, 0, 0}
+#define empty_Stmt_m {BLOB_INITIALIZER,NULL, NULL, NULL, 0, 0, 0}
 #endif /* INTERFACE */
 const struct Stmt empty_Stmt = empty_Stmt_m;
 
@@ -86,6 +87,7 @@ static void db_err(const char *zFormat, ...){
   if( g.xferPanic && g.cgiOutput==1 ){
     cgi_reset_content();
     @ error Database\serror:\s%F(z)
+    cgi_close_connection();
     cgi_reply();
   }
   fossil_fatal("Database error: %s", z);
@@ -331,6 +333,7 @@ int db_vprepare(Stmt *pStmt, int flags, const char *zFormat, va_list ap){
   db.pAllStmt = pStmt;
   pStmt->nStep = 0;
   pStmt->rc = rc;
+  pStmt->bPersist = (flags & DB_PREPARE_PERSISTENT)!=0;
   return rc;
 }
 int db_prepare(Stmt *pStmt, const char *zFormat, ...){
@@ -387,6 +390,7 @@ int db_prepare_blob(Stmt *pStmt, Blob *pSql){
   pStmt->pNext = pStmt->pPrev = 0;
   pStmt->nStep = 0;
   pStmt->rc = rc;
+  pStmt->bPersist = 0;
   return rc;
 }
 
@@ -1762,6 +1766,19 @@ int db_repository_has_changed(void){
   return g.iRepoDataVers != v;               
 }
 
+/*
+** Take the current content of the repository database as the baseline
+** for db_repository_has_changed().  Changes that other processes made
+** before now are not reported.
+*/
+void db_repository_mark_unchanged(void){
+  if( !g.repositoryOpen ) return;
+  /* Reading the data version notices changes by other processes */
+  db_int(0, "PRAGMA repository.data_version");
+  sqlite3_file_control(g.db, "repository", SQLITE_FCNTL_DATA_VERSION,
+                       &g.iRepoDataVers);
+}
+
 /*
 ** Flags for the db_find_and_open_repository() function.
 */
@@ -1938,6 +1955,8 @@ void db_close(int reportErrors){
   g.dbIgnoreErrors++; /* Stop "database locked" warnings from PRAGMA optimize */
   sqlite3_exec(g.db, "PRAGMA optimize", 0, 0, 0);
   g.dbIgnoreErrors--;
+  cache_artifact_close();
+  manifest_cache_clear();
   db_close_config();
 
   /* If the localdb has a lot of unused free space,
@@ -1970,6 +1989,102 @@ void db_close(int reportErrors){
   backoffice_run_if_needed();
 }
 
+/*
+** Reset every statement on the database connection and finalize the
+** statements that the web page just generated prepared for itself with
+** db_prepare() and its variants, including any that are still in use.
+** Statements from db_static_prepare() belong to static Stmt objects that
+** outlive the web page.  They are kept, so that later web pages do not
+** have to prepare them again.
+*/
+void db_finalize_transient(void){
+  sqlite3_stmt *pStmt = 0;
+  Stmt *p, *pNext;
+  if( g.db==0 ) return;
+  while( (pStmt = sqlite3_next_stmt(g.db,pStmt))!=0 ){
+    sqlite3_reset(pStmt);
+  }
+  for(p=db.pAllStmt; p; p=pNext){
+    pNext = p->pNext;
+    if( !p->bPersist ) db_finalize(p);
+  }
+}
+
+/*
+** Return true if db_request_done() can be expected to succeed once the
+** current web page is finished, as far as can be told while the web page
+** is still being generated.  This is used to decide whether to offer to
+** keep the connection open before the reply is sent.
+*/
+int db_request_can_continue(void){
+  Stmt q;
+  int nAttach = 0;
+  if( g.db==0 || db.nBegin || db.nCommitHook ) return 0;
+  if( db_repository_has_changed() ) return 0;
+  /* The web page might still be restricted by an authorizer, so do
+  ** not insist on the query below */
+  if( db_prepare_ignore_error(&q, "PRAGMA database_list")!=SQLITE_OK ){
+    return 0;
+  }
+  while( db_step(&q)==SQLITE_ROW ){
+    if( db_column_int(&q, 0)>1
+     && fossil_strcmp(db_column_text(&q, 1), "configdb")!=0
+    ){
+      nAttach++;
+    }
+  }
+  db_finalize(&q);
+  return nAttach==0;
+}
+
+/*
+** Get the database connection ready for the next web page, when the
+** same process goes on to generate more web pages using the repository
+** that is already open.  All statements other than static ones are
+** finalized and everything that the prior web page created in the TEMP
+** schema is dropped.
+**
+** Return false if the connection cannot be reused, either because the
+** prior web page left a transaction or a commit hook pending or left
+** some other database attached, or because the repository has changed
+** since the last call to db_repository_mark_unchanged().  Content cached
+** in memory might be out of date in that case.
+*/
+int db_request_done(void){
+  Stmt q;
+  Blob sql;
+  if( g.db==0 || db.nBegin || db.nCommitHook ) return 0;
+  /* Optional changes from db_optional_sql() are dropped, as they would be
+  ** if the process exited */
+  while( db.nBeforeCommit ){
+    sqlite3_free(db.azBeforeCommit[--db.nBeforeCommit]);
+  }
+  db_finalize_transient();
+  sqlite3_set_authorizer(g.db, 0, 0);
+  sqlite3_limit(g.db, SQLITE_LIMIT_VDBE_OP, 0x7fffffff);
+  if( !db_request_can_continue() ) return 0;
+  blob_init(&sql, 0, 0);
+  db_prepare(&q, "SELECT type, name FROM temp.sqlite_master"
+                 " WHERE type IN ('table','view','trigger')");
+  while( db_step(&q)==SQLITE_ROW ){
+    const char *zType = db_column_text(&q, 0);
+    const char *zName = db_column_text(&q, 1);
+    if( zType[0]=='t' && zType[1]=='a' ){
+      blob_append_sql(&sql, "DROP TABLE IF EXISTS temp.\"%w\";", zName);
+    }else if( zType[0]=='v' ){
+      blob_append_sql(&sql, "DROP VIEW IF EXISTS temp.\"%w\";", zName);
+    }else{
+      blob_append_sql(&sql, "DROP TRIGGER IF EXISTS temp.\"%w\";", zName);
+    }
+  }
+  db_finalize(&q);
+  if( blob_size(&sql) ){
+    db_multi_exec("%s", blob_sql_text(&sql));
+  }
+  blob_reset(&sql);
+  return 1;
+}
+
 /*
 ** Close the database as quickly as possible without unnecessary processing.
 */
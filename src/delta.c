@@ -28,6 +28,9 @@
 #include <stdlib.h>
 #include <string.h>
 #include "delta.h"
+#if defined(__SSE2__)
+# include <emmintrin.h>
+#endif
 
 /*
 ** Macros for turning debugging printfs on and off
@@ -217,6 +220,18 @@ static int digit_count(int v){
 # define GCC_VERSION 0
 #endif
 
+/*
+** Match extension in delta_create_ex() compares 8 bytes at a time when
+** the compiler can count trailing zeros and the byte order is known to
+** be little-endian.
+*/
+#if defined(__GNUC__) && defined(__BYTE_ORDER__) \
+    && __BYTE_ORDER__==__ORDER_LITTLE_ENDIAN__
+# define DELTA_WORD_COMPARE 1
+#else
+# define DELTA_WORD_COMPARE 0
+#endif
+
 /*
 ** Compute a 32-bit big-endian checksum on the N-byte buffer.  If the
 ** buffer is not a multiple of 4 bytes length, compute the sum that would
@@ -524,6 +539,324 @@ int delta_create(
   return zDelta - zOrigDelta;
 }
 
+/*
+** Effort levels for delta_create_ex().  Level 0 is the classic encoder
+** implemented by delta_create() above.  Higher levels index the source
+** file more densely and search longer collision chains, trading encoder
+** speed for smaller deltas.
+*/
+#if INTERFACE
+#define DELTA_EFFORT_CLASSIC  0   /* The original delta_create() */
+#define DELTA_EFFORT_FAST     1   /* Sparse index, short chains */
+#define DELTA_EFFORT_NORMAL   2   /* Index every 4th byte */
+#define DELTA_EFFORT_BEST     3   /* Index every byte, long chains */
+#endif /* INTERFACE */
+
+/*
+** Parameters for each effort level of the gear-hash encoder.
+*/
+static const struct {
+  int iStride;        /* Index one source window every iStride bytes */
+  int mxChain;        /* Maximum number of collisions to examine */
+  int nGood;          /* Stop searching once a match this long is found */
+} aDeltaEffort[] = {
+  { NHASH, 250,         0 },   /* 0: unused - see delta_create() */
+  { NHASH,   8,      4096 },   /* 1: DELTA_EFFORT_FAST */
+  {     4,  64,     65536 },   /* 2: DELTA_EFFORT_NORMAL */
+  {     1, 250, 0x7fffffff },  /* 3: DELTA_EFFORT_BEST */
+};
+
+/*
+** Never index more than this many source windows.  Very large sources
+** fall back to a sparser stride to keep memory use bounded.
+*/
+#define DELTA_MX_INDEX  (1<<24)
+
+/*
+** Random values used by the gear hash.  One entry for each byte value.
+*/
+static const u32 aGear[256] = {
+  0xe4afc9df, 0xaf10c5b5, 0x4361f2a6, 0xdb948bbc, 0x1686f76d, 0xc50d5858,
+  0xaecb843b, 0x17dde8bd, 0xf389a6d8, 0x2d0a6b51, 0x6c6f1741, 0x5e697042,
+  0x7c400632, 0xec497651, 0x92e5d510, 0x20bfe753, 0x56e8c659, 0x8a5be848,
+  0x1d00efc1, 0x1fe1381d, 0x24b209ec, 0xd478de4b, 0x398aebf3, 0xfa6388a9,
+  0xe5ab4f52, 0x04686732, 0x194a4dd5, 0x4ee8700d, 0x5dd7ff59, 0xe5ad46a7,
+  0xe249837b, 0x96f7c768, 0xad44fcc5, 0x6954f0cb, 0x1ef086cd, 0xcb0d1af9,
+  0x6213d4d0, 0x09b2ca14, 0x4efc2fec, 0xab3887ec, 0xc36e1bce, 0x02eca365,
+  0x46894c85, 0x8c22ba29, 0xb79904da, 0x7743e43b, 0x7354baf9, 0x6576f77c,
+  0xc8bc7cb0, 0xa261bb85, 0x373b70ad, 0x7cf17b7a, 0x205c4415, 0xb308bf3a,
+  0x391a04ed, 0x49749dee, 0x83ef21ca, 0x9d1c1601, 0xe45b040f, 0x1f8e6a22,
+  0x8b822ba7, 0x1023375c, 0xafd90b38, 0x5977c087, 0x8d8976b4, 0xc8ab447b,
+  0xa4aaf949, 0x8bf73588, 0xc586664b, 0x20af5f6c, 0xa315e36d, 0xf071d6f1,
+  0x9f5de766, 0x5597e17e, 0x9eb6c1e2, 0x97def647, 0x6bd06b4c, 0xb182da10,
+  0xb2d54170, 0x4592cdad, 0x98cb147e, 0xb2d182dc, 0xd3c230b9, 0x2f7e1033,
+  0x4278d76f, 0x4a367f85, 0x3d1531a6, 0xff163af6, 0x31543c92, 0x6e02d9d1,
+  0x92248aed, 0x6c5c4171, 0x6a307a48, 0xca505674, 0xd348715b, 0x710c82aa,
+  0xca6ff2c6, 0xb2d2337d, 0x6300cd43, 0x2fba92f7, 0xc16dcca5, 0x67d34bf9,
+  0xdb21f94f, 0x6505022b, 0x6d4011eb, 0x80d58cf5, 0x182dbe50, 0x531addc3,
+  0x1cf58bd2, 0x1c7c3fb5, 0xead09c70, 0xd282fb3f, 0x314ee46d, 0x55a5630c,
+  0xc157622e, 0x8f442047, 0x62d479c1, 0x5069c9d7, 0x4330b2be, 0xf98c59ad,
+  0x2581ded1, 0xd525ce7c, 0xf1a57929, 0x8e8ebb49, 0x651140fa, 0xeccae9dd,
+  0x8fd33585, 0xc51fc7b4, 0x80c27140, 0x13a8d095, 0x3ef4fd48, 0x8ae81126,
+  0x915e3d40, 0x8834d15b, 0x51e8b2d4, 0xb1f030ad, 0x4b5ca0bf, 0x362ecc5a,
+  0x1b1a8a88, 0x033e5a0d, 0xc78c5872, 0xdcc5f853, 0x1a3a9f34, 0x725b409a,
+  0x5349ba7e, 0xe4cf47dd, 0x8aa8d927, 0xa0024dc1, 0xdef93a9c, 0xccf20f69,
+  0x2ef25526, 0xee8246ad, 0x6ca10546, 0xcd358b02, 0xf6eb5028, 0x012dd5bf,
+  0xc8d76632, 0xa637b37a, 0x5b43b196, 0x835d82ee, 0x530b36ae, 0x8e036461,
+  0xb36991e6, 0xabf738cc, 0xd13d49db, 0x78c4aed8, 0x4ee4d2b7, 0x42f9452e,
+  0x21cab000, 0x8e9bf745, 0xfe16c0fc, 0xe7232cf8, 0xd531d966, 0x2db0a368,
+  0x026a4f46, 0x3bd7fa67, 0x57f47d6a, 0xd3737986, 0x343f1347, 0x1ca495ec,
+  0x4d330ee0, 0xb10c0a77, 0x381cb896, 0x4ecbcd31, 0xdad32667, 0x7decb468,
+  0x8759fad8, 0xb8567df9, 0x8ac5a7ad, 0xf8330e15, 0xa7cdbf4d, 0x14a6fcbf,
+  0xad1e5dc7, 0xb2775c14, 0x674bed2e, 0x472a2b79, 0x4ae4413b, 0x9aab4b1a,
+  0x8ac62d3e, 0xa3589b4e, 0xb6116996, 0xff5f64e7, 0x6bb22dc6, 0xef55a2a3,
+  0x3b3c0b43, 0xf0d2fb49, 0x58ca1e14, 0x7a1ae190, 0xe336a204, 0xd9b10e5f,
+  0xf728de22, 0x7171e2d4, 0xe843cc61, 0xa83b3446, 0x18c1f0ff, 0xfd1e7190,
+  0x56a168c6, 0x0c8b365a, 0x22482c3a, 0xde20847d, 0x1b47266a, 0x0ec92c4f,
+  0x435be40f, 0xc49967a2, 0xe5c72114, 0x3d519d26, 0xd05e11dc, 0x5ed6852e,
+  0x401340f7, 0x29bb2ad1, 0xd0c4b881, 0xbd43d60b, 0x37d86c8a, 0x736f046e,
+  0xefb33e7f, 0x87efd261, 0xc9da5ab0, 0xd30f6536, 0xca9ee6a2, 0xdf1f1d67,
+  0xaacf84fe, 0x105d5316, 0xfdc60f29, 0xb8451638, 0x4ac17459, 0xed06a9fc,
+  0x3f1f89e0, 0x0a5e30d1, 0x44caa893, 0x2ac0cf9f, 0x5555f6c6, 0x9a252300,
+  0xf6e2b862, 0x9c3bba35, 0x84d09eeb, 0x76bb18cd,
+};
+
+/*
+** The gear hash of a window is computed as h = (h<<2) + aGear[c] for
+** each byte c in turn.  Because each step shifts by two bits, only the
+** last NHASH bytes contribute to a 32-bit hash so that the window rolls
+** forward with no need to subtract out the byte that leaves it.  The
+** low-order bits depend on only the most recent bytes, so use the high
+** bits of a multiplicative hash to select a bucket.
+*/
+#define GEAR_NEXT(h,c)    (((h)<<2) + aGear[(unsigned char)(c)])
+#define GEAR_BUCKET(h,n)  ((u32)((h)*0x9e3779b1u)>>(32-(n)))
+
+/*
+** Compute the gear hash of the NHASH bytes at z[].
+*/
+static u32 gear_once(const char *z){
+  u32 h = 0;
+  int i;
+  for(i=0; i<NHASH; i++) h = GEAR_NEXT(h, z[i]);
+  return h;
+}
+
+/*
+** Return the number of bytes, up to a maximum of N, for which a[] and
+** b[] are equal, comparing from the start of each buffer.
+**
+** Use 16-byte SSE2 compares or 8-byte word compares where available
+** rather than comparing one byte at a time.
+*/
+static int delta_match_forward(const char *a, const char *b, int N){
+  int i = 0;
+#if defined(__SSE2__)
+  while( i+16<=N ){
+    __m128i x = _mm_loadu_si128((const __m128i*)&a[i]);
+    __m128i y = _mm_loadu_si128((const __m128i*)&b[i]);
+    unsigned m = 0xffff & ~(unsigned)_mm_movemask_epi8(_mm_cmpeq_epi8(x,y));
+    if( m ) return i + __builtin_ctz(m);
+    i += 16;
+  }
+#elif DELTA_WORD_COMPARE
+  while( i+8<=N ){
+    unsigned long long x, y;
+    memcpy(&x, &a[i], 8);
+    memcpy(&y, &b[i], 8);
+    if( x!=y ) return i + __builtin_ctzll(x^y)/8;
+    i += 8;
+  }
+#endif
+  while( i<N && a[i]==b[i] ) i++;
+  return i;
+}
+
+/*
+** Return the number of bytes, up to a maximum of N, for which the bytes
+** immediately before a[] and b[] are equal, comparing backwards.
+*/
+static int delta_match_backward(const char *a, const char *b, int N){
+  int i = 0;
+#if defined(__SSE2__)
+  while( i+16<=N ){
+    __m128i x = _mm_loadu_si128((const __m128i*)&a[-i-16]);
+    __m128i y = _mm_loadu_si128((const __m128i*)&b[-i-16]);
+    unsigned m = 0xffff & ~(unsigned)_mm_movemask_epi8(_mm_cmpeq_epi8(x,y));
+    if( m ) return i + __builtin_clz(m) - 16;
+    i += 16;
+  }
+#elif DELTA_WORD_COMPARE
+  while( i+8<=N ){
+    unsigned long long x, y;
+    memcpy(&x, &a[-i-8], 8);
+    memcpy(&y, &b[-i-8], 8);
+    if( x!=y ) return i + __builtin_clzll(x^y)/8;
+    i += 8;
+  }
+#endif
+  while( i<N && a[-i-1]==b[-i-1] ) i++;
+  return i;
+}
+
+/*
+** Create a new delta using the encoder selected by eEffort, one of the
+** DELTA_EFFORT_* values.  The output is in exactly the same format as
+** delta_create() and can be read by delta_apply().  The zDelta buffer
+** must be sized as for delta_create().
+**
+** For effort levels above DELTA_EFFORT_CLASSIC, the algorithm is the
+** same as delta_create() but with these differences:
+**
+**   *  A gear hash, which needs just a shift and an add per byte,
+**      replaces the Adler-style rolling hash.
+**
+**   *  The source is indexed at every iStride-th byte rather than
+**      only at every NHASH-th byte, so that matches that are not aligned
+**      to a multiple of NHASH in the source can still be found.
+**
+**   *  Matches are extended forwards and backwards using wide compares.
+**
+**   *  The collision chain limit depends on the effort, and the search
+**      stops early once a sufficiently long match has been found.
+*/
+int delta_create_ex(
+  const char *zSrc,      /* The source or pattern file */
+  unsigned int lenSrc,   /* Length of the source file */
+  const char *zOut,      /* The target file */
+  unsigned int lenOut,   /* Length of the target file */
+  char *zDelta,          /* Write the delta into this buffer */
+  int eEffort            /* One of the DELTA_EFFORT_* values */
+){
+  int i, base;
+  char *zOrigDelta = zDelta;
+  u32 h;
+  int iStride;               /* Distance between indexed source windows */
+  int mxChain;               /* Maximum collision chain walk */
+  int nGood;                 /* Stop searching at a match this long */
+  int nIndex;                /* Number of indexed source windows */
+  int nBits;                 /* log2 of the number of hash buckets */
+  int *aBucket;              /* Most recent window for each hash bucket */
+  int *collide;              /* Collision chain */
+
+  if( eEffort<=DELTA_EFFORT_CLASSIC || lenSrc<=NHASH ){
+    return delta_create(zSrc, lenSrc, zOut, lenOut, zDelta);
+  }
+  if( eEffort>DELTA_EFFORT_BEST ) eEffort = DELTA_EFFORT_BEST;
+  iStride = aDeltaEffort[eEffort].iStride;
+  mxChain = aDeltaEffort[eEffort].mxChain;
+  nGood = aDeltaEffort[eEffort].nGood;
+  while( (lenSrc-NHASH)/iStride >= DELTA_MX_INDEX ) iStride *= 2;
+
+  /* Add the target file size to the beginning of the delta
+  */
+  putInt(lenOut, &zDelta);
+  *(zDelta++) = '\n';
+
+  /* Index the source file.  Window number n begins at zSrc[n*iStride].
+  */
+  nIndex = (lenSrc-NHASH)/iStride + 1;
+  for(nBits=4; (1<<nBits)<nIndex; nBits++){}
+  collide = fossil_malloc( (nIndex + (1<<nBits))*sizeof(int) );
+  aBucket = &collide[nIndex];
+  memset(aBucket, -1, (1<<nBits)*sizeof(int));
+  h = 0;
+  for(i=0; i<NHASH-1; i++) h = GEAR_NEXT(h, zSrc[i]);
+  for(; i<lenSrc; i++){
+    int iWin = i-(NHASH-1);
+    h = GEAR_NEXT(h, zSrc[i]);
+    if( iWin%iStride==0 ){
+      u32 hv = GEAR_BUCKET(h, nBits);
+      collide[iWin/iStride] = aBucket[hv];
+      aBucket[hv] = iWin/iStride;
+    }
+  }
+
+  /* Scan the target file generating copy commands and literal sections
+  ** of the delta, exactly as delta_create() does.
+  */
+  base = 0;    /* We have already generated everything before zOut[base] */
+  while( base+NHASH<lenOut ){
+    unsigned int bestCnt = 0, bestOfst = 0, bestLitsz = 0;
+    h = gear_once(&zOut[base]);
+    i = 0;     /* Trying to match a source window against zOut[base+i] */
+    while( 1 ){
+      int iWin = aBucket[GEAR_BUCKET(h, nBits)];
+      int limit = mxChain;
+      while( iWin>=0 && (limit--)>0 ){
+        int iSrc = iWin*iStride;
+        int y = base+i;
+        int j, k, cnt, ofst, sz;
+
+        /* Match forwards from zSrc[iSrc] and zOut[base+i], then backwards
+        ** no further than zOut[base] */
+        j = delta_match_forward(&zSrc[iSrc], &zOut[y],
+                 lenSrc-iSrc <= lenOut-y ? lenSrc-iSrc : lenOut-y);
+        if( j>=NHASH ){
+          k = delta_match_backward(&zSrc[iSrc], &zOut[y], iSrc<i ? iSrc : i);
+          ofst = iSrc-k;
+          cnt = j+k;
+          sz = digit_count(i-k)+digit_count(cnt)+digit_count(ofst)+3;
+          if( cnt>=sz && cnt>bestCnt ){
+            bestCnt = cnt;
+            bestOfst = ofst;
+            bestLitsz = i-k;
+            if( cnt>=nGood ) break;
+          }
+        }
+        iWin = collide[iWin];
+      }
+
+      if( bestCnt>0 ){
+        if( bestLitsz>0 ){
+          /* Add an insert command before the copy */
+          putInt(bestLitsz,&zDelta);
+          *(zDelta++) = ':';
+          memcpy(zDelta, &zOut[base], bestLitsz);
+          zDelta += bestLitsz;
+          base += bestLitsz;
+        }
+        base += bestCnt;
+        putInt(bestCnt, &zDelta);
+        *(zDelta++) = '@';
+        putInt(bestOfst, &zDelta);
+        *(zDelta++) = ',';
+        break;
+      }
+
+      /* If we reach this point, it means no match is found so far */
+      if( base+i+NHASH>=lenOut ){
+        /* We have reached the end of the file and have not found any
+        ** matches.  Do an "insert" for everything that does not match */
+        putInt(lenOut-base, &zDelta);
+        *(zDelta++) = ':';
+        memcpy(zDelta, &zOut[base], lenOut-base);
+        zDelta += lenOut-base;
+        base = lenOut;
+        break;
+      }
+
+      /* Advance the hash by one character.  Keep looking for a match */
+      h = GEAR_NEXT(h, zOut[base+i+NHASH]);
+      i++;
+    }
+  }
+  /* Output a final "insert" record to get all the text at the end of
+  ** the file that does not match anything in the source file.
+  */
+  if( base<lenOut ){
+    putInt(lenOut-base, &zDelta);
+    *(zDelta++) = ':';
+    memcpy(zDelta, &zOut[base], lenOut-base);
+    zDelta += lenOut-base;
+  }
+  /* Output the final checksum record. */
+  putInt(checksum(zOut, lenOut), &zDelta);
+  *(zDelta++) = ';';
+  fossil_free(collide);
+  return zDelta - zOrigDelta;
+}
+
 /*
 ** Return the size (in bytes) of the output from applying
 ** a delta.
@@ -652,6 +985,224 @@ int delta_apply(
   return -1;
 }
 
+/*
+** A DeltaMap describes how to construct some target file as a sequence
+** of segments, each of which is either a run of bytes copied from the
+** original source file at the bottom of a delta chain, or a run of
+** literal bytes found inside one of the deltas of the chain.
+**
+** A chain of deltas is collapsed by composing each delta in turn with
+** the map for the file it is applied to, beginning from the identity
+** map of the source.  The final target is then written in a single
+** pass, without ever constructing the intermediate files.  Literal
+** segments point directly into the delta text, so every delta of the
+** chain must remain unchanged until the map is no longer needed.
+*/
+#if INTERFACE
+struct DeltaSeg {
+  unsigned int iOut;     /* Offset of this segment in the target */
+  unsigned int n;        /* Number of bytes in this segment */
+  unsigned int ofst;     /* Offset in the source, if zLit==0 */
+  const char *zLit;      /* Literal text, or NULL to copy from the source */
+};
+struct DeltaMap {
+  int nSeg;              /* Number of segments in use */
+  int nAlloc;            /* Number of slots allocated for aSeg[] */
+  unsigned int nOut;     /* Size of the target */
+  unsigned int cksum;    /* Checksum of the target, from its delta */
+  struct DeltaSeg *aSeg; /* Segments, in target order */
+};
+#endif /* INTERFACE */
+
+/*
+** Append a segment to pMap, merging it into the previous segment when
+** the two are contiguous.
+*/
+static void delta_map_append(
+  DeltaMap *pMap,
+  unsigned int n,
+  unsigned int ofst,
+  const char *zLit
+){
+  struct DeltaSeg *pSeg;
+  if( n==0 ) return;
+  if( pMap->nSeg>0 ){
+    pSeg = &pMap->aSeg[pMap->nSeg-1];
+    if( zLit ? (pSeg->zLit && pSeg->zLit+pSeg->n==zLit)
+             : (pSeg->zLit==0 && pSeg->ofst+pSeg->n==ofst) ){
+      pSeg->n += n;
+      pMap->nOut += n;
+      return;
+    }
+  }
+  if( pMap->nSeg>=pMap->nAlloc ){
+    pMap->nAlloc = pMap->nAlloc*2 + 16;
+    pMap->aSeg = fossil_realloc(pMap->aSeg, pMap->nAlloc*sizeof(pMap->aSeg[0]));
+  }
+  pSeg = &pMap->aSeg[pMap->nSeg++];
+  pSeg->iOut = pMap->nOut;
+  pSeg->n = n;
+  pSeg->ofst = ofst;
+  pSeg->zLit = zLit;
+  pMap->nOut += n;
+}
+
+/*
+** Reset pMap to the identity map of a source file of lenSrc bytes.
+** Space previously allocated for pMap is reused.  pMap must be zeroed
+** prior to its first use.
+*/
+void delta_map_init(DeltaMap *pMap, unsigned int lenSrc){
+  pMap->nSeg = 0;
+  pMap->nOut = 0;
+  pMap->cksum = 0;
+  delta_map_append(pMap, lenSrc, 0, 0);
+}
+
+/*
+** Free all memory held by pMap.
+*/
+void delta_map_reset(DeltaMap *pMap){
+  fossil_free(pMap->aSeg);
+  memset(pMap, 0, sizeof(*pMap));
+}
+
+/*
+** Compose the delta zDelta with pIn, which maps to the file that the
+** delta is applied to, and write the resulting map into pOut.  pOut and
+** pIn must be different maps.
+**
+** Return the size of the target of the delta, or -1 if the delta is
+** malformed.  The delta is checked in the same way as delta_apply().
+*/
+int delta_map_compose(
+  DeltaMap *pOut,        /* Write the composed map here */
+  const DeltaMap *pIn,   /* Map of the file the delta applies to */
+  const char *zDelta,    /* The delta */
+  int lenDelta           /* Length of the delta */
+){
+  unsigned int limit;
+  unsigned int total = 0;
+
+  assert( pOut!=pIn );
+  pOut->nSeg = 0;
+  pOut->nOut = 0;
+  limit = getInt(&zDelta, &lenDelta);
+  if( *zDelta!='\n' ){
+    /* ERROR: size integer not terminated by "\n" */
+    return -1;
+  }
+  zDelta++; lenDelta--;
+  while( *zDelta && lenDelta>0 ){
+    unsigned int cnt, ofst;
+    cnt = getInt(&zDelta, &lenDelta);
+    switch( zDelta[0] ){
+      case '@': {
+        int lwr, upr;
+        zDelta++; lenDelta--;
+        ofst = getInt(&zDelta, &lenDelta);
+        if( lenDelta>0 && zDelta[0]!=',' ){
+          /* ERROR: copy command not terminated by ',' */
+          return -1;
+        }
+        zDelta++; lenDelta--;
+        total += cnt;
+        if( total>limit ){
+          /* ERROR: copy exceeds output file size */
+          return -1;
+        }
+        if( ofst+cnt > pIn->nOut ){
+          /* ERROR: copy extends past end of input */
+          return -1;
+        }
+        if( cnt==0 ) break;
+
+        /* Find the segment of pIn that holds byte ofst, then copy
+        ** segments, or parts of them, until cnt bytes are mapped */
+        lwr = 0;
+        upr = pIn->nSeg-1;
+        while( lwr<upr ){
+          int mid = (lwr+upr+1)/2;
+          if( pIn->aSeg[mid].iOut<=ofst ){
+            lwr = mid;
+          }else{
+            upr = mid-1;
+          }
+        }
+        while( cnt>0 ){
+          const struct DeltaSeg *pSeg = &pIn->aSeg[lwr++];
+          unsigned int skip = ofst - pSeg->iOut;
+          unsigned int n = pSeg->n - skip;
+          if( n>cnt ) n = cnt;
+          if( pSeg->zLit ){
+            delta_map_append(pOut, n, 0, pSeg->zLit+skip);
+          }else{
+            delta_map_append(pOut, n, pSeg->ofst+skip, 0);
+          }
+          ofst += n;
+          cnt -= n;
+        }
+        break;
+      }
+      case ':': {
+        zDelta++; lenDelta--;
+        total += cnt;
+        if( total>limit ){
+          /* ERROR:  insert command gives an output larger than predicted */
+          return -1;
+        }
+        if( cnt>lenDelta ){
+          /* ERROR: insert count exceeds size of delta */
+          return -1;
+        }
+        delta_map_append(pOut, cnt, 0, zDelta);
+        zDelta += cnt;
+        lenDelta -= cnt;
+        break;
+      }
+      case ';': {
+        if( total!=limit ){
+          /* ERROR: generated size does not match predicted size */
+          return -1;
+        }
+        pOut->cksum = cnt;
+        return total;
+      }
+      default: {
+        /* ERROR: unknown delta operator */
+        return -1;
+      }
+    }
+  }
+  /* ERROR: unterminated delta */
+  return -1;
+}
+
+/*
+** Write the target described by pMap into zOut, using zSrc as the
+** source file at the bottom of the delta chain.  zOut must have space
+** for pMap->nOut bytes plus a NUL terminator.
+**
+** Return the size of the target, or -1 if the checksum test is enabled
+** and fails.
+*/
+int delta_map_apply(const DeltaMap *pMap, const char *zSrc, char *zOut){
+  int i;
+  for(i=0; i<pMap->nSeg; i++){
+    const struct DeltaSeg *pSeg = &pMap->aSeg[i];
+    memcpy(&zOut[pSeg->iOut], pSeg->zLit ? pSeg->zLit : &zSrc[pSeg->ofst],
+           pSeg->n);
+  }
+  zOut[pMap->nOut] = 0;
+#ifdef FOSSIL_ENABLE_DELTA_CKSUM_TEST
+  if( pMap->cksum!=checksum(zOut, pMap->nOut) ){
+    /* ERROR:  bad checksum */
+    return -1;
+  }
+#endif
+  return pMap->nOut;
+}
+
 /*
 ** Analyze a delta.  Figure out the total number of bytes copied from
 ** source to target, and the total number of bytes inserted by the delta,
@@ -20,12 +20,38 @@
 #include "config.h"
 #include "deltacmd.h"
 
+/*
+** SETTING: delta-effort width=2 default=0
+** How hard to work when computing deltas for new artifacts and for
+** artifacts sent over the network.  0 selects the classic delta encoder.
+** Values 1 through 3 select a faster encoder that can also find more
+** matches, with higher values giving smaller deltas at some cost in
+** speed.  All values produce deltas that any version of Fossil can read.
+*/
+
+/*
+** Return the effort level to use for blob_delta_create().
+*/
+static int delta_effort(void){
+  static int eEffort = -1;
+  if( eEffort<0 ){
+    eEffort = g.repositoryOpen ? db_get_int("delta-effort", 0) : 0;
+    if( eEffort<0 ) eEffort = 0;
+  }
+  return eEffort;
+}
+
 /*
 ** Create a delta that describes the change from pOriginal to pTarget
-** and put that delta in pDelta.  The pDelta blob is assumed to be
-** uninitialized.
+** and put that delta in pDelta using the encoder selected by eEffort.
+** The pDelta blob is assumed to be uninitialized.
 */
-int blob_delta_create(Blob *pOriginal, Blob *pTarget, Blob *pDelta){
+int blob_delta_create_ex(
+  Blob *pOriginal,
+  Blob *pTarget,
+  Blob *pDelta,
+  int eEffort
+){
   const char *zOrig, *zTarg;
   int lenOrig, lenTarg;
   int len;
@@ -37,11 +63,20 @@ int blob_delta_create(Blob *pOriginal, Blob *pTarget, Blob *pDelta){
   lenTarg = blob_size(pTarget);
   blob_resize(pDelta, lenTarg+16);
   zRes = blob_materialize(pDelta);
-  len = delta_create(zOrig, lenOrig, zTarg, lenTarg, zRes);
+  len = delta_create_ex(zOrig, lenOrig, zTarg, lenTarg, zRes, eEffort);
   blob_resize(pDelta, len);
   return 0;
 }
 
+/*
+** Create a delta that describes the change from pOriginal to pTarget
+** and put that delta in pDelta.  The pDelta blob is assumed to be
+** uninitialized.
+*/
+int blob_delta_create(Blob *pOriginal, Blob *pTarget, Blob *pDelta){
+  return blob_delta_create_ex(pOriginal, pTarget, pDelta, delta_effort());
+}
+
 /*
 ** COMMAND: test-delta-create
 **
@@ -173,21 +208,25 @@ void delta_apply_cmd(void){
 /*
 ** COMMAND: test-delta
 **
-** Usage: %fossil test-delta FILE1 FILE2
+** Usage: %fossil test-delta ?--effort N? FILE1 FILE2
 **
 ** Read two files named on the command-line.  Create and apply deltas
 ** going in both directions.  Verify that the original files are
-** correctly recovered.
+** correctly recovered.  The --effort option selects the delta encoder
+** as for the "delta-effort" setting.
 */
 void cmd_test_delta(void){
   Blob f1, f2;     /* Original file content */
   Blob d12, d21;   /* Deltas from f1->f2 and f2->f1 */
   Blob a1, a2;     /* Recovered file content */
-  if( g.argc!=4 ) usage("FILE1 FILE2");
+  const char *zEffort = find_option("effort",0,1);
+  int eEffort = zEffort ? atoi(zEffort) : 0;
+  verify_all_options();
+  if( g.argc!=4 ) usage("?--effort N? FILE1 FILE2");
   blob_read_from_file(&f1, g.argv[2], ExtFILE);
   blob_read_from_file(&f2, g.argv[3], ExtFILE);
-  blob_delta_create(&f1, &f2, &d12);
-  blob_delta_create(&f2, &f1, &d21);
+  blob_delta_create_ex(&f1, &f2, &d12, eEffort);
+  blob_delta_create_ex(&f2, &f1, &d21, eEffort);
   blob_delta_apply(&f1, &d12, &a2);
   blob_delta_apply(&f2, &d21, &a1);
   if( blob_compare(&f1,&a1) || blob_compare(&f2, &a2) ){
@@ -195,3 +234,68 @@ void cmd_test_delta(void){
   }
   fossil_print("ok\n");
 }
+
+/*
+** COMMAND: test-delta-bench
+**
+** Usage: %fossil test-delta-bench ?OPTIONS? FILE1 FILE2
+**
+** Measure the speed of the delta encoder at each effort level, and the
+** size of the deltas that it generates, for a delta that carries FILE1
+** into FILE2.  Each delta is applied and checked against FILE2.
+**
+** Options:
+**    --effort N       Only measure effort level N
+**    --repeat N       Create and apply each delta N times.  Default 1.
+*/
+void cmd_test_delta_bench(void){
+  Blob f1, f2;             /* Original file content */
+  Blob delta, out;         /* The delta and the result of applying it */
+  const char *zEffort = find_option("effort",0,1);
+  const char *zRepeat = find_option("repeat",0,1);
+  int nRepeat = zRepeat ? atoi(zRepeat) : 1;
+  int eFirst = 0, eLast = DELTA_EFFORT_BEST;
+  int e, i;
+  verify_all_options();
+  if( g.argc!=4 ) usage("?OPTIONS? FILE1 FILE2");
+  if( blob_read_from_file(&f1, g.argv[2], ExtFILE)<0 ){
+    fossil_fatal("cannot read %s", g.argv[2]);
+  }
+  if( blob_read_from_file(&f2, g.argv[3], ExtFILE)<0 ){
+    fossil_fatal("cannot read %s", g.argv[3]);
+  }
+  if( nRepeat<1 ) nRepeat = 1;
+  if( zEffort ) eFirst = eLast = atoi(zEffort);
+  fossil_print("source %d bytes, target %d bytes\n",
+               blob_size(&f1), blob_size(&f2));
+  for(e=eFirst; e<=eLast; e++){
+    sqlite3_int64 tmCreate, tmApply;
+    double mb = (double)blob_size(&f2)*nRepeat/1048576.0;
+    tmCreate = current_time_in_milliseconds();
+    for(i=0; i<nRepeat; i++){
+      if( i ) blob_reset(&delta);
+      blob_delta_create_ex(&f1, &f2, &delta, e);
+    }
+    tmCreate = current_time_in_milliseconds() - tmCreate;
+    tmApply = current_time_in_milliseconds();
+    for(i=0; i<nRepeat; i++){
+      if( i ) blob_reset(&out);
+      blob_delta_apply(&f1, &delta, &out);
+    }
+    tmApply = current_time_in_milliseconds() - tmApply;
+    if( blob_compare(&f2, &out) ){
+      fossil_fatal("effort %d: delta does not reproduce the target", e);
+    }
+    fossil_print("effort %d: delta %9d bytes  ratio %7.2f  "
+                 "create %8.1f MB/s  apply %8.1f MB/s\n",
+                 e, blob_size(&delta),
+                 blob_size(&delta) ? (double)blob_size(&f2)/blob_size(&delta)
+                                   : 0.0,
+                 mb*1000.0/(tmCreate>0 ? tmCreate : 1),
+                 mb*1000.0/(tmApply>0 ? tmApply : 1));
+    blob_reset(&delta);
+    blob_reset(&out);
+  }
+  blob_reset(&f1);
+  blob_reset(&f2);
+}
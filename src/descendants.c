@@ -208,6 +208,20 @@ void compute_direct_ancestors(int rid){
   );
 }
 
+/*
+** The check-in whose ancestors are in the TEMP table "ok" that is used
+** by mtime_of_manifest_file(), or -1 if there is no such table.
+*/
+static int prevVid = -1;
+
+/*
+** Forget the ancestors computed by mtime_of_manifest_file().  The TEMP
+** table that holds them is dropped at the end of each web page.
+*/
+void descendants_reset(void){
+  prevVid = -1;
+}
+
 /*
 ** Compute the "mtime" of the file given whose blob.rid is "fid" that
 ** is part of check-in "vid".  The mtime will be the mtime on vid or
@@ -218,7 +232,6 @@ int mtime_of_manifest_file(
   int fid,       /* The id of the file whose check-in time is sought */
   i64 *pMTime    /* Write result here */
 ){
-  static int prevVid = -1;
   static Stmt q;
 
   if( prevVid!=vid ){
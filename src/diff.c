@@ -21,6 +21,9 @@
 #include "config.h"
 #include "diff.h"
 #include <assert.h>
+#if defined(__SSE2__)
+# include <emmintrin.h>
+#endif
 
 
 #if INTERFACE
@@ -44,6 +47,7 @@
 #define DIFF_NOTTOOBIG    (((u64)0x08)<<32) /* Only display if not too big */
 #define DIFF_STRIP_EOLCR  (((u64)0x10)<<32) /* Strip trailing CR */
 #define DIFF_SLOW_SBS     (((u64)0x20)<<32) /* Better but slower side-by-side */
+#define DIFF_HISTOGRAM    (((u64)0x40)<<32) /* Use the histogram algorithm */
 
 /*
 ** These error messages are shared in multiple locations.  They are defined
@@ -62,7 +66,10 @@
     "whitespace changes only\n"
 
 /*
-** Maximum length of a line in a text file, in bytes.  (2**13 = 8192 bytes)
+** Lines longer than this many bytes cause looks_like_utf8() to report
+** LOOK_LONG.  (2**13 = 8192 bytes)  The diff engine itself has no limit
+** on line length; only the low LENGTH_MASK_SZ bits of each length are
+** folded into the line hash.
 */
 #define LENGTH_MASK_SZ  13
 #define LENGTH_MASK     ((1<<LENGTH_MASK_SZ)-1)
@@ -72,16 +79,17 @@
 /*
 ** Information about each line of a file being diffed.
 **
-** The lower LENGTH_MASK_SZ bits of the hash (DLine.h) are the length
-** of the line.  If any line is longer than LENGTH_MASK characters,
-** the file is considered binary.
+** The lower LENGTH_MASK_SZ bits of the hash (DLine.h) are the low bits
+** of the number of significant bytes in the line.  The full length is
+** kept in DLine.n, so lines of any length can be diffed.  The object
+** is 24 bytes on 64-bit hosts, and the fields read by the comparison
+** routines (z, n and h) are adjacent at the front.
 */
 typedef struct DLine DLine;
 struct DLine {
   const char *z;        /* The text of the line */
+  unsigned int n;       /* Number of bytes */
   unsigned int h;       /* Hash of the line */
-  unsigned short indent;  /* Indent of the line. Only !=0 with -w/-Z option */
-  unsigned short n;     /* number of bytes */
   unsigned int iNext;   /* 1+(Index of next line with same the same hash) */
 
   /* an array of DLine elements serves two purposes.  The fields
@@ -118,8 +126,34 @@ struct DContext {
   DLine *aTo;        /* File on right side of the diff */
   int nTo;           /* Number of lines in aTo[] */
   int (*same_fn)(const DLine*,const DLine*); /* comparison function */
+  int useHistogram;  /* Use histogram_step() rather than diff_step() */
+  i64 nHistWork;     /* Lines that histogramLCS() may still examine */
 };
 
+/*
+** Return the offset of the first \n or NUL character in z[0..n-1], or n
+** if there is none.
+**
+** Use 16-byte SSE2 compares where available rather than looking at one
+** byte at a time.
+*/
+static int find_line_end(const char *z, int n){
+  int i = 0;
+#if defined(__SSE2__)
+  const __m128i nl = _mm_set1_epi8('\n');
+  const __m128i nul = _mm_setzero_si128();
+  while( i+16<=n ){
+    __m128i x = _mm_loadu_si128((const __m128i*)&z[i]);
+    unsigned m = (unsigned)_mm_movemask_epi8(
+                   _mm_or_si128(_mm_cmpeq_epi8(x,nl), _mm_cmpeq_epi8(x,nul)));
+    if( m ) return i + __builtin_ctz(m);
+    i += 16;
+  }
+#endif
+  while( i<n && z[i]!='\n' && z[i]!=0 ) i++;
+  return i;
+}
+
 /*
 ** Count the number of lines in the input string.  Include the last line
 ** in the count even if it lacks the \n terminator.  If an empty string
@@ -132,14 +166,14 @@ static int count_lines(
   int n,
   int *pnLine
 ){
-  int nLine;
-  const char *zNL, *z2;
-  for(nLine=0, z2=z; (zNL = strchr(z2,'\n'))!=0; z2=zNL+1, nLine++){}
-  if( z2[0]!='\0' ){
+  int nLine = 0;
+  int i = 0;
+  while( i<n ){
+    i += find_line_end(&z[i], n-i);
+    if( i<n && z[i]==0 ) return 0;
     nLine++;
-    do{ z2++; }while( z2[0]!='\0' );
+    i++;
   }
-  if( n!=(int)(z2-z) ) return 0;
   if( pnLine ) *pnLine = nLine;
   return 1;
 }
@@ -147,14 +181,14 @@ static int count_lines(
 /*
 ** Return an array of DLine objects containing a pointer to the
 ** start of each line and a hash of that line.  The lower
-** bits of the hash store the length of each line.
+** bits of the hash store the low bits of the length of each line.
 **
 ** Trailing whitespace is removed from each line.  2010-08-20:  Not any
 ** more.  If trailing whitespace is ignored, the "patch" command gets
 ** confused by the diff output.  Ticket [a9f7b23c2e376af5b0e5b]
 **
-** Return 0 if the file is binary or contains a line that is
-** too long.
+** Return 0 if the file is binary.  There is no limit on the
+** length of individual lines.
 **
 ** Profiling show that in most cases this routine consumes the bulk of
 ** the CPU time on a diff.
@@ -182,13 +216,8 @@ static DLine *break_into_lines(
   }
   i = 0;
   do{
-    zNL = strchr(z,'\n');
-    if( zNL==0 ) zNL = z+n;
-    nn = (int)(zNL - z);
-    if( nn>LENGTH_MASK ){
-      fossil_free(a);
-      return 0;
-    }
+    nn = find_line_end(z, n);
+    zNL = z+nn;
     a[i].z = z;
     k = nn;
     if( diffFlags & DIFF_STRIP_EOLCR ){
@@ -218,8 +247,7 @@ static DLine *break_into_lines(
         h *= 0x9e3779b1;
       }
     }
-    a[i].indent = s;
-    a[i].h = h = (h<<LENGTH_MASK_SZ) | (k-s);
+    a[i].h = h = (h<<LENGTH_MASK_SZ) | ((k-s)&LENGTH_MASK);
     h2 = h % nLine;
     a[i].iNext = a[h2].iHash;
     a[h2].iHash = i+1;
@@ -237,18 +265,30 @@ static DLine *break_into_lines(
 ** Return true if two DLine elements are identical.
 */
 static int same_dline(const DLine *pA, const DLine *pB){
-  return pA->h==pB->h && memcmp(pA->z,pB->z, pA->h&LENGTH_MASK)==0;
+  return pA->h==pB->h && pA->n==pB->n && memcmp(pA->z,pB->z,pA->n)==0;
 }
 
 /*
 ** Return true if two DLine elements are identical, ignoring
-** all whitespace. The indent field of pA/pB already points
-** to the first non-space character in the string.
+** whitespace at the end of the line.
 */
+static int same_dline_ignore_eolws(const DLine *pA, const DLine *pB){
+  int nA = pA->n, nB = pB->n;
+  if( pA->h!=pB->h ) return 0;
+  while( nA>0 && fossil_isspace(pA->z[nA-1]) ){ nA--; }
+  while( nB>0 && fossil_isspace(pB->z[nB-1]) ){ nB--; }
+  return nA==nB && memcmp(pA->z,pB->z,nA)==0;
+}
 
+/*
+** Return true if two DLine elements are identical, ignoring
+** all whitespace.
+*/
 static int same_dline_ignore_allws(const DLine *pA, const DLine *pB){
-  int a = pA->indent, b = pB->indent;
+  int a = 0, b = 0;
   if( pA->h==pB->h ){
+    while( a<pA->n && fossil_isspace(pA->z[a]) ) ++a;
+    while( b<pB->n && fossil_isspace(pB->z[b]) ) ++b;
     while( a<pA->n || b<pB->n ){
       if( a<pA->n && b<pB->n && pA->z[a++] != pB->z[b++] ) return 0;
       while( a<pA->n && fossil_isspace(pA->z[a])) ++a;
@@ -327,6 +367,22 @@ static void appendDiffLineno(Blob *pOut, int lnA, int lnB, int html){
   if( html ) blob_append(pOut, "</span>", -1);
 }
 
+/*
+** Number of diff chunks output so far by contextDiff() and sbsDiff().
+** In HTML output, each chunk is marked with an id made from this number.
+*/
+static int nContextChunk = 0;
+static int nSbsChunk = 0;
+
+/*
+** Forget the number of diff chunks output, so that the ids in the next
+** web page start again from the beginning.
+*/
+void diff_reset(void){
+  nContextChunk = 0;
+  nSbsChunk = 0;
+}
+
 /*
 ** Given a raw diff p[] in which the p->aEdit[] array has been filled
 ** in, compute a context diff into pOut.
@@ -349,7 +405,6 @@ static void contextDiff(
   int i, j;     /* Loop counters */
   int m;        /* Number of lines to output */
   int skip;     /* Number of lines to skip */
-  static int nChunk = 0;  /* Number of diff chunks seen so far */
   int nContext;    /* Number of lines of context */
   int showLn;      /* Show line numbers */
   int html;        /* Render as HTML */
@@ -423,7 +478,7 @@ static void contextDiff(
     ** context diff that contains line numbers, show the separator from
     ** the previous block.
     */
-    nChunk++;
+    nContextChunk++;
     if( showLn ){
       if( !showDivider ){
         /* Do not show a top divider */
@@ -433,7 +488,9 @@ static void contextDiff(
       }else{
         blob_appendf(pOut, "%.80c\n", '.');
       }
-      if( html ) blob_appendf(pOut, "<span id=\"chunk%d\"></span>", nChunk);
+      if( html ){
+        blob_appendf(pOut, "<span id=\"chunk%d\"></span>", nContextChunk);
+      }
     }else{
       if( html ) blob_appendf(pOut, "<span class=\"diffln\">");
       /*
@@ -891,12 +948,17 @@ static void sbsWriteLineChange(
   /* At this point we know that there is a chunk of text that has
   ** changed between the left and the right.  Check to see if there
   ** is a large unchanged section in the middle of that changed block.
+  ** textLCS() takes time proportional to the product of the lengths
+  ** of the changed chunks when the text is repetitive, so do not try
+  ** on chunks longer than the lines that the diff engine used to allow.
   */
   nLeftDiff = nLeft - nSuffix - nPrefix;
   nRightDiff = nRight - nSuffix - nPrefix;
   if( p->escHtml
    && nLeftDiff >= 6
    && nRightDiff >= 6
+   && nLeftDiff <= LENGTH_MASK
+   && nRightDiff <= LENGTH_MASK
    && textLCS(&zLeft[nPrefix], nLeftDiff, &zRight[nPrefix], nRightDiff, aLCS)
   ){
     sbsWriteLineno(p, lnLeft, SBS_LNA);
@@ -1192,7 +1254,6 @@ static void sbsDiff(
   int i, j;     /* Loop counters */
   int m, ma, mb;/* Number of lines to output */
   int skip;     /* Number of lines to skip */
-  static int nChunk = 0; /* Number of chunks of diff output seen so far */
   SbsLine s;    /* Output line buffer */
   int nContext; /* Lines of context above and below each change */
   int showDivider = 0;  /* True to show the divider */
@@ -1294,9 +1355,10 @@ static void sbsDiff(
       }
     }
     showDivider = 1;
-    nChunk++;
+    nSbsChunk++;
     if( s.escHtml ){
-      blob_appendf(s.apCols[SBS_LNA], "<span id=\"chunk%d\"></span>", nChunk);
+      blob_appendf(s.apCols[SBS_LNA], "<span id=\"chunk%d\"></span>",
+                   nSbsChunk);
     }
 
     /* Show the initial common area */
@@ -1662,6 +1724,185 @@ static void diff_step(DContext *p, int iS1, int iE1, int iS2, int iE2){
   }
 }
 
+/*
+** A line that occurs more than this many times in the aFrom[] side of a
+** region is never used as the anchor of a histogram diff step.  If every
+** line the two sides have in common is that frequent, the region is
+** handed to diff_step() instead.
+*/
+#define HISTOGRAM_MAX_CHAIN 64
+
+/*
+** Each call to histogramLCS() examines every line of its region, and a
+** region can shrink by as little as one line per call.  To keep the
+** total work close to linear, histogram_step() hands its region to
+** diff_step() once histogramLCS() has examined this many times the
+** number of lines in the two files.
+*/
+#define HISTOGRAM_MAX_WORK 32
+
+/*
+** One distinct line in the aFrom[] side of a region being diffed by
+** histogramLCS(), and the list of places where it occurs.
+*/
+typedef struct HistRec HistRec;
+struct HistRec {
+  int iLine;          /* One of the lines with this text */
+  int nCnt;           /* Number of occurrences */
+  int iFirst;         /* 1+(offset in region of the first occurrence) */
+  int iNextRec;       /* 1+(next record in the same hash bucket) */
+};
+
+/*
+** Locate a sequence of lines that are the same in lines iS1 through iE1-1
+** of aFrom[] and lines iS2 through iE2-1 of aTo[], using the histogram
+** method.  Each matching sequence is scored by the number of times its
+** least common line occurs in aFrom[].  The longest sequence wins, or
+** the one with the rarest line if that is lower than the score of the
+** longest so far.  Return the bounds of the sequence.
+**
+** Return false if the two blocks have no line in common that occurs no
+** more than HISTOGRAM_MAX_CHAIN times in aFrom[].
+*/
+static int histogramLCS(
+  DContext *p,               /* Two files being compared */
+  int iS1, int iE1,          /* Range of lines in p->aFrom[] */
+  int iS2, int iE2,          /* Range of lines in p->aTo[] */
+  int *piSX, int *piEX,      /* Write p->aFrom[] common segment here */
+  int *piSY, int *piEY       /* Write p->aTo[] common segment here */
+){
+  int nA = iE1 - iS1;        /* Number of lines on the aFrom[] side */
+  int nBits;                 /* Log2 of the number of hash buckets */
+  int *aBucket;              /* Hash table of records.  1+index in aRec[] */
+  HistRec *aRec;             /* One record per distinct line */
+  int nRec = 0;              /* Number of records in aRec[] */
+  int *aNext;                /* 1+(offset of next occurrence of same line) */
+  int *aRecOf;               /* Index in aRec[] of each line of aFrom[] */
+  int bestCnt = HISTOGRAM_MAX_CHAIN+1;  /* Score of the best match */
+  int bestLen = 0;           /* Length of the best match */
+  int i, j, k, r;
+
+  for(nBits=4; (1<<nBits)<nA*2; nBits++){}
+  aBucket = fossil_malloc( sizeof(int)*((1<<nBits) + nA*2)
+                           + sizeof(HistRec)*nA );
+  memset(aBucket, 0, sizeof(int)*(1<<nBits));
+  aNext = &aBucket[1<<nBits];
+  aRecOf = &aNext[nA];
+  aRec = (HistRec*)&aRecOf[nA];
+
+  /* Build the histogram of the aFrom[] side, adding lines in reverse
+  ** order so that each list of occurrences comes out in order. */
+  for(i=iE1-1; i>=iS1; i--){
+    DLine *pLine = &p->aFrom[i];
+    int b = (int)((pLine->h*0x9e3779b1u) >> (32-nBits));
+    for(r=aBucket[b]; r>0; r=aRec[r-1].iNextRec){
+      if( p->same_fn(&p->aFrom[aRec[r-1].iLine], pLine) ) break;
+    }
+    if( r==0 ){
+      r = ++nRec;
+      aRec[r-1].nCnt = 0;
+      aRec[r-1].iFirst = 0;
+      aRec[r-1].iNextRec = aBucket[b];
+      aBucket[b] = r;
+    }
+    aRec[r-1].iLine = i;
+    aRec[r-1].nCnt++;
+    aNext[i-iS1] = aRec[r-1].iFirst;
+    aRec[r-1].iFirst = i-iS1+1;
+    aRecOf[i-iS1] = r-1;
+  }
+
+  /* Try each line of the aTo[] side as the anchor of a match */
+  for(j=iS2; j<iE2; ){
+    DLine *pLine = &p->aTo[j];
+    int b = (int)((pLine->h*0x9e3779b1u) >> (32-nBits));
+    int jNext = j+1;
+    for(r=aBucket[b]; r>0; r=aRec[r-1].iNextRec){
+      if( p->same_fn(&p->aFrom[aRec[r-1].iLine], pLine) ) break;
+    }
+    if( r>0 && aRec[r-1].nCnt<=bestCnt ){
+      for(k=aRec[r-1].iFirst; k>0; k=aNext[k-1]){
+        int iSX = iS1+k-1, iEX = iSX+1;
+        int iSY = j, iEY = j+1;
+        int nCnt = aRec[r-1].nCnt;
+        while( iSX>iS1 && iSY>iS2
+            && p->same_fn(&p->aFrom[iSX-1], &p->aTo[iSY-1]) ){
+          iSX--;
+          iSY--;
+          if( aRec[aRecOf[iSX-iS1]].nCnt<nCnt ){
+            nCnt = aRec[aRecOf[iSX-iS1]].nCnt;
+          }
+        }
+        while( iEX<iE1 && iEY<iE2
+            && p->same_fn(&p->aFrom[iEX], &p->aTo[iEY]) ){
+          if( aRec[aRecOf[iEX-iS1]].nCnt<nCnt ){
+            nCnt = aRec[aRecOf[iEX-iS1]].nCnt;
+          }
+          iEX++;
+          iEY++;
+        }
+        if( jNext<iEY ) jNext = iEY;
+        if( bestLen<iEX-iSX || nCnt<bestCnt ){
+          bestLen = iEX-iSX;
+          bestCnt = nCnt;
+          *piSX = iSX;
+          *piEX = iEX;
+          *piSY = iSY;
+          *piEY = iEY;
+        }
+      }
+    }
+    j = jNext;
+  }
+  fossil_free(aBucket);
+  return bestLen>0;
+}
+
+/*
+** Do a single step in the difference using the histogram algorithm.
+** This is the same as diff_step() except that the block of common text
+** is the one anchored by the least common line, as found by
+** histogramLCS().  Regions where every line in common is very frequent
+** are handed to diff_step(), as is whatever is left once the work limit
+** of HISTOGRAM_MAX_WORK is used up.
+**
+** The histogram algorithm is better at keeping unique lines, such as the
+** names in a lock file or the keys in an SQL dump, lined up with each
+** other when most of the other lines are repetitive.
+*/
+static void histogram_step(DContext *p, int iS1, int iE1, int iS2, int iE2){
+  int iSX, iEX, iSY, iEY;
+
+  while( 1 ){
+    if( iE1<=iS1 ){
+      /* The first segment is empty */
+      if( iE2>iS2 ){
+        appendTriple(p, 0, 0, iE2-iS2);
+      }
+      return;
+    }
+    if( iE2<=iS2 ){
+      /* The second segment is empty */
+      appendTriple(p, 0, iE1-iS1, 0);
+      return;
+    }
+    if( p->nHistWork<=0
+     || !histogramLCS(p, iS1, iE1, iS2, iE2, &iSX, &iEX, &iSY, &iEY)
+    ){
+      diff_step(p, iS1, iE1, iS2, iE2);
+      return;
+    }
+    p->nHistWork -= (iE1-iS1) + (iE2-iS2);
+
+    /* Recursively diff the part before the common segment, then loop
+    ** to diff the part after it */
+    histogram_step(p, iS1, iSX, iS2, iSY);
+    appendTriple(p, iEX - iSX, 0, 0);
+    iS1 = iEX;
+    iS2 = iEY;
+  }
+}
+
 /*
 ** Compute the differences between two files already loaded into
 ** the DContext structure.
@@ -1694,7 +1935,12 @@ static void diff_all(DContext *p){
   if( iS>0 ){
     appendTriple(p, iS, 0, 0);
   }
-  diff_step(p, iS, iE1, iS, iE2);
+  if( p->useHistogram ){
+    p->nHistWork = HISTOGRAM_MAX_WORK*(i64)(p->nFrom + p->nTo);
+    histogram_step(p, iS, iE1, iS, iE2);
+  }else{
+    diff_step(p, iS, iE1, iS, iE2);
+  }
   if( iE1<p->nFrom ){
     appendTriple(p, p->nFrom - iE1, 0, 0);
   }
@@ -1878,9 +2124,12 @@ int *text_diff(
   memset(&c, 0, sizeof(c));
   if( (diffFlags & DIFF_IGNORE_ALLWS)==DIFF_IGNORE_ALLWS ){
     c.same_fn = same_dline_ignore_allws;
+  }else if( diffFlags & DIFF_IGNORE_EOLWS ){
+    c.same_fn = same_dline_ignore_eolws;
   }else{
     c.same_fn = same_dline;
   }
+  c.useHistogram = (diffFlags & DIFF_HISTOGRAM)!=0;
   c.aFrom = break_into_lines(blob_str(pA_Blob), blob_size(pA_Blob),
                              &c.nFrom, diffFlags);
   c.aTo = break_into_lines(blob_str(pB_Blob), blob_size(pB_Blob),
@@ -1954,6 +2203,7 @@ int *text_diff(
 **   --brief                    Show filenames only    DIFF_BRIEF
 **   -c|--context N             N lines of context.    DIFF_CONTEXT_MASK
 **   --html                     Format for HTML        DIFF_HTML
+**   --histogram                Histogram algorithm    DIFF_HISTOGRAM
 **   --invert                   Invert the diff        DIFF_INVERT
 **   -n|--linenum               Show line numbers      DIFF_LINENO
 **   --noopt                    Disable optimization   DIFF_NOOPT
@@ -1993,6 +2243,7 @@ u64 diff_options(void){
     diffFlags |= f;
   }
   if( find_option("html",0,0)!=0 ) diffFlags |= DIFF_HTML;
+  if( find_option("histogram",0,0)!=0 ) diffFlags |= DIFF_HISTOGRAM;
   if( find_option("linenum","n",0)!=0 ) diffFlags |= DIFF_LINENO;
   if( find_option("noopt",0,0)!=0 ) diffFlags |= DIFF_NOOPT;
   if( find_option("numstat",0,0)!=0 ) diffFlags |= DIFF_NUMSTAT;
@@ -2066,6 +2317,89 @@ void test_diff_cmd(void){
   re_free(pRe);
 }
 
+/*
+** COMMAND: test-diff-bench
+**
+** Usage: %fossil test-diff-bench ?OPTIONS? FILE1 FILE2
+**
+** Compare the speed of the diff algorithms, and the size of the edit
+** scripts they produce, on the two files given.  The time needed to
+** split both files into lines is shown separately.
+**
+** Options:
+**   --repeat N                  Run each algorithm N times.  Default: 10
+**   -w|--ignore-all-space       Ignore white space when comparing lines
+**   -Z|--ignore-trailing-space  Ignore whitespace at line end
+*/
+void test_diff_bench_cmd(void){
+  static const struct {
+    const char *zName;     /* Name of the algorithm */
+    u64 diffFlags;         /* Flags to select it */
+  } aAlg[] = {
+    { "default",    0              },
+    { "histogram",  DIFF_HISTOGRAM },
+  };
+  Blob a, b;
+  const char *z;
+  int nRepeat;
+  u64 diffFlags = 0;
+  sqlite3_int64 tmStart;
+  int i, k;
+
+  z = find_option("repeat",0,1);
+  nRepeat = z ? atoi(z) : 10;
+  if( nRepeat<1 ) nRepeat = 1;
+  if( find_option("ignore-trailing-space","Z",0)!=0 ){
+    diffFlags = DIFF_IGNORE_EOLWS;
+  }
+  if( find_option("ignore-all-space","w",0)!=0 ){
+    diffFlags = DIFF_IGNORE_ALLWS;
+  }
+  verify_all_options();
+  if( g.argc!=4 ) usage("?OPTIONS? FILE1 FILE2");
+  blob_read_from_file(&a, g.argv[2], ExtFILE);
+  blob_read_from_file(&b, g.argv[3], ExtFILE);
+  blob_to_utf8_no_bom(&a, 0);
+  blob_to_utf8_no_bom(&b, 0);
+
+  /* Time the line splitter */
+  tmStart = current_time_in_milliseconds();
+  for(k=0; k<nRepeat; k++){
+    int nA, nB;
+    DLine *aA = break_into_lines(blob_str(&a), blob_size(&a), &nA, diffFlags);
+    DLine *aB = break_into_lines(blob_str(&b), blob_size(&b), &nB, diffFlags);
+    if( aA==0 || aB==0 ){
+      fossil_fatal("%s", DIFF_CANNOT_COMPUTE_BINARY);
+    }
+    fossil_free(aA);
+    fossil_free(aB);
+  }
+  fossil_print("%-10s %9.3f ms\n", "split:",
+               (double)(current_time_in_milliseconds()-tmStart)/nRepeat);
+
+  /* Time each of the diff algorithms */
+  for(i=0; i<count(aAlg); i++){
+    int *aEdit = 0;
+    int nEdit = 0, nChng = 0;
+    tmStart = current_time_in_milliseconds();
+    for(k=0; k<nRepeat; k++){
+      fossil_free(aEdit);
+      aEdit = text_diff(&a, &b, 0, 0, diffFlags | aAlg[i].diffFlags);
+    }
+    for(k=0; aEdit[k] || aEdit[k+1] || aEdit[k+2]; k+=3){
+      nEdit++;
+      nChng += aEdit[k+1] + aEdit[k+2];
+    }
+    fossil_print("%-10s %9.3f ms %7d triples %9d lines changed\n",
+                 mprintf("%s:", aAlg[i].zName),
+                 (double)(current_time_in_milliseconds()-tmStart)/nRepeat,
+                 nEdit, nChng);
+    fossil_free(aEdit);
+  }
+  blob_reset(&a);
+  blob_reset(&b);
+}
+
 /**************************************************************************
 ** The basic difference engine is above.  What follows is the annotation
 ** engine.  Both are in the same file since they share many components.
@@ -2080,7 +2414,7 @@ struct Annotator {
   DContext c;       /* The diff-engine context */
   struct AnnLine {  /* Lines of the original files... */
     const char *z;       /* The text of the line */
-    short int n;         /* Number of bytes (omitting trailing \n) */
+    int n;               /* Number of bytes (omitting trailing \n) */
     short int iVers;     /* Level at which tag was set */
   } *aOrig;
   int nOrig;        /* Number of elements in aOrig[] */
@@ -2110,6 +2444,8 @@ static int annotation_start(Annotator *p, Blob *pInput, u64 diffFlags){
   memset(p, 0, sizeof(*p));
   if( (diffFlags & DIFF_IGNORE_ALLWS)==DIFF_IGNORE_ALLWS ){
     p->c.same_fn = same_dline_ignore_allws;
+  }else if( diffFlags & DIFF_IGNORE_EOLWS ){
+    p->c.same_fn = same_dline_ignore_eolws;
   }else{
     p->c.same_fn = same_dline;
   }
@@ -2129,75 +2465,331 @@ static int annotation_start(Annotator *p, Blob *pInput, u64 diffFlags){
 }
 
 /*
-** The input pParent is the next most recent ancestor of the file
-** being annotated.  Do another step of the annotation.  Return true
-** if additional annotation is required.
+** One step of an annotation:  an ancestral version of the file being
+** annotated, and the differences between it and that file.  Steps are
+** diffed on worker threads, so annotation_step_diff() must not touch the
+** database or any global state.  The lines of the file being annotated
+** are shared by all steps and are read-only while steps are running.
+*/
+typedef struct AnnStep AnnStep;
+struct AnnStep {
+  DContext c;            /* Differences going from the ancestor to the file */
+  Blob content;          /* Text of the ancestor */
+  u64 diffFlags;         /* Flags that control the diff */
+  int iVers;             /* Version to which inserted lines are attributed */
+  int rc;                /* Non-zero if the ancestor could not be diffed */
+};
+
+/*
+** Create a new annotation step for the ancestor whose text is pParent.
+** The step takes ownership of the content of pParent.
 */
-static int annotation_step(
+static AnnStep *annotation_step_new(
   Annotator *p,
   Blob *pParent,
   int iVers,
   u64 diffFlags
 ){
-  int i, j;
-  int lnTo;
+  AnnStep *pStep = fossil_malloc( sizeof(*pStep) );
+  memset(pStep, 0, sizeof(*pStep));
+  pStep->c.same_fn = p->c.same_fn;
+  pStep->c.aTo = p->c.aTo;
+  pStep->c.nTo = p->c.nTo;
+  pStep->content = *pParent;
+  blob_zero(pParent);
+  pStep->diffFlags = diffFlags;
+  pStep->iVers = iVers;
+  return pStep;
+}
 
-  /* Prepare the parent file to be diffed */
-  p->c.aFrom = break_into_lines(blob_str(pParent), blob_size(pParent),
-                                &p->c.nFrom, diffFlags);
-  if( p->c.aFrom==0 ){
-    return 1;
+/*
+** Compute the differences going from the ancestor of annotation step
+** pArg to the file being annotated.  The text of the ancestor is no longer
+** needed afterwards and is freed.
+*/
+static void annotation_step_diff(void *pArg){
+  AnnStep *pStep = (AnnStep*)pArg;
+  blob_to_utf8_no_bom(&pStep->content, 0);
+  pStep->c.aFrom = break_into_lines(blob_str(&pStep->content),
+                                    blob_size(&pStep->content),
+                                    &pStep->c.nFrom, pStep->diffFlags);
+  if( pStep->c.aFrom==0 ){
+    pStep->rc = 1;
+  }else{
+    diff_all(&pStep->c);
+    free(pStep->c.aFrom);
+    pStep->c.aFrom = 0;
   }
+  blob_reset(&pStep->content);
+}
+
+/*
+** Record the results of a diffed annotation step in p, then free the
+** step.  Return true if additional annotation is required.
+**
+** If aParent is not NULL, then it is the completed annotation of the
+** ancestor, with nParent entries, one for each line.  Lines that are
+** carried over unchanged from the ancestor take their origin from aParent,
+** which completes the annotation.  If nParent is not the number of lines
+** in the ancestor, aParent is ignored and true is returned.
+*/
+static int annotation_step_finish(
+  Annotator *p,
+  AnnStep *pStep,
+  const int *aParent,
+  int nParent
+){
+  int i, j;
+  int lnTo, lnFrom;
+  int rc = pStep->rc;
 
-  /* Compute the differences going from pParent to the file being
-  ** annotated. */
-  diff_all(&p->c);
+  if( rc==0 && aParent && pStep->c.nFrom!=nParent ){
+    aParent = 0;
+    rc = 1;
+  }
 
   /* Where new lines are inserted on this difference, record the
   ** iVers as the source of the new line.
   */
-  for(i=lnTo=0; i<p->c.nEdit; i+=3){
-    int nCopy = p->c.aEdit[i];
-    int nIns = p->c.aEdit[i+2];
+  for(i=lnTo=lnFrom=0; i<pStep->c.nEdit; i+=3){
+    int nCopy = pStep->c.aEdit[i];
+    int nDel = pStep->c.aEdit[i+1];
+    int nIns = pStep->c.aEdit[i+2];
+    if( aParent ){
+      for(j=0; j<nCopy; j++){
+        if( p->aOrig[lnTo+j].iVers<0 ){
+          p->aOrig[lnTo+j].iVers = aParent[lnFrom+j];
+        }
+      }
+    }
     lnTo += nCopy;
+    lnFrom += nCopy + nDel;
     for(j=0; j<nIns; j++, lnTo++){
       if( p->aOrig[lnTo].iVers<0 ){
-        p->aOrig[lnTo].iVers = iVers;
+        p->aOrig[lnTo].iVers = pStep->iVers;
       }
     }
   }
 
   /* Clear out the diff results */
-  fossil_free(p->c.aEdit);
-  p->c.aEdit = 0;
-  p->c.nEdit = 0;
-  p->c.nEditAlloc = 0;
+  fossil_free(pStep->c.aEdit);
+  fossil_free(pStep);
+  return rc;
+}
 
-  /* Clear out the from file */
-  free(p->c.aFrom);
+/*
+** SETTING: annotate-threads width=5 default=0
+** The number of threads used by "fossil annotate" and the /annotate page
+** to compare ancestral versions of a file with the version being annotated,
+** while the next few ancestors are read from the repository.  A value of 0
+** means to use one thread per CPU, up to a maximum of 8.  A value of 1
+** disables threading.
+*/
 
-  /* Return no errors */
-  return 0;
+/*
+** Analyze ancestors iFirst through iLast-1 of the file being annotated,
+** most recent first.  The text of ancestor i is written into an empty
+** Blob by xContent(pArg,i,pOut), on the calling thread.  Up to nThread
+** worker threads diff the ancestors against the file while the next
+** few ancestors are being read.
+**
+** Stop early, and set p->bMoreToDo, if the limit on the number of
+** versions or the time limit is reached.  Return the index of the first
+** ancestor that was not analyzed.
+*/
+static int annotation_run(
+  Annotator *p,          /* The annotator */
+  int iFirst,            /* First ancestor to analyze */
+  int iLast,             /* One more than the last ancestor to analyze */
+  void (*xContent)(void*,int,Blob*),  /* Read the text of an ancestor */
+  void *pArg,            /* First argument to xContent */
+  int nThread,           /* Number of worker threads */
+  u64 diffFlags,         /* Flags that control the diff */
+  int iLimit,            /* Maximum number of versions, or 0 */
+  sqlite3_int64 mxTime   /* Halt at this time, or 0 */
+){
+  WorkQueue *pQueue;
+  AnnStep *pStep;
+  Blob content;
+  int i;
+
+  if( iLast-iFirst<4 ) nThread = 1;
+  pQueue = workqueue_new(nThread, nThread*4, annotation_step_diff);
+  for(i=iFirst; i<iLast; i++){
+    if( i>=3 ){  /* Process at least 3 rows before imposing limits */
+      if( (iLimit>0 && i>=iLimit)
+       || (mxTime>0 && current_time_in_milliseconds()>mxTime)
+      ){
+        p->bMoreToDo = 1;
+        break;
+      }
+    }
+    if( workqueue_full(pQueue) ){
+      annotation_step_finish(p, workqueue_pop(pQueue), 0, 0);
+    }
+    xContent(pArg, i, &content);
+    workqueue_push(pQueue, annotation_step_new(p, &content, i-1, diffFlags));
+  }
+  while( (pStep = workqueue_pop(pQueue))!=0 ){
+    annotation_step_finish(p, pStep, 0, 0);
+  }
+  workqueue_free(pQueue, 0);
+  return i;
 }
 
-/* Return the current time as milliseconds since the Julian epoch */
-static sqlite3_int64 current_time_in_milliseconds(void){
-  static sqlite3_vfs *clockVfs = 0;
-  sqlite3_int64 t;
-  if( clockVfs==0 ) clockVfs = sqlite3_vfs_find(0);
-  if( clockVfs->iVersion>=2 && clockVfs->xCurrentTimeInt64!=0 ){
-    clockVfs->xCurrentTimeInt64(clockVfs, &t);
-  }else{
-    double r;
-    clockVfs->xCurrentTime(clockVfs, &r);
-    t = (sqlite3_int64)(r*86400000.0);
+/*
+** Completed annotations are saved in the repository cache file, if there
+** is one (see "fossil cache init"), so that later requests need only
+** analyze the versions that are newer than a saved annotation.  This
+** structure holds one saved annotation.
+*/
+typedef struct AnnCache AnnCache;
+struct AnnCache {
+  int nVers;              /* Number of versions analyzed */
+  struct AnnVers *aVers;  /* The versions, most recent first */
+  int nLine;              /* Number of lines in the file */
+  int *aLine;             /* Index into aVers[] of the origin of each line */
+};
+
+/*
+** Return the cache key for the annotation of zFilename as of check-in
+** zMUuid, computed using diffFlags.  The key is obtained from
+** fossil_malloc().
+*/
+static char *annotation_cache_key(
+  const char *zMUuid,
+  const char *zFilename,
+  u64 diffFlags
+){
+  diffFlags &= DIFF_IGNORE_ALLWS|DIFF_STRIP_EOLCR;
+  return mprintf("%s/%llx/%s", zMUuid, diffFlags, zFilename);
+}
+
+/*
+** Decode a saved annotation read from the cache.  Return non-zero if the
+** annotation is not usable, for example because one of the check-ins
+** it refers to is no longer in the repository.
+*/
+static int annotation_cache_decode(
+  AnnCache *pCache,      /* Write the decoded annotation here */
+  Blob *pVers,           /* Hashes of the check-in and file of each version */
+  Blob *pLines           /* Index of the origin of each line */
+){
+  Blob tok;
+  Stmt q;
+  int i;
+  int rc = 0;
+
+  memset(pCache, 0, sizeof(*pCache));
+  db_prepare(&q,
+    "SELECT date(event.mtime), coalesce(event.euser,event.user)"
+    "  FROM blob, event"
+    " WHERE blob.uuid=:uuid AND event.objid=blob.rid"
+  );
+  while( rc==0 && blob_token(pVers, &tok) ){
+    struct AnnVers *p;
+    pCache->aVers = fossil_realloc(pCache->aVers,
+                           (pCache->nVers+1)*sizeof(pCache->aVers[0]));
+    p = &pCache->aVers[pCache->nVers++];
+    memset(p, 0, sizeof(*p));
+    p->zMUuid = mprintf("%b", &tok);
+    if( !blob_token(pVers, &tok) ){
+      rc = 1;
+      break;
+    }
+    p->zFUuid = mprintf("%b", &tok);
+    db_bind_text(&q, ":uuid", p->zMUuid);
+    if( db_step(&q)==SQLITE_ROW ){
+      p->zDate = fossil_strdup(db_column_text(&q, 0));
+      p->zUser = fossil_strdup(db_column_text(&q, 1));
+    }else{
+      rc = 1;
+    }
+    db_reset(&q);
+  }
+  db_finalize(&q);
+  while( rc==0 && blob_token(pLines, &tok) ){
+    i = atoi(blob_buffer(&tok));
+    if( i<0 || i>=pCache->nVers ){
+      rc = 1;
+      break;
+    }
+    pCache->aLine = fossil_realloc(pCache->aLine,
+                           (pCache->nLine+1)*sizeof(pCache->aLine[0]));
+    pCache->aLine[pCache->nLine++] = i;
   }
-  return t;
+  if( pCache->nVers==0 ) rc = 1;
+  return rc;
+}
+
+/*
+** Save the completed annotation p in the cache under the key zKey.
+*/
+static void annotation_cache_save(Annotator *p, const char *zKey){
+  Blob vers, lines;
+  int i;
+  blob_init(&vers, 0, 0);
+  blob_init(&lines, 0, 0);
+  for(i=0; i<p->nVers; i++){
+    blob_appendf(&vers, "%s %s\n", p->aVers[i].zMUuid, p->aVers[i].zFUuid);
+  }
+  for(i=0; i<p->nOrig; i++){
+    int iVers = p->aOrig[i].iVers;
+    if( iVers<0 ) iVers = p->nVers-1;
+    blob_appendf(&lines, "%d%c", iVers, (i%20)==19 ? '\n' : ' ');
+  }
+  cache_annotation_write(zKey, &vers, &lines);
+  blob_reset(&vers);
+  blob_reset(&lines);
+}
+
+/*
+** Free the strings of nVers version records that were not used in an
+** annotation.
+*/
+static void annotation_vers_free(struct AnnVers *aVers, int nVers){
+  int i;
+  for(i=0; i<nVers; i++){
+    fossil_free((char*)aVers[i].zFUuid);
+    fossil_free((char*)aVers[i].zMUuid);
+    fossil_free((char*)aVers[i].zDate);
+    fossil_free((char*)aVers[i].zUser);
+  }
+}
+
+/*
+** Supplies the text of each ancestral version of the file being annotated
+** to annotation_run().
+*/
+typedef struct AnnSource AnnSource;
+struct AnnSource {
+  int *aFid;             /* File artifact ID of each version */
+  int bIncomplete;       /* True if some content is missing */
+};
+
+/*
+** Read the text of the i-th ancestral version into pOut.
+*/
+static void annotation_content(void *pArg, int i, Blob *pOut){
+  AnnSource *pSrc = (AnnSource*)pArg;
+  if( !content_get(pSrc->aFid[i], pOut) ) pSrc->bIncomplete = 1;
 }
 
 /*
 ** Compute a complete annotation on a file.  The file is identified by its
 ** filename and check-in name (NULL for current check-in).
+**
+** When there is no origin, the most recent saved annotation of an
+** ancestral version of the file is used to complete the annotation, so
+** that only the versions newer than that one need to be analyzed.  The
+** annotation is saved for later reuse if it is complete.
+**
+** A full analysis diffs every ancestor against the file being annotated.
+** With a saved annotation, lines that are carried over from the saved
+** version instead take the origin that was found when that version was
+** annotated.  The two can differ where a line was moved or duplicated,
+** since the diff then matches it against a different copy.  Each result
+** is a valid annotation, but they are not always identical.
 */
 static void annotate_file(
   Annotator *p,          /* The annotator */
@@ -2211,14 +2803,24 @@ static void annotate_file(
   Blob step;             /* Text of previous revision */
   int cid;               /* Selected check-in ID */
   int origid = 0;        /* The origin ID or zero */
-  int rid;               /* Artifact ID of the file being annotated */
   int fnid;              /* Filename ID */
   Stmt q;                /* Query returning all ancestor versions */
   int cnt = 0;           /* Number of versions analyzed */
   int iLimit;            /* Maximum number of versions to analyze */
   sqlite3_int64 mxTime;  /* Halt at this time if not already complete */
+  struct AnnVers *aRow = 0; /* All ancestral versions, most recent first */
+  int *aFid = 0;         /* File artifact ID for each entry in aRow[] */
+  int nRow = 0;          /* Number of entries in aRow[] and aFid[] */
+  char **azKey = 0;      /* Cache key for each entry in aRow[] */
+  int iHit = -1;         /* Entry in aRow[] with a saved annotation */
+  AnnCache hit;          /* The saved annotation for aRow[iHit] */
+  int iCached = -1;      /* Versions from here on come from hit.aVers[] */
+  AnnSource src;         /* Reads the text of each ancestor */
+  int nThread;           /* Number of worker threads */
+  int i;
 
   memset(p, 0, sizeof(*p));
+  memset(&hit, 0, sizeof(hit));
 
   if( zLimit ){
     if( strcmp(zLimit,"none")==0 ){
@@ -2277,40 +2879,94 @@ static void annotate_file(
     " ORDER BY ancestor.generation;",
     fnid
   );
-
   while( db_step(&q)==SQLITE_ROW ){
-    if( cnt>=3 ){  /* Process at least 3 rows before imposing limits */
-      if( (iLimit>0 && cnt>=iLimit)
-       || (cnt>0 && mxTime>0 && current_time_in_milliseconds()>mxTime)
-      ){
-        p->bMoreToDo = 1;
-        break;
+    if( (nRow & 0x3f)==0 ){
+      aRow = fossil_realloc(aRow, (nRow+0x40)*sizeof(aRow[0]));
+      aFid = fossil_realloc(aFid, (nRow+0x40)*sizeof(aFid[0]));
+    }
+    memset(&aRow[nRow], 0, sizeof(aRow[0]));
+    aRow[nRow].zFUuid = fossil_strdup(db_column_text(&q, 0));
+    aRow[nRow].zMUuid = fossil_strdup(db_column_text(&q, 1));
+    aRow[nRow].zDate = fossil_strdup(db_column_text(&q, 2));
+    aRow[nRow].zUser = fossil_strdup(db_column_text(&q, 3));
+    aFid[nRow] = db_column_int(&q, 4);
+    nRow++;
+  }
+  db_finalize(&q);
+
+  /* Find the most recent version with a saved annotation */
+  if( origid==0 && nRow>0 ){
+    Blob vers, lines;
+    blob_init(&vers, 0, 0);
+    blob_init(&lines, 0, 0);
+    azKey = fossil_malloc( nRow*sizeof(azKey[0]) );
+    for(i=0; i<nRow; i++){
+      azKey[i] = annotation_cache_key(aRow[i].zMUuid, zFilename, annFlags);
+    }
+    iHit = cache_annotation_read(azKey, nRow, &vers, &lines);
+    if( iHit>=0 && annotation_cache_decode(&hit, &vers, &lines) ){
+      iHit = -1;
+    }
+    blob_reset(&vers);
+    blob_reset(&lines);
+  }
+
+  if( nRow>0 ){
+    if( !content_get(aFid[0], &toAnnotate) ){
+      fossil_fatal("unable to retrieve content of artifact #%d", aFid[0]);
+    }
+    blob_to_utf8_no_bom(&toAnnotate, 0);
+    annotation_start(p, &toAnnotate, annFlags);
+    p->bMoreToDo = origid!=0;
+    p->origId = origid;
+    p->showId = cid;
+    cnt = 1;
+    if( iHit==0 ){
+      if( hit.nLine==p->nOrig ){
+        for(i=0; i<p->nOrig; i++) p->aOrig[i].iVers = hit.aLine[i];
+        iCached = cnt = 0;
+      }else{
+        iHit = -1;
       }
     }
-    rid = db_column_int(&q, 4);
-    if( cnt==0 ){
-      if( !content_get(rid, &toAnnotate) ){
-        fossil_fatal("unable to retrieve content of artifact #%d", rid);
+  }
+  src.aFid = aFid;
+  src.bIncomplete = 0;
+  nThread = db_get_int("annotate-threads", 0);
+  if( nThread<=0 ) nThread = workqueue_default_nthread(8);
+  while( iCached<0 && cnt<nRow ){
+    int iEnd = iHit>=cnt ? iHit : nRow;
+    cnt = annotation_run(p, cnt, iEnd, annotation_content, &src, nThread,
+                         annFlags, iLimit, mxTime);
+    if( cnt<iEnd ) break;
+    if( cnt==iHit ){
+      /* Complete the annotation using the saved annotation of this
+      ** version.  Its line origins are relative to its own list of
+      ** versions, which continues the list from here. */
+      AnnStep *pStep;
+      for(i=0; i<hit.nLine; i++) hit.aLine[i] += cnt;
+      annotation_content(&src, cnt, &step);
+      pStep = annotation_step_new(p, &step, cnt-1, annFlags);
+      annotation_step_diff(pStep);
+      if( annotation_step_finish(p, pStep, hit.aLine, hit.nLine)==0 ){
+        iCached = cnt;
+      }else{
+        cnt++;
+        iHit = -1;
       }
-      blob_to_utf8_no_bom(&toAnnotate, 0);
-      annotation_start(p, &toAnnotate, annFlags);
-      p->bMoreToDo = origid!=0;
-      p->origId = origid;
-      p->showId = cid;
-    }
-    p->aVers = fossil_realloc(p->aVers, (p->nVers+1)*sizeof(p->aVers[0]));
-    p->aVers[p->nVers].zFUuid = fossil_strdup(db_column_text(&q, 0));
-    p->aVers[p->nVers].zMUuid = fossil_strdup(db_column_text(&q, 1));
-    p->aVers[p->nVers].zDate = fossil_strdup(db_column_text(&q, 2));
-    p->aVers[p->nVers].zUser = fossil_strdup(db_column_text(&q, 3));
-    if( cnt>0 ){
-      content_get(rid, &step);
-      blob_to_utf8_no_bom(&step, 0);
-      annotation_step(p, &step, p->nVers-1, annFlags);
-      blob_reset(&step);
-    }
-    p->nVers++;
-    cnt++;
+    }
+  }
+
+  /* Record the versions analyzed */
+  p->nVers = iCached>=0 ? iCached : cnt;
+  p->aVers = fossil_malloc( (p->nVers+hit.nVers+1)*sizeof(p->aVers[0]) );
+  memcpy(p->aVers, aRow, p->nVers*sizeof(p->aVers[0]));
+  annotation_vers_free(&aRow[p->nVers], nRow-p->nVers);
+  if( iCached>=0 ){
+    memcpy(&p->aVers[p->nVers], hit.aVers, hit.nVers*sizeof(hit.aVers[0]));
+    p->nVers += hit.nVers;
+  }else{
+    annotation_vers_free(hit.aVers, hit.nVers);
   }
 
   if( p->nVers==0 ){
@@ -2321,7 +2977,20 @@ static void annotate_file(
     }
   }
 
-  db_finalize(&q);
+  /* Save a complete annotation, unless some ancestor is a phantom and
+  ** so might have changed the file in ways that are not yet known. */
+  if( azKey && !p->bMoreToDo && iHit!=0 && !src.bIncomplete && p->nOrig>0
+   && !db_exists("SELECT 1 FROM ancestor WHERE rid IN phantom")
+  ){
+    annotation_cache_save(p, azKey[0]);
+  }
+
+  for(i=0; i<nRow && azKey; i++) fossil_free(azKey[i]);
+  fossil_free(azKey);
+  fossil_free(aRow);
+  fossil_free(aFid);
+  fossil_free(hit.aVers);
+  fossil_free(hit.aLine);
   db_end_transaction(0);
 }
 
@@ -2553,6 +3222,13 @@ void annotation_page(void){
 ** of the file shows the first time each line in the file was changed or
 ** removed by any subsequent check-in.
 **
+** If the repository has a cache (see "fossil cache init"), complete
+** annotations are saved there, and a later annotation of a newer version
+** of the file only analyzes the versions after the newest saved one.
+** Lines that were moved or duplicated might then be credited to a
+** different check-in than a full analysis would show.  Run "fossil cache
+** clear" to force a full analysis.
+**
 ** Options:
 **   --filevers                  Show file version numbers rather than
 **                               check-in versions
@@ -2643,3 +3319,205 @@ void annotate_cmd(void){
     }
   }
 }
+
+/*
+** A synthetic file history, used by test-annotate-bench.  Version 0 is
+** the file being annotated.  Each older version is made from the next
+** newer one by a few random edits.
+*/
+typedef struct AnnSynth AnnSynth;
+struct AnnSynth {
+  unsigned int r;        /* State of the pseudo-random number generator */
+  int nEdit;             /* Number of edits between versions */
+  int iVers;             /* The current version */
+  int nLine;             /* Number of lines in the current version */
+  int nAlloc;            /* Slots allocated in azLine[] */
+  char **azLine;         /* Lines of the current version */
+};
+
+/*
+** Return the next pseudo-random number for a synthetic history.
+*/
+static unsigned int annotation_synth_random(AnnSynth *p){
+  p->r = p->r*1103515245 + 12345;
+  return p->r>>8;
+}
+
+/*
+** Return a new random line of text, obtained from fossil_malloc().
+*/
+static char *annotation_synth_line(AnnSynth *p){
+  unsigned int x = annotation_synth_random(p);
+  return mprintf("%*s/* line %08x of a synthetic file */ x += %u;",
+                 (x%4)*2, "", x, x%1000);
+}
+
+/*
+** Write the text of the current version of a synthetic history into pOut.
+*/
+static void annotation_synth_text(AnnSynth *p, Blob *pOut){
+  int i;
+  blob_zero(pOut);
+  for(i=0; i<p->nLine; i++){
+    blob_append(pOut, p->azLine[i], -1);
+    blob_append_char(pOut, '\n');
+  }
+}
+
+/*
+** Start a synthetic history with nLine lines and nEdit edits between
+** versions, and write the text of version 0 into pOut.
+*/
+static void annotation_synth_init(
+  AnnSynth *p,
+  int nLine,
+  int nEdit,
+  Blob *pOut
+){
+  int i;
+  memset(p, 0, sizeof(*p));
+  p->r = 20200101;
+  p->nEdit = nEdit;
+  p->nAlloc = nLine + 100;
+  p->azLine = fossil_malloc( p->nAlloc*sizeof(p->azLine[0]) );
+  for(i=0; i<nLine; i++) p->azLine[i] = annotation_synth_line(p);
+  p->nLine = nLine;
+  annotation_synth_text(p, pOut);
+}
+
+/*
+** Implementation of the xContent callback of annotation_run() for a
+** synthetic history.  Versions must be requested in order.
+*/
+static void annotation_synth_content(void *pArg, int iVers, Blob *pOut){
+  AnnSynth *p = (AnnSynth*)pArg;
+  int i, k;
+  assert( iVers==p->iVers+1 );
+  p->iVers = iVers;
+  for(k=0; k<p->nEdit; k++){
+    unsigned int x = annotation_synth_random(p);
+    i = p->nLine>0 ? (int)(x % p->nLine) : 0;
+    switch( (x>>16)%3 ){
+      case 0: {     /* Change a line */
+        if( p->nLine==0 ) break;
+        fossil_free(p->azLine[i]);
+        p->azLine[i] = annotation_synth_line(p);
+        break;
+      }
+      case 1: {     /* Insert a line */
+        if( p->nLine>=p->nAlloc ){
+          p->nAlloc = p->nAlloc*2;
+          p->azLine = fossil_realloc(p->azLine,
+                                     p->nAlloc*sizeof(p->azLine[0]));
+        }
+        memmove(&p->azLine[i+1], &p->azLine[i],
+                (p->nLine-i)*sizeof(p->azLine[0]));
+        p->azLine[i] = annotation_synth_line(p);
+        p->nLine++;
+        break;
+      }
+      default: {    /* Delete a line */
+        if( p->nLine<=1 ) break;
+        fossil_free(p->azLine[i]);
+        memmove(&p->azLine[i], &p->azLine[i+1],
+                (p->nLine-i-1)*sizeof(p->azLine[0]));
+        p->nLine--;
+        break;
+      }
+    }
+  }
+  annotation_synth_text(p, pOut);
+}
+
+/*
+** Free a synthetic history.
+*/
+static void annotation_synth_free(AnnSynth *p){
+  int i;
+  for(i=0; i<p->nLine; i++) fossil_free(p->azLine[i]);
+  fossil_free(p->azLine);
+}
+
+/*
+** COMMAND: test-annotate-bench
+**
+** Usage: %fossil test-annotate-bench ?OPTIONS?
+**
+** Measure the speed of the annotation engine on a synthetic history of a
+** single file.  The history is generated in memory, so no repository is
+** needed.  Each run analyzes the whole history, first on one thread and
+** then on the requested number of worker threads, then sees how many
+** versions can be analyzed within the one-second time limit that is
+** used by default by "fossil annotate".  The results of all runs must
+** be the same.
+**
+** Options:
+**   --edits N       Number of edits between versions.  Default: 3
+**   --lines N       Number of lines in the file.  Default: 5000
+**   --threads N     Number of worker threads.  Default: one per CPU,
+**                   but at least 2 and no more than 8
+**   --versions N    Number of versions in the history.  Default: 1000
+*/
+void annotate_bench_cmd(void){
+  const char *z;
+  int nVers, nLine, nEdit, nThread;
+  int aThread[2];
+  int i, k;
+  unsigned int aSum[2];
+
+  z = find_option("versions",0,1);
+  nVers = z ? atoi(z) : 1000;
+  z = find_option("lines",0,1);
+  nLine = z ? atoi(z) : 5000;
+  z = find_option("edits",0,1);
+  nEdit = z ? atoi(z) : 3;
+  z = find_option("threads",0,1);
+  nThread = z ? atoi(z) : workqueue_default_nthread(8);
+  verify_all_options();
+  if( nVers<2 || nLine<1 || nEdit<1 ){
+    usage("?--versions N? ?--lines N? ?--edits N? ?--threads N?");
+  }
+  if( nThread<2 ) nThread = 2;
+  aThread[0] = 1;
+  aThread[1] = nThread;
+  fossil_print("%d versions of %d lines, %d edits per version\n",
+               nVers, nLine, nEdit);
+  for(k=0; k<2; k++){
+    int iTimed;
+    for(iTimed=0; iTimed<2; iTimed++){
+      Annotator ann;
+      AnnSynth synth;
+      Blob base;
+      sqlite3_int64 tmStart, tmEnd;
+      int nDone;
+      unsigned int sum = 0;
+
+      annotation_synth_init(&synth, nLine, nEdit, &base);
+      annotation_start(&ann, &base, 0);
+      tmStart = current_time_in_milliseconds();
+      nDone = annotation_run(&ann, 1, nVers, annotation_synth_content,
+                             &synth, aThread[k], 0, 0,
+                             iTimed ? tmStart+1000 : 0);
+      tmEnd = current_time_in_milliseconds();
+      for(i=0; i<ann.nOrig; i++){
+        sum = sum*31 + (unsigned int)ann.aOrig[i].iVers;
+      }
+      if( iTimed ){
+        fossil_print("%2d thread%s: %5d versions within 1 second\n",
+                     aThread[k], aThread[k]>1 ? "s" : " ", nDone);
+      }else{
+        aSum[k] = sum;
+        fossil_print("%2d thread%s: %5d versions in %6lld ms\n",
+                     aThread[k], aThread[k]>1 ? "s" : " ", nDone,
+                     tmEnd-tmStart);
+      }
+      free(ann.c.aTo);
+      fossil_free(ann.aOrig);
+      blob_reset(&base);
+      annotation_synth_free(&synth);
+    }
+  }
+  if( aSum[0]!=aSum[1] ){
+    fossil_fatal("the annotations differ");
+  }
+}
@@ -837,6 +837,7 @@ const char *diff_get_binary_glob(void){
 **   --exec-abs-paths           Force absolute path names with external commands.
 **   --exec-rel-paths           Force relative path names with external commands.
 **   --from|-r VERSION          Select VERSION as source for the diff
+**   --histogram                Use the histogram diff algorithm
 **   --internal|-i              Use internal diff logic
 **   --new-file|-N              Show complete text of added and deleted files
 **   --numstat                  Show only the number of lines delete and added
@@ -128,6 +128,7 @@ void etag_check(unsigned eFlags, const char *zHash){
   cgi_reset_content();
   cgi_set_status(304, "Not Modified");
   cgi_reply();
+  web_page_exit(0);   /* Go on to the next web page, if there is one */
   db_close(0);
   fossil_exit(0);
 }
@@ -163,6 +164,7 @@ void etag_last_modified(sqlite3_int64 mtime){
   cgi_reset_content();
   cgi_set_status(304, "Not Modified");
   cgi_reply();
+  web_page_exit(0);   /* Go on to the next web page, if there is one */
   db_close(0);
   fossil_exit(0);
 }
@@ -186,6 +188,15 @@ sqlite3_int64 etag_mtime(void){
   return iEtagMtime;
 }
 
+/* Forget the ETag of the current web page, so that another web page
+** can be generated by the same process.
+*/
+void etag_reset(void){
+  zETag[0] = 0;
+  iMaxAge = 0;
+  iEtagMtime = 0;
+}
+
 /* 
 ** COMMAND: test-etag
 **
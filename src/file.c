@@ -86,6 +86,20 @@ struct fossilStat {
 };
 #endif
 
+/*
+** The signature of a file, as filled in by file_repo_stat().
+*/
+struct FileSig {
+  i64 iSize;            /* Size in bytes.  -1 if the file does not exist */
+  i64 iMtime;           /* Modification time in seconds */
+  i64 iMtimeNs;         /* Modification time in nanoseconds */
+  i64 iCtimeNs;         /* Inode change time in nanoseconds */
+  i64 iIno;             /* Inode number.  0 on Windows */
+  i64 iDev;             /* Device number.  0 on Windows */
+  int perm;             /* PERM_REG, PERM_EXE or PERM_LNK */
+  int isFile;           /* True for an ordinary file or a symlink */
+};
+
 #if defined(_WIN32) || defined(__CYGWIN__)
 # define fossil_isdirsep(a)    (((a) == '/') || ((a) == '\\'))
 #else
@@ -306,6 +320,56 @@ int file_perm(const char *zFilename, int eFType){
   return PERM_REG;
 }
 
+/*
+** Stat zFilename just once and fill *p with its size, modification time
+** and permissions, as file_size(), file_mtime() and file_perm() would
+** report them for a RepoFILE, and whether or not it is an ordinary file
+** or a symlink, as file_isfile_or_link() would.  Also record the
+** nanosecond change and modification times and the inode and device
+** numbers, where the platform provides them, for use as the file's
+** signature.  The cache of the most recent stat() is neither used nor
+** changed, so this routine may be called from worker threads.
+**
+** Return 0 on success.  If the file does not exist, return non-zero with
+** the size and the times set to -1.
+*/
+int file_repo_stat(const char *zFilename, FileSig *p){
+  struct fossilStat x;
+  memset(p, 0, sizeof(*p));
+  p->perm = PERM_REG;
+  if( fossil_stat(zFilename, &x, RepoFILE)!=0 ){
+    p->iSize = p->iMtime = p->iMtimeNs = p->iCtimeNs = -1;
+    return 1;
+  }
+  p->iSize = x.st_size;
+  p->iMtime = x.st_mtime;
+  p->isFile = S_ISREG(x.st_mode) || S_ISLNK(x.st_mode);
+#if defined(_WIN32)
+  p->iMtimeNs = p->iCtimeNs = x.st_mtime*(i64)1000000000;
+#else
+# if defined(HAVE_STRUCT_STAT_ST_MTIM)
+  p->iMtimeNs = x.st_mtim.tv_sec*(i64)1000000000 + x.st_mtim.tv_nsec;
+  p->iCtimeNs = x.st_ctim.tv_sec*(i64)1000000000 + x.st_ctim.tv_nsec;
+# elif defined(HAVE_STRUCT_STAT_ST_MTIMESPEC)
+  p->iMtimeNs = x.st_mtimespec.tv_sec*(i64)1000000000
+                  + x.st_mtimespec.tv_nsec;
+  p->iCtimeNs = x.st_ctimespec.tv_sec*(i64)1000000000
+                  + x.st_ctimespec.tv_nsec;
+# else
+  p->iMtimeNs = x.st_mtime*(i64)1000000000;
+  p->iCtimeNs = x.st_ctime*(i64)1000000000;
+# endif
+  p->iIno = (i64)x.st_ino;
+  p->iDev = (i64)x.st_dev;
+  if( S_ISREG(x.st_mode) && ((S_IXUSR)&x.st_mode)!=0 ){
+    p->perm = PERM_EXE;
+  }else if( db_allow_symlinks() && S_ISLNK(x.st_mode) ){
+    p->perm = PERM_LNK;
+  }
+#endif
+  return 0;
+}
+
 /*
 ** Return TRUE if the named file is an executable.  Return false
 ** for directories, devices, fifos, symlinks, etc.
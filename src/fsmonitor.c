@@ -0,0 +1,661 @@
+/*
+** Copyright (c) 2020 D. Richard Hipp
+**
+** This program is free software; you can redistribute it and/or
+** modify it under the terms of the Simplified BSD License (also
+** known as the "2-Clause License" or "FreeBSD License".)
+
+** This program is distributed in the hope that it will be useful,
+** but without any warranty; without even the implied warranty of
+** merchantability or fitness for a particular purpose.
+**
+** Author contact information:
+**   drh@hwaci.com
+**   http://www.hwaci.com/drh/
+**
+*******************************************************************************
+**
+** This file implements the "fossil fsmonitor" daemon, which watches a
+** check-out for changes using inotify and records the names of changed
+** files in a journal, and the routines that let vfile_check_signature()
+** use that journal to look at only the files that have changed.
+**
+** The journal is a file next to the check-out database, named by adding
+** "-fsmonitor" to the name of that database.  Its first line is:
+**
+**     fossil-fsmonitor PID EPOCH
+**
+** where PID is the process id of the daemon and EPOCH is unique to
+** each run of the daemon.  Each following line is the name of a file,
+** relative to the root of the check-out, that might have changed, or
+** the name of a directory followed by "/" if anything at or below that
+** directory might have changed.  Lines are only ever appended, except
+** that the daemon truncates the journal and starts a new epoch if the
+** inotify queue overflows, if a directory is renamed, or if the journal
+** grows too large.
+**
+** After each scan of the check-out, the epoch and the position in the
+** journal up to which all changes have been seen are remembered in the
+** "fsmonitor-token" entry of the VVAR table.  The next scan in the same
+** epoch need only look at the files named after that position.  Before
+** each scan, the scanning process creates a "cookie" file and waits for
+** the daemon to record it, so that every change made before the scan
+** started is known to be in the journal.  If the daemon is not running
+** or does not respond, or if the epoch has changed, the whole check-out
+** is scanned as usual.
+*/
+#include "config.h"
+#include "fsmonitor.h"
+#if defined(HAVE_INOTIFY_INIT1) && !defined(_WIN32)
+# include <sys/inotify.h>
+# include <dirent.h>
+# include <errno.h>
+# include <fcntl.h>
+# include <signal.h>
+# include <unistd.h>
+# define FSMONITOR_ENABLED 1
+#else
+# define FSMONITOR_ENABLED 0
+#endif
+
+/*
+** The journal is restarted with a new epoch when it grows larger than
+** this many bytes.
+*/
+#define FSMONITOR_MX_JOURNAL  (4*1024*1024)
+
+/*
+** Number of milliseconds to wait for the daemon to record a cookie.
+*/
+#define FSMONITOR_COOKIE_WAIT 1000
+
+/*
+** Events that cause a file or directory to be recorded in the journal.
+*/
+#define FSMONITOR_MASK  (IN_MODIFY|IN_ATTRIB|IN_CREATE|IN_DELETE| \
+                         IN_MOVED_FROM|IN_MOVED_TO|IN_DELETE_SELF| \
+                         IN_MOVE_SELF)
+
+/*
+** Information about the journal, found by fsmonitor_begin_scan() and
+** saved by fsmonitor_end_scan().
+*/
+static struct {
+  int active;            /* True if the journal was synchronized */
+  char *zEpoch;          /* Epoch of the journal */
+  i64 iEnd;              /* All changes before this offset are known */
+} fsmScan;
+
+/*
+** Return the name of the journal for the current check-out, in memory
+** obtained from fossil_malloc().
+*/
+static char *fsmonitor_journal_name(void){
+  return mprintf("%s-fsmonitor", g.zLocalDbName);
+}
+
+#if FSMONITOR_ENABLED
+/*
+** Read the header of the journal from the start of file in.  If it is
+** valid, store the process id of the daemon in *pPid, the epoch in
+** *pzEpoch and the size of the header in *pnHdr and return true.
+*/
+static int fsmonitor_read_header(
+  FILE *in,
+  int *pPid,
+  char **pzEpoch,
+  i64 *pnHdr
+){
+  char zLine[200];
+  char zEpoch[100];
+  int pid;
+  rewind(in);
+  if( fgets(zLine, sizeof(zLine), in)==0 ) return 0;
+  if( sscanf(zLine, "fossil-fsmonitor %d %99s", &pid, zEpoch)!=2 ) return 0;
+  if( pid<=0 || zLine[strlen(zLine)-1]!='\n' ) return 0;
+  *pPid = pid;
+  *pzEpoch = fossil_strdup(zEpoch);
+  *pnHdr = (i64)strlen(zLine);
+  return 1;
+}
+
+/*
+** Return the process id of the daemon for the current check-out if it
+** is running, or zero if it is not.
+*/
+static int fsmonitor_pid(char **pzEpoch){
+  char *zJournal = fsmonitor_journal_name();
+  FILE *in = fossil_fopen(zJournal, "rb");
+  char *zEpoch = 0;
+  int pid = 0;
+  i64 nHdr;
+  fossil_free(zJournal);
+  if( in==0 ) return 0;
+  if( !fsmonitor_read_header(in, &pid, &zEpoch, &nHdr) || kill(pid, 0) ){
+    pid = 0;
+  }
+  fclose(in);
+  if( pid && pzEpoch ){
+    *pzEpoch = zEpoch;
+  }else{
+    fossil_free(zEpoch);
+  }
+  return pid;
+}
+
+/*
+** Append to pOut the content of the journal in, starting at offset
+** iFrom, up to the end of the last complete line.  Return the offset
+** just past the content read.
+*/
+static i64 fsmonitor_read_journal(FILE *in, i64 iFrom, Blob *pOut){
+  char zBuf[8192];
+  size_t n;
+  int nOrig = blob_size(pOut);
+  int i;
+  clearerr(in);
+  if( fseek(in, (long)iFrom, SEEK_SET) ) return iFrom;
+  while( (n = fread(zBuf, 1, sizeof(zBuf), in))>0 ){
+    blob_append(pOut, zBuf, (int)n);
+  }
+  for(i=blob_size(pOut); i>nOrig && blob_buffer(pOut)[i-1]!='\n'; i--){}
+  blob_resize(pOut, i);
+  return iFrom + (i - nOrig);
+}
+#endif /* FSMONITOR_ENABLED */
+
+/*
+** Get ready to scan the current check-out, vid, for changes.  Return
+** true if the fsmonitor daemon is running and the check-out has been
+** scanned before in the current epoch of its journal, in which case the
+** names of the files and directories that might have changed since
+** then are loaded into the TEMP.FSMDIRTY table.  Return false if the
+** whole check-out must be scanned.
+**
+** If the daemon is running, the caller must call fsmonitor_end_scan()
+** after the scan completes.
+*/
+int fsmonitor_begin_scan(int vid){
+#if FSMONITOR_ENABLED
+  char *zJournal;
+  char *zCookie;
+  char *zLine;
+  char *zToken;
+  char *zEpoch;
+  FILE *in;
+  int pid, fd, nLine, i, nWait;
+  i64 nHdr, iStart, iEnd, iTokenEnd;
+  Blob content;
+  char *z;
+  int found = 0;
+  int rc = 0;
+
+  fsmScan.active = 0;
+  fossil_free(fsmScan.zEpoch);
+  fsmScan.zEpoch = 0;
+  if( g.zLocalDbName==0 ) return 0;
+  zJournal = fsmonitor_journal_name();
+  in = fossil_fopen(zJournal, "rb");
+  fossil_free(zJournal);
+  if( in==0 ) return 0;
+  if( !fsmonitor_read_header(in, &pid, &fsmScan.zEpoch, &nHdr) ){
+    fclose(in);
+    return 0;
+  }
+  if( kill(pid, 0) ){
+    fclose(in);
+    return 0;
+  }
+
+  /* Create a cookie and wait for the daemon to record it */
+  fseek(in, 0, SEEK_END);
+  iStart = ftell(in);
+  zCookie = mprintf("%s-fsmcookie-%d", g.zLocalDbName, (int)getpid());
+  zLine = mprintf("%s\n", file_tail(zCookie));
+  nLine = (int)strlen(zLine);
+  fd = open(zCookie, O_WRONLY|O_CREAT|O_TRUNC, 0644);
+  if( fd>=0 ){
+    close(fd);
+    blob_zero(&content);
+    iEnd = iStart;
+    for(nWait=0; !found && nWait<FSMONITOR_COOKIE_WAIT; nWait++){
+      int nOld = blob_size(&content);
+      iEnd = fsmonitor_read_journal(in, iEnd, &content);
+      z = blob_buffer(&content);
+      for(i=nOld; i<blob_size(&content); ){
+        int j;
+        for(j=i; z[j]!='\n'; j++){}
+        if( j+1-i==nLine && memcmp(&z[i], zLine, nLine)==0 ){
+          found = 1;
+          iEnd = iStart + j + 1;
+          break;
+        }
+        i = j+1;
+      }
+      if( !found ) sqlite3_sleep(1);
+    }
+    blob_reset(&content);
+    unlink(zCookie);
+  }
+  fossil_free(zCookie);
+  fossil_free(zLine);
+  if( !found ){
+    fclose(in);
+    return 0;
+  }
+  fsmScan.active = 1;
+  fsmScan.iEnd = iEnd;
+
+  /* If the last scan was in the same epoch, load the names recorded
+  ** since then. */
+  zToken = db_lget("fsmonitor-token", 0);
+  if( zToken ){
+    char zEpoch[100];
+    long long int iFrom;
+    int tokenVid;
+    if( sscanf(zToken, "%99s %lld %d", zEpoch, &iFrom, &tokenVid)==3
+     && fossil_strcmp(zEpoch, fsmScan.zEpoch)==0
+     && tokenVid==vid
+     && iFrom>=nHdr && iFrom<=iEnd
+    ){
+      Stmt ins;
+      Blob name;
+      blob_zero(&content);
+      iTokenEnd = fsmonitor_read_journal(in, (i64)iFrom, &content);
+      if( iTokenEnd>iEnd ) blob_resize(&content, (int)(iEnd - iFrom));
+      db_multi_exec(
+        "CREATE TEMP TABLE IF NOT EXISTS fsmdirty("
+        "  name TEXT PRIMARY KEY,"
+        "  isdir BOOLEAN"
+        ");"
+        "DELETE FROM fsmdirty;"
+      );
+      db_prepare(&ins, "INSERT OR IGNORE INTO fsmdirty VALUES(:name,:isdir)");
+      rc = 1;
+      z = blob_buffer(&content);
+      for(i=0; i<blob_size(&content); ){
+        int j, isDir;
+        for(j=i; z[j]!='\n'; j++){}
+        isDir = j>i && z[j-1]=='/';
+        if( isDir && j-1==i ){
+          rc = 0;   /* The whole check-out might have changed */
+          break;
+        }
+        blob_init(&name, &z[i], j-i-isDir);
+        db_bind_str(&ins, ":name", &name);
+        db_bind_int(&ins, ":isdir", isDir);
+        db_step(&ins);
+        db_reset(&ins);
+        i = j+1;
+      }
+      db_finalize(&ins);
+      blob_reset(&content);
+    }
+    fossil_free(zToken);
+  }
+
+  /* The daemon might have truncated the journal and started a new epoch
+  ** since the header was read, in which case the cookie and the names
+  ** found above could be from either epoch.  Scan everything. */
+  zEpoch = 0;
+  if( !fsmonitor_read_header(in, &pid, &zEpoch, &nHdr)
+   || fossil_strcmp(zEpoch, fsmScan.zEpoch)!=0
+  ){
+    fsmScan.active = 0;
+    rc = 0;
+  }
+  fossil_free(zEpoch);
+  fclose(in);
+  return rc;
+#else
+  fsmScan.active = 0;
+  return 0;
+#endif
+}
+
+/*
+** Call this routine after a scan of check-out vid for changes is done.
+** Remember how far into the journal of the fsmonitor daemon the scan
+** has caught up, for use by the next fsmonitor_begin_scan().
+*/
+void fsmonitor_end_scan(int vid){
+  if( !fsmScan.active ) return;
+  db_lset("fsmonitor-token",
+          mprintf("%s %lld %d", fsmScan.zEpoch, fsmScan.iEnd, vid));
+  fsmScan.active = 0;
+}
+
+#if FSMONITOR_ENABLED
+/*
+** State of the fsmonitor daemon.
+*/
+static struct {
+  int fd;                /* The inotify file descriptor */
+  int nWd;               /* Number of slots in azWd[] */
+  char **azWd;           /* Directory for each watch.  "" for the root */
+  int wdRoot;            /* Watch descriptor of the root of the check-out */
+  int jfd;               /* The journal, open for appending */
+  i64 szJournal;         /* Size of the journal */
+  const char *zDbTail;   /* Name of the check-out database, without path */
+  int nDbTail;           /* Length of zDbTail */
+  int bRestart;          /* True to restart with a new epoch */
+  volatile int bStop;    /* True when the daemon should exit */
+} fsmd;
+
+/*
+** SIGTERM and SIGINT handler for the daemon.
+*/
+static void fsmonitor_sighandler(int sig){
+  fsmd.bStop = 1;
+}
+
+/*
+** Start watching directory zDir, relative to the root of the check-out,
+** and all of its subdirectories.
+*/
+static void fsmonitor_watch(const char *zDir){
+  char *zFull = mprintf("%s%s", g.zLocalRoot, zDir);
+  DIR *d;
+  struct dirent *pEntry;
+  int wd;
+  wd = inotify_add_watch(fsmd.fd, zFull, FSMONITOR_MASK|IN_ONLYDIR|
+                                         IN_DONT_FOLLOW|IN_EXCL_UNLINK);
+  if( wd<0 ){
+    if( errno==ENOSPC ){
+      fossil_fatal("cannot watch \"%s\": too many directories."
+                   " Raise /proc/sys/fs/inotify/max_user_watches", zFull);
+    }
+    fossil_free(zFull);
+    return;
+  }
+  if( wd>=fsmd.nWd ){
+    int n = wd*2 + 64;
+    fsmd.azWd = fossil_realloc(fsmd.azWd, n*sizeof(fsmd.azWd[0]));
+    memset(&fsmd.azWd[fsmd.nWd], 0, (n-fsmd.nWd)*sizeof(fsmd.azWd[0]));
+    fsmd.nWd = n;
+  }
+  fossil_free(fsmd.azWd[wd]);
+  fsmd.azWd[wd] = fossil_strdup(zDir);
+  if( zDir[0]==0 ) fsmd.wdRoot = wd;
+  d = opendir(zFull);
+  if( d ){
+    while( (pEntry = readdir(d))!=0 ){
+      char *zSub;
+      if( pEntry->d_name[0]=='.'
+       && (pEntry->d_name[1]==0
+           || (pEntry->d_name[1]=='.' && pEntry->d_name[2]==0)) ){
+        continue;
+      }
+      if( pEntry->d_type!=DT_DIR && pEntry->d_type!=DT_UNKNOWN ) continue;
+      zSub = zDir[0] ? mprintf("%s/%s", zDir, pEntry->d_name)
+                     : fossil_strdup(pEntry->d_name);
+      if( pEntry->d_type==DT_DIR || file_isdir(zSub, RepoFILE)==1 ){
+        fsmonitor_watch(zSub);
+      }
+      fossil_free(zSub);
+    }
+    closedir(d);
+  }
+  fossil_free(zFull);
+}
+
+/*
+** Start watching the whole check-out, and truncate the journal and
+** start a new epoch.
+*/
+static void fsmonitor_start_epoch(void){
+  char *zHdr;
+  int i;
+  if( fsmd.fd>=0 ) close(fsmd.fd);
+  for(i=0; i<fsmd.nWd; i++){
+    fossil_free(fsmd.azWd[i]);
+    fsmd.azWd[i] = 0;
+  }
+  fsmd.fd = inotify_init1(IN_CLOEXEC);
+  if( fsmd.fd<0 ) fossil_fatal("inotify_init1() failed, errno %d", errno);
+  fsmd.wdRoot = -1;
+  fsmonitor_watch("");
+  zHdr = mprintf("fossil-fsmonitor %d %lld.%d\n", (int)getpid(),
+                 current_time_in_milliseconds(), (int)getpid());
+  if( ftruncate(fsmd.jfd, 0)
+   || write(fsmd.jfd, zHdr, strlen(zHdr))!=(ssize_t)strlen(zHdr) ){
+    fossil_fatal("cannot write the fsmonitor journal");
+  }
+  fsmd.szJournal = (i64)strlen(zHdr);
+  fossil_free(zHdr);
+  fsmd.bRestart = 0;
+}
+
+/*
+** Append line zLine to pOut, unless it is the same as the last line.
+*/
+static void fsmonitor_append(Blob *pOut, const char *zLine){
+  int n = (int)strlen(zLine);
+  int nOut = blob_size(pOut);
+  const char *z = blob_buffer(pOut);
+  if( nOut>=n && memcmp(&z[nOut-n], zLine, n)==0
+   && (nOut==n || z[nOut-n-1]=='\n') ){
+    return;
+  }
+  blob_append(pOut, zLine, n);
+}
+
+/*
+** Process a single inotify event, appending the name of whatever
+** might have changed to pOut.
+*/
+static void fsmonitor_event(struct inotify_event *ev, Blob *pOut){
+  const char *zDir;
+  char *zPath;
+  if( ev->mask & IN_Q_OVERFLOW ){
+    fsmd.bRestart = 1;
+    return;
+  }
+  if( ev->wd<0 || ev->wd>=fsmd.nWd || fsmd.azWd[ev->wd]==0 ) return;
+  zDir = fsmd.azWd[ev->wd];
+  if( ev->mask & (IN_IGNORED|IN_DELETE_SELF|IN_MOVE_SELF) ){
+    if( ev->wd==fsmd.wdRoot ){
+      fsmd.bStop = 1;
+    }else if( ev->mask & IN_IGNORED ){
+      fossil_free(fsmd.azWd[ev->wd]);
+      fsmd.azWd[ev->wd] = 0;
+    }
+    return;
+  }
+  if( ev->len==0 ) return;
+  if( zDir[0]==0 && strncmp(ev->name, fsmd.zDbTail, fsmd.nDbTail)==0 ){
+    /* The check-out database, its journals, and cookies */
+    if( (ev->mask & IN_CREATE)!=0
+     && strncmp(&ev->name[fsmd.nDbTail], "-fsmcookie-", 11)==0
+    ){
+      blob_appendf(pOut, "%s\n", ev->name);
+    }else if( ev->name[fsmd.nDbTail]==0
+           && (ev->mask & (IN_DELETE|IN_MOVED_FROM))!=0 ){
+      fsmd.bStop = 1;   /* The check-out has been closed */
+    }
+    return;
+  }
+  if( strchr(ev->name, '\n') ){
+    fsmd.bRestart = 1;
+    return;
+  }
+  if( ev->mask & IN_ISDIR ){
+    zPath = zDir[0] ? mprintf("%s/%s", zDir, ev->name)
+                    : fossil_strdup(ev->name);
+    if( ev->mask & IN_MOVED_FROM ){
+      /* Watches below a renamed directory still carry the old name */
+      fsmd.bRestart = 1;
+    }else if( ev->mask & (IN_CREATE|IN_MOVED_TO) ){
+      fsmonitor_watch(zPath);
+    }
+    fossil_free(zPath);
+    zPath = zDir[0] ? mprintf("%s/%s/\n", zDir, ev->name)
+                    : mprintf("%s/\n", ev->name);
+  }else{
+    zPath = zDir[0] ? mprintf("%s/%s\n", zDir, ev->name)
+                    : mprintf("%s\n", ev->name);
+  }
+  fsmonitor_append(pOut, zPath);
+  fossil_free(zPath);
+}
+
+/*
+** The main loop of the daemon.  Record changes in the journal until
+** told to stop or until the check-out is closed.
+*/
+static void fsmonitor_run(void){
+  char aBuf[65536];
+  Blob out;
+  blob_zero(&out);
+  while( !fsmd.bStop ){
+    ssize_t n = read(fsmd.fd, aBuf, sizeof(aBuf));
+    ssize_t i;
+    if( n<0 ){
+      if( errno==EINTR ) continue;
+      break;
+    }
+    for(i=0; i<n; ){
+      struct inotify_event *ev = (struct inotify_event*)&aBuf[i];
+      fsmonitor_event(ev, &out);
+      i += sizeof(struct inotify_event) + ev->len;
+    }
+    if( fsmd.bStop ) break;
+    if( fsmd.bRestart
+     || fsmd.szJournal + blob_size(&out) > FSMONITOR_MX_JOURNAL ){
+      fsmonitor_start_epoch();
+    }else if( blob_size(&out)>0 ){
+      if( write(fsmd.jfd, blob_buffer(&out), blob_size(&out))
+            !=(ssize_t)blob_size(&out) ){
+        break;
+      }
+      fsmd.szJournal += blob_size(&out);
+    }
+    blob_reset(&out);
+  }
+  blob_reset(&out);
+}
+#endif /* FSMONITOR_ENABLED */
+
+/*
+** COMMAND: fsmonitor
+**
+** Usage: %fossil fsmonitor SUBCOMMAND
+**
+** Run or control a daemon that watches the files of the current
+** check-out for changes and keeps a journal of the names of the files
+** that change.  While the daemon is running, commands such as "status",
+** "changes" and "commit" only look at the files named in the journal,
+** rather than at every file in the check-out.  This is only available
+** on Linux.
+**
+** Subcommands:
+**
+**    start ?--foreground?   Start the daemon for the current check-out.
+**                           With --foreground, run the daemon in this
+**                           process rather than in the background.
+**
+**    status                 Show whether or not the daemon is running.
+**
+**    stop                   Stop the daemon.
+**
+** The daemon also stops by itself when the check-out is closed.
+*/
+void fsmonitor_cmd(void){
+  const char *zCmd;
+  int nCmd;
+  db_must_be_within_tree();
+  if( g.argc<3 ){
+    usage("start|status|stop");
+  }
+  zCmd = g.argv[2];
+  nCmd = (int)strlen(zCmd);
+#if !FSMONITOR_ENABLED
+  fossil_fatal("fsmonitor is not supported on this platform");
+#else
+  if( strncmp(zCmd, "start", nCmd)==0 ){
+    int bForeground = find_option("foreground",0,0)!=0;
+    char *zJournal = fsmonitor_journal_name();
+    struct sigaction sa;
+    int fdReady[2];
+    int pid;
+    verify_all_options();
+    if( (pid = fsmonitor_pid(0))!=0 ){
+      fossil_fatal("fsmonitor is already running as process %d", pid);
+    }
+    fsmd.zDbTail = file_tail(g.zLocalDbName);
+    fsmd.nDbTail = (int)strlen(fsmd.zDbTail);
+    fsmd.fd = -1;
+    fsmd.jfd = open(zJournal, O_WRONLY|O_CREAT|O_APPEND|O_CLOEXEC, 0644);
+    if( fsmd.jfd<0 ) fossil_fatal("cannot open %s", zJournal);
+    db_close(1);
+    if( !bForeground ){
+      char c = 0;
+      if( pipe(fdReady) ) fossil_fatal("pipe() failed");
+      pid = fork();
+      if( pid<0 ) fossil_fatal("fork() failed");
+      if( pid>0 ){
+        close(fdReady[1]);
+        if( read(fdReady[0], &c, 1)!=1 || c!='R' ){
+          fossil_fatal("fsmonitor failed to start");
+        }
+        fossil_print("fsmonitor started as process %d\n", pid);
+        return;
+      }
+      close(fdReady[0]);
+      setsid();
+    }
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = fsmonitor_sighandler;
+    sigaction(SIGTERM, &sa, 0);
+    sigaction(SIGINT, &sa, 0);
+    fsmonitor_start_epoch();
+    if( !bForeground ){
+      int i;
+      if( write(fdReady[1], "R", 1)!=1 ){ /* Parent has gone away */ }
+      close(fdReady[1]);
+      for(i=0; i<=2; i++){
+        close(i);
+        open("/dev/null", O_RDWR);
+      }
+    }else{
+      fossil_print("fsmonitor running as process %d\n", (int)getpid());
+    }
+    fsmonitor_run();
+    unlink(zJournal);
+    fossil_free(zJournal);
+    fossil_exit(0);
+  }else if( strncmp(zCmd, "status", nCmd)==0 ){
+    char *zEpoch = 0;
+    int pid;
+    verify_all_options();
+    pid = fsmonitor_pid(&zEpoch);
+    if( pid ){
+      char *zJournal = fsmonitor_journal_name();
+      fossil_print("fsmonitor is running as process %d\n", pid);
+      fossil_print("journal: %s (%lld bytes, epoch %s)\n", zJournal,
+                   file_size(zJournal, ExtFILE), zEpoch);
+      fossil_free(zJournal);
+      fossil_free(zEpoch);
+    }else{
+      fossil_print("fsmonitor is not running\n");
+    }
+  }else if( strncmp(zCmd, "stop", nCmd)==0 ){
+    int pid, i;
+    verify_all_options();
+    pid = fsmonitor_pid(0);
+    if( pid==0 ){
+      fossil_print("fsmonitor is not running\n");
+      return;
+    }
+    kill(pid, SIGTERM);
+    for(i=0; i<200 && kill(pid, 0)==0; i++) sqlite3_sleep(10);
+    if( kill(pid, 0)==0 ){
+      fossil_fatal("fsmonitor process %d did not stop", pid);
+    }
+    fossil_print("fsmonitor process %d stopped\n", pid);
+  }else{
+    fossil_fatal("unknown subcommand \"%s\": should be one of:"
+                 " start status stop", zCmd);
+  }
+#endif
+}
@@ -179,6 +179,20 @@ static char *persistBranchName(GraphContext *p, const char *zBranch){
   return p->azBranch[p->nBranch-1];
 }
 
+/*
+** Number of rows added to all graphs so far.  Each row is numbered with
+** this count, so that the rows of all graphs on a web page are distinct.
+*/
+static int nGraphRow = 0;
+
+/*
+** Forget the number of rows, so that the rows of the next web page are
+** numbered from the beginning.
+*/
+void graph_reset(void){
+  nGraphRow = 0;
+}
+
 /*
 ** Add a new row to the graph context.  Rows are added from top to bottom.
 */
@@ -195,7 +209,6 @@ int graph_add_row(
 ){
   GraphRow *pRow;
   int nByte;
-  static int nRow = 0;
 
   if( p->nErr ) return 0;
   nByte = sizeof(GraphRow);
@@ -224,7 +237,7 @@ int graph_add_row(
   }
   p->pLast = pRow;
   p->nRow++;
-  pRow->idx = pRow->idxTop = ++nRow;
+  pRow->idx = pRow->idxTop = ++nGraphRow;
   return pRow->idx;
 }
 
@@ -39,6 +39,8 @@ struct gzip_state {
   int iCRC;             /* The checksum */
   z_stream stream;      /* The working compressor */
   Blob out;             /* Results stored here */
+  void (*xOut)(void*,const char*,int);  /* Or send results here */
+  void *pOutArg;        /* First argument to xOut() */
 } gzip;
 
 /*
@@ -51,6 +53,18 @@ static void put32(char *z, int v){
   z[3] = (v>>24) & 0xff;
 }
 
+/*
+** Append n bytes of output from z to the gzip file.
+*/
+static void gzip_output(const char *z, int n){
+  if( n<=0 ) return;
+  if( gzip.xOut ){
+    gzip.xOut(gzip.pOutArg, z, n);
+  }else{
+    blob_append(&gzip.out, z, n);
+  }
+}
+
 /*
 ** Begin constructing a gzip file.
 */
@@ -71,6 +85,21 @@ void gzip_begin(sqlite3_int64 now){
   blob_append(&gzip.out, aHdr, 10);
   gzip.iCRC = 0;
   gzip.eState = 1;
+  gzip.xOut = 0;
+  gzip.pOutArg = 0;
+}
+
+/*
+** Send the compressed output to xOut() as it is generated, instead of
+** accumulating the whole gzip file in memory.  Call this immediately
+** after gzip_begin().  The Blob returned by gzip_finish() is then empty.
+*/
+void gzip_set_output(void (*xOut)(void*,const char*,int), void *pArg){
+  assert( gzip.eState==1 );
+  gzip.xOut = xOut;
+  gzip.pOutArg = pArg;
+  gzip_output(blob_buffer(&gzip.out), blob_size(&gzip.out));
+  blob_reset(&gzip.out);
 }
 
 /*
@@ -79,15 +108,10 @@ void gzip_begin(sqlite3_int64 now){
 #define GZIP_BUFSZ 100000
 void gzip_step(const char *pIn, int nIn){
   char *zOutBuf;
-  int nOut;
 
-  nOut = nIn + nIn/10 + 100;
-  if( nOut<100000 ) nOut = 100000;
-  zOutBuf = fossil_malloc(nOut);
+  zOutBuf = fossil_malloc(GZIP_BUFSZ);
   gzip.stream.avail_in = nIn;
   gzip.stream.next_in = (unsigned char*)pIn;
-  gzip.stream.avail_out = nOut;
-  gzip.stream.next_out = (unsigned char*)zOutBuf;
   if( gzip.eState==1 ){
     gzip.stream.zalloc = (alloc_func)0;
     gzip.stream.zfree = (free_func)0;
@@ -97,16 +121,17 @@ void gzip_step(const char *pIn, int nIn){
   }
   gzip.iCRC = crc32(gzip.iCRC, gzip.stream.next_in, gzip.stream.avail_in);
   do{
-    deflate(&gzip.stream, nIn==0 ? Z_FINISH : 0);
-    blob_append(&gzip.out, zOutBuf, nOut - gzip.stream.avail_out);
-    gzip.stream.avail_out = nOut;
+    gzip.stream.avail_out = GZIP_BUFSZ;
     gzip.stream.next_out = (unsigned char*)zOutBuf;
-  }while( gzip.stream.avail_in>0 );
+    deflate(&gzip.stream, nIn==0 ? Z_FINISH : 0);
+    gzip_output(zOutBuf, GZIP_BUFSZ - gzip.stream.avail_out);
+  }while( gzip.stream.avail_out==0 );
   fossil_free(zOutBuf);
 }
 
 /*
-** Finish the gzip file and put the content in *pOut
+** Finish the gzip file and put the content in *pOut.  *pOut is empty if
+** the output was sent elsewhere by gzip_set_output().
 */
 void gzip_finish(Blob *pOut){
   char aTrailer[8];
@@ -115,10 +140,11 @@ void gzip_finish(Blob *pOut){
   deflateEnd(&gzip.stream);
   put32(aTrailer, gzip.iCRC);
   put32(&aTrailer[4], gzip.stream.total_in);
-  blob_append(&gzip.out, aTrailer, 8);
+  gzip_output(aTrailer, 8);
   *pOut = gzip.out;
   blob_zero(&gzip.out);
   gzip.eState = 0;
+  gzip.xOut = 0;
 }
 
 /*
@@ -97,6 +97,9 @@ int hname_validate(const char *zHash, int nHash){
 ** corresponding to the hash that matched if the hash is correct.
 ** (Examples: HNAME_SHA1 or HNAME_K256).  And the return is HNAME_ERROR
 ** if the hash does not match.
+**
+** No global state is used, so this routine may be called from worker
+** threads.
 */
 int hname_verify_hash(Blob *pContent, const char *zHash, int nHash){
   int id = HNAME_ERROR;
@@ -109,9 +112,10 @@ int hname_verify_hash(Blob *pContent, const char *zHash, int nHash){
       break;
     }
     case HNAME_LEN_K256: {
-      sha3sum_init(256);
-      sha3sum_step_blob(pContent);
-      if( memcmp(sha3sum_finish(0),zHash,64)==0 ) id = HNAME_K256;
+      Blob hash;
+      sha3sum_blob(pContent, 256, &hash);
+      if( memcmp(blob_buffer(&hash),zHash,64)==0 ) id = HNAME_K256;
+      blob_reset(&hash);
       break;
     }
   }
@@ -151,6 +155,53 @@ int hname_verify_file_hash(const char *zFile, const char *zHash, int nHash){
   return id;
 }
 
+/*
+** Compute the hash of file zFile using the algorithm whose hashes are
+** nHash characters long and write it, zero-terminated, into zOut[],
+** which must have room for HNAME_MAX+1 characters.  If isLink is true,
+** zFile is a symbolic link and the name of its target is hashed, as
+** blob_read_from_file() would do for a RepoFILE.
+**
+** Return 0 on success, or non-zero if the file cannot be read.  No use
+** is made of the cache of the most recent stat() and fossil_fatal() is
+** never called, so this routine may be called from worker threads.
+*/
+int hname_file_hash_mt(
+  const char *zFile,       /* The file to hash */
+  int isLink,              /* True if zFile is a symlink, per file_perm() */
+  int nHash,               /* HNAME_LEN_SHA1 or HNAME_LEN_K256 */
+  char *zOut               /* Write the hash here */
+){
+  int rc;
+  Blob hash;
+  if( nHash!=HNAME_LEN_SHA1 && nHash!=HNAME_LEN_K256 ) return 1;
+  if( isLink ){
+#if !defined(_WIN32)
+    char zBuf[1024];
+    ssize_t len = readlink(zFile, zBuf, sizeof(zBuf)-1);
+    Blob target;
+    if( len<0 ) return 1;
+    blob_init(&target, zBuf, (int)len);
+    if( nHash==HNAME_LEN_SHA1 ){
+      rc = sha1sum_blob(&target, &hash);
+    }else{
+      rc = sha3sum_blob(&target, 256, &hash);
+    }
+#else
+    return 1;
+#endif
+  }else if( nHash==HNAME_LEN_SHA1 ){
+    rc = sha1sum_file(zFile, ExtFILE, &hash);
+  }else{
+    rc = sha3sum_file(zFile, ExtFILE, 256, &hash);
+  }
+  if( rc ) return 1;
+  memcpy(zOut, blob_buffer(&hash), nHash);
+  zOut[nHash] = 0;
+  blob_reset(&hash);
+  return 0;
+}
+
 /*
 ** Compute a hash on blob pContent.  Write the hash into blob pHashOut.
 ** This routine assumes that pHashOut is uninitialized.
@@ -20,6 +20,7 @@
 #include "config.h"
 #include "http.h"
 #include <assert.h>
+#include <zlib.h>
 
 #ifdef _WIN32
 #include <io.h>
@@ -192,29 +193,51 @@ char *prompt_for_httpauth_creds(void){
   return zHttpAuth;
 }
 
+#if INTERFACE
+/*
+** The body of an HTTP reply that is being received a little at a time
+** using http_exchange_read().
+*/
+struct HttpReply {
+  int isCompressed;      /* True if the body is compressed */
+  int closeConnection;   /* True to close the connection when done */
+  int nBody;             /* Size of the body on the wire */
+  int nLeft;             /* Bytes of the body not yet taken off the wire */
+  int nTotal;            /* Size of the body after it is uncompressed */
+  int nRead;             /* Bytes returned by http_exchange_read() so far */
+  int isEof;             /* True when the whole body has been returned */
+  int isError;           /* True if the body is truncated or corrupt */
+  void *pInflate;        /* Decompressor state.  Private to http.c */
+};
+#endif
+
+/*
+** Size of the chunks in which a reply body is received
+*/
+#define HTTP_CHUNK  65536
+
+/*
+** Decompressor state for an HttpReply
+*/
+struct HttpInflate {
+  z_stream stream;                 /* The zlib decompressor */
+  int isInit;                      /* True if stream is initialized */
+  unsigned char aIn[HTTP_CHUNK];   /* Compressed content from the wire */
+  unsigned char aOut[HTTP_CHUNK];  /* Uncompressed content */
+};
+
 /*
 ** Sign the content in pSend, compress it, and send it to the server
-** via HTTP or HTTPS.  Get a reply, uncompress the reply, and store the reply
-** in pRecv.  pRecv is assumed to be uninitialized when
-** this routine is called - this routine will initialize it.
+** via HTTP or HTTPS.  Return non-zero if the request cannot be sent.
 **
 ** The server address is contain in the "g" global structure.  The
 ** url_parse() routine should have been called prior to this routine
 ** in order to fill this structure appropriately.
 */
-int http_exchange(Blob *pSend, Blob *pReply, int useLogin, int maxRedirect){
+int http_exchange_send(Blob *pSend, int useLogin){
   Blob login;           /* The login card */
   Blob payload;         /* The complete payload including login card */
   Blob hdr;             /* The HTTP request header */
-  int closeConnection;  /* True to close the connection when done */
-  int iLength;          /* Expected length of the reply payload */
-  int iRecvLen;         /* Received length of the reply payload */
-  int rc = 0;           /* Result code */
-  int iHttpVersion;     /* Which version of HTTP protocol server uses */
-  char *zLine;          /* A single line of the reply header */
-  int i;                /* Loop counter */
-  int isError = 0;      /* True if the reply is an error message */
-  int isCompressed = 1; /* True if the reply is compressed */
 
   if( transport_open(&g.url) ){
     fossil_warning("%s", transport_errmsg(&g.url));
@@ -268,7 +291,33 @@ int http_exchange(Blob *pSend, Blob *pReply, int useLogin, int maxRedirect){
   blob_reset(&hdr);
   blob_reset(&payload);
   transport_flip(&g.url);
+  return 0;
+}
 
+/*
+** Read the header of the server reply to a request sent by
+** http_exchange_send() and prepare pReply for reading the body of
+** the reply using http_exchange_read().  Redirects and requests for
+** HTTP authorization are followed by sending pSend again.  Return
+** non-zero if there is an error, in which case the connection has
+** been closed and pReply need not be passed to http_exchange_end().
+*/
+int http_exchange_begin(
+  Blob *pSend,          /* The request, in case it must be sent again */
+  int useLogin,         /* Include a login card */
+  int maxRedirect,      /* Maximum number of redirects to follow */
+  HttpReply *pReply     /* Write the reply state here */
+){
+  int closeConnection;  /* True to close the connection when done */
+  int iLength;          /* Expected length of the reply payload */
+  int rc = 0;           /* Result code */
+  int iHttpVersion;     /* Which version of HTTP protocol server uses */
+  char *zLine;          /* A single line of the reply header */
+  int i;                /* Loop counter */
+  int isError = 0;      /* True if the reply is an error message */
+  int isCompressed = 1; /* True if the reply is compressed */
+
+  memset(pReply, 0, sizeof(*pReply));
   /*
   ** Read and interpret the server reply
   */
@@ -285,7 +334,8 @@ int http_exchange(Blob *pSend, Blob *pReply, int useLogin, int maxRedirect){
           }
           g.zHttpAuth = prompt_for_httpauth_creds();
           transport_close(&g.url);
-          return http_exchange(pSend, pReply, useLogin, maxRedirect);
+          if( http_exchange_send(pSend, useLogin) ) return 1;
+          return http_exchange_begin(pSend, useLogin, maxRedirect, pReply);
         }
       }
       if( rc!=200 && rc!=301 && rc!=302 ){
@@ -347,7 +397,8 @@ int http_exchange(Blob *pSend, Blob *pReply, int useLogin, int maxRedirect){
       fSeenHttpAuth = 0;
       if( g.zHttpAuth ) free(g.zHttpAuth);
       g.zHttpAuth = get_httpauth();
-      return http_exchange(pSend, pReply, useLogin, maxRedirect);
+      if( http_exchange_send(pSend, useLogin) ) return 1;
+      return http_exchange_begin(pSend, useLogin, maxRedirect, pReply);
     }else if( fossil_strnicmp(zLine, "content-type: ", 14)==0 ){
       if( fossil_strnicmp(&zLine[14], "application/x-fossil-debug", -1)==0 ){
         isCompressed = 0;
@@ -369,20 +420,17 @@ int http_exchange(Blob *pSend, Blob *pReply, int useLogin, int maxRedirect){
   }
 
   /*
-  ** Extract the reply payload that follows the header
+  ** An error reply is read in full and reported.
   */
-  blob_zero(pReply);
-  blob_resize(pReply, iLength);
-  iRecvLen = transport_receive(&g.url, blob_buffer(pReply), iLength);
-  if( iRecvLen != iLength ){
-    fossil_warning("response truncated: got %d bytes of %d", iRecvLen, iLength);
-    goto write_err;
-  }
-  blob_resize(pReply, iLength);
   if( isError ){
+    Blob err;
     char *z;
-    int i, j;
-    z = blob_str(pReply);
+    int iRecvLen, j;
+    blob_zero(&err);
+    blob_resize(&err, iLength);
+    iRecvLen = transport_receive(&g.url, blob_buffer(&err), iLength);
+    blob_resize(&err, iRecvLen);
+    z = blob_str(&err);
     for(i=j=0; z[i]; i++, j++){
       if( z[i]=='<' ){
         while( z[i] && z[i]!='>' ) i++;
@@ -392,9 +440,142 @@ int http_exchange(Blob *pSend, Blob *pReply, int useLogin, int maxRedirect){
     }
     z[j] = 0;
     fossil_warning("server sends error: %s", z);
+    blob_reset(&err);
     goto write_err;
   }
-  if( isCompressed ) blob_uncompress(pReply, pReply);
+
+  /*
+  ** The body of a compressed reply begins with the 4-byte big-endian
+  ** size of the uncompressed body, as written by blob_compress().
+  */
+  pReply->closeConnection = closeConnection;
+  pReply->nBody = iLength;
+  pReply->nLeft = iLength;
+  pReply->nTotal = iLength;
+  pReply->isEof = iLength==0;
+  if( isCompressed && iLength>4 ){
+    struct HttpInflate *p = fossil_malloc( sizeof(*p) );
+    unsigned char a[4];
+    memset(&p->stream, 0, sizeof(p->stream));
+    p->isInit = inflateInit(&p->stream)==Z_OK;
+    pReply->pInflate = p;
+    if( !p->isInit || transport_receive(&g.url, (char*)a, 4)!=4 ){
+      pReply->isError = 1;
+      http_exchange_end(pReply);
+      fossil_warning("response truncated");
+      return 1;
+    }
+    pReply->isCompressed = 1;
+    pReply->nLeft -= 4;
+    pReply->nTotal = (a[0]<<24) + (a[1]<<16) + (a[2]<<8) + a[3];
+  }
+  return 0;
+
+  /*
+  ** Jump to here if an error is seen.
+  */
+write_err:
+  transport_close(&g.url);
+  return 1;
+}
+
+/*
+** Take up to N bytes of raw body content off of the wire.  Return
+** the number of bytes received.
+*/
+static int http_exchange_fetch(HttpReply *pReply, unsigned char *zBuf, int N){
+  int got;
+  if( N>pReply->nLeft ) N = pReply->nLeft;
+  if( N>HTTP_CHUNK ) N = HTTP_CHUNK;
+  if( N<=0 ) return 0;
+  got = transport_receive(&g.url, (char*)zBuf, N);
+  if( got<0 ) got = 0;
+  pReply->nLeft -= got;
+  if( got<N ){
+    fossil_warning("response truncated: got %d bytes of %d",
+                   pReply->nBody - pReply->nLeft, pReply->nBody);
+    pReply->isError = 1;
+    pReply->isEof = 1;
+  }
+  return got;
+}
+
+/*
+** Append up to N more bytes of the (uncompressed) reply body to pOut.
+** Return the number of bytes appended, or 0 at the end of the body.
+*/
+int http_exchange_read(HttpReply *pReply, Blob *pOut, int N){
+  struct HttpInflate *p = (struct HttpInflate*)pReply->pInflate;
+  int nOut = 0;
+  if( N>HTTP_CHUNK ) N = HTTP_CHUNK;
+  if( pReply->isEof || N<=0 ) return 0;
+  if( !pReply->isCompressed ){
+    if( p==0 ){
+      p = fossil_malloc( sizeof(*p) );
+      p->isInit = 0;
+      pReply->pInflate = p;
+    }
+    nOut = http_exchange_fetch(pReply, p->aOut, N);
+    if( pReply->nLeft==0 ) pReply->isEof = 1;
+  }else{
+    while( nOut==0 && !pReply->isEof ){
+      int rc;
+      if( p->stream.avail_in==0 ){
+        p->stream.next_in = p->aIn;
+        p->stream.avail_in = http_exchange_fetch(pReply, p->aIn, HTTP_CHUNK);
+        if( pReply->isError ) break;
+      }
+      p->stream.next_out = p->aOut;
+      p->stream.avail_out = N;
+      rc = inflate(&p->stream, Z_NO_FLUSH);
+      nOut = N - p->stream.avail_out;
+      if( rc==Z_STREAM_END ){
+        pReply->isEof = 1;
+      }else if( (rc!=Z_OK && rc!=Z_BUF_ERROR)
+             || (nOut==0 && p->stream.avail_in==0 && pReply->nLeft==0)
+      ){
+        fossil_warning("cannot uncompress the reply");
+        pReply->isError = 1;
+        pReply->isEof = 1;
+      }
+    }
+  }
+  if( nOut>0 ){
+    blob_append(pOut, (const char*)p->aOut, nOut);
+    pReply->nRead += nOut;
+  }
+  return nOut;
+}
+
+/*
+** Finish reading a reply started by http_exchange_begin().  Any part
+** of the body that has not been read is discarded.  Return non-zero
+** if the reply was truncated or corrupt.
+*/
+int http_exchange_end(HttpReply *pReply){
+  struct HttpInflate *p = (struct HttpInflate*)pReply->pInflate;
+  int closeConnection = pReply->closeConnection;
+  if( p ){
+    if( p->isInit ) inflateEnd(&p->stream);
+    fossil_free(p);
+    pReply->pInflate = 0;
+  }
+  if( pReply->isError ){
+    transport_close(&g.url);
+    return 1;
+  }
+  if( pReply->nLeft>0 && !closeConnection ){
+    char zDiscard[1000];
+    while( pReply->nLeft>0 ){
+      int n = pReply->nLeft<(int)sizeof(zDiscard)
+                ? pReply->nLeft : (int)sizeof(zDiscard);
+      if( transport_receive(&g.url, zDiscard, n)!=n ){
+        closeConnection = 1;
+        break;
+      }
+      pReply->nLeft -= n;
+    }
+  }
 
   /*
   ** Close the connection to the server if appropriate.
@@ -412,11 +593,23 @@ int http_exchange(Blob *pSend, Blob *pReply, int useLogin, int maxRedirect){
     transport_rewind(&g.url);
   }
   return 0;
+}
 
-  /*
-  ** Jump to here if an error is seen.
-  */
-write_err:
-  transport_close(&g.url);
-  return 1;
+/*
+** Sign the content in pSend, compress it, and send it to the server
+** via HTTP or HTTPS.  Get a reply, uncompress the reply, and store the reply
+** in pRecv.  pRecv is assumed to be uninitialized when
+** this routine is called - this routine will initialize it.
+**
+** The server address is contain in the "g" global structure.  The
+** url_parse() routine should have been called prior to this routine
+** in order to fill this structure appropriately.
+*/
+int http_exchange(Blob *pSend, Blob *pReply, int useLogin, int maxRedirect){
+  HttpReply reply;
+  blob_zero(pReply);
+  if( http_exchange_send(pSend, useLogin) ) return 1;
+  if( http_exchange_begin(pSend, useLogin, maxRedirect, &reply) ) return 1;
+  while( http_exchange_read(&reply, pReply, HTTP_CHUNK)>0 ){}
+  return http_exchange_end(&reply);
 }
@@ -61,6 +61,7 @@ void load_control(void){
   @ Load average limit: %f(mxLoad)</p>
   style_footer();
   cgi_set_status(503,"Server Overload");
+  cgi_close_connection();
   cgi_reply();
   exit(0);
 }
@@ -52,18 +52,24 @@
 #include <time.h>
 
 
+/*
+** Settings that are looked up once and then remembered.  login_reset()
+** forgets them.
+*/
+static const char *zLoginGroup = 0;   /* The "login-group-name" setting */
+static int loginGroupOnce = 1;        /* True if zLoginGroup is not known */
+static int ipPrefixTerms = -1;        /* The "ip-prefix-terms" setting */
+
 /*
 ** Return the login-group name.  Or return 0 if this repository is
 ** not a member of a login-group.
 */
 const char *login_group_name(void){
-  static const char *zGroup = 0;
-  static int once = 1;
-  if( once ){
-    zGroup = db_get("login-group-name", 0);
-    once = 0;
+  if( loginGroupOnce ){
+    zLoginGroup = db_get("login-group-name", 0);
+    loginGroupOnce = 0;
   }
-  return zGroup;
+  return zLoginGroup;
 }
 
 /*
@@ -121,15 +127,14 @@ static void redirect_to_g(void){
 */
 static char *ipPrefix(const char *zIP){
   int i, j;
-  static int ip_prefix_terms = -1;
-  if( ip_prefix_terms<0 ){
-    ip_prefix_terms = db_get_int("ip-prefix-terms",2);
+  if( ipPrefixTerms<0 ){
+    ipPrefixTerms = db_get_int("ip-prefix-terms",2);
   }
-  if( ip_prefix_terms==0 ) return mprintf("0");
+  if( ipPrefixTerms==0 ) return mprintf("0");
   for(i=j=0; zIP[i]; i++){
     if( zIP[i]=='.' ){
       j++;
-      if( j==ip_prefix_terms ) break;
+      if( j==ipPrefixTerms ) break;
     }
   }
   return mprintf("%.*s", i, zIP);
@@ -1198,6 +1203,19 @@ void login_set_anon_nobody_capabilities(void){
   }
 }
 
+/*
+** Forget the login state of the current web page, so that the same
+** process can go on to generate another web page for some other user.
+** Settings that were remembered are looked up again.  The login
+** information held in the global "g" structure must be reset separately.
+*/
+void login_reset(void){
+  login_anon_once = 1;
+  zLoginGroup = 0;
+  loginGroupOnce = 1;
+  ipPrefixTerms = -1;
+}
+
 /*
 ** Flags passed into the 2nd argument of login_set/replace_capabilities().
 */
@@ -220,7 +220,7 @@ int invalid_utf8(
 /*
 ** Maximum length of a line in a text file, in UTF-16 characters.  (4096)
 ** The number of bytes represented by this value cannot exceed LENGTH_MASK
-** bytes, because that is the line buffer size used by the diff engine.
+** bytes, so that UTF-8 and UTF-16 text report LOOK_LONG consistently.
 */
 #define UTF16_LENGTH_MASK_SZ   (LENGTH_MASK_SZ-(sizeof(WCHAR_T)-sizeof(char)))
 #define UTF16_LENGTH_MASK      ((1<<UTF16_LENGTH_MASK_SZ)-1)
@@ -29,6 +29,7 @@
 #include "main.h"
 #include <string.h>
 #include <time.h>
+#include <setjmp.h>
 #include <fcntl.h>
 #include <sys/types.h>
 #include <sys/stat.h>
@@ -2423,6 +2424,191 @@ void sigalrm_handler(int x){
   fossil_panic("TIMEOUT");
 }
 
+/*
+** State used by a process that generates many web pages, one after
+** another.  See http_request_loop().
+*/
+static Global gServer;        /* Copy of g from before the first web page */
+static int gServerSaved = 0;  /* True after gServer has been filled in */
+static int gServerHttps = 0;  /* True for the --https option */
+static jmp_buf webPageJmp;    /* Where fossil_exit() goes after a web page */
+static int bWebPageJmp = 0;   /* True while webPageJmp may be used */
+
+/*
+** This routine is called by fossil_exit().  Many web pages end with a
+** call to fossil_exit(0), after a redirect for example.  If the web page
+** has been sent in full, and the process can go on to generate more web
+** pages, return to http_request_loop() instead of exiting.
+*/
+void web_page_exit(int rc){
+  if( bWebPageJmp && rc==0 && g.cgiOutput==2
+   && db_transaction_nesting_depth()==0
+  ){
+    bWebPageJmp = 0;
+    db_finalize_transient();
+    longjmp(webPageJmp, 1);
+  }
+}
+
+/*
+** Return true if the state left behind by the current web page, as far
+** as it can be known at this point, still allows this process to go on
+** to generate another web page.
+*/
+static int web_page_reusable(void){
+  if( !gServerSaved || !gServer.repositoryOpen || g.db!=gServer.db ){
+    return 0;
+  }
+#ifdef FOSSIL_ENABLE_JSON
+  if( g.json.isJsonMode ) return 0;
+#endif
+#ifdef FOSSIL_ENABLE_TCL
+  if( g.tcl.interp!=gServer.tcl.interp ) return 0;
+#endif
+  if( skin_draft_in_use() ) return 0;
+  return 1;
+}
+
+/*
+** Return true if another web page can follow the one that is being
+** generated on the same connection.  This is called before the header
+** of the reply is sent, so that the client can be told if the connection
+** is going to be closed.  web_page_reset() can still fail afterwards in
+** rare cases, such as when the repository is changed by a web page that
+** streams its reply.
+*/
+int web_page_can_continue(void){
+  return bWebPageJmp && web_page_reusable() && db_request_can_continue();
+}
+
+#if !defined(_WIN32)
+/*
+** Read one HTTP request and generate the web page that answers it.
+*/
+static void web_page_run(
+  const char *zNotFound,    /* The --notfound option, or NULL */
+  Glob *pFileGlob,          /* Static content must match this */
+  int allowRepoList,        /* List repositories on URL "/" */
+  int useSCGI               /* Requests use SCGI rather than HTTP */
+){
+  if( setjmp(webPageJmp)==0 ){
+    bWebPageJmp = 1;
+    if( useSCGI ){
+      cgi_handle_scgi_request();
+    }else{
+      cgi_handle_http_request(0);
+    }
+    process_one_web_page(zNotFound, pFileGlob, allowRepoList);
+  }
+  bWebPageJmp = 0;
+}
+
+/*
+** Forget the web page that was just generated, so that this process can
+** go on to generate another.  Return false if that is not possible and
+** the process must exit instead.
+**
+** The per-request state in the global "g" structure is undone by
+** restoring the copy in gServer.  Other modules reset their own state,
+** including values that they cache in static variables.  The open
+** repository is reused only if it did not change while the web page was
+** generated, since state held in memory might depend on it.  Caches that
+** only a change to the repository makes stale are therefore not reset.
+**
+** Backoffice work found by the web page is started by closing the
+** repository, as it would be when the process exits.  The repository
+** is then opened again for the next web page.
+*/
+static int web_page_reset(void){
+  int nRequest;
+  if( !web_page_reusable() ) return 0;
+  if( !db_request_done() ) return 0;
+  if( g.zConfigDbName!=0 && gServer.zConfigDbName==0 ){
+    db_close_config();
+  }
+  if( g.dbConfig!=gServer.dbConfig
+   || g.zConfigDbName!=gServer.zConfigDbName
+  ){
+    return 0;
+  }
+  content_clear_cache();
+  manifest_cache_clear();
+  capabilities_reset();
+  Th_FossilReset();
+  blob_reset(&g.cgiIn);
+  blob_reset(&g.httpHeader);
+  blob_reset(&g.thLog);
+  cgi_reset_request();
+  login_reset();
+  style_reset();
+  skin_reset();
+  etag_reset();
+  cookie_reset();
+  ticket_reset();
+  stats_report_reset();
+  timeline_reset();
+  graph_reset();
+  diff_reset();
+  search_reset();
+  printf_reset();
+  descendants_reset();
+  nRequest = g.nRequest;
+  memcpy(&g, &gServer, sizeof(g));
+  g.nRequest = nRequest;
+  if( backoffice_pending() ){
+    db_close(1);
+    db_open_repository(g.zRepositoryName);
+    memcpy(&gServer, &g, sizeof(g));
+  }
+  backoffice_reset();
+  return 1;
+}
+
+/*
+** Answer each request on the connection on standard input and output,
+** one after another, in this process.  Keep going until there are no
+** more requests, as determined by cgi_http_next_request(), or until the
+** state left behind by a request cannot be reset.
+**
+** nLatency is the maximum run time of each request in seconds, or 0 for
+** no limit.
+*/
+static int http_request_loop(
+  const char *zNotFound,    /* The --notfound option, or NULL */
+  Glob *pFileGlob,          /* Static content must match this */
+  int allowRepoList,        /* List repositories on URL "/" */
+  int useSCGI,              /* Requests use SCGI rather than HTTP */
+  int nLatency              /* Maximum run time of each request */
+){
+  if( !gServerSaved ){
+    Th_FossilReset();
+    blob_zero(&g.cgiIn);
+    blob_zero(&g.httpHeader);
+    blob_zero(&g.thLog);
+    gServerHttps = P("HTTPS")!=0;
+    memcpy(&gServer, &g, sizeof(g));
+    gServerSaved = 1;
+  }
+  while( cgi_http_next_request() ){
+    g.now = time(0);
+    if( gServerHttps ) cgi_replace_parameter("HTTPS","on");
+    db_repository_mark_unchanged();
+    if( nLatency ) alarm(nLatency);
+    web_page_run(zNotFound, pFileGlob, allowRepoList, useSCGI);
+    if( nLatency ) alarm(0);
+    if( g.fAnyTrace ){
+      fprintf(stderr, "/***** Webpage finished in subprocess %d *****/\n",
+              getpid());
+    }
+    if( !web_page_reset() ){
+      cgi_http_close();
+      return 0;
+    }
+  }
+  return 1;
+}
+#endif /* !_WIN32 */
+
 /*
 ** COMMAND: server*
 ** COMMAND: ui
@@ -2467,6 +2653,8 @@ void sigalrm_handler(int x){
 ** by default.
 **
 ** Options:
+**   --backlog N         Allow up to N connections to wait to be accepted.
+**                       The default is 10.  Unix only.
 **   --baseurl URL       Use URL as the base (useful for reverse proxies)
 **   --create            Create a new REPOSITORY if it does not already exist
 **   --page PAGE         Start "ui" on PAGE.  ex: --page "timeline?y=ci"
@@ -2474,8 +2662,15 @@ void sigalrm_handler(int x){
 **   --localauth         enable automatic login for requests from localhost
 **   --localhost         listen on 127.0.0.1 only (always true for "ui")
 **   --https             signal a request coming in via https
+**   --idle-timeout N    Close a persistent connection after N seconds with
+**                       no new request.  Default 5.  With --workers, also
+**                       close it once it has been idle for N seconds in
+**                       total.  Unix only.
 **   --max-latency N     Do not let any single HTTP request run for more than N
 **                       seconds (only works on unix)
+**   --max-requests N    Handle up to N requests on each connection, using
+**                       HTTP keep-alive.  Default 1.  Ignored if REPOSITORY
+**                       is a directory.  Unix only.
 **   --nocompress        Do not compress HTTP replies
 **   --nojail            Drop root privileges but do not enter the chroot jail
 **   --nossl             signal that no SSL connections are available (Always
@@ -2488,6 +2683,10 @@ void sigalrm_handler(int x){
 **   --skin LABEL        Use override skin LABEL
 **   --usepidkey         Use saved encryption key from parent process.  This is
 **                       only necessary when using SEE on Windows.
+**   --workers N         Start N worker processes up front that each keep the
+**                       repository open and handle one connection after
+**                       another, instead of starting a new process for each
+**                       connection.  Unix only.
 **
 ** See also: cgi, http, winsrv
 */
@@ -2502,6 +2701,11 @@ void cmd_webserver(void){
 #if !defined(_WIN32)
   int noJail;               /* Do not enter the chroot jail */
   const char *zMaxLatency;   /* Maximum runtime of any single HTTP request */
+  const char *zWorkers;      /* Number of pre-forked workers.  --workers */
+  const char *zBacklog;      /* Length of the listen queue.  --backlog */
+  const char *zMaxRequest;   /* Requests per connection.  --max-requests */
+  const char *zIdle;         /* Keep-alive timeout.  --idle-timeout */
+  Glob *pFileGlob;           /* Static content must match zFileGlob */
 #endif
   int allowRepoList;         /* List repositories on URL "/" */
   const char *zAltBase;      /* Argument to the --baseurl option */
@@ -2533,6 +2737,10 @@ void cmd_webserver(void){
 #if !defined(_WIN32)
   noJail = find_option("nojail",0,0)!=0;
   zMaxLatency = find_option("max-latency",0,1);
+  zWorkers = find_option("workers",0,1);
+  zBacklog = find_option("backlog",0,1);
+  zMaxRequest = find_option("max-requests",0,1);
+  zIdle = find_option("idle-timeout",0,1);
 #endif
   g.useLocalauth = find_option("localauth", 0, 0)!=0;
   Th_InitTraceLog();
@@ -2638,12 +2846,20 @@ void cmd_webserver(void){
   if( g.repositoryOpen ) flags |= HTTP_SERVER_HAD_REPOSITORY;
   if( g.localOpen ) flags |= HTTP_SERVER_HAD_CHECKOUT;
   db_close(1);
+  /* A process can only go on to the next request on a connection if it
+  ** keeps the repository open, so there are no persistent connections
+  ** when serving a directory of repositories */
+  cgi_http_server_config(zWorkers ? atoi(zWorkers) : 0,
+                         zBacklog ? atoi(zBacklog) : 0,
+                         zMaxRequest && (flags & HTTP_SERVER_HAD_REPOSITORY)
+                             && (flags & HTTP_SERVER_SCGI)==0
+                             ? atoi(zMaxRequest) : 0,
+                         zIdle ? atoi(zIdle) : 0);
   if( cgi_http_server(iPort, mxPort, zBrowserCmd, zIpAddr, flags) ){
     fossil_fatal("unable to listen on TCP socket %d", iPort);
   }
   if( zMaxLatency ){
     signal(SIGALRM, sigalrm_handler);
-    alarm(atoi(zMaxLatency));
   }
   g.httpIn = stdin;
   g.httpOut = stdout;
@@ -2663,15 +2879,20 @@ void cmd_webserver(void){
   }else{
     g.zRepositoryName = enter_chroot_jail(g.zRepositoryName, noJail);
   }
-  if( flags & HTTP_SERVER_SCGI ){
-    cgi_handle_scgi_request();
+  pFileGlob = glob_create(zFileGlob);
+  if( cgi_http_is_worker() ){
+    /* A pre-forked worker handles one connection after another, keeping
+    ** the repository open in between.  It exits, to be replaced by a new
+    ** worker, once it cannot reset itself for another connection. */
+    do{
+      cgi_http_worker_accept();
+    }while( http_request_loop(zNotFound, pFileGlob, allowRepoList,
+                              (flags & HTTP_SERVER_SCGI)!=0,
+                              zMaxLatency ? atoi(zMaxLatency) : 0) );
   }else{
-    cgi_handle_http_request(0);
-  }
-  process_one_web_page(zNotFound, glob_create(zFileGlob), allowRepoList);
-  if( g.fAnyTrace ){
-    fprintf(stderr, "/***** Webpage finished in subprocess %d *****/\n",
-            getpid());
+    http_request_loop(zNotFound, pFileGlob, allowRepoList,
+                      (flags & HTTP_SERVER_SCGI)!=0,
+                      zMaxLatency ? atoi(zMaxLatency) : 0);
   }
 #else
   /* Win32 implementation */
@@ -58,6 +58,7 @@ SRC = \
   $(SRCDIR)/foci.c \
   $(SRCDIR)/forum.c \
   $(SRCDIR)/fshell.c \
+  $(SRCDIR)/fsmonitor.c \
   $(SRCDIR)/fusefs.c \
   $(SRCDIR)/glob.c \
   $(SRCDIR)/graph.c \
@@ -134,6 +135,7 @@ SRC = \
   $(SRCDIR)/timeline.c \
   $(SRCDIR)/tkt.c \
   $(SRCDIR)/tktsetup.c \
+  $(SRCDIR)/trigram.c \
   $(SRCDIR)/undo.c \
   $(SRCDIR)/unicode.c \
   $(SRCDIR)/unversioned.c \
@@ -149,6 +151,7 @@ SRC = \
   $(SRCDIR)/wikiformat.c \
   $(SRCDIR)/winfile.c \
   $(SRCDIR)/winhttp.c \
+  $(SRCDIR)/workqueue.c \
   $(SRCDIR)/wysiwyg.c \
   $(SRCDIR)/xfer.c \
   $(SRCDIR)/xfersetup.c \
@@ -270,6 +273,7 @@ TRANS_SRC = \
   $(OBJDIR)/foci_.c \
   $(OBJDIR)/forum_.c \
   $(OBJDIR)/fshell_.c \
+  $(OBJDIR)/fsmonitor_.c \
   $(OBJDIR)/fusefs_.c \
   $(OBJDIR)/glob_.c \
   $(OBJDIR)/graph_.c \
@@ -346,6 +350,7 @@ TRANS_SRC = \
   $(OBJDIR)/timeline_.c \
   $(OBJDIR)/tkt_.c \
   $(OBJDIR)/tktsetup_.c \
+  $(OBJDIR)/trigram_.c \
   $(OBJDIR)/undo_.c \
   $(OBJDIR)/unicode_.c \
   $(OBJDIR)/unversioned_.c \
@@ -361,6 +366,7 @@ TRANS_SRC = \
   $(OBJDIR)/wikiformat_.c \
   $(OBJDIR)/winfile_.c \
   $(OBJDIR)/winhttp_.c \
+  $(OBJDIR)/workqueue_.c \
   $(OBJDIR)/wysiwyg_.c \
   $(OBJDIR)/xfer_.c \
   $(OBJDIR)/xfersetup_.c \
@@ -409,6 +415,7 @@ OBJ = \
  $(OBJDIR)/foci.o \
  $(OBJDIR)/forum.o \
  $(OBJDIR)/fshell.o \
+ $(OBJDIR)/fsmonitor.o \
  $(OBJDIR)/fusefs.o \
  $(OBJDIR)/glob.o \
  $(OBJDIR)/graph.o \
@@ -485,6 +492,7 @@ OBJ = \
  $(OBJDIR)/timeline.o \
  $(OBJDIR)/tkt.o \
  $(OBJDIR)/tktsetup.o \
+ $(OBJDIR)/trigram.o \
  $(OBJDIR)/undo.o \
  $(OBJDIR)/unicode.o \
  $(OBJDIR)/unversioned.o \
@@ -500,6 +508,7 @@ OBJ = \
  $(OBJDIR)/wikiformat.o \
  $(OBJDIR)/winfile.o \
  $(OBJDIR)/winhttp.o \
+ $(OBJDIR)/workqueue.o \
  $(OBJDIR)/wysiwyg.o \
  $(OBJDIR)/xfer.o \
  $(OBJDIR)/xfersetup.o \
@@ -744,6 +753,7 @@ $(OBJDIR)/headers:	$(OBJDIR)/page_index.h $(OBJDIR)/builtin_data.h $(OBJDIR)/def
 	$(OBJDIR)/foci_.c:$(OBJDIR)/foci.h \
 	$(OBJDIR)/forum_.c:$(OBJDIR)/forum.h \
 	$(OBJDIR)/fshell_.c:$(OBJDIR)/fshell.h \
+	$(OBJDIR)/fsmonitor_.c:$(OBJDIR)/fsmonitor.h \
 	$(OBJDIR)/fusefs_.c:$(OBJDIR)/fusefs.h \
 	$(OBJDIR)/glob_.c:$(OBJDIR)/glob.h \
 	$(OBJDIR)/graph_.c:$(OBJDIR)/graph.h \
@@ -820,6 +830,7 @@ $(OBJDIR)/headers:	$(OBJDIR)/page_index.h $(OBJDIR)/builtin_data.h $(OBJDIR)/def
 	$(OBJDIR)/timeline_.c:$(OBJDIR)/timeline.h \
 	$(OBJDIR)/tkt_.c:$(OBJDIR)/tkt.h \
 	$(OBJDIR)/tktsetup_.c:$(OBJDIR)/tktsetup.h \
+	$(OBJDIR)/trigram_.c:$(OBJDIR)/trigram.h \
 	$(OBJDIR)/undo_.c:$(OBJDIR)/undo.h \
 	$(OBJDIR)/unicode_.c:$(OBJDIR)/unicode.h \
 	$(OBJDIR)/unversioned_.c:$(OBJDIR)/unversioned.h \
@@ -835,6 +846,7 @@ $(OBJDIR)/headers:	$(OBJDIR)/page_index.h $(OBJDIR)/builtin_data.h $(OBJDIR)/def
 	$(OBJDIR)/wikiformat_.c:$(OBJDIR)/wikiformat.h \
 	$(OBJDIR)/winfile_.c:$(OBJDIR)/winfile.h \
 	$(OBJDIR)/winhttp_.c:$(OBJDIR)/winhttp.h \
+	$(OBJDIR)/workqueue_.c:$(OBJDIR)/workqueue.h \
 	$(OBJDIR)/wysiwyg_.c:$(OBJDIR)/wysiwyg.h \
 	$(OBJDIR)/xfer_.c:$(OBJDIR)/xfer.h \
 	$(OBJDIR)/xfersetup_.c:$(OBJDIR)/xfersetup.h \
@@ -1182,6 +1194,14 @@ $(OBJDIR)/fshell.o:	$(OBJDIR)/fshell_.c $(OBJDIR)/fshell.h $(SRCDIR)/config.h
 
 $(OBJDIR)/fshell.h:	$(OBJDIR)/headers
 
+$(OBJDIR)/fsmonitor_.c:	$(SRCDIR)/fsmonitor.c $(OBJDIR)/translate
+	$(OBJDIR)/translate $(SRCDIR)/fsmonitor.c >$@
+
+$(OBJDIR)/fsmonitor.o:	$(OBJDIR)/fsmonitor_.c $(OBJDIR)/fsmonitor.h $(SRCDIR)/config.h
+	$(XTCC) -o $(OBJDIR)/fsmonitor.o -c $(OBJDIR)/fsmonitor_.c
+
+$(OBJDIR)/fsmonitor.h:	$(OBJDIR)/headers
+
 $(OBJDIR)/fusefs_.c:	$(SRCDIR)/fusefs.c $(OBJDIR)/translate
 	$(OBJDIR)/translate $(SRCDIR)/fusefs.c >$@
 
@@ -1790,6 +1810,14 @@ $(OBJDIR)/tktsetup.o:	$(OBJDIR)/tktsetup_.c $(OBJDIR)/tktsetup.h $(SRCDIR)/confi
 
 $(OBJDIR)/tktsetup.h:	$(OBJDIR)/headers
 
+$(OBJDIR)/trigram_.c:	$(SRCDIR)/trigram.c $(OBJDIR)/translate
+	$(OBJDIR)/translate $(SRCDIR)/trigram.c >$@
+
+$(OBJDIR)/trigram.o:	$(OBJDIR)/trigram_.c $(OBJDIR)/trigram.h $(SRCDIR)/config.h
+	$(XTCC) -o $(OBJDIR)/trigram.o -c $(OBJDIR)/trigram_.c
+
+$(OBJDIR)/trigram.h:	$(OBJDIR)/headers
+
 $(OBJDIR)/undo_.c:	$(SRCDIR)/undo.c $(OBJDIR)/translate
 	$(OBJDIR)/translate $(SRCDIR)/undo.c >$@
 
@@ -1910,6 +1938,14 @@ $(OBJDIR)/winhttp.o:	$(OBJDIR)/winhttp_.c $(OBJDIR)/winhttp.h $(SRCDIR)/config.h
 
 $(OBJDIR)/winhttp.h:	$(OBJDIR)/headers
 
+$(OBJDIR)/workqueue_.c:	$(SRCDIR)/workqueue.c $(OBJDIR)/translate
+	$(OBJDIR)/translate $(SRCDIR)/workqueue.c >$@
+
+$(OBJDIR)/workqueue.o:	$(OBJDIR)/workqueue_.c $(OBJDIR)/workqueue.h $(SRCDIR)/config.h
+	$(XTCC) -o $(OBJDIR)/workqueue.o -c $(OBJDIR)/workqueue_.c
+
+$(OBJDIR)/workqueue.h:	$(OBJDIR)/headers
+
 $(OBJDIR)/wysiwyg_.c:	$(SRCDIR)/wysiwyg.c $(OBJDIR)/translate
 	$(OBJDIR)/translate $(SRCDIR)/wysiwyg.c >$@
 
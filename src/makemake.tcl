@@ -69,6 +69,7 @@ set src {
   foci
   forum
   fshell
+  fsmonitor
   fusefs
   glob
   graph
@@ -144,6 +145,7 @@ set src {
   timeline
   tkt
   tktsetup
+  trigram
   undo
   unicode
   unversioned
@@ -159,6 +161,7 @@ set src {
   wikiformat
   winfile
   winhttp
+  workqueue
   wysiwyg
   xfer
   xfersetup
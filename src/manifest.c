@@ -116,6 +116,15 @@ struct Manifest {
     char *zName;           /* Key or field name */
     char *zValue;          /* Value of the field */
   } *aField;            /* One for each J card */
+  int nArena;           /* Bytes in the allocation holding *p and aFile[] etc */
+  int iBase;            /* Index of current baseline file in iterator */
+  int nRef;             /* Number of references to this object */
+  u8 isBusy;            /* True while handed out by manifest_get() */
+  u8 inCache;           /* True while held by the manifest cache */
+  int szCache;          /* Bytes charged against the manifest cache */
+  Manifest *pHashNext;  /* Next entry on the same manifest cache hash chain */
+  Manifest *pLruPrev;   /* Next more recently used manifest cache entry */
+  Manifest *pLruNext;   /* Next less recently used manifest cache entry */
 };
 #endif
 
@@ -154,16 +163,52 @@ static const char *azNameOfMType[] = {
 };
 
 /*
-** A cache of parsed manifests.  This reduces the number of
-** calls to manifest_parse() when doing a rebuild.
+** A cache of parsed manifests.  This reduces the number of calls to
+** manifest_parse() when doing a rebuild, and when pages such as the
+** timeline, /dir and /tree or commands such as annotate look at the same
+** check-ins over and over again.
+**
+** Entries are located by rid using a hash table and are kept on a
+** doubly-linked LRU list, so that both lookup and eviction are O(1).
+** The total size of all cached manifests is kept below szLimit bytes,
+** which is taken from the "manifest-cache-size" setting.
+**
+** Manifest objects are reference counted.  The cache holds one
+** reference to each entry, each delta-manifest holds a reference to its
+** baseline, and manifest_get() hands out a reference that is given
+** back by manifest_destroy().  So a baseline that is shared by many
+** delta-manifests is only parsed once.  An entry that has been handed
+** out by manifest_get() is marked busy and is not handed out again
+** until it is given back, because callers are free to use the file
+** iterator of the manifests they get.
 */
-#define MX_MANIFEST_CACHE 6
 static struct {
-  int nxAge;
-  int aAge[MX_MANIFEST_CACHE];
-  Manifest *apManifest[MX_MANIFEST_CACHE];
+  i64 szTotal;            /* Total size of all entries in the cache */
+  i64 szLimit;            /* Maximum value for szTotal.  0 if not yet known */
+  int n;                  /* Current number of cache entries */
+  int nHash;              /* Number of buckets in apHash[] */
+  Manifest **apHash;      /* Hash table of cache entries */
+  Manifest *pHead;        /* Most recently used entry */
+  Manifest *pTail;        /* Least recently used entry */
+  i64 nHit;               /* Number of cache hits */
+  i64 nMiss;              /* Number of cache misses */
+  i64 nShared;            /* Number of times a baseline was shared */
+  i64 nEvict;             /* Number of entries evicted to stay under szLimit */
 } manifestCache;
 
+/*
+** SETTING: manifest-cache-size width=25 default=50000000
+** The maximum number of bytes of parsed check-in manifests and other
+** control artifacts that are held in memory so that they do not need
+** to be parsed again.  A value of zero disables the cache.
+*/
+
+/*
+** Return the hash bucket for artifact rid.
+*/
+#define MANIFEST_CACHE_HASH(rid) (((unsigned)(rid)*2654435761u) \
+                                     % manifestCache.nHash)
+
 /*
 ** True if manifest_crosslink_begin() has been called but
 ** manifest_crosslink_end() is still pending.
@@ -171,20 +216,29 @@ static struct {
 static int manifest_crosslink_busy = 0;
 
 /*
-** Clear the memory allocated in a manifest object
+** Drop one reference to a manifest object.  Free the object when
+** the last reference goes away.
+*/
+static void manifest_release(Manifest *p){
+  if( p==0 ) return;
+  assert( p->nRef>0 );
+  if( --p->nRef>0 ) return;
+  assert( !p->inCache );
+  blob_reset(&p->content);
+  manifest_release(p->pBaseline);
+  memset(p, 0, sizeof(*p));
+  fossil_free(p);
+}
+
+/*
+** Give back a manifest object obtained from manifest_get() or
+** manifest_parse().  The object is freed unless the manifest cache or
+** some delta-manifest still holds a reference to it.
 */
 void manifest_destroy(Manifest *p){
   if( p ){
-    blob_reset(&p->content);
-    fossil_free(p->aFile);
-    fossil_free(p->azParent);
-    fossil_free(p->azCChild);
-    fossil_free(p->aTag);
-    fossil_free(p->aField);
-    fossil_free(p->aCherrypick);
-    if( p->pBaseline ) manifest_destroy(p->pBaseline);
-    memset(p, 0, sizeof(*p));
-    fossil_free(p);
+    p->isBusy = 0;
+    manifest_release(p);
   }
 }
 
@@ -214,62 +268,191 @@ static char maskToType(unsigned int x){
 }
 
 /*
-** Add an element to the manifest cache using LRU replacement.
+** Return the maximum number of bytes of parsed manifests to hold in
+** the cache, or -1 if the cache is disabled.
 */
-void manifest_cache_insert(Manifest *p){
-  while( p ){
-    int i;
-    Manifest *pBaseline = p->pBaseline;
-    p->pBaseline = 0;
-    for(i=0; i<MX_MANIFEST_CACHE; i++){
-      if( manifestCache.apManifest[i]==0 ) break;
-    }
-    if( i>=MX_MANIFEST_CACHE ){
-      int oldest = 0;
-      int oldestAge = manifestCache.aAge[0];
-      for(i=1; i<MX_MANIFEST_CACHE; i++){
-        if( manifestCache.aAge[i]<oldestAge ){
-          oldest = i;
-          oldestAge = manifestCache.aAge[i];
-        }
-      }
-      manifest_destroy(manifestCache.apManifest[oldest]);
-      i = oldest;
-    }
-    manifestCache.aAge[i] = ++manifestCache.nxAge;
-    manifestCache.apManifest[i] = p;
-    p = pBaseline;
+static i64 manifest_cache_limit(void){
+  if( manifestCache.szLimit==0 ){
+    manifestCache.szLimit = db_get_int("manifest-cache-size", 50000000);
+    if( manifestCache.szLimit<=0 ) manifestCache.szLimit = -1;
   }
+  return manifestCache.szLimit;
 }
 
 /*
-** Try to extract a line from the manifest cache. Return 1 if found.
-** Return 0 if not found.
+** Return the approximate number of bytes of memory used by manifest p,
+** not counting its baseline.
 */
-static Manifest *manifest_cache_find(int rid){
-  int i;
+static int manifest_memory_size(Manifest *p){
+  i64 n = p->nArena + (i64)p->content.nAlloc;
+  return n>0x7fffffff ? 0x7fffffff : (int)n;
+}
+
+/*
+** Unlink entry p from the LRU list.
+*/
+static void manifest_cache_unlink(Manifest *p){
+  if( p->pLruPrev ){
+    p->pLruPrev->pLruNext = p->pLruNext;
+  }else{
+    manifestCache.pHead = p->pLruNext;
+  }
+  if( p->pLruNext ){
+    p->pLruNext->pLruPrev = p->pLruPrev;
+  }else{
+    manifestCache.pTail = p->pLruPrev;
+  }
+  p->pLruPrev = p->pLruNext = 0;
+}
+
+/*
+** Make entry p the most recently used entry of the LRU list.  Entry p
+** must not currently be on the list.
+*/
+static void manifest_cache_link_head(Manifest *p){
+  p->pLruPrev = 0;
+  p->pLruNext = manifestCache.pHead;
+  if( manifestCache.pHead ){
+    manifestCache.pHead->pLruPrev = p;
+  }else{
+    manifestCache.pTail = p;
+  }
+  manifestCache.pHead = p;
+}
+
+/*
+** Resize the hash table of the manifest cache to nNew buckets.
+*/
+static void manifest_cache_rehash(int nNew){
   Manifest *p;
-  for(i=0; i<MX_MANIFEST_CACHE; i++){
-    if( manifestCache.apManifest[i] && manifestCache.apManifest[i]->rid==rid ){
-      p = manifestCache.apManifest[i];
-      manifestCache.apManifest[i] = 0;
-      return p;
-    }
+  fossil_free(manifestCache.apHash);
+  manifestCache.nHash = nNew;
+  manifestCache.apHash = fossil_malloc( nNew*sizeof(Manifest*) );
+  memset(manifestCache.apHash, 0, nNew*sizeof(Manifest*));
+  for(p=manifestCache.pHead; p; p=p->pLruNext){
+    int h = MANIFEST_CACHE_HASH(p->rid);
+    p->pHashNext = manifestCache.apHash[h];
+    manifestCache.apHash[h] = p;
   }
-  return 0;
 }
 
 /*
-** Clear the manifest cache.
+** Return the cache entry for artifact rid, or NULL if rid is not in
+** the cache.  A successful lookup makes the entry the most recently
+** used one.
 */
-void manifest_cache_clear(void){
-  int i;
-  for(i=0; i<MX_MANIFEST_CACHE; i++){
-    if( manifestCache.apManifest[i] ){
-      manifest_destroy(manifestCache.apManifest[i]);
-    }
+static Manifest *manifest_cache_lookup(int rid){
+  Manifest *p;
+  if( manifestCache.n==0 ) return 0;
+  p = manifestCache.apHash[MANIFEST_CACHE_HASH(rid)];
+  while( p && p->rid!=rid ) p = p->pHashNext;
+  if( p && p!=manifestCache.pHead ){
+    manifest_cache_unlink(p);
+    manifest_cache_link_head(p);
   }
-  memset(&manifestCache, 0, sizeof(manifestCache));
+  return p;
+}
+
+/*
+** Remove entry p from the cache and drop the reference that the cache
+** holds to it.
+*/
+static void manifest_cache_remove(Manifest *p){
+  Manifest **pp = &manifestCache.apHash[MANIFEST_CACHE_HASH(p->rid)];
+  while( *pp!=p ) pp = &(*pp)->pHashNext;
+  *pp = p->pHashNext;
+  p->pHashNext = 0;
+  manifest_cache_unlink(p);
+  manifestCache.szTotal -= p->szCache;
+  manifestCache.n--;
+  p->inCache = 0;
+  manifest_release(p);
+}
+
+/*
+** Add manifest p to the cache, evicting the least recently used entries
+** as needed to stay within the memory budget.  The cache takes its own
+** reference to p.  Return true if p was added.
+*/
+static int manifest_cache_add(Manifest *p){
+  int h;
+  if( p->inCache ) return 1;
+  if( p->rid<=0 ) return 0;
+  p->szCache = manifest_memory_size(p);
+  if( p->szCache>manifest_cache_limit() ) return 0;
+  if( manifest_cache_lookup(p->rid)!=0 ) return 0;
+  while( manifestCache.szTotal+p->szCache>manifestCache.szLimit ){
+    manifest_cache_remove(manifestCache.pTail);
+    manifestCache.nEvict++;
+  }
+  if( manifestCache.n>=manifestCache.nHash ){
+    manifest_cache_rehash(manifestCache.nHash*2 + 64);
+  }
+  h = MANIFEST_CACHE_HASH(p->rid);
+  p->pHashNext = manifestCache.apHash[h];
+  manifestCache.apHash[h] = p;
+  manifest_cache_link_head(p);
+  manifestCache.szTotal += p->szCache;
+  manifestCache.n++;
+  p->inCache = 1;
+  p->nRef++;
+  return 1;
+}
+
+/*
+** Give manifest p back to the cache.  This is the same as
+** manifest_destroy() except that p is added to the cache if it is not
+** there already.
+*/
+void manifest_cache_insert(Manifest *p){
+  if( p==0 ) return;
+  manifest_cache_add(p);
+  manifest_destroy(p);
+}
+
+/*
+** Try to get manifest rid from the cache.  Return NULL if it is not
+** in the cache or if it is already handed out.  Otherwise mark it as
+** handed out and return it.  Give it back using manifest_destroy().
+*/
+static Manifest *manifest_cache_find(int rid){
+  Manifest *p = manifest_cache_lookup(rid);
+  if( p==0 || p->isBusy ){
+    manifestCache.nMiss++;
+    return 0;
+  }
+  manifestCache.nHit++;
+  p->isBusy = 1;
+  p->nRef++;
+  return p;
+}
+
+/*
+** Clear the manifest cache.  Manifests that are handed out remain
+** valid until they are given back.
+*/
+void manifest_cache_clear(void){
+  while( manifestCache.pTail ){
+    manifest_cache_remove(manifestCache.pTail);
+  }
+  fossil_free(manifestCache.apHash);
+  manifestCache.apHash = 0;
+  manifestCache.nHash = 0;
+  manifestCache.szTotal = 0;
+  manifestCache.szLimit = 0;
+}
+
+/*
+** Return a one-line human-readable summary of the manifest cache
+** statistics.  The string is obtained from fossil_malloc().
+*/
+char *manifest_cache_summary(void){
+  return mprintf("%,d entries, %,lld of %,lld bytes, %,lld hits, "
+                 "%,lld misses, %,lld shared baselines, %,lld evictions",
+                 manifestCache.n, manifestCache.szTotal,
+                 manifest_cache_limit(), manifestCache.nHit,
+                 manifestCache.nMiss, manifestCache.nShared,
+                 manifestCache.nEvict);
 }
 
 #ifdef FOSSIL_DONT_VERIFY_MANIFEST_MD5SUM
@@ -380,6 +563,61 @@ static char next_card(ManifestText *p){
   return c;
 }
 
+/*
+** Arrays used by manifest_parse() while it collects the F, J, M, P, Q
+** and T cards of an artifact.  They are kept from one call to the next,
+** so that in the steady state parsing allocates no memory for them at
+** all.  Once an artifact has been parsed, its arrays are copied into the
+** same allocation as the Manifest object itself, at their exact size.
+*/
+static struct {
+  ManifestFile *aFile;      /* F cards */
+  int nFileAlloc;           /* Slots allocated in aFile[] */
+  void *aField;             /* J cards */
+  int nFieldAlloc;          /* Slots allocated in aField[] */
+  char **azCChild;          /* M cards */
+  int nCChildAlloc;         /* Slots allocated in azCChild[] */
+  char **azParent;          /* Arguments to P cards */
+  int nParentAlloc;         /* Slots allocated in azParent[] */
+  void *aCherrypick;        /* Q cards */
+  int nCherrypickAlloc;     /* Slots allocated in aCherrypick[] */
+  struct TagType *aTag;     /* T cards */
+  int nTagAlloc;            /* Slots allocated in aTag[] */
+} manifestScratch;
+
+/*
+** Hand the arrays that manifest_parse() used for Manifest p back to
+** manifestScratch, for use by the next call.
+*/
+static void manifest_parse_done(Manifest *p, int nCherrypickAlloc){
+  manifestScratch.aFile = p->aFile;
+  manifestScratch.nFileAlloc = p->nFileAlloc;
+  manifestScratch.aField = p->aField;
+  manifestScratch.nFieldAlloc = p->nFieldAlloc;
+  manifestScratch.azCChild = p->azCChild;
+  manifestScratch.nCChildAlloc = p->nCChildAlloc;
+  manifestScratch.azParent = p->azParent;
+  manifestScratch.nParentAlloc = p->nParentAlloc;
+  manifestScratch.aCherrypick = p->aCherrypick;
+  manifestScratch.nCherrypickAlloc = nCherrypickAlloc;
+  manifestScratch.aTag = p->aTag;
+  manifestScratch.nTagAlloc = p->nTagAlloc;
+}
+
+/*
+** Used by manifest_parse() to copy array p->A[] of p->N entries out of
+** manifestScratch and into the space at pSpace.
+*/
+#define MANIFEST_MOVE_ARRAY(A,N,NALLOC) \
+  if( p->N ){ \
+    memcpy(pSpace, p->A, p->N*sizeof(p->A[0])); \
+    p->A = (void*)pSpace; \
+    pSpace += p->N*sizeof(p->A[0]); \
+  }else{ \
+    p->A = 0; \
+  } \
+  p->NALLOC = p->N
+
 /*
 ** Shorthand for a control-artifact parsing error
 */
@@ -433,6 +671,10 @@ Manifest *manifest_parse(Blob *pContent, int rid, Blob *pErr){
   unsigned int m;
   unsigned int seenCard = 0;   /* Which card types have been seen */
   char zErrBuf[100];           /* Write error messages here */
+  Manifest work;               /* The artifact being parsed */
+  int nCherrypickAlloc;        /* Slots allocated in p->aCherrypick[] */
+  i64 nByte;                   /* Size of the final allocation for p */
+  char *pSpace;                /* Unused part of that allocation */
 
   if( rid==0 ){
     isRepeat = 1;
@@ -475,10 +717,23 @@ Manifest *manifest_parse(Blob *pContent, int rid, Blob *pErr){
     return 0;
   }
 
-  /* Allocate a Manifest object to hold the parsed control artifact.
+  /* Parse into a Manifest object on the stack, using the arrays in
+  ** manifestScratch.  All of the strings point into the content blob.
   */
-  p = fossil_malloc( sizeof(*p) );
+  p = &work;
   memset(p, 0, sizeof(*p));
+  p->aFile = manifestScratch.aFile;
+  p->nFileAlloc = manifestScratch.nFileAlloc;
+  p->aField = manifestScratch.aField;
+  p->nFieldAlloc = manifestScratch.nFieldAlloc;
+  p->azCChild = manifestScratch.azCChild;
+  p->nCChildAlloc = manifestScratch.nCChildAlloc;
+  p->azParent = manifestScratch.azParent;
+  p->nParentAlloc = manifestScratch.nParentAlloc;
+  p->aCherrypick = manifestScratch.aCherrypick;
+  nCherrypickAlloc = manifestScratch.nCherrypickAlloc;
+  p->aTag = manifestScratch.aTag;
+  p->nTagAlloc = manifestScratch.nTagAlloc;
   memcpy(&p->content, pContent, sizeof(p->content));
   p->rid = rid;
   blob_zero(pContent);
@@ -836,9 +1091,12 @@ Manifest *manifest_parse(Blob *pContent, int rid, Blob *pErr){
           SYNTAX("invalid hash on Q-card");
         }
         n = p->nCherrypick;
+        if( n>=nCherrypickAlloc ){
+          nCherrypickAlloc = nCherrypickAlloc*2 + 5;
+          p->aCherrypick = fossil_realloc(p->aCherrypick,
+                                 nCherrypickAlloc*sizeof(p->aCherrypick[0]));
+        }
         p->nCherrypick++;
-        p->aCherrypick = fossil_realloc(p->aCherrypick,
-                                 p->nCherrypick*sizeof(p->aCherrypick[0]));
         p->aCherrypick[n].zCPTarget = zUuid;
         p->aCherrypick[n].zCPBase = zUuid = next_token(&x, &sz);
         if( zUuid && !hname_validate(zUuid,sz) ){
@@ -1049,6 +1307,36 @@ Manifest *manifest_parse(Blob *pContent, int rid, Blob *pErr){
 
   md5sum_init();
   if( !isRepeat ) g.parseCnt[p->type]++;
+
+  /* Move the parsed artifact into a single allocation holding the
+  ** Manifest object and all of its arrays, sized exactly.
+  */
+  manifest_parse_done(p, nCherrypickAlloc);
+  nByte = sizeof(*p)
+        + p->nFile*(i64)sizeof(p->aFile[0])
+        + p->nField*(i64)sizeof(p->aField[0])
+        + p->nCChild*(i64)sizeof(p->azCChild[0])
+        + p->nParent*(i64)sizeof(p->azParent[0])
+        + p->nCherrypick*(i64)sizeof(p->aCherrypick[0])
+        + p->nTag*(i64)sizeof(p->aTag[0]);
+  p = fossil_malloc( nByte );
+  memcpy(p, &work, sizeof(*p));
+  p->nArena = (int)nByte;
+  p->nRef = 1;
+  pSpace = (char*)&p[1];
+  MANIFEST_MOVE_ARRAY(aFile, nFile, nFileAlloc);
+  MANIFEST_MOVE_ARRAY(aField, nField, nFieldAlloc);
+  MANIFEST_MOVE_ARRAY(azCChild, nCChild, nCChildAlloc);
+  MANIFEST_MOVE_ARRAY(azParent, nParent, nParentAlloc);
+  MANIFEST_MOVE_ARRAY(aTag, nTag, nTagAlloc);
+  if( p->nCherrypick ){
+    memcpy(pSpace, p->aCherrypick, p->nCherrypick*sizeof(p->aCherrypick[0]));
+    p->aCherrypick = (void*)pSpace;
+    pSpace += p->nCherrypick*sizeof(p->aCherrypick[0]);
+  }else{
+    p->aCherrypick = 0;
+  }
+  assert( pSpace==(char*)p + nByte );
   return p;
 
 manifest_syntax_error:
@@ -1065,7 +1353,8 @@ manifest_syntax_error:
     blob_appendf(pErr, "unknown error on line %d", lineNo);
   }
   md5sum_init();
-  manifest_destroy(p);
+  manifest_parse_done(p, nCherrypickAlloc);
+  blob_reset(&p->content);
   return 0;
 }
 
@@ -1078,16 +1367,13 @@ Manifest *manifest_get(int rid, int cfType, Blob *pErr){
   Manifest *p;
   if( !rid ) return 0;
   p = manifest_cache_find(rid);
-  if( p ){
-    if( cfType!=CFTYPE_ANY && cfType!=p->type ){
-      manifest_cache_insert(p);
-      p = 0;
-    }
-    return p;
+  if( p==0 ){
+    content_get(rid, &content);
+    p = manifest_parse(&content, rid, pErr);
+    if( p==0 ) return 0;
+    if( manifest_cache_add(p) ) p->isBusy = 1;
   }
-  content_get(rid, &content);
-  p = manifest_parse(&content, rid, pErr);
-  if( p && cfType!=CFTYPE_ANY && cfType!=p->type ){
+  if( cfType!=CFTYPE_ANY && cfType!=p->type ){
     manifest_destroy(p);
     p = 0;
   }
@@ -1149,12 +1435,21 @@ void manifest_test_parse_cmd(void){
 /*
 ** COMMAND: test-parse-all-blobs
 **
-** Usage: %fossil test-parse-all-blobs
+** Usage: %fossil test-parse-all-blobs ?OPTIONS?
 **
 ** Parse all entries in the BLOB table that are believed to be non-data
 ** artifacts and report any errors.  Run this test command on historical
 ** repositories after making any changes to the manifest_parse()
 ** implementation to confirm that the changes did not break anything.
+**
+** Also report how fast the artifacts were parsed and freed again, and
+** how much memory manifest_parse() allocated for them, not counting
+** the content.
+**
+** Options:
+**    --quiet              Do not show progress
+**    --repeat N           Parse each artifact N times
+**    -R|--repository FILE Use the repository in FILE
 */
 void manifest_test_parse_all_blobs_cmd(void){
   Manifest *p;
@@ -1162,25 +1457,144 @@ void manifest_test_parse_all_blobs_cmd(void){
   Stmt q;
   int nTest = 0;
   int nErr = 0;
+  const char *zRepeat;
+  int nRepeat;
+  int k;
+  int iTimer;
+  i64 nParse = 0;
+  i64 nByte = 0;
+  i64 nAlloc = 0;
+  sqlite3_uint64 nUsec = 0;
+  zRepeat = find_option("repeat",0,1);
+  nRepeat = zRepeat ? atoi(zRepeat) : 1;
+  if( nRepeat<1 ) nRepeat = 1;
   db_find_and_open_repository(0, 0);
   verify_all_options();
+  iTimer = fossil_timer_start();
   db_prepare(&q, "SELECT DISTINCT objid FROM EVENT");
   while( db_step(&q)==SQLITE_ROW ){
     int id = db_column_int(&q,0);
-    fossil_print("Checking %d       \r", id);
+    Blob content;
+    if( !g.fQuiet ){
+      fossil_print("Checking %d       \r", id);
+      fflush(stdout);
+    }
     nTest++;
-    fflush(stdout);
-    blob_init(&err, 0, 0);
-    p = manifest_get(id, CFTYPE_ANY, &err);
-    if( p==0 ){
-      fossil_print("%d ERROR: %s\n", id, blob_str(&err));
-      nErr++;
+    content_get(id, &content);
+    for(k=0; k<nRepeat; k++){
+      Blob copy;
+      blob_copy(&copy, &content);
+      blob_init(&err, 0, 0);
+      fossil_timer_reset(iTimer);
+      p = manifest_parse(&copy, id, &err);
+      if( p==0 ){
+        if( k==0 ){
+          fossil_print("%d ERROR: %s\n", id, blob_str(&err));
+          nErr++;
+        }
+      }else{
+        nParse++;
+        nByte += blob_size(&p->content);
+        nAlloc += p->nArena;
+      }
+      manifest_destroy(p);
+      nUsec += fossil_timer_fetch(iTimer);
+      blob_reset(&err);
     }
-    blob_reset(&err);
-    manifest_destroy(p);
+    blob_reset(&content);
   }
   db_finalize(&q);
+  fossil_timer_stop(iTimer);
   fossil_print("%d tests with %d errors\n", nTest, nErr);
+  fossil_print("%lld artifacts parsed (%lld bytes) in %.3f seconds",
+               nParse, nByte, nUsec/1e6);
+  if( nUsec>0 ){
+    fossil_print(": %.0f artifacts/s, %.1f MB/s", nParse*1e6/nUsec,
+                 nByte/(double)nUsec);
+  }
+  fossil_print("\n");
+  fossil_print("%lld bytes allocated by the parser, %.0f per artifact\n",
+               nAlloc, nParse ? nAlloc/(double)nParse : 0.0);
+}
+
+/*
+** COMMAND: test-manifest-cache
+**
+** Usage: %fossil test-manifest-cache ?OPTIONS?
+**
+** Load the manifest of every check-in using manifest_get(), walk its
+** list of files, and then show statistics for the parsed manifest
+** cache.
+**
+** Options:
+**    --limit N            Use a cache size limit of N bytes instead
+**                         of the "manifest-cache-size" setting
+**    --repeat N           Make N passes over the check-ins
+**    -R|--repository FILE Use the repository in FILE
+*/
+void manifest_test_cache_cmd(void){
+  const char *zLimit;
+  const char *zRepeat;
+  int nRepeat;
+  int k;
+  i64 nFile = 0;
+  Stmt q;
+  zLimit = find_option("limit",0,1);
+  zRepeat = find_option("repeat",0,1);
+  nRepeat = zRepeat ? atoi(zRepeat) : 1;
+  db_find_and_open_repository(0, 0);
+  verify_all_options();
+  if( zLimit ){
+    manifestCache.szLimit = atoi(zLimit);
+    if( manifestCache.szLimit<=0 ) manifestCache.szLimit = -1;
+  }
+  for(k=0; k<nRepeat; k++){
+    db_prepare(&q, "SELECT objid FROM event WHERE type='ci' ORDER BY mtime");
+    while( db_step(&q)==SQLITE_ROW ){
+      Manifest *p = manifest_get(db_column_int(&q,0), CFTYPE_MANIFEST, 0);
+      if( p==0 ) continue;
+      manifest_file_rewind(p);
+      while( manifest_file_next(p, 0)!=0 ) nFile++;
+      manifest_destroy(p);
+    }
+    db_finalize(&q);
+  }
+  fossil_print("files-visited: %lld\n", nFile);
+  fossil_print("entries: %d\n", manifestCache.n);
+  fossil_print("bytes: %lld\n", manifestCache.szTotal);
+  fossil_print("limit: %lld\n", manifestCache.szLimit);
+  fossil_print("hits: %lld\n", manifestCache.nHit);
+  fossil_print("misses: %lld\n", manifestCache.nMiss);
+  fossil_print("shared-baselines: %lld\n", manifestCache.nShared);
+  fossil_print("evictions: %lld\n", manifestCache.nEvict);
+}
+
+/*
+** Return a reference to check-in manifest rid for use as the baseline
+** of a delta-manifest.  Baselines are only read, never iterated
+** directly, so the copy in the cache is shared even if it is currently
+** handed out by manifest_get().  Return NULL if rid is not a check-in
+** manifest.
+*/
+static Manifest *manifest_get_baseline(int rid){
+  Manifest *p;
+  Blob content;
+  if( !rid ) return 0;
+  p = manifest_cache_lookup(rid);
+  if( p ){
+    if( p->type!=CFTYPE_MANIFEST ) return 0;
+    manifestCache.nShared++;
+    p->nRef++;
+    return p;
+  }
+  content_get(rid, &content);
+  p = manifest_parse(&content, rid, 0);
+  if( p && p->type!=CFTYPE_MANIFEST ){
+    manifest_release(p);
+    return 0;
+  }
+  if( p ) manifest_cache_add(p);
+  return p;
 }
 
 /*
@@ -1193,7 +1607,7 @@ void manifest_test_parse_all_blobs_cmd(void){
 static int fetch_baseline(Manifest *p, int throwError){
   if( p->zBaseline!=0 && p->pBaseline==0 ){
     int rid = uuid_to_rid(p->zBaseline, 1);
-    p->pBaseline = manifest_get(rid, CFTYPE_MANIFEST, 0);
+    p->pBaseline = manifest_get_baseline(rid);
     if( p->pBaseline==0 ){
       if( !throwError ){
         db_multi_exec(
@@ -1213,10 +1627,8 @@ static int fetch_baseline(Manifest *p, int throwError){
 */
 void manifest_file_rewind(Manifest *p){
   p->iFile = 0;
+  p->iBase = 0;
   fetch_baseline(p, 1);
-  if( p->pBaseline ){
-    p->pBaseline->iFile = 0;
-  }
 }
 
 /*
@@ -1242,7 +1654,7 @@ ManifestFile *manifest_file_next(
     Manifest *pB = p->pBaseline;
     int cmp;
     while(1){
-      if( pB->iFile>=pB->nFile ){
+      if( p->iBase>=pB->nFile ){
         /* We have used all entries out of the baseline.  Return the next
         ** entry from the delta. */
         if( p->iFile<p->nFile ) pOut = &p->aFile[p->iFile++];
@@ -1250,13 +1662,13 @@ ManifestFile *manifest_file_next(
       }else if( p->iFile>=p->nFile ){
         /* We have used all entries from the delta.  Return the next
         ** entry from the baseline. */
-        if( pB->iFile<pB->nFile ) pOut = &pB->aFile[pB->iFile++];
+        if( p->iBase<pB->nFile ) pOut = &pB->aFile[p->iBase++];
         break;
-      }else if( (cmp = fossil_strcmp(pB->aFile[pB->iFile].zName,
+      }else if( (cmp = fossil_strcmp(pB->aFile[p->iBase].zName,
                               p->aFile[p->iFile].zName)) < 0 ){
         /* The next baseline entry comes before the next delta entry.
         ** So return the baseline entry. */
-        pOut = &pB->aFile[pB->iFile++];
+        pOut = &pB->aFile[p->iBase++];
         break;
       }else if( cmp>0 ){
         /* The next delta entry comes before the next baseline
@@ -1266,14 +1678,14 @@ ManifestFile *manifest_file_next(
       }else if( p->aFile[p->iFile].zUuid ){
         /* The next delta entry is a replacement for the next baseline
         ** entry.  Skip the baseline entry and return the delta entry */
-        pB->iFile++;
+        p->iBase++;
         pOut = &p->aFile[p->iFile++];
         break;
       }else{
         /* The next delta entry is a delete of the next baseline
         ** entry.  Skip them both.  Repeat the loop to find the next
         ** non-delete entry. */
-        pB->iFile++;
+        p->iBase++;
         p->iFile++;
         continue;
       }
@@ -1396,14 +1808,17 @@ static void add_one_mlink(
 /*
 ** Do a binary search to find a file in the p->aFile[] array.
 **
-** As an optimization, guess that the file we seek is at index p->iFile.
+** As an optimization, guess that the file we seek is at index *piFile.
 ** That will usually be the case.  If it is not found there, then do the
 ** actual binary search.
 **
-** Update p->iFile to be the index of the file that is found.
+** Update *piFile to be the index of the file that is found.  For a
+** baseline, piFile points into the delta-manifest, as the baseline
+** itself might be shared.
 */
 static ManifestFile *manifest_file_seek_base(
   Manifest *p,             /* Manifest to search */
+  int *piFile,             /* Index of the file found by the last search */
   const char *zName,       /* Name of the file we are looking for */
   int bBest                /* 0: exact match only.  1: closest match */
 ){
@@ -1415,14 +1830,14 @@ static ManifestFile *manifest_file_seek_base(
   }
   lwr = 0;
   upr = p->nFile - 1;
-  if( p->iFile>=lwr && p->iFile<upr ){
-    c = fossil_strcmp(p->aFile[p->iFile+1].zName, zName);
+  if( *piFile>=lwr && *piFile<upr ){
+    c = fossil_strcmp(p->aFile[*piFile+1].zName, zName);
     if( c==0 ){
-      return &p->aFile[++p->iFile];
+      return &p->aFile[++(*piFile)];
     }else if( c>0 ){
-      upr = p->iFile;
+      upr = *piFile;
     }else{
-      lwr = p->iFile+1;
+      lwr = *piFile+1;
     }
   }
   while( lwr<=upr ){
@@ -1433,7 +1848,7 @@ static ManifestFile *manifest_file_seek_base(
     }else if( c>0 ){
       upr = i-1;
     }else{
-      p->iFile = i;
+      *piFile = i;
       return &p->aFile[i];
     }
   }
@@ -1458,11 +1873,12 @@ static ManifestFile *manifest_file_seek_base(
 ManifestFile *manifest_file_seek(Manifest *p, const char *zName, int bBest){
   ManifestFile *pFile;
 
-  pFile = manifest_file_seek_base(p, zName, p->zBaseline ? 0 : bBest);
+  pFile = manifest_file_seek_base(p, &p->iFile, zName,
+                                  p->zBaseline ? 0 : bBest);
   if( pFile && pFile->zUuid==0 ) return 0;
   if( pFile==0 && p->zBaseline ){
     fetch_baseline(p, 1);
-    pFile = manifest_file_seek_base(p->pBaseline, zName,bBest);
+    pFile = manifest_file_seek_base(p->pBaseline, &p->iBase, zName, bBest);
   }
   return pFile;
 }
@@ -1639,7 +2055,8 @@ static void add_mlink(
     ** in the child. */
     for(i=0, pParentFile=pParent->aFile; i<pParent->nFile; i++, pParentFile++){
       if( pParentFile->zUuid ){
-        pChildFile = manifest_file_seek_base(pChild, pParentFile->zName, 0);
+        pChildFile = manifest_file_seek_base(pChild, &pChild->iFile,
+                                             pParentFile->zName, 0);
         if( pChildFile==0 ){
           /* The child file reverts to baseline.  Show this as a change */
           pChildFile = manifest_file_seek(pChild, pParentFile->zName, 0);
@@ -2122,6 +2539,8 @@ int manifest_crosslink(int rid, Blob *pContent, int flags){
       char *zCom;
       parentid = manifest_add_checkin_linkages(rid,p,p->nParent,p->azParent);
       search_doc_touch('c', rid, 0);
+      search_file_touch(rid);
+      trigram_touch(rid);
       db_multi_exec(
         "REPLACE INTO event(type,mtime,objid,user,comment,"
                            "bgcolor,euser,ecomment,omtime)"
@@ -2441,7 +2860,9 @@ int manifest_crosslink(int rid, Blob *pContent, int flags){
     if( p->zComment ){
       blob_appendf(&comment, " %s.", p->zComment);
     }
-    /* Next loop expects tags to be sorted on hash, so sort it. */
+    /* Next loop expects tags to be sorted on hash, so sort it.  That
+    ** changes the order of p->aTag[], so keep p out of the cache. */
+    if( p->inCache ) manifest_cache_remove(p);
     qsort(p->aTag, p->nTag, sizeof(p->aTag[0]), tag_compare);
     for(i=0; i<p->nTag; i++){
       zTagUuid = p->aTag[i].zUuid;
@@ -45,14 +45,30 @@
 # define FOSSIL_HASH_DIGITS_URL 16   /* For %!S (embedded in URLs) */
 #endif
 
+/*
+** Values derived from settings by hashDigits() and wiki_convert_flags().
+** They are computed when first needed.
+*/
+static int nDigitHuman = 0;   /* Hash digits for human display */
+static int nDigitUrl = 0;     /* Hash digits in URLs */
+static int wikiFlags = 0;     /* Flags for wiki text on a timeline */
+
+/*
+** Forget the values derived from settings, as the settings might change
+** before the next web page that this process generates.
+*/
+void printf_reset(void){
+  nDigitHuman = 0;
+  nDigitUrl = 0;
+  wikiFlags = 0;
+}
+
 /*
 ** Return the number of artifact hash digits to display.  The number is for
 ** human output if the bForUrl is false and is destined for a URL if
 ** bForUrl is false.
 */
 static int hashDigits(int bForUrl){
-  static int nDigitHuman = 0;
-  static int nDigitUrl = 0;
   if( nDigitHuman==0 ){
     nDigitHuman = db_get_int("hash-digits", FOSSIL_HASH_DIGITS);
     if( nDigitHuman < 6 ) nDigitHuman = 6;
@@ -221,7 +237,6 @@ static int StrNLen32(const char *z, int N){
 ** is acceptable even if the "timeline-block-markup" setting is false.
 */
 static int wiki_convert_flags(int altForm2){
-  static int wikiFlags = 0;
   if( wikiFlags==0 ){
     if( altForm2 || db_get_boolean("timeline-block-markup", 0) ){
       wikiFlags = WIKI_INLINE | WIKI_NOBADLINKS;
@@ -1047,6 +1062,7 @@ static int fossil_print_error(int rc, const char *z){
 #endif
   if( g.cgiOutput==1 && g.db ){
     g.cgiOutput = 2;
+    cgi_close_connection();
     cgi_reset_content();
     cgi_set_content_type("text/html");
     style_header("Bad Request");
@@ -120,6 +120,11 @@ int purge_artifact_list(
     return 0;
   }
 
+  /* Parsed copies of the artifacts must not outlive them */
+  manifest_cache_clear();
+  search_file_unindex(zTab);
+  trigram_unindex(zTab);
+
   /* Make sure we are not removing a manifest that is the baseline of some
   ** manifest that is being left behind.  This step is not strictly necessary.
   ** is is just a safety check. */
@@ -188,6 +188,282 @@ static int cchFNamePrefix;  /* Length of directory prefix in zFNameFormat */
 static char *zDestDir;      /* Destination directory on deconstruct */
 static int prefixLength;    /* Length of directory prefix for deconstruct */
 static int fKeepRid1;       /* Flag to preserve RID=1 on de- and reconstruct */
+static int nRebuildThread;  /* Number of worker threads for "rebuild" */
+static i64 nRebuildByte;    /* Bytes of artifact content processed */
+
+/*
+** Parallel rebuild.
+**
+** When "fossil rebuild --threads N" is used, the main thread still walks
+** the delta trees and calls manifest_crosslink() in exactly the same
+** order as a single-threaded rebuild, so the resulting database is
+** identical.  But the expensive part of expanding each artifact, the
+** zlib inflation and the delta application, is done ahead of time by
+** worker threads.
+**
+** The main thread plans the work by walking the delta trees rooted at
+** each full-text artifact in the same order that rebuild_step() will
+** later visit them, reading the compressed content of each artifact
+** into a RebuildJob.  Each job holds up to about REBUILD_JOB_SIZE bytes
+** of expanded content.  When a tree is split across jobs, the later
+** job also carries the chain of ancestors needed to expand its first
+** artifact.  Worker threads expand the jobs, and rebuild_step() then
+** takes expanded content from the finished jobs in order.
+**
+** The plan is only a prediction.  If manifest_crosslink() changes the
+** delta table so that rebuild_step() asks for an artifact other than
+** the one that was predicted, the artifact is simply expanded inline.
+*/
+#define REBUILD_JOB_SIZE 4000000
+
+typedef struct RebuildJob RebuildJob;
+struct RebuildJob {
+  int nNode;                /* Number of entries in aNode[] */
+  int nAlloc;               /* Number of slots allocated in aNode[] */
+  int iNext;                /* Next node to be consumed by rebuild_step() */
+  i64 szJob;                /* Total expanded size of nodes to be consumed */
+  struct RebuildNode {
+    int rid;                  /* The artifact */
+    int iParent;              /* Delta source in aNode[], or -1 */
+    int isPath;               /* Only needed to expand later nodes */
+    Blob content;             /* Compressed content, then expanded content */
+  } *aNode;
+};
+
+/*
+** State of the planner for parallel rebuild
+*/
+static struct {
+  WorkQueue *pQueue;        /* Worker threads */
+  RebuildJob *pCur;         /* Job being consumed by rebuild_step() */
+  Stmt qRoot;               /* Full-text artifacts that root delta trees */
+  int nStack;               /* Entries on the DFS stack */
+  int nStackAlloc;          /* Slots allocated for aStack[] */
+  struct RebuildPlanEntry {
+    int rid;                  /* Artifact to visit */
+    int depth;                /* Depth in the delta tree.  0 for the root */
+  } *aStack;
+  int nPath;                /* Depth of the most recently planned node + 1 */
+  int nPathAlloc;           /* Slots allocated in aPath[] and aPathIdx[] */
+  int *aPath;               /* Ancestors of the most recently planned node */
+  int *aPathIdx;            /* Index of aPath[] entries in the current job */
+  Bag planned;              /* Artifacts already planned */
+  i64 nExpand;              /* Bytes of content expanded by worker threads */
+} rebuildPlan;
+
+/*
+** Expand all nodes of a RebuildJob.  This runs in a worker thread and
+** so must not use the database.
+*/
+static void rebuild_job_expand(void *pArg){
+  RebuildJob *pJob = (RebuildJob*)pArg;
+  int i;
+  for(i=0; i<pJob->nNode; i++){
+    struct RebuildNode *pNode = &pJob->aNode[i];
+    blob_uncompress(&pNode->content, &pNode->content);
+    if( pNode->iParent>=0 ){
+      Blob next;
+      blob_delta_apply(&pJob->aNode[pNode->iParent].content,
+                       &pNode->content, &next);
+      blob_reset(&pNode->content);
+      pNode->content = next;
+    }
+  }
+  for(i=0; i<pJob->nNode; i++){
+    if( pJob->aNode[i].isPath ) blob_reset(&pJob->aNode[i].content);
+  }
+}
+
+/*
+** Free a RebuildJob
+*/
+static void rebuild_job_free(void *pArg){
+  RebuildJob *pJob = (RebuildJob*)pArg;
+  int i;
+  for(i=0; i<pJob->nNode; i++){
+    blob_reset(&pJob->aNode[i].content);
+  }
+  fossil_free(pJob->aNode);
+  fossil_free(pJob);
+}
+
+/*
+** Append artifact rid to pJob and return its index in pJob->aNode[].
+*/
+static int rebuild_job_add(RebuildJob *pJob, int rid, int iParent, int isPath){
+  static Stmt q;
+  struct RebuildNode *pNode;
+  if( pJob->nNode>=pJob->nAlloc ){
+    pJob->nAlloc = pJob->nAlloc*2 + 20;
+    pJob->aNode = fossil_realloc(pJob->aNode,
+                                 pJob->nAlloc*sizeof(pJob->aNode[0]));
+  }
+  pNode = &pJob->aNode[pJob->nNode];
+  pNode->rid = rid;
+  pNode->iParent = iParent;
+  pNode->isPath = isPath;
+  blob_zero(&pNode->content);
+  db_static_prepare(&q, "SELECT content, size FROM blob WHERE rid=:rid");
+  db_bind_int(&q, ":rid", rid);
+  if( db_step(&q)==SQLITE_ROW ){
+    db_column_blob(&q, 0, &pNode->content);
+    if( !isPath ) pJob->szJob += db_column_int(&q, 1);
+  }
+  db_reset(&q);
+  return pJob->nNode++;
+}
+
+/*
+** Push artifact rid onto the planner DFS stack
+*/
+static void rebuild_plan_push(int rid, int depth){
+  if( rebuildPlan.nStack>=rebuildPlan.nStackAlloc ){
+    rebuildPlan.nStackAlloc = rebuildPlan.nStackAlloc*2 + 20;
+    rebuildPlan.aStack = fossil_realloc(rebuildPlan.aStack,
+                     rebuildPlan.nStackAlloc*sizeof(rebuildPlan.aStack[0]));
+  }
+  rebuildPlan.aStack[rebuildPlan.nStack].rid = rid;
+  rebuildPlan.aStack[rebuildPlan.nStack].depth = depth;
+  rebuildPlan.nStack++;
+}
+
+/*
+** Plan the next job and hand it to the worker threads.  Return false
+** if there is no more work to plan.
+*/
+static int rebuild_plan_job(void){
+  static Stmt q1;
+  RebuildJob *pJob;
+  pJob = fossil_malloc( sizeof(*pJob) );
+  memset(pJob, 0, sizeof(*pJob));
+  while( pJob->szJob<REBUILD_JOB_SIZE ){
+    int rid, depth, i, cid, nChild;
+    Bag children;
+    if( rebuildPlan.nStack==0 ){
+      /* Start the next delta tree, but not in a job that already
+      ** holds part of a different tree. */
+      if( pJob->nNode>0 ) break;
+      while( db_step(&rebuildPlan.qRoot)==SQLITE_ROW ){
+        rid = db_column_int(&rebuildPlan.qRoot, 0);
+        if( db_column_int(&rebuildPlan.qRoot, 1)>=0 ){
+          rebuild_plan_push(rid, 0);
+          break;
+        }
+      }
+      if( rebuildPlan.nStack==0 ) break;
+    }
+    rebuildPlan.nStack--;
+    rid = rebuildPlan.aStack[rebuildPlan.nStack].rid;
+    depth = rebuildPlan.aStack[rebuildPlan.nStack].depth;
+    bag_insert(&rebuildPlan.planned, rid);
+    if( depth>=rebuildPlan.nPathAlloc ){
+      rebuildPlan.nPathAlloc = depth*2 + 20;
+      rebuildPlan.aPath = fossil_realloc(rebuildPlan.aPath,
+                           rebuildPlan.nPathAlloc*sizeof(int));
+      rebuildPlan.aPathIdx = fossil_realloc(rebuildPlan.aPathIdx,
+                           rebuildPlan.nPathAlloc*sizeof(int));
+    }
+    if( pJob->nNode==0 ){
+      /* A tree continued from a prior job.  Include its ancestors. */
+      for(i=0; i<depth; i++){
+        rebuildPlan.aPathIdx[i] =
+            rebuild_job_add(pJob, rebuildPlan.aPath[i], i-1, 1);
+      }
+    }
+    rebuildPlan.aPath[depth] = rid;
+    rebuildPlan.aPathIdx[depth] = rebuild_job_add(pJob, rid,
+                        depth ? rebuildPlan.aPathIdx[depth-1] : -1, 0);
+
+    /* Visit children in the same order as rebuild_step() */
+    db_static_prepare(&q1,
+       "SELECT rid FROM delta WHERE srcid=:rid"
+       "   AND (SELECT size FROM blob WHERE rid=delta.rid)>=0");
+    db_bind_int(&q1, ":rid", rid);
+    bag_init(&children);
+    while( db_step(&q1)==SQLITE_ROW ){
+      cid = db_column_int(&q1, 0);
+      if( !bag_find(&rebuildPlan.planned, cid) ){
+        bag_insert(&children, cid);
+      }
+    }
+    db_reset(&q1);
+    nChild = bag_count(&children);
+    i = rebuildPlan.nStack + nChild;
+    for(cid=bag_first(&children); cid; cid=bag_next(&children, cid)){
+      rebuild_plan_push(cid, depth+1);
+    }
+    /* Reverse the children just pushed so the first is popped first */
+    for(cid=rebuildPlan.nStack-nChild; cid<--i; cid++){
+      struct RebuildPlanEntry x = rebuildPlan.aStack[cid];
+      rebuildPlan.aStack[cid] = rebuildPlan.aStack[i];
+      rebuildPlan.aStack[i] = x;
+    }
+    bag_clear(&children);
+  }
+  if( pJob->nNode==0 ){
+    rebuild_job_free(pJob);
+    return 0;
+  }
+  rebuildPlan.nExpand += pJob->szJob;
+  workqueue_push(rebuildPlan.pQueue, pJob);
+  return 1;
+}
+
+/*
+** Start worker threads for a parallel rebuild.
+*/
+static void rebuild_plan_begin(int nThread){
+  memset(&rebuildPlan, 0, sizeof(rebuildPlan));
+  rebuildPlan.pQueue = workqueue_new(nThread, nThread*4, rebuild_job_expand);
+  bag_init(&rebuildPlan.planned);
+  db_prepare(&rebuildPlan.qRoot,
+     "SELECT rid, size FROM blob /*scan*/"
+     " WHERE NOT EXISTS(SELECT 1 FROM shun WHERE uuid=blob.uuid)"
+     "   AND NOT EXISTS(SELECT 1 FROM delta WHERE rid=blob.rid)"
+  );
+}
+
+/*
+** Stop the worker threads and free all planner state.
+*/
+static void rebuild_plan_end(void){
+  if( rebuildPlan.pQueue==0 ) return;
+  if( rebuildPlan.pCur ) rebuild_job_free(rebuildPlan.pCur);
+  workqueue_free(rebuildPlan.pQueue, rebuild_job_free);
+  db_finalize(&rebuildPlan.qRoot);
+  bag_clear(&rebuildPlan.planned);
+  fossil_free(rebuildPlan.aStack);
+  fossil_free(rebuildPlan.aPath);
+  fossil_free(rebuildPlan.aPathIdx);
+  rebuildPlan.pQueue = 0;
+  rebuildPlan.pCur = 0;
+}
+
+/*
+** If the worker threads have already expanded the content of artifact
+** rid, move that content into pOut and return true.  Return false if
+** the content must be computed by the caller.
+*/
+static int rebuild_prefetched(int rid, Blob *pOut){
+  RebuildJob *pJob;
+  int i;
+  if( rebuildPlan.pQueue==0 ) return 0;
+  while( (pJob = rebuildPlan.pCur)==0 || pJob->iNext>=pJob->nNode ){
+    if( pJob ) rebuild_job_free(pJob);
+    while( !workqueue_full(rebuildPlan.pQueue) && rebuild_plan_job() ){}
+    rebuildPlan.pCur = workqueue_pop(rebuildPlan.pQueue);
+    if( rebuildPlan.pCur==0 ) return 0;
+  }
+  for(i=pJob->iNext; i<pJob->nNode; i++){
+    if( pJob->aNode[i].rid==rid && !pJob->aNode[i].isPath ){
+      *pOut = pJob->aNode[i].content;
+      blob_zero(&pJob->aNode[i].content);
+      pJob->iNext = i+1;
+      return 1;
+    }
+  }
+  return 0;
+}
 
 
 /*
@@ -244,6 +520,7 @@ static void rebuild_step(int rid, int size, Blob *pBase){
   while( rid>0 ){
 
     /* Fix up the "blob.size" field if needed. */
+    nRebuildByte += blob_size(pBase);
     if( size!=blob_size(pBase) ){
       db_multi_exec(
          "UPDATE blob SET size=%d WHERE rid=%d", blob_size(pBase), rid
@@ -306,10 +583,12 @@ static void rebuild_step(int rid, int size, Blob *pBase){
       db_bind_int(&q2, ":rid", cid);
       if( db_step(&q2)==SQLITE_ROW && (sz = db_column_int(&q2,1))>=0 ){
         Blob delta, next;
-        db_ephemeral_blob(&q2, 0, &delta);
-        blob_uncompress(&delta, &delta);
-        blob_delta_apply(pBase, &delta, &next);
-        blob_reset(&delta);
+        if( !rebuild_prefetched(cid, &next) ){
+          db_ephemeral_blob(&q2, 0, &delta);
+          blob_uncompress(&delta, &delta);
+          blob_delta_apply(pBase, &delta, &next);
+          blob_reset(&delta);
+        }
         db_reset(&q2);
         if( i<nChild ){
           rebuild_step(cid, sz, &next);
@@ -384,7 +663,8 @@ int rebuild_db(int randomize, int doOut, int doClustering){
                        "'config','shun','private','reportfmt',"
                        "'concealed','accesslog','modreq',"
                        "'purgeevent','purgeitem','unversioned',"
-                       "'subscriber','pending_alert','alert_bounce')"
+                       "'subscriber','pending_alert','alert_bounce',"
+                       "'trigram','trigramfile')"
      " AND name NOT GLOB 'sqlite_*'"
      " AND name NOT GLOB 'fx_*'"
   );
@@ -425,16 +705,20 @@ int rebuild_db(int randomize, int doOut, int doClustering){
      "   AND NOT EXISTS(SELECT 1 FROM delta WHERE rid=blob.rid)"
   );
   manifest_crosslink_begin();
+  if( nRebuildThread>1 ) rebuild_plan_begin(nRebuildThread);
   while( db_step(&s)==SQLITE_ROW ){
     int rid = db_column_int(&s, 0);
     int size = db_column_int(&s, 1);
     if( size>=0 ){
       Blob content;
-      content_get(rid, &content);
+      if( !rebuild_prefetched(rid, &content) ){
+        content_get(rid, &content);
+      }
       rebuild_step(rid, size, &content);
     }
   }
   db_finalize(&s);
+  rebuild_plan_end();
   db_prepare(&s,
      "SELECT rid, size FROM blob"
      " WHERE NOT EXISTS(SELECT 1 FROM shun WHERE uuid=blob.uuid)"
@@ -594,6 +878,7 @@ static void reconstruct_private_table(void){
 **   --quiet           Only show output if there are errors
 **   --randomize       Scan artifacts in a random order
 **   --stats           Show artifact statistics after rebuilding
+**   --threads N       Use N worker threads to expand artifacts
 **   --vacuum          Run VACUUM on the database after rebuilding
 **   --wal             Set Write-Ahead-Log journalling mode on the database
 **
@@ -618,6 +903,8 @@ void rebuild_database(void){
   int optIndex;
   int optIfNeeded;
   int compressOnlyFlag;
+  const char *zThreads;
+  sqlite3_int64 tmStart;
 
   omitVerify = find_option("noverify",0,0)!=0;
   forceFlag = find_option("force","f",0)!=0;
@@ -633,6 +920,8 @@ void rebuild_database(void){
   optNoIndex = find_option("noindex",0,0)!=0;
   optIfNeeded = find_option("ifneeded",0,0)!=0;
   compressOnlyFlag = find_option("compress-only",0,0)!=0;
+  zThreads = find_option("threads",0,1);
+  nRebuildThread = zThreads ? atoi(zThreads) : 0;
   if( compressOnlyFlag ) runCompress = runVacuum = 1;
   if( zPagesize ){
     newPagesize = atoi(zPagesize);
@@ -667,8 +956,20 @@ void rebuild_database(void){
   if( !compressOnlyFlag ){
     search_drop_index();
     ttyOutput = 1;
+    nRebuildByte = 0;
+    tmStart = current_time_in_milliseconds();
     errCnt = rebuild_db(randomizeFlag, 1, doClustering);
     reconstruct_private_table();
+    if( !g.fQuiet && (showStats || nRebuildThread>1) ){
+      sqlite3_int64 nMs = current_time_in_milliseconds() - tmStart;
+      if( nMs<1 ) nMs = 1;
+      fossil_print("%d artifacts, %.1f MB in %.3f seconds: %.1f MB/s"
+                   " using %d thread%s\n",
+                   bag_count(&bagDone), nRebuildByte/1e6, nMs/1000.0,
+                   nRebuildByte/(nMs*1000.0),
+                   nRebuildThread>1 ? nRebuildThread : 1,
+                   nRebuildThread>1 ? "s" : "");
+    }
   }
   db_multi_exec(
     "REPLACE INTO config(name,value,mtime) VALUES('content-schema',%Q,now());"
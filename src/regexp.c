@@ -646,6 +646,112 @@ const char *re_compile(ReCompiled **ppRe, const char *zIn, int noCase){
   return pRe->zErr;
 }
 
+/*
+** REs with more states than this are not searched for trigrams by
+** re_trigrams().
+*/
+#define RE_TRIGRAM_MXSTATE 2000
+
+/*
+** Write into a[] the states that state x of pRe can move to, and return
+** how many there are.
+*/
+static int re_successors(ReCompiled *pRe, int x, int *a){
+  switch( pRe->aOp[x] ){
+    case RE_OP_ACCEPT:   return 0;
+    case RE_OP_GOTO:
+    case RE_OP_CC_INC:
+    case RE_OP_CC_EXC:   a[0] = x+pRe->aArg[x];  return 1;
+    case RE_OP_FORK:     a[0] = x+1;  a[1] = x+pRe->aArg[x];  return 2;
+    case RE_OP_ANYSTAR:  a[0] = x;  a[1] = x+1;  return 2;
+    default:             a[0] = x+1;  return 1;
+  }
+}
+
+/*
+** Return true if the accepting state of pRe can be reached from the
+** initial state without going through state iSkip.  aSeen[] and aStack[]
+** are scratch space with one entry for each state.
+*/
+static int re_accept_reachable(
+  ReCompiled *pRe,
+  int iSkip,
+  char *aSeen,
+  int *aStack
+){
+  int nStack = 0;
+  if( iSkip==0 ) return 0;
+  memset(aSeen, 0, pRe->nState);
+  aSeen[0] = 1;
+  aStack[nStack++] = 0;
+  while( nStack>0 ){
+    int x = aStack[--nStack];
+    int aNext[2], nNext, k;
+    if( pRe->aOp[x]==RE_OP_ACCEPT ) return 1;
+    nNext = re_successors(pRe, x, aNext);
+    for(k=0; k<nNext; k++){
+      int y = aNext[k];
+      if( y<0 || y>=(int)pRe->nState || y==iSkip || aSeen[y] ) continue;
+      aSeen[y] = 1;
+      aStack[nStack++] = y;
+    }
+  }
+  return 0;
+}
+
+/*
+** Find trigrams that must appear in any text that pRe matches.  Write
+** up to mxTg of them into aTg[] and return the number written.  Each
+** trigram is three bytes, c0<<16 | c1<<8 | c2, with ASCII letters folded
+** to lower case.
+**
+** Only runs of ASCII characters that every match passes through, one
+** right after another, are used.  So an RE such as "abc|xyz" yields no
+** trigrams at all, even though every match contains one of two.  A
+** return of zero means that nothing is known.
+*/
+int re_trigrams(ReCompiled *pRe, unsigned *aTg, int mxTg){
+  int n = (int)pRe->nState;
+  int *aStack;
+  char *aSeen, *aOther;
+  int i, k;
+  int nTg = 0;
+  int nRun = 0;
+  unsigned tg = 0;
+  if( n<4 || n>RE_TRIGRAM_MXSTATE ) return 0;
+  aStack = fossil_malloc( n*(sizeof(int)+2) );
+  aSeen = (char*)&aStack[n];
+  aOther = &aSeen[n];
+
+  /* aOther[i] is true if state i can be entered from any state
+  ** other than state i-1 */
+  memset(aOther, 0, n);
+  for(i=0; i<n; i++){
+    int aNext[2];
+    int nNext = re_successors(pRe, i, aNext);
+    for(k=0; k<nNext; k++){
+      if( aNext[k]!=i+1 && aNext[k]>=0 && aNext[k]<n ) aOther[aNext[k]] = 1;
+    }
+  }
+
+  for(i=0; i<n && nTg<mxTg; i++){
+    unsigned c = pRe->aOp[i]==RE_OP_MATCH ? (unsigned)pRe->aArg[i] : 0;
+    if( c==RE_EOF || c>0x7f || re_accept_reachable(pRe, i, aSeen, aStack) ){
+      nRun = 0;
+      continue;
+    }
+    if( aOther[i] ) nRun = 0;
+    if( c>='A' && c<='Z' ) c += 'a' - 'A';
+    tg = ((tg<<8) | c) & 0xffffff;
+    if( ++nRun>=3 ){
+      for(k=0; k<nTg && aTg[k]!=tg; k++){}
+      if( k==nTg ) aTg[nTg++] = tg;
+    }
+  }
+  fossil_free(aStack);
+  return nTg;
+}
+
 /*
 ** Implementation of the regexp() SQL function.  This function implements
 ** the build-in REGEXP operator.  The first argument to the function is the
@@ -721,6 +827,7 @@ static void grep_file(ReCompiled *pRe, const char *zFile, FILE *in){
 ** Flags for grep_buffer()
 */
 #define GREP_EXISTS    0x001    /* If any match, print only the name and stop */
+#define GREP_QUIET     0x002    /* Print nothing.  Only count the matches */
 
 /*
 ** Run a "grep" over a text file
@@ -739,6 +846,7 @@ static int grep_buffer(
     ln++;
     if( re_match(pRe, (const unsigned char*)(z+i), j-i) ){
       cnt++;
+      if( flags & GREP_QUIET ) continue;
       if( flags & GREP_EXISTS ){
         fossil_print("%s\n", zName);
         break;
@@ -796,10 +904,17 @@ void re_test_grep(void){
 ** over all historic versions of FILENAME.  For details of the supported
 ** RE dialect, see https://fossil-scm.org/fossil/doc/trunk/www/grep.md
 **
+** If the trigram index is turned on (see "fossil grep-index"), versions
+** of FILENAME that cannot possibly match are skipped without being read.
+** Any file versions not yet in the index are added to it first, so this
+** command then writes to the repository.  Use --no-index to leave the
+** repository unchanged.
+**
 ** Options:
 **
 **     -i|--ignore-case         Ignore case
 **     -l|--files-with-matches  List only checkin ID for versions that match
+**     --no-index               Do not use the trigram index
 **     -v|--verbose             Show each file as it is analyzed
 */
 void re_grep_cmd(void){
@@ -808,11 +923,13 @@ void re_grep_cmd(void){
   ReCompiled *pRe;
   const char *zErr;
   int ignoreCase = 0;
+  int useIndex;
   Blob fullName;
 
   if( find_option("ignore-case","i",0)!=0 ) ignoreCase = 1;
   if( find_option("files-with-matches","l",0)!=0 ) flags |= GREP_EXISTS;
   if( find_option("verbose","v",0)!=0 ) bVerbose = 1;
+  useIndex = find_option("no-index",0,0)==0;
   db_find_and_open_repository(0, 0);
   verify_all_options();
   if( g.argc<4 ){
@@ -826,17 +943,21 @@ void re_grep_cmd(void){
                       blob_str(&fullName));
     if( fnid ){
       Stmt q;
+      const char *zFilter = "";
       add_content_sql_commands(g.db);
+      if( useIndex && trigram_candidates(pRe) ){
+        zFilter = " AND mlink.fid IN (SELECT rid FROM grepcand)";
+      }
       db_prepare(&q,
         "SELECT content(ux), substr(ux,1,10) FROM ("
         "  SELECT blob.uuid AS ux, min(event.mtime) AS mx"
         "    FROM mlink, blob, event"
         "   WHERE mlink.mid=event.objid"
         "     AND mlink.fid=blob.rid"
-        "     AND mlink.fnid=%d"
+        "     AND mlink.fnid=%d%s"
         "   GROUP BY blob.uuid"
         ") ORDER BY mx DESC;",
-        fnid
+        fnid, zFilter/*safe-for-%s*/
       );
       while( db_step(&q)==SQLITE_ROW ){
         if( bVerbose ) fossil_print("%s:\n", db_column_text(&q,1));
@@ -846,3 +967,79 @@ void re_grep_cmd(void){
     }
   }
 }
+
+/*
+** COMMAND: test-grep-bench
+**
+** Usage: %fossil test-grep-bench REGEXP ?OPTIONS?
+**
+** Run REGEXP over every line of every version of every file in the
+** repository twice, once reading every file and once reading only the
+** files that the trigram index says might match.  Report the number of
+** files read, the number of matching lines, and the time taken by each.
+** The trigram index is brought up to date first but is not timed.
+**
+** Options:
+**
+**   -i|--ignore-case    Ignore case
+**   --repeat N          Run each search N times.  Default: 1
+*/
+void re_grep_bench_cmd(void){
+  ReCompiled *pRe;
+  const char *zErr;
+  const char *zRepeat;
+  int ignoreCase = find_option("ignore-case","i",0)!=0;
+  int nRepeat = 1;
+  int useIndex;
+  unsigned aTg[20];
+  int nTg;
+
+  zRepeat = find_option("repeat",0,1);
+  if( zRepeat ) nRepeat = atoi(zRepeat);
+  if( nRepeat<1 ) nRepeat = 1;
+  db_find_and_open_repository(0, 0);
+  verify_all_options();
+  if( g.argc!=3 ) usage("REGEXP ?OPTIONS?");
+  zErr = re_compile(&pRe, g.argv[2], ignoreCase);
+  if( zErr ) fossil_fatal("%s", zErr);
+  if( !trigram_index_exists() ){
+    fossil_fatal("the trigram index is off.  Use \"fossil grep-index on\"");
+  }
+  trigram_update_index();
+  nTg = re_trigrams(pRe, aTg, count(aTg));
+  fossil_print("%d trigram%s in the RE\n", nTg, nTg==1 ? "" : "s");
+  add_content_sql_commands(g.db);
+  for(useIndex=0; useIndex<=1; useIndex++){
+    int iTimer = fossil_timer_start();
+    int nFile = 0;
+    int nLine = 0;
+    sqlite3_uint64 nUs;
+    int i;
+    for(i=0; i<nRepeat; i++){
+      Stmt q;
+      const char *zFilter = "";
+      if( useIndex && trigram_candidates(pRe) ){
+        zFilter = " WHERE fid IN (SELECT rid FROM grepcand)";
+      }
+      nFile = nLine = 0;
+      db_prepare(&q,
+        "SELECT content(uuid) FROM blob"
+        " WHERE rid IN (SELECT fid FROM mlink%s)",
+        zFilter/*safe-for-%s*/
+      );
+      while( db_step(&q)==SQLITE_ROW ){
+        const char *z = db_column_text(&q, 0);
+        if( z==0 ) continue;
+        nFile++;
+        nLine += grep_buffer(pRe, 0, z, GREP_QUIET);
+      }
+      db_finalize(&q);
+    }
+    nUs = fossil_timer_stop(iTimer);
+    if( nUs<1 ) nUs = 1;
+    fossil_print("%-10s %6d files  %7d lines  %9.3f ms per search\n",
+                 useIndex ? "indexed:" : "full scan:", nFile, nLine,
+                 nUs/(1000.0*nRepeat));
+  }
+  re_free(pRe);
+}
@@ -35,6 +35,7 @@
 #include "config.h"
 #include "search.h"
 #include <assert.h>
+#include <time.h>
 
 #if INTERFACE
 
@@ -512,6 +513,56 @@ static void search_body_sqlfunc(
   sqlite3_result_text(context, z+nHdr+1, -1, SQLITE_TRANSIENT);
 }
 
+/*
+** Files larger than this many bytes are left out of the file content
+** index, as are binary files.
+*/
+#define SEARCH_FILE_MAXSIZE 1048576
+
+/*
+** Return the text of file artifact rid as it appears in the file content
+** index.  That is the content of the file, or an empty string for binary
+** files, very large files, and files whose content is not available.
+** Write the number of bytes of text into *pnText.
+**
+** The returned pointer is valid until the next call to this routine.
+*/
+static const char *search_file_text_cached(int rid, int *pnText){
+  static Blob text = BLOB_INITIALIZER;
+  static int ridCached = 0;
+  if( rid!=ridCached ){
+    blob_reset(&text);
+    ridCached = rid;
+    if( db_int(-1, "SELECT size FROM blob WHERE rid=%d", rid)
+                                                   <= SEARCH_FILE_MAXSIZE ){
+      if( !content_get(rid, &text) ){
+        /* Content not available, perhaps not yet.  Do not remember
+        ** the empty text as the text of rid. */
+        ridCached = 0;
+      }else if( looks_like_binary(&text) ){
+        blob_reset(&text);
+      }
+    }
+  }
+  *pnText = blob_size(&text);
+  return blob_str(&text);
+}
+
+/*     filetext(RID)
+**
+** Return the text of file artifact RID as it is found in the file
+** content index.
+*/
+static void search_filetext_sqlfunc(
+  sqlite3_context *context,
+  int argc,
+  sqlite3_value **argv
+){
+  int n;
+  const char *z = search_file_text_cached(sqlite3_value_int(argv[0]), &n);
+  sqlite3_result_text(context, z, n, SQLITE_TRANSIENT);
+}
+
 /*      urlencode(X)
 **
 ** Encode a string for use as a query parameter in a URL.  This is
@@ -526,13 +577,19 @@ static void search_urlencode_sqlfunc(
   sqlite3_result_text(context, z, -1, fossil_free);
 }
 
+/*
+** True after search_sql_setup() has registered its SQL functions.  This
+** is reset by search_reset(), as the repository might be reopened by
+** the time of the next web page.
+*/
+static int searchSqlDone = 0;
+
 /*
 ** Register the various SQL functions (defined above) needed to implement
 ** full-scan search.
 */
 void search_sql_setup(sqlite3 *db){
-  static int once = 0;
-  if( once++ ) return;
+  if( searchSqlDone++ ) return;
   sqlite3_create_function(db, "search_match", -1, SQLITE_UTF8, 0,
      search_match_sqlfunc, 0, 0);
   sqlite3_create_function(db, "search_score", 0, SQLITE_UTF8, 0,
@@ -549,6 +606,34 @@ void search_sql_setup(sqlite3 *db){
      search_body_sqlfunc, 0, 0);
   sqlite3_create_function(db, "urlencode", 1, SQLITE_UTF8, 0,
      search_urlencode_sqlfunc, 0, 0);
+  sqlite3_create_function(db, "filetext", 1, SQLITE_UTF8, 0,
+     search_filetext_sqlfunc, 0, 0);
+}
+
+/*
+** Implementation of "fossil search --files".  Bring the file content
+** index up to date, then show at most mxLine lines that match zPattern.
+*/
+static void search_file_cmd(const char *zPattern, int mxLine){
+  Stmt q;
+  if( !search_file_index_exists() ){
+    fossil_fatal("the file content index is off."
+                 "  Use \"fossil fts-config enable s\" to turn it on.");
+  }
+  search_update_index(SRCH_FILE);
+  search_file_content(zPattern, mxLine);
+  db_prepare(&q,
+    "SELECT filehit.fname, filehit.ln, blob.uuid, filehit.txt"
+    "  FROM filehit, blob, event"
+    " WHERE blob.rid=filehit.ckid AND event.objid=filehit.ckid"
+    " ORDER BY event.mtime DESC, filehit.fname, filehit.ln"
+  );
+  while( db_step(&q)==SQLITE_ROW ){
+    fossil_print("%s:%d: [%S] %s\n",
+       db_column_text(&q, 0), db_column_int(&q, 1),
+       db_column_text(&q, 2), db_column_text(&q, 3));
+  }
+  db_finalize(&q);
 }
 
 /*
@@ -557,11 +642,18 @@ void search_sql_setup(sqlite3 *db){
 ** COMMAND: search*
 **
 ** Usage: %fossil search [-all|-a] [-limit|-n #] [-width|-W #] pattern...
+**    or: %fossil search --files [-limit|-n #] pattern...
 **
 ** Search for timeline entries matching all words provided on the
 ** command line. Whole-word matches scope more highly than partial
 ** matches.
 **
+** With the --files option, search the content of every version of every
+** file instead, using the file content index.  Each matching line is
+** shown together with the filename, the line number and the check-in
+** that added that version of the file.  The file content index must be
+** turned on first using "fossil fts-config enable s".
+**
 ** Outputs, by default, some top-N fraction of the results. The -all
 ** option can be used to output all matches, regardless of their search
 ** score.  The -limit option can be used to limit the number of entries
@@ -571,6 +663,7 @@ void search_sql_setup(sqlite3 *db){
 ** Options:
 **
 **     -a|--all          Output all matches, not just best matches.
+**     --files           Search the content of files.
 **     -n|--limit N      Limit output to N matches.
 **     -W|--width WIDTH  Set display width to WIDTH columns, 0 for
 **                       unlimited. Defaults the terminal's width.
@@ -588,6 +681,7 @@ void search_cmd(void){
   const char *zWidth = find_option("width","W",1);
   int nLimit = zLimit ? atoi(zLimit) : -1000;   /* Max number of matching
                                                    lines/entries to list */
+  int fFiles = find_option("files",0,0)!=0;
   int width;
   if( zWidth ){
     width = atoi(zWidth);
@@ -604,6 +698,11 @@ void search_cmd(void){
   for(i=3; i<g.argc; i++){
     blob_appendf(&pattern, " %s", g.argv[i]);
   }
+  if( fFiles ){
+    search_file_cmd(blob_str(&pattern), nLimit>0 ? nLimit : 0);
+    blob_reset(&pattern);
+    return;
+  }
   (void)search_init(blob_str(&pattern),"*","*","...",SRCHFLG_STATIC);
   blob_reset(&pattern);
   search_sql_setup(g.db);
@@ -642,15 +741,32 @@ void search_cmd(void){
 #define SRCH_TECHNOTE 0x0010    /* Search over tech notes */
 #define SRCH_FORUM    0x0020    /* Search over forum messages */
 #define SRCH_ALL      0x003f    /* Search over everything */
+#define SRCH_FILE     0x0040    /* Search over file content.  Not in SRCH_ALL */
 #endif
 
+/*
+** Search types that the server configuration is known to allow or to
+** disallow, as found by search_restrict().
+*/
+static unsigned int knownGood = 0;
+static unsigned int knownBad = 0;
+
+/*
+** Forget what has been learned about the server configuration and the
+** database connection, so that the same process can go on to generate
+** another web page.
+*/
+void search_reset(void){
+  searchSqlDone = 0;
+  knownGood = 0;
+  knownBad = 0;
+}
+
 /*
 ** Remove bits from srchFlags which are disallowed by either the
 ** current server configuration or by user permissions.
 */
 unsigned int search_restrict(unsigned int srchFlags){
-  static unsigned int knownGood = 0;
-  static unsigned int knownBad = 0;
   static const struct { unsigned m; const char *zKey; } aSetng[] = {
      { SRCH_CKIN,     "search-ci"   },
      { SRCH_DOC,      "search-doc"  },
@@ -658,9 +774,12 @@ unsigned int search_restrict(unsigned int srchFlags){
      { SRCH_WIKI,     "search-wiki" },
      { SRCH_TECHNOTE, "search-technote" },
      { SRCH_FORUM,    "search-forum" },
+     { SRCH_FILE,     "search-file" },
   };
   int i;
-  if( g.perm.Read==0 )   srchFlags &= ~(SRCH_CKIN|SRCH_DOC|SRCH_TECHNOTE);
+  if( g.perm.Read==0 ){
+    srchFlags &= ~(SRCH_CKIN|SRCH_DOC|SRCH_TECHNOTE|SRCH_FILE);
+  }
   if( g.perm.RdTkt==0 )  srchFlags &= ~(SRCH_TKT);
   if( g.perm.RdWiki==0 ) srchFlags &= ~(SRCH_WIKI);
   if( g.perm.RdForum==0) srchFlags &= ~(SRCH_FORUM);
@@ -948,6 +1067,83 @@ static void search_indexed(
 #endif
 }
 
+/*
+** Search the content of every version of every file for zPattern using
+** the file content index.  zPattern is an FTS4 query, as for indexed
+** search.  The matches are written into the TEMP table FILEHIT, with
+** one row for each matching line and for each check-in that added that
+** version of the file under a given name:
+**
+**    fname:   Name of the file
+**    ckid:    RID of the check-in
+**    fid:     RID of the file content
+**    ln:      Line number of the match, starting with 1
+**    txt:     Text of the matching line
+**
+** Stop after mxLine matching lines, or find all matches if mxLine<=0.
+** Return the number of matching lines found.
+*/
+int search_file_content(const char *zPattern, int mxLine){
+  Stmt q, ins;
+  int nLine = 0;
+  db_multi_exec(
+    "CREATE TEMP TABLE IF NOT EXISTS filehit("
+    "  fname TEXT, ckid INTEGER, fid INTEGER, ln INTEGER, txt TEXT);"
+    "DELETE FROM filehit;"
+  );
+  if( !search_file_index_exists() ) return 0;
+  search_sql_setup(g.db);
+  db_prepare(&q,
+    "SELECT docid, offsets(ftsfidx) FROM ftsfidx WHERE ftsfidx MATCH %Q",
+    zPattern
+  );
+  db_prepare(&ins,
+    "INSERT INTO filehit(fname,ckid,fid,ln,txt)"
+    "  SELECT DISTINCT filename.name, mlink.mid, mlink.fid, :ln, :txt"
+    "    FROM mlink, filename"
+    "   WHERE mlink.fid=:fid AND filename.fnid=mlink.fnid"
+  );
+  while( (mxLine<=0 || nLine<mxLine) && db_step(&q)==SQLITE_ROW ){
+    int fid = db_column_int(&q, 0);
+    const char *zOff = db_column_text(&q, 1);
+    int n, iPos = 0, iLn = 1, iLastLn = 0;
+    const char *z = search_file_text_cached(fid, &n);
+
+    /* The offsets() value is a list of integers in groups of four.  The
+    ** third integer in each group is the byte offset of a matching term.
+    ** The groups are in order of increasing offset. */
+    while( zOff && zOff[0] && (mxLine<=0 || nLine<mxLine) ){
+      int aVal[4], i, iStart, iEnd;
+      Blob line;
+      for(i=0; i<4 && zOff[0]; i++){
+        aVal[i] = atoi(zOff);
+        while( fossil_isdigit(zOff[0]) ) zOff++;
+        while( zOff[0]==' ' ) zOff++;
+      }
+      if( i<4 || aVal[2]>=n ) break;
+      if( aVal[2]<iPos ){ iPos = 0; iLn = 1; }
+      for(; iPos<aVal[2]; iPos++){
+        if( z[iPos]=='\n' ) iLn++;
+      }
+      if( iLn==iLastLn ) continue;
+      iLastLn = iLn;
+      for(iStart=iPos; iStart>0 && z[iStart-1]!='\n'; iStart--){}
+      for(iEnd=iPos; iEnd<n && z[iEnd]!='\n'; iEnd++){}
+      if( iEnd>iStart && z[iEnd-1]=='\r' ) iEnd--;
+      blob_init(&line, iEnd>iStart ? &z[iStart] : "", iEnd-iStart);
+      db_bind_int(&ins, ":fid", fid);
+      db_bind_int(&ins, ":ln", iLn);
+      db_bind_str(&ins, ":txt", &line);
+      db_step(&ins);
+      db_reset(&ins);
+      nLine++;
+    }
+  }
+  db_finalize(&ins);
+  db_finalize(&q);
+  return nLine;
+}
+
 /*
 ** If z[] is of the form "<mark>TEXT</mark>" where TEXT contains
 ** no white-space or punctuation, then return the length of the mark.
@@ -998,6 +1194,19 @@ static char *cleanSnippet(const char *zSnip){
 }
 
 
+/*
+** Unindexed documents are added to the full-text index in batches of
+** at most SEARCH_BATCH_SIZE documents.  Each batch is committed on its
+** own, so that a long reindex can be interrupted and resumed later and
+** so that searches can use whatever has been indexed so far.
+**
+** Web pages that search only index a single batch.  The backoffice
+** carries on with more batches for up to SEARCH_BACKOFFICE_TIME seconds
+** per run.
+*/
+#define SEARCH_BATCH_SIZE       100
+#define SEARCH_BACKOFFICE_TIME  10
+
 /*
 ** This routine generates web-page output for a search operation.
 ** Other web-pages can invoke this routine to add search results
@@ -1027,7 +1236,9 @@ int search_run_and_output(
   if( !search_index_exists() ){
     search_fullscan(zPattern, srchFlags);  /* Full-scan search */
   }else{
-    search_update_index(srchFlags);        /* Update the index, if necessary */
+    /* Index one batch of new documents now and leave the rest to the
+    ** backoffice.  Documents not yet indexed are not found. */
+    search_update_index_batch(srchFlags, SEARCH_BATCH_SIZE);
     search_indexed(zPattern, srchFlags);   /* Indexed search */
   }
   db_prepare(&q, "SELECT url, snip, label, score, id"
@@ -1185,6 +1396,19 @@ void search_page(void){
 }
 
 
+/*
+** Append the plain text of the HTML in pHtml to pOut.  Or, if pDefer
+** is not NULL, store a copy of the HTML in pDefer so that the caller
+** can do the conversion later, perhaps on a worker thread.
+*/
+static void stext_append_html(Blob *pHtml, Blob *pOut, Blob *pDefer){
+  if( pDefer ){
+    blob_append(pDefer, blob_buffer(pHtml), blob_size(pHtml));
+  }else{
+    html_to_plaintext(blob_str(pHtml), pOut);
+  }
+}
+
 /*
 ** This is a helper function for search_stext().  Writing into pOut
 ** the search text obtained from pIn according to zMimetype.
@@ -1192,12 +1416,19 @@ void search_page(void){
 ** The title of the document is the first line of text.  All subsequent
 ** lines are the body.  If the document has no title, the first line
 ** is blank.
+**
+** If pDefer is not NULL and the last step of the conversion is to turn
+** HTML into plain text, then that step is skipped.  The HTML is left in
+** pDefer instead and true is returned.  The caller must then append
+** html_to_plaintext(pDefer) to pOut itself.
 */
-static void get_stext_by_mimetype(
+static int get_stext_by_mimetype_deferred(
   Blob *pIn,
   const char *zMimetype,
-  Blob *pOut
+  Blob *pOut,
+  Blob *pDefer
 ){
+  int rc = 0;
   Blob html, title;
   blob_init(&html, 0, 0);
   blob_init(&title, 0, 0);
@@ -1213,7 +1444,8 @@ static void get_stext_by_mimetype(
       blob_append(pOut, "\n", 1);
       wiki_convert(pIn, &html, 0);
     }
-    html_to_plaintext(blob_str(&html), pOut);
+    stext_append_html(&html, pOut, pDefer);
+    rc = 1;
   }else if( fossil_strcmp(zMimetype,"text/x-markdown")==0 ){
     markdown_to_html(pIn, &title, &html);
     if( blob_size(&title) ){
@@ -1221,18 +1453,28 @@ static void get_stext_by_mimetype(
     }else{
       blob_append(pOut, "\n", 1);
     }
-    html_to_plaintext(blob_str(&html), pOut);
+    stext_append_html(&html, pOut, pDefer);
+    rc = 1;
   }else if( fossil_strcmp(zMimetype,"text/html")==0 ){
     if( doc_is_embedded_html(pIn, &title) ){
       blob_appendf(pOut, "%s\n", blob_str(&title));
     }
-    html_to_plaintext(blob_str(pIn), pOut);
+    stext_append_html(pIn, pOut, pDefer);
+    rc = 1;
   }else{
     blob_append(pOut, "\n", 1);
     blob_append(pOut, blob_buffer(pIn), blob_size(pIn));
   }
   blob_reset(&html);
   blob_reset(&title);
+  return rc && pDefer!=0;
+}
+static void get_stext_by_mimetype(
+  Blob *pIn,
+  const char *zMimetype,
+  Blob *pOut
+){
+  get_stext_by_mimetype_deferred(pIn, zMimetype, pOut, 0);
 }
 
 /*
@@ -1274,37 +1516,29 @@ static void append_all_ticket_fields(Blob *pAccum, Stmt *pQuery, int iTitle){
 
 
 /*
-** Return "search text" - a reduced version of a document appropriate for
-** full text search and/or for constructing a search result snippet.
-**
-**    cType:            d      Embedded documentation
-**                      w      Wiki page
-**                      c      Check-in comment
-**                      t      Ticket text
-**                      e      Tech note
-**                      f      Forum
-**
-**    rid               The RID of an artifact that defines the object
-**                      being searched.
-**
-**    zName             Name of the object being searched.  This is used
-**                      only to help figure out the mimetype (text/plain,
-**                      test/html, test/x-fossil-wiki, or text/x-markdown)
-**                      so that the code can know how to simplify the text.
+** Compute the search text for a document the same as search_stext()
+** below, except that if the search text ends with the plain-text
+** rendering of some HTML, then the HTML is written into pDefer and true
+** is returned.  The caller must finish the search text by appending
+** html_to_plaintext(pDefer) to pOut.  That final step does not use the
+** database, so it can be run on a worker thread.
 */
-void search_stext(
+static int search_stext_deferred(
   char cType,            /* Type of document */
   int rid,               /* BLOB.RID or TAG.TAGID value for document */
   const char *zName,     /* Auxiliary information */
-  Blob *pOut             /* OUT: Initialize to the search text */
+  Blob *pOut,            /* OUT: Initialize to the search text */
+  Blob *pDefer           /* OUT: HTML still to be converted */
 ){
+  int rc = 0;
   blob_init(pOut, 0, 0);
   switch( cType ){
     case 'd': {   /* Documents */
       Blob doc;
       content_get(rid, &doc);
       blob_to_utf8_no_bom(&doc, 0);
-      get_stext_by_mimetype(&doc, mimetype_from_name(zName), pOut);
+      rc = get_stext_by_mimetype_deferred(&doc, mimetype_from_name(zName),
+                                          pOut, pDefer);
       blob_reset(&doc);
       break;
     }
@@ -1325,8 +1559,8 @@ void search_stext(
       }else{
         blob_init(&wiki, pWiki->zWiki, -1);
       }
-      get_stext_by_mimetype(&wiki, wiki_filter_mimetypes(pWiki->zMimetype),
-                            pOut);
+      rc = get_stext_by_mimetype_deferred(&wiki,
+                  wiki_filter_mimetypes(pWiki->zMimetype), pOut, pDefer);
       blob_reset(&wiki);
       manifest_destroy(pWiki);
       break;
@@ -1356,7 +1590,8 @@ void search_stext(
           Blob x;
           blob_init(&x,0,0);
           db_column_blob(&q, 0, &x);
-          get_stext_by_mimetype(&x, "text/x-fossil-wiki", pOut);
+          rc = get_stext_by_mimetype_deferred(&x, "text/x-fossil-wiki",
+                                              pOut, pDefer);
           blob_reset(&x);
         }
       }
@@ -1391,6 +1626,40 @@ void search_stext(
       break;
     }
   }
+  return rc;
+}
+
+/*
+** Return "search text" - a reduced version of a document appropriate for
+** full text search and/or for constructing a search result snippet.
+**
+**    cType:            d      Embedded documentation
+**                      w      Wiki page
+**                      c      Check-in comment
+**                      t      Ticket text
+**                      e      Tech note
+**                      f      Forum
+**
+**    rid               The RID of an artifact that defines the object
+**                      being searched.
+**
+**    zName             Name of the object being searched.  This is used
+**                      only to help figure out the mimetype (text/plain,
+**                      test/html, test/x-fossil-wiki, or text/x-markdown)
+**                      so that the code can know how to simplify the text.
+*/
+void search_stext(
+  char cType,            /* Type of document */
+  int rid,               /* BLOB.RID or TAG.TAGID value for document */
+  const char *zName,     /* Auxiliary information */
+  Blob *pOut             /* OUT: Initialize to the search text */
+){
+  Blob html;
+  blob_init(&html, 0, 0);
+  if( search_stext_deferred(cType, rid, zName, pOut, &html) ){
+    html_to_plaintext(blob_str(&html), pOut);
+  }
+  blob_reset(&html);
 }
 
 /*
@@ -1504,20 +1773,61 @@ static const char zFtsDrop[] =
 @ DROP TABLE IF EXISTS repository.ftsdocs;
 ;
 
+/* The schema for the file content index.  This is only created if the
+** "search-file" setting is on.  The content of each file artifact is
+** indexed once, no matter how many check-ins or filenames use it.  The
+** MLINK table maps each artifact back to its check-ins and filenames.
+*/
+static const char zFtsFileSchema[] =
+@ -- One entry for each file artifact whose content is searchable
+@ CREATE TABLE IF NOT EXISTS repository.ftsfile(
+@   rowid INTEGER PRIMARY KEY, -- BLOB.RID.  Maps to the ftsfidx.docid
+@   idxed BOOLEAN              -- True if currently in the index
+@ );
+@ CREATE INDEX IF NOT EXISTS repository.ftsfileIdxed
+@   ON ftsfile(idxed) WHERE idxed==0;
+@ CREATE VIEW IF NOT EXISTS repository.ftsfilecontent AS
+@   SELECT rowid, filetext(rowid) AS 'body' FROM ftsfile;
+@ CREATE VIRTUAL TABLE IF NOT EXISTS repository.ftsfidx
+@   USING fts4(content="ftsfilecontent", body%s);
+;
+static const char zFtsFileDrop[] =
+@ DROP TABLE IF EXISTS repository.ftsfidx;
+@ DROP VIEW IF EXISTS repository.ftsfilecontent;
+@ DROP TABLE IF EXISTS repository.ftsfile;
+;
+
 /*
-** Create or drop the tables associated with a full-text index.
+** Create or drop the tables associated with a full-text index.  The
+** file content index is created along with the rest of the full-text
+** index if the "search-file" setting is on.  It can also be created
+** or dropped on its own.
 */
 static int searchIdxExists = -1;
+static int searchFileIdxExists = -1;
+void search_create_file_index(void){
+  int useStemmer = db_get_boolean("search-stemmer",0);
+  const char *zExtra = useStemmer ? ",tokenize=porter" : "";
+  search_sql_setup(g.db);
+  db_multi_exec(zFtsFileSchema/*works-like:"%s"*/, zExtra/*safe-for-%s*/);
+  searchFileIdxExists = 1;
+}
+void search_drop_file_index(void){
+  db_multi_exec(zFtsFileDrop/*works-like:""*/);
+  searchFileIdxExists = 0;
+}
 void search_create_index(void){
   int useStemmer = db_get_boolean("search-stemmer",0);
   const char *zExtra = useStemmer ? ",tokenize=porter" : "";
   search_sql_setup(g.db);
   db_multi_exec(zFtsSchema/*works-like:"%s"*/, zExtra/*safe-for-%s*/);
   searchIdxExists = 1;
+  if( db_get_boolean("search-file",0) ) search_create_file_index();
 }
 void search_drop_index(void){
   db_multi_exec(zFtsDrop/*works-like:""*/);
   searchIdxExists = 0;
+  search_drop_file_index();
 }
 
 /*
@@ -1530,6 +1840,16 @@ int search_index_exists(void){
   return searchIdxExists;
 }
 
+/*
+** Return true if the file content index exists
+*/
+int search_file_index_exists(void){
+  if( searchFileIdxExists<0 ){
+    searchFileIdxExists = db_table_exists("repository","ftsfile");
+  }
+  return searchFileIdxExists;
+}
+
 /*
 ** Fill the FTSDOCS table with unindexed entries for everything
 ** in the repository.  This uses INSERT OR IGNORE so entries already
@@ -1561,6 +1881,44 @@ void search_fill_index(void){
     "INSERT OR IGNORE INTO ftsdocs(type,rid,name,idxed)"
     "  SELECT type, objid, comment, 0 FROM event WHERE type IN ('e','f');"
   );
+  if( search_file_index_exists() ){
+    db_multi_exec(
+      "INSERT OR IGNORE INTO ftsfile(rowid,idxed)"
+      "  SELECT DISTINCT fid, 0 FROM mlink WHERE fid>0;"
+    );
+  }
+}
+
+/*
+** The artifacts whose RIDs are listed in TEMP table zTab are about to
+** be purged.  Remove any of them that are file artifacts from the file
+** content index while their content is still available.
+*/
+void search_file_unindex(const char *zTab){
+  if( search_file_index_exists() ){
+    search_sql_setup(g.db);
+    db_multi_exec(
+      "DELETE FROM ftsfidx WHERE docid IN"
+      "  (SELECT rowid FROM ftsfile WHERE idxed AND rowid IN \"%w\");"
+      "DELETE FROM ftsfile WHERE rowid IN \"%w\";",
+      zTab, zTab
+    );
+  }
+}
+
+/*
+** The file changes of check-in mid have just been added to MLINK.  Queue
+** any file artifacts that they introduce to be added to the file content
+** index.  Artifacts that are already in the index are not indexed again.
+*/
+void search_file_touch(int mid){
+  if( search_file_index_exists() ){
+    db_multi_exec(
+      "INSERT OR IGNORE INTO ftsfile(rowid,idxed)"
+      "  SELECT fid, 0 FROM mlink WHERE mid=%d AND fid>0",
+      mid
+    );
+  }
 }
 
 /*
@@ -1618,7 +1976,9 @@ static void search_update_doc_index(void){
   ** required. */
   rTime = db_double(0.0, "SELECT mtime FROM event WHERE objid=%d", ckid);
   db_multi_exec(
-    "CREATE TEMP TABLE current_docs(rid INTEGER PRIMARY KEY, name);"
+    "CREATE TEMP TABLE IF NOT EXISTS current_docs(rid INTEGER PRIMARY KEY,"
+    "                                             name);"
+    "DELETE FROM current_docs;"
     "CREATE VIRTUAL TABLE IF NOT EXISTS temp.foci USING files_of_checkin;"
     "INSERT OR IGNORE INTO current_docs(rid, name)"
     "  SELECT blob.rid, foci.filename FROM foci, blob"
@@ -1656,17 +2016,127 @@ static void search_update_doc_index(void){
     "  label='Document: '||label"
     " WHERE type='d' AND NOT idxed"
   );
+
+  /* Index the doc-branch check-in as part of the current batch, so
+  ** that the work above is not repeated for the next batch. */
+  db_multi_exec(
+    "INSERT OR IGNORE INTO ftsbatch(id,type)"
+    "  SELECT rowid, 'c' FROM ftsdocs WHERE type='c' AND rid=%d", ckid
+  );
 }
 
 /*
-** Deal with all of the unindexed 'c' terms in FTSDOCS
+** SETTING: search-threads width=5 default=0
+** The number of threads used to convert documents into plain text
+** while the full-text search index is being built or brought up to
+** date.  A value of 0 means to use one thread per CPU, up to a maximum
+** of 8.  A value of 1 disables threading.
 */
-static void search_update_checkin_index(void){
-  db_multi_exec(
-    "INSERT INTO ftsidx(docid,title,body)"
-    " SELECT rowid, '', body('c',rid,NULL) FROM ftsdocs"
-    "  WHERE type='c' AND NOT idxed;"
+
+/*
+** The search text for one document in the current batch.
+*/
+typedef struct SearchText SearchText;
+struct SearchText {
+  int id;              /* FTSDOCS.ROWID of the document */
+  char cType;          /* Type of document */
+  int rid;             /* FTSDOCS.RID of the document */
+  char *zName;         /* FTSDOCS.NAME of the document */
+  int isDeferred;      /* True if html has yet to be added to text */
+  Blob text;           /* The search text */
+  Blob html;           /* HTML whose plain text goes at the end of text */
+};
+
+/*
+** Worker thread job:  Finish the search text for a single document.
+*/
+static void search_text_finish(void *pArg){
+  SearchText *p = (SearchText*)pArg;
+  if( p->isDeferred ){
+    html_to_plaintext(blob_str(&p->html), &p->text);
+  }
+}
+
+/*
+** Split the finished search text for a single document into a title,
+** which is the first line, and a body, which is everything else.  Store
+** both in the FTSBATCH table and then free the document.
+*/
+static void search_text_store(SearchText *p){
+  static Stmt q;
+  char *z = blob_str(&p->text);
+  char *zBody;
+  int i;
+  for(i=0; z[i] && z[i]!='\n'; i++){}
+  zBody = z[i] ? &z[i+1] : &z[i];
+  z[i] = 0;
+  db_static_prepare(&q,
+     "UPDATE ftsbatch SET title=:title, body=:body WHERE id=:id");
+  db_bind_text(&q, ":title", z);
+  db_bind_text(&q, ":body", zBody);
+  db_bind_int(&q, ":id", p->id);
+  db_step(&q);
+  db_reset(&q);
+  blob_reset(&p->text);
+  blob_reset(&p->html);
+  fossil_free(p->zName);
+}
+
+/*
+** Compute the search text for every document in the FTSBATCH table.
+** The documents are read from the repository and rendered into HTML
+** here, since that needs the database, and the HTML is converted into
+** plain text on worker threads.
+*/
+static void search_fill_batch(int nDoc){
+  SearchText *aText = fossil_malloc( sizeof(aText[0])*nDoc );
+  SearchText *p;
+  WorkQueue *pQueue;
+  Stmt q;
+  int nThread;
+  int i;
+
+  db_prepare(&q,
+    "SELECT ftsbatch.id, ftsbatch.type, ftsdocs.rid, ftsdocs.name"
+    "  FROM ftsbatch, ftsdocs"
+    " WHERE ftsdocs.rowid=ftsbatch.id"
+    " ORDER BY ftsbatch.id"
   );
+  for(i=0; i<nDoc && db_step(&q)==SQLITE_ROW; i++){
+    p = &aText[i];
+    p->id = db_column_int(&q, 0);
+    p->cType = db_column_text(&q, 1)[0];
+    p->rid = db_column_int(&q, 2);
+    p->zName = fossil_strdup(db_column_text(&q, 3));
+  }
+  db_finalize(&q);
+  nDoc = i;
+
+  nThread = db_get_int("search-threads", 0);
+  if( nThread<=0 ) nThread = workqueue_default_nthread(8);
+  if( nDoc<16 ) nThread = 1;
+  pQueue = workqueue_new(nThread, nThread*4, search_text_finish);
+  for(i=0; i<nDoc; i++){
+    p = &aText[i];
+    blob_init(&p->html, 0, 0);
+    p->isDeferred = search_stext_deferred(p->cType, p->rid, p->zName,
+                                          &p->text, &p->html);
+    if( workqueue_full(pQueue) ){
+      search_text_store(workqueue_pop(pQueue));
+    }
+    workqueue_push(pQueue, p);
+  }
+  while( (p = workqueue_pop(pQueue))!=0 ){
+    search_text_store(p);
+  }
+  workqueue_free(pQueue, 0);
+  fossil_free(aText);
+}
+
+/*
+** Finish the 'c' entries of the current batch
+*/
+static void search_update_checkin_index(void){
   db_multi_exec(
     "UPDATE ftsdocs SET idxed=1, name=NULL,"
     " (label,url,mtime) = "
@@ -1677,43 +2147,32 @@ static void search_update_checkin_index(void){
     "     FROM event, blob"
     "    WHERE event.objid=ftsdocs.rid"
     "      AND blob.rid=ftsdocs.rid)"
-    "WHERE ftsdocs.type='c' AND NOT ftsdocs.idxed"
+    "WHERE ftsdocs.rowid IN (SELECT id FROM ftsbatch WHERE type='c')"
   );
 }
 
 /*
-** Deal with all of the unindexed 't' terms in FTSDOCS
+** Finish the 't' entries of the current batch
 */
 static void search_update_ticket_index(void){
-  db_multi_exec(
-    "INSERT INTO ftsidx(docid,title,body)"
-    " SELECT rowid, title('t',rid,NULL), body('t',rid,NULL) FROM ftsdocs"
-    "  WHERE type='t' AND NOT idxed;"
-  );
-  if( db_changes()==0 ) return;
   db_multi_exec(
     "UPDATE ftsdocs SET idxed=1, name=NULL,"
     "  (label,url,mtime) ="
-    "  (SELECT printf('Ticket: %%s (%%s)',title('t',tkt_id,null),"
+    "  (SELECT printf('Ticket: %%s (%%s)',"
+    "                 (SELECT title FROM ftsbatch WHERE id=ftsdocs.rowid),"
     "                 datetime(tkt_mtime)),"
     "          printf('/tktview/%%.20s',tkt_uuid),"
     "          tkt_mtime"
     "     FROM ticket"
     "    WHERE tkt_id=ftsdocs.rid)"
-    "WHERE ftsdocs.type='t' AND NOT ftsdocs.idxed"
+    "WHERE ftsdocs.rowid IN (SELECT id FROM ftsbatch WHERE type='t')"
   );
 }
 
 /*
-** Deal with all of the unindexed 'w' terms in FTSDOCS
+** Finish the 'w' entries of the current batch
 */
 static void search_update_wiki_index(void){
-  db_multi_exec(
-    "INSERT INTO ftsidx(docid,title,body)"
-    " SELECT rowid, title('w',rid,NULL),body('w',rid,NULL) FROM ftsdocs"
-    "  WHERE type='w' AND NOT idxed;"
-  );
-  if( db_changes()==0 ) return;
   db_multi_exec(
     "UPDATE ftsdocs SET idxed=1,"
     "  (name,label,url,mtime) = "
@@ -1722,20 +2181,14 @@ static void search_update_wiki_index(void){
     "            '/wiki?name='||urlencode(ftsdocs.name),"
     "            tagxref.mtime"
     "       FROM tagxref WHERE tagxref.rid=ftsdocs.rid)"
-    " WHERE ftsdocs.type='w' AND NOT ftsdocs.idxed"
+    " WHERE ftsdocs.rowid IN (SELECT id FROM ftsbatch WHERE type='w')"
   );
 }
 
 /*
-** Deal with all of the unindexed 'f' terms in FTSDOCS
+** Finish the 'f' entries of the current batch
 */
 static void search_update_forum_index(void){
-  db_multi_exec(
-    "INSERT INTO ftsidx(docid,title,body)"
-    " SELECT rowid, title('f',rid,NULL),body('f',rid,NULL) FROM ftsdocs"
-    "  WHERE type='f' AND NOT idxed;"
-  );
-  if( db_changes()==0 ) return;
   db_multi_exec(
     "UPDATE ftsdocs SET idxed=1, name=NULL,"
     " (label,url,mtime) = "
@@ -1745,20 +2198,14 @@ static void search_update_forum_index(void){
     "     FROM event, blob"
     "    WHERE event.objid=ftsdocs.rid"
     "      AND blob.rid=ftsdocs.rid)"
-    "WHERE ftsdocs.type='f' AND NOT ftsdocs.idxed"
+    "WHERE ftsdocs.rowid IN (SELECT id FROM ftsbatch WHERE type='f')"
   );
 }
 
 /*
-** Deal with all of the unindexed 'e' terms in FTSDOCS
+** Finish the 'e' entries of the current batch
 */
 static void search_update_technote_index(void){
-  db_multi_exec(
-    "INSERT INTO ftsidx(docid,title,body)"
-    " SELECT rowid, title('e',rid,NULL),body('e',rid,NULL) FROM ftsdocs"
-    "  WHERE type='e' AND NOT idxed;"
-  );
-  if( db_changes()==0 ) return;
   db_multi_exec(
     "UPDATE ftsdocs SET idxed=1,"
     "  (name,label,url,mtime) = "
@@ -1769,35 +2216,175 @@ static void search_update_technote_index(void){
     "       FROM tagxref, tag USING (tagid)"
     "      WHERE tagxref.rid=ftsdocs.rid"
     "        AND tagname GLOB 'event-*')"
-    " WHERE ftsdocs.type='e' AND NOT ftsdocs.idxed"
+    " WHERE ftsdocs.rowid IN (SELECT id FROM ftsbatch WHERE type='e')"
   );
 }
 
 /*
-** Deal with all of the unindexed entries in the FTSDOCS table - that
-** is to say, all the entries with FTSDOCS.IDXED=0.  Add them to the
-** index.
+** Add at most nLimit unindexed entries from FTSDOCS, of the kinds
+** selected by srchFlags, to the index.  Return the number added.
 */
-void search_update_index(unsigned int srchFlags){
-  if( !search_index_exists() ) return;
-  if( !db_exists("SELECT 1 FROM ftsdocs WHERE NOT idxed") ) return;
-  search_sql_setup(g.db);
-  if( srchFlags & (SRCH_CKIN|SRCH_DOC) ){
+static int search_update_docs_batch(unsigned int srchFlags, int nLimit){
+  char zTypes[8];
+  int n = 0;
+  int nDoc;
+  if( srchFlags & (SRCH_CKIN|SRCH_DOC) ) zTypes[n++] = 'c';
+  if( srchFlags & SRCH_TKT ) zTypes[n++] = 't';
+  if( srchFlags & SRCH_WIKI ) zTypes[n++] = 'w';
+  if( srchFlags & SRCH_TECHNOTE ) zTypes[n++] = 'e';
+  if( srchFlags & SRCH_FORUM ) zTypes[n++] = 'f';
+  zTypes[n] = 0;
+  if( n==0 ) return 0;
+  if( !db_exists("SELECT 1 FROM ftsdocs WHERE NOT idxed") ) return 0;
+  db_multi_exec(
+    "CREATE TEMP TABLE IF NOT EXISTS ftsbatch("
+    "  id INTEGER PRIMARY KEY,"     /* FTSDOCS.ROWID */
+    "  type CHAR(1),"               /* FTSDOCS.TYPE */
+    "  title TEXT,"                 /* Title of the document */
+    "  body TEXT"                   /* Body of the document */
+    ");"
+    "DELETE FROM ftsbatch;"
+  );
+  if( zTypes[0]=='c' ){
     search_update_doc_index();
-    search_update_checkin_index();
   }
-  if( srchFlags & SRCH_TKT ){
+  db_multi_exec(
+    "INSERT OR IGNORE INTO ftsbatch(id,type)"
+    "  SELECT rowid, type FROM ftsdocs"
+    "   WHERE NOT idxed AND instr(%Q,type)>0"
+    "   LIMIT %d",
+    zTypes, nLimit
+  );
+  nDoc = db_int(0, "SELECT count(*) FROM ftsbatch");
+  if( nDoc>0 ){
+    search_fill_batch(nDoc);
+    db_multi_exec(
+      "INSERT INTO ftsidx(docid,title,body)"
+      "  SELECT id, title, body FROM ftsbatch ORDER BY id"
+    );
+    search_update_checkin_index();
     search_update_ticket_index();
-  }
-  if( srchFlags & SRCH_WIKI ){
     search_update_wiki_index();
-  }
-  if( srchFlags & SRCH_TECHNOTE ){
     search_update_technote_index();
-  }
-  if( srchFlags & SRCH_FORUM ){
     search_update_forum_index();
+    db_multi_exec("DELETE FROM ftsbatch");
   }
+  return nDoc;
+}
+
+/*
+** Add at most nLimit unindexed file artifacts from FTSFILE to the file
+** content index.  Return the number added.
+**
+** Phantoms are skipped.  They are picked up by a later batch once their
+** content arrives.
+*/
+static int search_update_file_batch(int nLimit){
+  Stmt q;
+  int *aRid;
+  int nRid = 0;
+  int i;
+  if( !search_file_index_exists() ) return 0;
+  aRid = fossil_malloc( sizeof(aRid[0])*nLimit );
+  db_prepare(&q,
+    "SELECT ftsfile.rowid FROM ftsfile, blob"
+    " WHERE ftsfile.idxed==0"
+    "   AND blob.rid=ftsfile.rowid AND blob.size>=0"
+    " LIMIT %d", nLimit
+  );
+  while( nRid<nLimit && db_step(&q)==SQLITE_ROW ){
+    aRid[nRid++] = db_column_int(&q, 0);
+  }
+  db_finalize(&q);
+  db_prepare(&q, "INSERT INTO ftsfidx(docid,body) VALUES(:rid,:body)");
+  for(i=0; i<nRid; i++){
+    int n;
+    const char *z = search_file_text_cached(aRid[i], &n);
+    db_bind_int(&q, ":rid", aRid[i]);
+    db_bind_text(&q, ":body", z);
+    db_step(&q);
+    db_reset(&q);
+    db_multi_exec("UPDATE ftsfile SET idxed=1 WHERE rowid=%d", aRid[i]);
+  }
+  db_finalize(&q);
+  fossil_free(aRid);
+  return nRid;
+}
+
+/*
+** Add a single batch of at most nLimit unindexed documents, of the kinds
+** selected by srchFlags, to the full-text index.  If SRCH_FILE is among
+** the srchFlags, then the batch may also include file artifacts for the
+** file content index.  The batch is added in its own transaction.
+**
+** Return the number of documents indexed.  Zero means that there are
+** no unindexed documents left of the kinds selected.
+*/
+int search_update_index_batch(unsigned int srchFlags, int nLimit){
+  int nDoc;
+  if( !search_index_exists() ) return 0;
+  search_sql_setup(g.db);
+  db_begin_transaction();
+  nDoc = search_update_docs_batch(srchFlags, nLimit);
+  if( (srchFlags & SRCH_FILE)!=0 && nDoc<nLimit ){
+    nDoc += search_update_file_batch(nLimit-nDoc);
+  }
+  db_end_transaction(0);
+  return nDoc;
+}
+
+/*
+** Deal with all of the unindexed entries in the FTSDOCS table - that
+** is to say, all the entries with FTSDOCS.IDXED=0.  Add them to the
+** index.
+*/
+void search_update_index(unsigned int srchFlags){
+  while( search_update_index_batch(srchFlags, SEARCH_BATCH_SIZE)>0 ){}
+}
+
+/*
+** Return the number of documents in the full-text index in *pnIdxed
+** and the total number of documents, indexed or not, in *pnTotal.
+*/
+void search_index_progress(int *pnIdxed, int *pnTotal){
+  *pnIdxed = 0;
+  *pnTotal = 0;
+  if( search_index_exists() ){
+    Stmt q;
+    db_prepare(&q, "SELECT count(*), total(idxed) FROM ftsdocs");
+    if( db_step(&q)==SQLITE_ROW ){
+      *pnTotal = db_column_int(&q, 0);
+      *pnIdxed = db_column_int(&q, 1);
+    }
+    db_finalize(&q);
+  }
+}
+
+/*
+** This routine is called by the backoffice.  Keep adding unindexed
+** documents to the full-text index for up to SEARCH_BACKOFFICE_TIME
+** seconds.  Whatever is left over is picked up by the next run.
+*/
+void search_backoffice(void){
+  static const struct { unsigned m; const char *zKey; } aSetng[] = {
+     { SRCH_CKIN,     "search-ci"   },
+     { SRCH_DOC,      "search-doc"  },
+     { SRCH_TKT,      "search-tkt"  },
+     { SRCH_WIKI,     "search-wiki" },
+     { SRCH_TECHNOTE, "search-technote" },
+     { SRCH_FORUM,    "search-forum" },
+     { SRCH_FILE,     "search-file" },
+  };
+  unsigned int srchFlags = 0;
+  time_t tmEnd;
+  int i;
+  if( !search_index_exists() ) return;
+  for(i=0; i<count(aSetng); i++){
+    if( db_get_boolean(aSetng[i].zKey,0) ) srchFlags |= aSetng[i].m;
+  }
+  tmEnd = time(0) + SEARCH_BACKOFFICE_TIME;
+  while( time(0)<tmEnd
+      && search_update_index_batch(srchFlags, SEARCH_BATCH_SIZE)>0 ){}
 }
 
 /*
@@ -1808,7 +2395,7 @@ void search_rebuild_index(void){
   fflush(stdout);
   search_create_index();
   search_fill_index();
-  search_update_index(search_restrict(SRCH_ALL));
+  search_update_index(search_restrict(SRCH_ALL|SRCH_FILE));
   fossil_print(" done\n");
 }
 
@@ -1827,6 +2414,9 @@ void search_rebuild_index(void){
 **
 **     enable cdtwe       Enable various kinds of search. c=Check-ins,
 **                        d=Documents, t=Tickets, w=Wiki, e=Tech Notes.
+**                        s=The content of all versions of all files.
+**                        This is only available with the search index,
+**                        and is used by "fossil search --files".
 **
 **     disable cdtwe      Disable various kinds of search
 **
@@ -1851,6 +2441,7 @@ void fts_config_cmd(void){
      { "search-wiki",     "wiki search:",      "w" },
      { "search-technote", "tech note search:", "e" },
      { "search-forum",    "forum search:",     "f" },
+     { "search-file",     "file search:",      "s" },
   };
   char *zSubCmd = 0;
   int i, j, n;
@@ -1910,6 +2501,18 @@ void fts_config_cmd(void){
     search_rebuild_index();
   }
 
+  /* Add or remove the file content index to match the settings */
+  if( iAction==0 && search_index_exists() ){
+    int useFile = db_get_boolean("search-file",0);
+    if( useFile && !search_file_index_exists() ){
+      search_create_file_index();
+      search_fill_index();
+      search_update_index(SRCH_FILE);
+    }else if( !useFile && search_file_index_exists() ){
+      search_drop_file_index();
+    }
+  }
+
   /* Always show the status before ending */
   for(i=0; i<count(aSetng); i++){
     fossil_print("%-17s %s\n", aSetng[i].zName,
@@ -1918,9 +2521,18 @@ void fts_config_cmd(void){
   fossil_print("%-17s %s\n", "Porter stemmer:",
        db_get_boolean("search-stemmer",0) ? "on" : "off");
   if( search_index_exists() ){
+    int nIdxed, nTotal;
     fossil_print("%-17s enabled\n", "full-text index:");
-    fossil_print("%-17s %d\n", "documents:",
-       db_int(0, "SELECT count(*) FROM ftsdocs"));
+    search_index_progress(&nIdxed, &nTotal);
+    fossil_print("%-17s %d\n", "documents:", nTotal);
+    if( nIdxed<nTotal ){
+      fossil_print("%-17s %d (%.1f%%)\n", "indexed:", nIdxed,
+                   (100.0*nIdxed)/nTotal);
+    }
+    if( search_file_index_exists() ){
+      fossil_print("%-17s %d\n", "file artifacts:",
+         db_int(0, "SELECT count(*) FROM ftsfile"));
+    }
   }else{
     fossil_print("%-17s disabled\n", "full-text index:");
   }
@@ -1595,8 +1595,14 @@ void page_srchsetup(){
     search_update_index(search_restrict(SRCH_ALL));
   }
   if( search_index_exists() ){
+    int nIdxed, nTotal;
+    search_index_progress(&nIdxed, &nTotal);
     @ <p>Currently using an SQLite FTS4 search index. This makes search
     @ run faster, especially on large repositories, but takes up space.</p>
+    if( nIdxed<nTotal ){
+      @ <p>%d(nIdxed) of %d(nTotal) documents have been indexed so far.
+      @ The rest are indexed in the background by the backoffice.</p>
+    }
     onoff_attribute("Use Porter Stemmer","search-stemmer","ss",0,0);
     @ <p><input type="submit" name="fts0" value="Delete The Full-Text Index">
     @ <input type="submit" name="fts1" value="Rebuild The Full-Text Index">
@@ -85,13 +85,15 @@ static int iDraftSkin = 0;
 */
 static struct SkinDetail {
   const char *zName;      /* Name of the detail */
-  const char *zValue;     /* Value of the detail */
+  const char *zDefault;   /* Value of the detail if the skin omits it */
+  char *zValue;           /* Value from the details.txt file, or NULL */
 } aSkinDetail[] = {
-  { "timeline-arrowheads",        "1"  },
-  { "timeline-circle-nodes",      "0"  },
-  { "timeline-color-graph-lines", "0"  },
-  { "white-foreground",           "0"  },
+  { "timeline-arrowheads",        "1", 0 },
+  { "timeline-circle-nodes",      "0", 0 },
+  { "timeline-color-graph-lines", "0", 0 },
+  { "white-foreground",           "0", 0 },
 };
+static int skinDetailInit = 0;   /* True after aSkinDetail[] is loaded */
 
 /*
 ** Invoke this routine to set the alternative skin.  Return NULL if the
@@ -149,6 +151,14 @@ void skin_use_draft(int i){
   iDraftSkin = i;
 }
 
+/*
+** Return the number of the draft skin in use, or 0 if a draft skin
+** is not in use.
+*/
+int skin_draft_in_use(void){
+  return iDraftSkin;
+}
+
 /*
 ** The following routines return the various components of the skin
 ** that should be used for the current run.
@@ -222,11 +232,10 @@ static struct SkinDetail *skin_detail_find(const char *zName){
 ** file.
 */
 static void skin_detail_initialize(void){
-  static int isInit = 0;
   char *zDetail;
   Blob detail, line, key, value;
-  if( isInit ) return;
-  isInit = 1;
+  if( skinDetailInit ) return;
+  skinDetailInit = 1;
   zDetail = (char*)skin_get("details");
   if( zDetail==0 ) return;
   zDetail = fossil_strdup(zDetail);
@@ -245,12 +254,26 @@ static void skin_detail_initialize(void){
     pDetail = skin_detail_find(zKey);
     if( pDetail==0 ) continue;
     if( !blob_token(&line, &value) ) continue;
+    fossil_free(pDetail->zValue);
     pDetail->zValue = fossil_strdup(blob_str(&value));
   }
   blob_reset(&detail);
   fossil_free(zDetail);
 }
 
+/*
+** Forget the skin details, so that they are loaded again for the next
+** web page.  The skin might be changed in the meantime.
+*/
+void skin_reset(void){
+  int i;
+  for(i=0; i<count(aSkinDetail); i++){
+    fossil_free(aSkinDetail[i].zValue);
+    aSkinDetail[i].zValue = 0;
+  }
+  skinDetailInit = 0;
+}
+
 /*
 ** Return a skin detail setting
 */
@@ -259,7 +282,7 @@ const char *skin_detail(const char *zName){
   skin_detail_initialize();
   pDetail = skin_detail_find(zName);
   if( pDetail==0 ) fossil_fatal("no such skin detail: %s", zName);
-  return pDetail->zValue;
+  return pDetail->zValue ? pDetail->zValue : pDetail->zDefault;
 }
 int skin_detail_boolean(const char *zName){
   return !is_false(skin_detail(zName));
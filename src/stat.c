@@ -272,6 +272,14 @@ void stat_page(void){
     @ <tr><th>Backoffice:</th>
     @ <td>Last run: %z(backoffice_last_run())</td></tr>
   }
+  if( g.perm.Admin ){
+    @ <tr><th>Artifact&nbsp;Cache:</th>
+    @ <td>%z(content_cache_summary())</td></tr>
+  }
+  if( g.perm.Admin ){
+    @ <tr><th>Manifest&nbsp;Cache:</th>
+    @ <td>%z(manifest_cache_summary())</td></tr>
+  }
   if( g.perm.Admin && alert_enabled() ){
     stats_for_email();
   }
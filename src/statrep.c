@@ -37,6 +37,14 @@ static int statsReportType = 0;
 */
 static const char *statsReportTimelineYFlag = NULL;
 
+/*
+** Forget the view of the current web page, so that the same process
+** can go on to generate another web page.
+*/
+void stats_report_reset(void){
+  statsReportType = 0;
+  statsReportTimelineYFlag = NULL;
+}
 
 /*
 ** Creates a TEMP VIEW named v_reports which is a wrapper around the
@@ -368,12 +368,16 @@ static void image_url_var(const char *zImageName){
   free(zConfigName);
 }
 
+/*
+** The nonce for the current web page.
+*/
+static char zNonce[52];
+
 /*
 ** Return a random nonce that is stored in static space.  For a particular
-** run, the same nonce is always returned.
+** web page, the same nonce is always returned.
 */
 char *style_nonce(void){
-  static char zNonce[52];
   if( zNonce[0]==0 ){
     unsigned char zSeed[24];
     sqlite3_randomness(24, zSeed);
@@ -554,6 +558,28 @@ void style_load_one_js_file(const char *zFile){
 static const char *azJsToLoad[4];
 static int nJsToLoad = 0;
 
+/*
+** Forget everything about the current web page, so that the same process
+** can go on to generate another one.
+*/
+void style_reset(void){
+  memset(aSubmenu, 0, sizeof(aSubmenu));
+  nSubmenu = 0;
+  memset(aSubmenuCtrl, 0, sizeof(aSubmenuCtrl));
+  nSubmenuCtrl = 0;
+  headerHasBeenGenerated = 0;
+  sideboxUsed = 0;
+  adUnitFlags = 0;
+  needHrefJs = 0;
+  needSortJs = 0;
+  needGraphJs = 0;
+  blob_reset(&blobOnLoad);
+  fossil_free(local_zCurrentPage);
+  local_zCurrentPage = 0;
+  nJsToLoad = 0;
+  zNonce[0] = 0;
+}
+
 /*
 ** Register a new JS file to load at the end of the document.
 */
@@ -1119,6 +1145,7 @@ void webpage_error(const char *zFormat, ...){
   }
   style_footer();
   if( zErr ){
+    cgi_close_connection();
     cgi_reply();
     fossil_exit(1);
   }
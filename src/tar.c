@@ -27,6 +27,90 @@
 #endif
 #include "tar.h"
 
+#if INTERFACE
+/*
+** The destination of an archive.  The archive is written out as it is
+** generated, so that the whole of it never needs to be held in memory.
+*/
+struct ArchiveSink {
+  FILE *out;              /* Write here, or to the CGI reply if NULL */
+  const char *zFile;      /* Name of the output file, for error messages */
+  sqlite3_int64 nByte;    /* Number of bytes written so far */
+  int bCopy;              /* True if copy holds all of the archive so far */
+  Blob copy;              /* Copy of an archive that is small enough to cache */
+};
+#endif
+
+/*
+** A copy of an archive generated for a web page is kept for the cache
+** only while the archive is no larger than this many bytes.
+*/
+#define ARCHIVE_CACHE_MAX (64*1024*1024)
+
+/*
+** Prepare pSink to receive an archive.  The archive is written to the
+** file zFile, or to standard output if zFile is "-", or to the body of
+** a reply begun by cgi_stream_begin() if zFile is NULL.  If bCopy is
+** true, a copy of the archive is also kept in pSink->copy unless the
+** archive grows larger than ARCHIVE_CACHE_MAX bytes.
+*/
+void archive_sink_open(ArchiveSink *pSink, const char *zFile, int bCopy){
+  memset(pSink, 0, sizeof(*pSink));
+  blob_zero(&pSink->copy);
+  pSink->bCopy = bCopy;
+  pSink->zFile = zFile;
+  if( zFile==0 ) return;
+  if( zFile[0]==0 || (zFile[0]=='-' && zFile[1]==0) ){
+    fflush(stdout);
+    fossil_binary_mode(stdout);
+    pSink->out = stdout;
+  }else{
+    file_mkfolder(zFile, ExtFILE, 1, 0);
+    pSink->out = fossil_fopen(zFile, "wb");
+    if( pSink->out==0 ){
+      fossil_fatal("unable to open file \"%s\" for writing", zFile);
+    }
+  }
+}
+
+/*
+** Append n bytes from z to the archive being written to the ArchiveSink
+** pArg.  The signature matches the callback of gzip_set_output().
+*/
+void archive_sink_write(void *pArg, const char *z, int n){
+  ArchiveSink *pSink = (ArchiveSink*)pArg;
+  if( n<=0 ) return;
+  if( pSink->out ){
+    fwrite(z, 1, n, pSink->out);
+  }else{
+    cgi_stream_write(z, n);
+  }
+  if( pSink->bCopy ){
+    if( pSink->nByte+n>ARCHIVE_CACHE_MAX ){
+      blob_reset(&pSink->copy);
+      pSink->bCopy = 0;
+    }else{
+      blob_append(&pSink->copy, z, n);
+    }
+  }
+  pSink->nByte += n;
+}
+
+/*
+** Finish writing an archive to pSink.  The copy of the archive, if any,
+** remains in pSink->copy and must be freed by the caller.
+*/
+void archive_sink_close(ArchiveSink *pSink){
+  FILE *out = pSink->out;
+  if( out==0 ) return;
+  pSink->out = 0;
+  if( fflush(out)!=0 || ferror(out) ){
+    if( out!=stdout ) fclose(out);
+    fossil_fatal("cannot write to %s", pSink->zFile);
+  }
+  if( out!=stdout ) fclose(out);
+}
+
 /*
 ** State information for the tarball builder.
 */
@@ -50,8 +134,9 @@ static struct tarball_t {
 ** Begin the process of generating a tarball.
 **
 ** Initialize the GZIP compressor and the table of directory names.
+** The compressed tarball is sent to pSink as it is generated.
 */
-static void tar_begin(sqlite3_int64 mTime){
+static void tar_begin(sqlite3_int64 mTime, ArchiveSink *pSink){
   assert( tball.aHdr==0 );
   tball.aHdr = fossil_malloc(512+512);
   memset(tball.aHdr, 0, 512+512);
@@ -68,6 +153,7 @@ static void tar_begin(sqlite3_int64 mTime){
   memcpy(&tball.aHdr[265], "nobody", 7);   /* Owner name */
   memcpy(&tball.aHdr[297], "nobody", 7);   /* Group name */
   gzip_begin(mTime);
+  gzip_set_output(archive_sink_write, pSink);
   db_multi_exec(
     "CREATE TEMP TABLE dir(name UNIQUE);"
   );
@@ -404,14 +490,14 @@ static void tar_add_file(
 }
 
 /*
-** Finish constructing the tarball.  Put the content of the tarball
-** in Blob pOut.
+** Finish constructing the tarball.
 */
-static void tar_finish(Blob *pOut){
+static void tar_finish(void){
+  Blob empty;
   db_multi_exec("DROP TABLE dir");
   gzip_step(tball.zSpaces, 512);
   gzip_step(tball.zSpaces, 512);
-  gzip_finish(pOut);
+  gzip_finish(&empty);
   fossil_free(tball.aHdr);
   tball.aHdr = 0;
   fossil_free(tball.zPrevDir);
@@ -431,7 +517,7 @@ static void tar_finish(Blob *pOut){
 */
 void test_tarball_cmd(void){
   int i;
-  Blob zip;
+  ArchiveSink sink;
   int eFType = SymFILE;
   if( g.argc<3 ){
     usage("ARCHIVE [options] FILE....");
@@ -440,7 +526,8 @@ void test_tarball_cmd(void){
     eFType = ExtFILE;
   }
   sqlite3_open(":memory:", &g.db);
-  tar_begin(-1);
+  archive_sink_open(&sink, g.argv[2], 0);
+  tar_begin(-1, &sink);
   for(i=3; i<g.argc; i++){
     Blob file;
     blob_zero(&file);
@@ -448,8 +535,8 @@ void test_tarball_cmd(void){
     tar_add_file(g.argv[i], &file, file_perm(0,0), file_mtime(0,0));
     blob_reset(&file);
   }
-  tar_finish(&zip);
-  blob_write_to_file(&zip, g.argv[2]);
+  tar_finish();
+  archive_sink_close(&sink);
 }
 
 /*
@@ -461,8 +548,8 @@ void test_tarball_cmd(void){
 ** resulting tarball contains a single file which is the RID
 ** object.  pInclude and pExclude are ignored in this case.
 **
-** If the RID object does not exist in the repository, then
-** pTar is zeroed.
+** The tarball is written to pSink as it is generated.  If the RID
+** object does not exist in the repository, then nothing is written.
 **
 ** zDir is a "synthetic" subdirectory which all files get
 ** added to as part of the tarball. It may be 0 or an empty string, in
@@ -473,7 +560,7 @@ void test_tarball_cmd(void){
 */
 void tarball_of_checkin(
   int rid,             /* The RID of the checkin from which to form a tarball */
-  Blob *pTar,          /* Write the tarball into this blob */
+  ArchiveSink *pSink,  /* Write the tarball here */
   const char *zDir,    /* Directory prefix for all file added to tarball */
   Glob *pInclude,      /* Only add files matching this pattern */
   Glob *pExclude       /* Exclude files matching this pattern */
@@ -488,7 +575,6 @@ void tarball_of_checkin(
 
   content_get(rid, &mfile);
   if( blob_size(&mfile)==0 ){
-    blob_zero(pTar);
     return;
   }
   blob_set_dynamic(&hash, rid_to_uuid(rid));
@@ -503,7 +589,7 @@ void tarball_of_checkin(
   if( pManifest ){
     int flg, eflg = 0;
     mTime = (pManifest->rDate - 2440587.5)*86400.0;
-    tar_begin(mTime);
+    tar_begin(mTime, pSink);
     flg = db_get_manifest_setting();
     if( flg ){
       /* eflg is the effective flags, taking include/exclude into account */
@@ -571,14 +657,14 @@ void tarball_of_checkin(
     blob_append(&filename, blob_str(&hash), 16);
     zName = blob_str(&filename);
     mTime = db_int64(0, "SELECT (julianday('now') -  2440587.5)*86400.0;");
-    tar_begin(mTime);
+    tar_begin(mTime, pSink);
     tar_add_file(zName, &mfile, 0, mTime);
   }
   manifest_destroy(pManifest);
   blob_reset(&mfile);
   blob_reset(&hash);
   blob_reset(&filename);
-  tar_finish(pTar);
+  tar_finish();
 }
 
 /*
@@ -605,7 +691,7 @@ void tarball_of_checkin(
 */
 void tarball_cmd(void){
   int rid;
-  Blob tarball;
+  ArchiveSink sink;
   const char *zName;
   Glob *pInclude = 0;
   Glob *pExclude = 0;
@@ -642,11 +728,11 @@ void tarball_cmd(void){
        db_get("project-name", "unnamed"), rid, rid
     );
   }
-  tarball_of_checkin(rid, &tarball, zName, pInclude, pExclude);
+  archive_sink_open(&sink, g.argv[3], 0);
+  tarball_of_checkin(rid, &sink, zName, pInclude, pExclude);
+  archive_sink_close(&sink);
   glob_free(pInclude);
   glob_free(pExclude);
-  blob_write_to_file(&tarball, g.argv[3]);
-  blob_reset(&tarball);
 }
 
 /*
@@ -684,7 +770,7 @@ char *tar_uuid_from_name(char **pzName){
 **
 ** Generate a compressed tarball for the check-in specified by the "r"
 ** query parameter.  Return that compressed tarball as the HTTP reply
-** content.
+** content.  The tarball is sent while it is being generated.
 **
 ** The r= and name= query parameters can be specified as extensions to the
 ** URI.  Example, the following URIs are all equivalent:
@@ -727,7 +813,7 @@ void tarball_page(void){
   Blob cacheKey;                /* The key to cache */
   Glob *pInclude = 0;           /* The compiled in= glob pattern */
   Glob *pExclude = 0;           /* The compiled ex= glob pattern */
-  Blob tarball;                 /* Tarball accumulated here */
+  Blob tarball;                 /* Tarball read from the cache */
   const char *z;
 
   login_check_credentials();
@@ -801,16 +887,23 @@ void tarball_page(void){
     style_footer();
     return;
   }
+  cgi_set_content_type("application/x-compressed");
   blob_zero(&tarball);
-  if( cache_read(&tarball, zKey)==0 ){
-    tarball_of_checkin(rid, &tarball, zName, pInclude, pExclude);
-    cache_write(&tarball, zKey);
+  if( cache_read(&tarball, zKey) ){
+    cgi_set_content(&tarball);
+  }else{
+    if( cgi_stream_begin() ){
+      ArchiveSink sink;
+      archive_sink_open(&sink, 0, cache_exists());
+      tarball_of_checkin(rid, &sink, zName, pInclude, pExclude);
+      if( sink.bCopy ) cache_write(&sink.copy, zKey);
+      blob_reset(&sink.copy);
+    }
+    cgi_stream_end();
   }
   glob_free(pInclude);
   glob_free(pExclude);
   fossil_free(zName);
   fossil_free(zRid);
   blob_reset(&cacheKey);
-  cgi_set_content(&tarball);
-  cgi_set_content_type("application/x-compressed");
 }
@@ -2128,6 +2128,21 @@ void Th_FossilInit(u32 flags){
   g.th1Flags |= (flags & TH_INIT_MASK);
 }
 
+/*
+** Delete the interpreter, if there is one, so that the next call to
+** Th_FossilInit() starts over with a new one.  This is used between
+** web pages generated by the same process, so that no TH1 variables
+** carry over from one web page to the next.
+*/
+void Th_FossilReset(void){
+  if( g.interp ){
+    Th_DeleteInterp(g.interp);
+    g.interp = 0;
+  }
+  g.th1Flags = 0;
+  enableOutput = 1;
+}
+
 /*
 ** Store a string value in a variable in the interpreter if the variable
 ** does not already exist.
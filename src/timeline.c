@@ -116,6 +116,22 @@ void hyperlink_to_user(const char *zU, const char *zD, const char *zSuf){
 #define TIMELINE_CHPICK   0x400000  /* Show cherrypick merges */
 #endif
 
+/*
+** Parameters for hash_color(), which depend on the skin, and the number
+** of timeline tables generated so far.  timeline_reset() forgets them.
+*/
+static int hashColorIx[2] = {0,0};
+static int nTimelineTable = 0;
+
+/*
+** Forget everything about the current web page, so that the same process
+** can go on to generate another one.
+*/
+void timeline_reset(void){
+  hashColorIx[0] = hashColorIx[1] = 0;
+  nTimelineTable = 0;
+}
+
 /*
 ** Hash a string and use the hash to determine a background color.
 */
@@ -126,7 +142,7 @@ char *hash_color(const char *z){
   int h1, h2, h3, h4;          /* Elements of the hash value */
   int mx, mn;                  /* Components of HSV */
   static char zColor[10];      /* The resulting color */
-  static int ix[2] = {0,0};    /* Color chooser parameters */
+  int *ix = hashColorIx;       /* Color chooser parameters */
 
   if( ix[0]==0 ){
     if( skin_detail_boolean("white-foreground") ){
@@ -217,8 +233,7 @@ void test_hash_color_page(void){
 ** Return a new timelineTable id.
 */
 int timeline_tableid(void){
-  static int id = 0;
-  return id++;
+  return nTimelineTable++;
 }
 
 /*
@@ -1096,36 +1111,36 @@ char *names_of_file(const char *zUuid){
 ** on the timeline.
 */
 static void timeline_y_submenu(int isDisabled){
-  static int i = 0;
+  /* The choices depend on the permissions of the current user, so they
+  ** are recomputed for each web page.  The array must be static because
+  ** the submenu holds on to it. */
   static const char *az[14];
-  if( i==0 ){
-    az[0] = "all";
-    az[1] = "Any Type";
-    i = 2;
-    if( g.perm.Read ){
-      az[i++] = "ci";
-      az[i++] = "Check-ins";
-      az[i++] = "g";
-      az[i++] = "Tags";
-    }
-    if( g.perm.RdWiki ){
-      az[i++] = "e";
-      az[i++] = "Tech Notes";
-    }
-    if( g.perm.RdTkt ){
-      az[i++] = "t";
-      az[i++] = "Tickets";
-    }
-    if( g.perm.RdWiki ){
-      az[i++] = "w";
-      az[i++] = "Wiki";
-    }
-    if( g.perm.RdForum ){
-      az[i++] = "f";
-      az[i++] = "Forum";
-    }
-    assert( i<=count(az) );
-  }
+  int i = 2;
+  az[0] = "all";
+  az[1] = "Any Type";
+  if( g.perm.Read ){
+    az[i++] = "ci";
+    az[i++] = "Check-ins";
+    az[i++] = "g";
+    az[i++] = "Tags";
+  }
+  if( g.perm.RdWiki ){
+    az[i++] = "e";
+    az[i++] = "Tech Notes";
+  }
+  if( g.perm.RdTkt ){
+    az[i++] = "t";
+    az[i++] = "Tickets";
+  }
+  if( g.perm.RdWiki ){
+    az[i++] = "w";
+    az[i++] = "Wiki";
+  }
+  if( g.perm.RdForum ){
+    az[i++] = "f";
+    az[i++] = "Forum";
+  }
+  assert( i<=count(az) );
   if( i>2 ){
     style_submenu_multichoice("y", i/2, az, isDisabled);
   }
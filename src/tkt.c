@@ -118,6 +118,19 @@ static void getAllTicketFields(void){
   }
 }
 
+/*
+** Forget the field values of the current web page, so that the same
+** process can go on to generate another web page.  The list of fields
+** is kept.
+*/
+void ticket_reset(void){
+  int i;
+  for(i=0; i<nField; i++){
+    aField[i].zValue = "";
+    aField[i].zAppend = 0;
+  }
+}
+
 /*
 ** Query the database for all TICKET fields for the specific
 ** ticket whose name is given by the "name" CGI parameter.
@@ -0,0 +1,618 @@
+/*
+** Copyright (c) 2020 D. Richard Hipp
+**
+** This program is free software; you can redistribute it and/or
+** modify it under the terms of the Simplified BSD License (also
+** known as the "2-Clause License" or "FreeBSD License".)
+
+** This program is distributed in the hope that it will be useful,
+** but without any warranty; without even the implied warranty of
+** merchantability or fitness for a particular purpose.
+**
+** Author contact information:
+**   drh@hwaci.com
+**   http://www.hwaci.com/drh/
+**
+*******************************************************************************
+**
+** This file implements an optional trigram index over the content of
+** file artifacts.  For every sequence of three bytes, the index holds
+** the list of file artifacts that contain it.  "fossil grep" uses the
+** index to skip file versions that cannot possibly match a regular
+** expression, and only runs re_match() over the rest.
+**
+** The index is two tables in the repository:
+**
+**    TRIGRAM        The RIDs of the file artifacts that contain each
+**                   trigram.  The list for one trigram is split over a
+**                   few segments, each a sorted list of RIDs encoded as
+**                   varint deltas.
+**
+**    TRIGRAMFILE    One row for each file artifact known to the index,
+**                   saying whether or not it has been indexed yet.
+**
+** Each batch of new files adds a segment for every trigram that it
+** contains.  The level of a segment is the base-2 logarithm of the
+** number of RIDs in it, and each trigram has at most one segment per
+** level.  A new segment is first merged with the existing segments of
+** the same or a lower level, smallest first.  A RID is only rewritten
+** when its segment moves to a higher level, so it is rewritten only a
+** few times as the index grows, rather than once per batch.
+**
+** Trigrams are folded to lower case, so that one index serves both
+** case-sensitive and case-insensitive searches.  The index only ever
+** rules files out.  Files that are not indexed, such as binary files
+** or files whose content has not arrived yet, are always searched.
+*/
+#include "config.h"
+#include "trigram.h"
+#include <assert.h>
+#include <time.h>
+
+/*
+** Files are added to the index in batches of about this many bytes of
+** content, or this many files, whichever comes first.  Each batch is
+** committed on its own.
+*/
+#define TRIGRAM_BATCH_BYTES  16000000
+#define TRIGRAM_BATCH_FILES  2000
+
+/*
+** Files larger than this are not indexed.  They are always searched.
+*/
+#define TRIGRAM_MAXSIZE      (10*1024*1024)
+
+/*
+** The backoffice adds files to the index for up to this many seconds
+** per run.
+*/
+#define TRIGRAM_BACKOFFICE_TIME  10
+
+/*
+** Values for TRIGRAMFILE.IDXED
+*/
+#define TRIGRAM_PENDING      0    /* Not yet indexed */
+#define TRIGRAM_INDEXED      1    /* Trigrams are in the index */
+#define TRIGRAM_UNINDEXABLE  2    /* Binary or too large.  Always searched */
+
+static const char zTrigramSchema[] =
+@ CREATE TABLE IF NOT EXISTS repository.trigram(
+@   tg INTEGER,                -- Three bytes, folded to lower case
+@   lvl INTEGER,               -- Level of this segment
+@   rids BLOB,                 -- Sorted RIDs, as varint deltas
+@   PRIMARY KEY(tg,lvl)
+@ );
+@ CREATE TABLE IF NOT EXISTS repository.trigramfile(
+@   rid INTEGER PRIMARY KEY,   -- BLOB.RID of a file artifact
+@   idxed INTEGER              -- 0: pending  1: indexed  2: unindexable
+@ );
+@ CREATE INDEX IF NOT EXISTS repository.trigramfilePending
+@   ON trigramfile(idxed) WHERE idxed==0;
+;
+static const char zTrigramDrop[] =
+@ DROP TABLE IF EXISTS repository.trigram;
+@ DROP TABLE IF EXISTS repository.trigramfile;
+;
+
+/*
+** A growable list of RIDs
+*/
+typedef struct RidList RidList;
+struct RidList {
+  int n;                 /* Number of RIDs in a[] */
+  int nAlloc;            /* Slots allocated for a[] */
+  int *a;                /* The RIDs */
+};
+
+/*
+** Append a RID to a list
+*/
+static void ridlist_append(RidList *p, int rid){
+  if( p->n>=p->nAlloc ){
+    p->nAlloc = p->nAlloc*2 + 100;
+    p->a = fossil_realloc(p->a, sizeof(p->a[0])*p->nAlloc);
+  }
+  p->a[p->n++] = rid;
+}
+
+/*
+** Comparison function for sorting RIDs
+*/
+static int ridlist_cmp(const void *a, const void *b){
+  return *(const int*)a - *(const int*)b;
+}
+
+/*
+** Sort the RIDs in p and remove duplicates
+*/
+static void ridlist_sort(RidList *p){
+  int i, n;
+  if( p->n<2 ) return;
+  qsort(p->a, p->n, sizeof(p->a[0]), ridlist_cmp);
+  for(i=n=1; i<p->n; i++){
+    if( p->a[i]!=p->a[n-1] ) p->a[n++] = p->a[i];
+  }
+  p->n = n;
+}
+
+/*
+** Set pOut to the union of the sorted RID lists in pA and pB.
+*/
+static void ridlist_merge(RidList *pOut, const RidList *pA, const RidList *pB){
+  int i = 0, j = 0;
+  pOut->n = 0;
+  while( i<pA->n && j<pB->n ){
+    if( pA->a[i]<pB->a[j] ){
+      ridlist_append(pOut, pA->a[i++]);
+    }else{
+      if( pA->a[i]==pB->a[j] ) i++;
+      ridlist_append(pOut, pB->a[j++]);
+    }
+  }
+  while( i<pA->n ) ridlist_append(pOut, pA->a[i++]);
+  while( j<pB->n ) ridlist_append(pOut, pB->a[j++]);
+}
+
+/*
+** Return the level of a segment that holds n RIDs.  That is the
+** number of times n can be halved before reaching 1.
+*/
+static int trigram_level(int n){
+  int lvl = 0;
+  while( n>1 ){
+    n >>= 1;
+    lvl++;
+  }
+  return lvl;
+}
+
+/*
+** Decode a TRIGRAM.RIDS value of n bytes and append its RIDs to pList.
+*/
+static void trigram_decode(const unsigned char *z, int n, RidList *pList){
+  int i = 0;
+  int rid = 0;
+  while( i<n ){
+    unsigned v = 0;
+    int shift = 0;
+    while( i<n && (z[i]&0x80)!=0 ){
+      v |= (unsigned)(z[i++]&0x7f)<<shift;
+      shift += 7;
+    }
+    if( i>=n ) break;
+    v |= (unsigned)z[i++]<<shift;
+    rid += (int)v;
+    ridlist_append(pList, rid);
+  }
+}
+
+/*
+** Encode the n RIDs in a[], which must be sorted, as a TRIGRAM.RIDS
+** value in pOut.
+*/
+static void trigram_encode(const int *a, int n, Blob *pOut){
+  int i;
+  int prev = 0;
+  blob_reset(pOut);
+  for(i=0; i<n; i++){
+    unsigned char x[5];
+    unsigned v = (unsigned)(a[i] - prev);
+    int k = 0;
+    while( v>=0x80 ){
+      x[k++] = (unsigned char)(v & 0x7f) | 0x80;
+      v >>= 7;
+    }
+    x[k++] = (unsigned char)v;
+    blob_append(pOut, (const char*)x, k);
+    prev = a[i];
+  }
+}
+
+/*
+** Remember whether or not the index exists.
+*/
+static int trigramIdxExists = -1;
+
+/*
+** Return true if the trigram index exists
+*/
+int trigram_index_exists(void){
+  if( trigramIdxExists<0 ){
+    trigramIdxExists = db_table_exists("repository","trigramfile");
+  }
+  return trigramIdxExists;
+}
+
+/*
+** Create the trigram index and queue every file artifact to be
+** added to it.
+*/
+void trigram_create_index(void){
+  db_multi_exec(zTrigramSchema/*works-like:""*/);
+  db_multi_exec(
+    "INSERT OR IGNORE INTO trigramfile(rid,idxed)"
+    "  SELECT DISTINCT fid, 0 FROM mlink WHERE fid>0"
+  );
+  trigramIdxExists = 1;
+}
+
+/*
+** Delete the trigram index
+*/
+void trigram_drop_index(void){
+  db_multi_exec(zTrigramDrop/*works-like:""*/);
+  trigramIdxExists = 0;
+}
+
+/*
+** The file changes of check-in mid have just been added to MLINK.  Queue
+** any new file artifacts to be added to the trigram index.
+*/
+void trigram_touch(int mid){
+  if( trigram_index_exists() ){
+    db_multi_exec(
+      "INSERT OR IGNORE INTO trigramfile(rid,idxed)"
+      "  SELECT fid, 0 FROM mlink WHERE mid=%d AND fid>0",
+      mid
+    );
+  }
+}
+
+/*
+** The artifacts whose RIDs are in TEMP table zTab are about to be
+** purged.  Forget about them.  Their RIDs are left in the TRIGRAM lists,
+** which is harmless since the index only ever rules files out.
+*/
+void trigram_unindex(const char *zTab){
+  if( trigram_index_exists() ){
+    db_multi_exec("DELETE FROM trigramfile WHERE rid IN \"%w\"", zTab);
+  }
+}
+
+/*
+** Sort the nKey (tg<<32)|rid keys in aKey[] by trigram.  The sort is a
+** radix sort, one byte of the trigram at a time, and is stable, so keys
+** with the same trigram stay in the order in which they were added.
+*/
+static void trigram_key_sort(u64 *aKey, int nKey){
+  u64 *aTmp = fossil_malloc( sizeof(aKey[0])*(nKey+1) );
+  u64 *aFrom = aKey;
+  u64 *aTo = aTmp;
+  int aCnt[256];
+  int shift, i;
+  for(shift=32; shift<56; shift+=8){
+    u64 *x;
+    int sum = 0;
+    memset(aCnt, 0, sizeof(aCnt));
+    for(i=0; i<nKey; i++) aCnt[(aFrom[i]>>shift)&0xff]++;
+    for(i=0; i<256; i++){
+      int c = aCnt[i];
+      aCnt[i] = sum;
+      sum += c;
+    }
+    for(i=0; i<nKey; i++) aTo[aCnt[(aFrom[i]>>shift)&0xff]++] = aFrom[i];
+    x = aFrom;
+    aFrom = aTo;
+    aTo = x;
+  }
+  if( aFrom!=aKey ) memcpy(aKey, aFrom, sizeof(aKey[0])*nKey);
+  fossil_free(aTmp);
+}
+
+/*
+** Append to aKey[] one (tg<<32)|rid key for each distinct trigram in
+** pContent.  aSeen[] is a bitmap with one bit for each possible trigram.
+** It must be all zeros on entry, and is all zeros again on return.
+*/
+static void trigram_scan(
+  Blob *pContent,        /* Content of the file */
+  int rid,               /* RID of the file */
+  unsigned char *aSeen,  /* Bitmap of trigrams already seen */
+  u64 **paKey,           /* Array of keys to append to */
+  int *pnKey,            /* Number of keys in *paKey */
+  int *pnAlloc           /* Slots allocated in *paKey */
+){
+  const unsigned char *z = (const unsigned char*)blob_buffer(pContent);
+  int n = blob_size(pContent);
+  u64 *aKey;
+  unsigned tg = 0;
+  int nKey;
+  int i;
+  if( n<3 ) return;
+  if( *pnKey + n > *pnAlloc ){
+    *pnAlloc = *pnAlloc*2 + n;
+    *paKey = fossil_realloc(*paKey, sizeof(u64)*(*pnAlloc));
+  }
+  aKey = *paKey;
+  nKey = *pnKey;
+  for(i=0; i<n; i++){
+    unsigned c = z[i];
+    if( c>='A' && c<='Z' ) c += 'a' - 'A';
+    tg = ((tg<<8) | c) & 0xffffff;
+    if( i>=2 && (aSeen[tg>>3] & (1<<(tg&7)))==0 ){
+      aSeen[tg>>3] |= 1<<(tg&7);
+      aKey[nKey++] = ((u64)tg<<32) | (u64)rid;
+    }
+  }
+  for(i=*pnKey; i<nKey; i++){
+    tg = (unsigned)(aKey[i]>>32);
+    aSeen[tg>>3] = 0;
+  }
+  *pnKey = nKey;
+}
+
+/*
+** Add one batch of pending file artifacts to the trigram index, in a
+** transaction of its own.  Return the number of files added, or zero
+** if there was nothing left to do.
+**
+** Phantoms are skipped.  They are picked up by a later batch once their
+** content arrives.
+*/
+int trigram_update_batch(void){
+  Stmt q, qDel, qPut;
+  RidList files = {0,0,0};
+  RidList old = {0,0,0};
+  RidList seg = {0,0,0};
+  RidList merged = {0,0,0};
+  unsigned char *aSeen;
+  u64 *aKey = 0;
+  int nKey = 0;
+  int nKeyAlloc = 0;
+  i64 nByte = 0;
+  Blob content, rids;
+  int i, j;
+
+  if( !trigram_index_exists() ) return 0;
+  db_prepare(&q,
+    "SELECT trigramfile.rid, blob.size FROM trigramfile, blob"
+    " WHERE trigramfile.idxed==0"
+    "   AND blob.rid=trigramfile.rid AND blob.size>=0"
+    " ORDER BY trigramfile.rid"
+  );
+  while( nByte<TRIGRAM_BATCH_BYTES && files.n<TRIGRAM_BATCH_FILES
+      && db_step(&q)==SQLITE_ROW ){
+    ridlist_append(&files, db_column_int(&q, 0));
+    nByte += db_column_int(&q, 1);
+  }
+  db_finalize(&q);
+  if( files.n==0 ) return 0;
+
+  db_begin_transaction();
+  blob_init(&content, 0, 0);
+  blob_init(&rids, 0, 0);
+  aSeen = fossil_malloc( 0x200000 );
+  memset(aSeen, 0, 0x200000);
+  db_prepare(&q, "UPDATE trigramfile SET idxed=:idxed WHERE rid=:rid");
+  for(i=0; i<files.n; i++){
+    int rid = files.a[i];
+    int idxed = TRIGRAM_UNINDEXABLE;
+    if( db_int(0, "SELECT size FROM blob WHERE rid=%d", rid)<=TRIGRAM_MAXSIZE
+     && content_get(rid, &content)
+     && !looks_like_binary(&content)
+    ){
+      trigram_scan(&content, rid, aSeen, &aKey, &nKey, &nKeyAlloc);
+      idxed = TRIGRAM_INDEXED;
+    }
+    blob_reset(&content);
+    db_bind_int(&q, ":idxed", idxed);
+    db_bind_int(&q, ":rid", rid);
+    db_step(&q);
+    db_reset(&q);
+  }
+  db_finalize(&q);
+  fossil_free(aSeen);
+
+  /* Add a segment with the new RIDs for each trigram, merged with any
+  ** segments that are not at a higher level than the result.  The
+  ** keys for each trigram are in increasing RID order, since the files
+  ** were processed in that order. */
+  trigram_key_sort(aKey, nKey);
+  db_prepare(&q, "SELECT lvl, rids FROM trigram WHERE tg=:tg ORDER BY lvl");
+  db_prepare(&qDel, "DELETE FROM trigram WHERE tg=:tg AND lvl<=:lvl");
+  db_prepare(&qPut,
+    "INSERT INTO trigram(tg,lvl,rids) VALUES(:tg,:lvl,:rids)");
+  for(i=0; i<nKey; i=j){
+    unsigned tg = (unsigned)(aKey[i]>>32);
+    int lvlDel = -1;
+    merged.n = 0;
+    for(j=i; j<nKey && (unsigned)(aKey[j]>>32)==tg; j++){
+      ridlist_append(&merged, (int)(aKey[j] & 0xffffffff));
+    }
+    db_bind_int(&q, ":tg", tg);
+    while( db_step(&q)==SQLITE_ROW
+        && db_column_int(&q, 0)<=trigram_level(merged.n) ){
+      RidList x;
+      lvlDel = db_column_int(&q, 0);
+      old.n = 0;
+      trigram_decode((const unsigned char*)db_column_raw(&q, 1),
+                     db_column_bytes(&q, 1), &old);
+      ridlist_merge(&seg, &old, &merged);
+      x = merged;
+      merged = seg;
+      seg = x;
+    }
+    db_reset(&q);
+    if( lvlDel>=0 ){
+      db_bind_int(&qDel, ":tg", tg);
+      db_bind_int(&qDel, ":lvl", lvlDel);
+      db_step(&qDel);
+      db_reset(&qDel);
+    }
+    trigram_encode(merged.a, merged.n, &rids);
+    db_bind_int(&qPut, ":tg", tg);
+    db_bind_int(&qPut, ":lvl", trigram_level(merged.n));
+    db_bind_blob(&qPut, ":rids", &rids);
+    db_step(&qPut);
+    db_reset(&qPut);
+  }
+  db_finalize(&q);
+  db_finalize(&qDel);
+  db_finalize(&qPut);
+  db_end_transaction(0);
+
+  blob_reset(&rids);
+  fossil_free(aKey);
+  fossil_free(files.a);
+  fossil_free(old.a);
+  fossil_free(seg.a);
+  fossil_free(merged.a);
+  return files.n;
+}
+
+/*
+** Add every pending file artifact to the trigram index
+*/
+void trigram_update_index(void){
+  while( trigram_update_batch()>0 ){}
+}
+
+/*
+** This routine is called by the backoffice.  Add pending file artifacts
+** to the trigram index for up to TRIGRAM_BACKOFFICE_TIME seconds.
+*/
+void trigram_backoffice(void){
+  time_t tmEnd;
+  if( !trigram_index_exists() ) return;
+  tmEnd = time(0) + TRIGRAM_BACKOFFICE_TIME;
+  while( time(0)<tmEnd && trigram_update_batch()>0 ){}
+}
+
+/*
+** Comparison function for sorting RidLists by size
+*/
+static int ridlist_size_cmp(const void *a, const void *b){
+  return ((const RidList*)a)->n - ((const RidList*)b)->n;
+}
+
+/*
+** Use the trigram index to find the file artifacts that might contain
+** a match for pRe.  Return false if the index cannot help, either because
+** it does not exist or because pRe has no trigrams that every match must
+** contain.  Otherwise, bring the index up to date, fill the TEMP table
+** GREPCAND with the RIDs of the candidates, and return true.  Any file
+** artifact that is not in GREPCAND cannot contain a match.
+*/
+int trigram_candidates(ReCompiled *pRe){
+  unsigned aTg[20];
+  RidList aList[20];
+  int nTg;
+  int i, j, k;
+  Stmt q;
+
+  if( !trigram_index_exists() ) return 0;
+  nTg = re_trigrams(pRe, aTg, count(aTg));
+  if( nTg==0 ) return 0;
+  trigram_update_index();
+  db_multi_exec(
+    "CREATE TEMP TABLE IF NOT EXISTS grepcand(rid INTEGER PRIMARY KEY);"
+    "DELETE FROM grepcand;"
+  );
+
+  /* Load the RID list for each trigram from all of its segments, then
+  ** intersect them, starting with the shortest */
+  memset(aList, 0, sizeof(aList));
+  db_prepare(&q, "SELECT rids FROM trigram WHERE tg=:tg");
+  for(i=0; i<nTg; i++){
+    int nSeg = 0;
+    db_bind_int(&q, ":tg", aTg[i]);
+    while( db_step(&q)==SQLITE_ROW ){
+      trigram_decode((const unsigned char*)db_column_raw(&q, 0),
+                     db_column_bytes(&q, 0), &aList[i]);
+      nSeg++;
+    }
+    db_reset(&q);
+    if( nSeg>1 ) ridlist_sort(&aList[i]);
+  }
+  db_finalize(&q);
+  qsort(aList, nTg, sizeof(aList[0]), ridlist_size_cmp);
+  for(i=1; i<nTg && aList[0].n>0; i++){
+    int n = 0;
+    for(j=k=0; j<aList[0].n; j++){
+      int rid = aList[0].a[j];
+      while( k<aList[i].n && aList[i].a[k]<rid ) k++;
+      if( k>=aList[i].n ) break;
+      if( aList[i].a[k]==rid ) aList[0].a[n++] = rid;
+    }
+    aList[0].n = n;
+  }
+
+  db_prepare(&q, "INSERT INTO grepcand(rid) VALUES(:rid)");
+  for(j=0; j<aList[0].n; j++){
+    db_bind_int(&q, ":rid", aList[0].a[j]);
+    db_step(&q);
+    db_reset(&q);
+  }
+  db_finalize(&q);
+  db_multi_exec(
+    "INSERT OR IGNORE INTO grepcand(rid)"
+    "  SELECT rid FROM trigramfile WHERE idxed!=%d", TRIGRAM_INDEXED
+  );
+  for(i=0; i<nTg; i++) fossil_free(aList[i].a);
+  return 1;
+}
+
+/*
+** COMMAND: grep-index*
+**
+** Usage: fossil grep-index ?SUBCOMMAND?
+**
+** Manage the trigram index that "fossil grep" uses to avoid scanning
+** file versions that cannot contain a match.  Subcommands:
+**
+**     on           Create the index and add every file artifact to it
+**
+**     off          Delete the index
+**
+**     rebuild      Delete the index and build it again from scratch
+**
+**     status       Show the size of the index.  This is the default.
+**
+** Once the index exists, new file artifacts are added to it by the
+** backoffice, or by the next "fossil grep", whichever comes first.
+*/
+void trigram_cmd(void){
+  const char *zCmd = g.argc>2 ? g.argv[2] : "status";
+  int n = (int)strlen(zCmd);
+  db_find_and_open_repository(0, 0);
+  verify_all_options();
+  if( n==0 ) n = 1;
+  if( strncmp(zCmd, "on", n)==0 && n>=2 ){
+    db_begin_transaction();
+    if( !trigram_index_exists() ) trigram_create_index();
+    db_end_transaction(0);
+    trigram_update_index();
+  }else if( strncmp(zCmd, "off", n)==0 && n>=2 ){
+    db_begin_transaction();
+    trigram_drop_index();
+    db_end_transaction(0);
+  }else if( strncmp(zCmd, "rebuild", n)==0 ){
+    db_begin_transaction();
+    trigram_drop_index();
+    trigram_create_index();
+    db_end_transaction(0);
+    trigram_update_index();
+  }else if( strncmp(zCmd, "status", n)!=0 ){
+    fossil_fatal("unknown subcommand \"%s\" - should be one of: "
+                 "on off rebuild status", zCmd);
+  }
+  if( !trigram_index_exists() ){
+    fossil_print("%-13s disabled\n", "grep index:");
+    return;
+  }
+  fossil_print("%-13s enabled\n", "grep index:");
+  fossil_print("%-13s %d\n", "files:",
+     db_int(0, "SELECT count(*) FROM trigramfile"));
+  fossil_print("%-13s %d\n", "pending:",
+     db_int(0, "SELECT count(*) FROM trigramfile WHERE idxed=%d",
+            TRIGRAM_PENDING));
+  fossil_print("%-13s %d\n", "unindexable:",
+     db_int(0, "SELECT count(*) FROM trigramfile WHERE idxed=%d",
+            TRIGRAM_UNINDEXABLE));
+  fossil_print("%-13s %d\n", "trigrams:",
+     db_int(0, "SELECT count(DISTINCT tg) FROM trigram"));
+  fossil_print("%-13s %d\n", "segments:",
+     db_int(0, "SELECT count(*) FROM trigram"));
+  fossil_print("%-13s %lld bytes\n", "size:",
+     db_int64(0, "SELECT sum(length(rids)) FROM trigram"));
+}
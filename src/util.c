@@ -42,6 +42,7 @@
 ** Exit.  Take care to close the database first.
 */
 NORETURN void fossil_exit(int rc){
+  web_page_exit(rc);
   db_close(1);
 #ifndef _WIN32
   if( g.fAnyTrace ){
@@ -392,6 +393,24 @@ int fossil_timer_is_active( int timerId ){
   }
 }
 
+/*
+** Return the current wall-clock time as milliseconds since the
+** Julian epoch.
+*/
+sqlite3_int64 current_time_in_milliseconds(void){
+  static sqlite3_vfs *clockVfs = 0;
+  sqlite3_int64 t;
+  if( clockVfs==0 ) clockVfs = sqlite3_vfs_find(0);
+  if( clockVfs->iVersion>=2 && clockVfs->xCurrentTimeInt64!=0 ){
+    clockVfs->xCurrentTimeInt64(clockVfs, &t);
+  }else{
+    double r;
+    clockVfs->xCurrentTime(clockVfs, &r);
+    t = (sqlite3_int64)(r*86400000.0);
+  }
+  return t;
+}
+
 /*
 ** Return TRUE if fd is a valid open file descriptor.  This only
 ** works on unix.  The function always returns true on Windows.
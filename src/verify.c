@@ -101,6 +101,22 @@ void verify_before_commit(int rid){
   }
 }
 
+/*
+** Return true if rid is waiting to be verified before the next commit.
+*/
+int verify_is_pending(int rid){
+  return bag_find(&toVerify, rid);
+}
+
+/*
+** Do not verify rid before the next commit after all.  Use this only
+** when the caller has already checked that the content stored for rid
+** expands to content that matches its hash.
+*/
+void verify_skip(int rid){
+  bag_remove(&toVerify, rid);
+}
+
 /*
 ** Cancel all pending verification operations.
 */
@@ -137,6 +137,238 @@ int load_vfile_from_rid(int vid){
 
 #endif /* INTERFACE */
 
+/*
+** SETTING: hash-threads width=5 default=0
+** The number of threads used to stat and hash the files of a check-out
+** when looking for changes, as is done by "fossil status", "fossil commit"
+** and many other commands.  A value of 0 means to use one thread per CPU,
+** up to a maximum of 8.  A value of 1 disables threading.
+*/
+
+/*
+** The VSIG table of the check-out database remembers the signature of
+** each file in the check-out - its size, its nanosecond modification
+** and change times, and its inode and device numbers - as of the last
+** time the content hash of that file was known.  While the signature is
+** unchanged, so is the content, and the file need not be read again.
+**
+** A signature is "racy" if the file changed so soon before its
+** signature was taken that a later edit, within the granularity of the
+** file timestamps, might leave the signature unchanged.  Racy
+** signatures are never trusted.  Instead the file is hashed again and a
+** new signature, which is no longer racy, is recorded.
+*/
+static const char zVsigSchema[] =
+@ CREATE TABLE IF NOT EXISTS localdb.vsig(
+@   pathname TEXT PRIMARY KEY,   -- Relative to the root of the check-out
+@   hash TEXT,                   -- Content hash when the signature was taken
+@   size INTEGER,                -- Size in bytes
+@   mtime INTEGER,               -- Modification time in nanoseconds
+@   ctime INTEGER,               -- Inode change time in nanoseconds
+@   inode INTEGER,               -- Inode number
+@   dev INTEGER,                 -- Device number
+@   tsig INTEGER                 -- When the signature was taken
+@ );
+;
+
+/*
+** A signature is racy if the file changed within this many nanoseconds
+** before tsig.  The first value is used when the file system keeps sub-
+** second timestamps and allows for the coarse clock used by the kernel
+** to stamp files.  The second is for file systems that keep timestamps
+** to the second, or to two seconds for FAT.
+*/
+#define VSIG_RACY_NS         ((i64)20000000)
+#define VSIG_RACY_COARSE_NS  ((i64)2000000000)
+
+/*
+** Create the VSIG table if it does not already exist.
+*/
+void vfile_sig_init(void){
+  db_multi_exec(zVsigSchema /*works-like:""*/);
+}
+
+/*
+** Return the current time in nanoseconds since 1970, the same epoch
+** used by file timestamps.
+*/
+static i64 vfile_sig_now(void){
+  return (current_time_in_milliseconds() - (i64)210866760000000)*1000000;
+}
+
+/*
+** Stat file zFullname into *pSig.  Return the time, taken just before
+** the stat(), to be recorded with the signature, or -1 if the file does
+** not exist.  The content hash later recorded with the signature must
+** be of content that was known or read no earlier than the stat().
+*/
+i64 vfile_sig_stat(const char *zFullname, FileSig *pSig){
+  i64 tSig = vfile_sig_now();
+  if( file_repo_stat(zFullname, pSig) ) return -1;
+  return tSig;
+}
+
+/*
+** Return true if the signature pOld taken at time tOld may be trusted
+** for a file whose current signature is pNew.
+*/
+static int vfile_sig_ok(const FileSig *pOld, i64 tOld, const FileSig *pNew){
+  i64 tChange;
+  if( pOld->iSize!=pNew->iSize
+   || pOld->iMtimeNs!=pNew->iMtimeNs
+   || pOld->iCtimeNs!=pNew->iCtimeNs
+   || pOld->iIno!=pNew->iIno
+   || pOld->iDev!=pNew->iDev
+  ){
+    return 0;
+  }
+  tChange = pOld->iCtimeNs>pOld->iMtimeNs ? pOld->iCtimeNs : pOld->iMtimeNs;
+  if( tChange%1000000000==0 ){
+    return tChange < tOld - VSIG_RACY_COARSE_NS;
+  }
+  return tChange < tOld - VSIG_RACY_NS;
+}
+
+/*
+** Record that the file zFullname, whose signature pSig was taken at
+** time tSig by vfile_sig_stat(), has content hash zHash.
+*/
+void vfile_sig_save(
+  const char *zFullname,   /* Full pathname of a file in the check-out */
+  const FileSig *pSig,     /* Its signature */
+  i64 tSig,                /* When the signature was taken */
+  const char *zHash        /* Hash of its content */
+){
+  int nRoot = (int)strlen(g.zLocalRoot);
+  if( tSig<0 || zHash==0 ) return;
+  if( strncmp(zFullname, g.zLocalRoot, nRoot)!=0 ) return;
+  db_multi_exec(
+    "REPLACE INTO vsig(pathname,hash,size,mtime,ctime,inode,dev,tsig)"
+    " VALUES(%Q,%Q,%lld,%lld,%lld,%lld,%lld,%lld)",
+    zFullname+nRoot, zHash, pSig->iSize, pSig->iMtimeNs, pSig->iCtimeNs,
+    pSig->iIno, pSig->iDev, tSig
+  );
+}
+
+/*
+** The extra WHERE clause used by vfile_check_signature() to check only
+** the VFILE entries that the fsmonitor daemon reports as possibly
+** changed, together with those that are added, removed, renamed or
+** already known to be changed.
+*/
+static const char zFsmDirty[] =
+@ AND (chnged OR deleted OR vfile.rid==0 OR origname NOT NULL
+@   OR vfile.pathname IN (SELECT name FROM fsmdirty)
+@   OR EXISTS(SELECT 1 FROM fsmdirty WHERE isdir
+@        AND substr(vfile.pathname,1,length(name)+1)=name||'/'))
+;
+
+/*
+** Information about a single file being checked by vfile_check_signature().
+** Fields down to zSigHash are filled in from the VFILE and VSIG tables.
+** The rest are filled in by vfile_check_one(), which may run on a worker
+** thread.
+*/
+typedef struct VfileCheck VfileCheck;
+struct VfileCheck {
+  int id;                  /* VFILE.ID */
+  int rid;                 /* VFILE.MRID */
+  int isDeleted;           /* VFILE.DELETED */
+  int oldChnged;           /* VFILE.CHNGED */
+  int origPerm;            /* PERM_EXE, PERM_LNK or PERM_REG per VFILE */
+  i64 oldMtime;            /* VFILE.MTIME */
+  i64 origSize;            /* Size of the artifact */
+  int useMtime;            /* Trust mtimes and signatures to detect changes */
+  int nUuid;               /* Length of zUuid */
+  char zUuid[HNAME_MAX+1]; /* Hash of the artifact, if rid>0 */
+  char *zName;             /* Full pathname of the file */
+  int hasSig;              /* True if there is a VSIG entry for the file */
+  FileSig sig;             /* The signature from VSIG */
+  i64 tSig;                /* VSIG.TSIG */
+  char zSigHash[HNAME_MAX+1]; /* VSIG.HASH */
+  int chnged;              /* New value of VFILE.CHNGED */
+  int notFile;             /* Exists but is not a file or symlink */
+  FileSig cur;             /* Current signature of the file on disk */
+  i64 tCur;                /* When cur was taken */
+  int sigOk;               /* True if sig may be trusted */
+  int isHashed;            /* True if zHash holds the hash of the file */
+  char zHash[HNAME_MAX+1]; /* Hash of the file on disk */
+};
+
+/*
+** The number of threads to be used by vfile_check_signature().  Zero
+** to use the "hash-threads" setting.
+*/
+static int nVfileCheckThread = 0;
+
+/*
+** Return true if the content of the file described by p is the same
+** as the artifact it was checked out from.  Use the signature from
+** VSIG, if it can be trusted, or else hash the file.
+*/
+static int vfile_check_same(VfileCheck *p){
+  if( p->sigOk ){
+    return memcmp(p->zSigHash, p->zUuid, p->nUuid+1)==0;
+  }
+  if( hname_file_hash_mt(p->zName, p->cur.perm==PERM_LNK, p->nUuid,
+                         p->zHash) ){
+    return 0;
+  }
+  p->isHashed = 1;
+  return memcmp(p->zHash, p->zUuid, p->nUuid)==0;
+}
+
+/*
+** Stat a single file and, if necessary, compare its content against
+** the artifact hash to determine whether or not the file has changed.
+** This routine does not touch the database and may be run on a
+** worker thread.
+*/
+static void vfile_check_one(void *pArg){
+  VfileCheck *p = (VfileCheck*)pArg;
+  int chnged = p->oldChnged;
+  p->tCur = vfile_sig_stat(p->zName, &p->cur);
+  p->sigOk = p->useMtime && p->hasSig && p->tCur>=0
+               && vfile_sig_ok(&p->sig, p->tSig, &p->cur);
+  if( chnged==0 && (p->isDeleted || p->rid==0) ){
+    /* "fossil rm" or "fossil add" always change the file */
+    chnged = 1;
+  }else if( !p->cur.isFile && p->cur.iSize>=0 ){
+    p->notFile = 1;
+    chnged = 1;
+  }
+  if( p->origSize!=p->cur.iSize ){
+    if( chnged!=1 ){
+      /* A file size change is definitive - the file has changed.  No
+      ** need to check the mtime or hash */
+      chnged = 1;
+    }
+  }else if( chnged==1 && p->rid!=0 && !p->isDeleted ){
+    /* File is believed to have changed but it is the same size.
+    ** Double check that it really has changed by looking at content. */
+    if( vfile_check_same(p) ) chnged = 0;
+  }else if( (chnged==0 || chnged==2 || chnged==4)
+         && (p->useMtime==0 || p->hasSig || p->cur.iMtime!=p->oldMtime) ){
+    /* For files that were formerly believed to be unchanged or that were
+    ** changed by merging, if their signature or mtime changes, or
+    ** unconditionally if --hash is used, check to see if they have been
+    ** edited by looking at their artifact hashes.  A file with a VSIG
+    ** entry is checked even if its mtime is unchanged, since the mtime is
+    ** only to the second. */
+    if( !vfile_check_same(p) ) chnged = 1;
+  }
+  p->chnged = chnged;
+}
+
+/*
+** Free a VfileCheck object.
+*/
+static void vfile_check_free(void *pArg){
+  VfileCheck *p = (VfileCheck*)pArg;
+  fossil_free(p->zName);
+  fossil_free(p);
+}
+
 /*
 ** Look at every VFILE entry with the given vid and update VFILE.CHNGED field
 ** according to whether or not the file has changed.
@@ -169,117 +401,175 @@ int load_vfile_from_rid(int vid){
 ** If the mtime is used, it is used only to determine if files are the same.
 ** If the mtime of a file has changed, we still examine the on-disk content
 ** to see whether or not the edit was a null-edit.
+**
+** When the mtime is used, so is the signature of the file in the VSIG
+** table, if there is one.  A file whose signature is unchanged and not
+** racy is known to have the content recorded with that signature and
+** is not read.  Every file that is hashed has its signature recorded.
+**
+** If the "fossil fsmonitor" daemon is running, only files that it has
+** seen change since the last scan, and files that are added, removed,
+** renamed or already known to be changed, are checked.
+**
+** The stat() and hashing of each file is done by vfile_check_one(), on a
+** pool of worker threads as set by the "hash-threads" setting.  Database
+** reads and updates all happen on the calling thread, in VFILE order.
 */
 void vfile_check_signature(int vid, unsigned int cksigFlags){
   int nErr = 0;
   Stmt q;
   int useMtime = (cksigFlags & CKSIG_HASH)==0
                     && db_get_boolean("mtime-changes", 1);
+  int nThread = nVfileCheckThread;
+  int bEof = 0;
+  int useFsm;
+  int bPartial = 0;
+  WorkQueue *pQueue;
+  VfileCheck *p;
 
+  if( nThread<=0 ) nThread = db_get_int("hash-threads", 0);
+  if( nThread<=0 ) nThread = workqueue_default_nthread(8);
+  if( nThread>1
+   && db_int(0, "SELECT count(*) FROM vfile WHERE vid=%d", vid)<64 ){
+    nThread = 1;
+  }
+  vfile_sig_now();   /* Initialize the clock before starting any threads */
+  pQueue = workqueue_new(nThread, nThread*16, vfile_check_one);
   db_begin_transaction();
-  db_prepare(&q, "SELECT id, %Q || pathname,"
-                 "       vfile.mrid, deleted, chnged, uuid, size, mtime,"
-                 "      CASE WHEN isexe THEN %d WHEN islink THEN %d ELSE %d END"
+  vfile_sig_init();
+  useFsm = (cksigFlags & (CKSIG_HASH|CKSIG_SETMTIME))==0
+            && vid==db_lget_int("checkout", 0);
+  if( useFsm ) bPartial = fsmonitor_begin_scan(vid);
+  db_prepare(&q, "SELECT vfile.id, %Q || vfile.pathname, vfile.mrid,"
+                 "       deleted, chnged, uuid, blob.size, vfile.mtime,"
+                 "      CASE WHEN isexe THEN %d WHEN islink THEN %d ELSE %d END,"
+                 "       vsig.hash, vsig.size, vsig.mtime, vsig.ctime,"
+                 "       vsig.inode, vsig.dev, vsig.tsig"
                  "  FROM vfile LEFT JOIN blob ON vfile.mrid=blob.rid"
-                 " WHERE vid=%d ", g.zLocalRoot, PERM_EXE, PERM_LNK, PERM_REG,
-                 vid);
-  while( db_step(&q)==SQLITE_ROW ){
-    int id, rid, isDeleted;
-    const char *zName;
-    int chnged = 0;
-    int oldChnged;
-#ifndef _WIN32
-    int origPerm;
-    int currentPerm;
-#endif
-    i64 oldMtime;
-    i64 currentMtime;
-    i64 origSize;
-    i64 currentSize;
-
-    id = db_column_int(&q, 0);
-    zName = db_column_text(&q, 1);
-    rid = db_column_int(&q, 2);
-    isDeleted = db_column_int(&q, 3);
-    oldChnged = chnged = db_column_int(&q, 4);
-    oldMtime = db_column_int64(&q, 7);
-    origSize = db_column_int64(&q, 6);
-    currentSize = file_size(zName, RepoFILE);
-    currentMtime = file_mtime(0, 0);
-#ifndef _WIN32
-    origPerm = db_column_int(&q, 8);
-    currentPerm = file_perm(zName, RepoFILE);
-#endif
-    if( chnged==0 && (isDeleted || rid==0) ){
-      /* "fossil rm" or "fossil add" always change the file */
-      chnged = 1;
-    }else if( !file_isfile_or_link(0) && currentSize>=0 ){
-      if( cksigFlags & CKSIG_ENOTFILE ){
-        fossil_warning("not an ordinary file: %s", zName);
-        nErr++;
+                 "       LEFT JOIN vsig ON vsig.pathname=vfile.pathname"
+                 " WHERE vid=%d %s", g.zLocalRoot, PERM_EXE, PERM_LNK, PERM_REG,
+                 vid, bPartial ? zFsmDirty/*safe-for-%s*/ : "");
+  while( 1 ){
+    int chnged;
+    if( bEof || workqueue_full(pQueue) || (bEof = db_step(&q)!=SQLITE_ROW) ){
+      /* Finish the oldest file.  Stop when all files are done. */
+      if( (p = workqueue_pop(pQueue))==0 ) break;
+    }else{
+      p = fossil_malloc( sizeof(*p) );
+      memset(p, 0, sizeof(*p));
+      p->id = db_column_int(&q, 0);
+      p->zName = fossil_strdup(db_column_text(&q, 1));
+      p->rid = db_column_int(&q, 2);
+      p->isDeleted = db_column_int(&q, 3);
+      p->oldChnged = db_column_int(&q, 4);
+      p->nUuid = db_column_bytes(&q, 5);
+      if( p->nUuid>HNAME_MAX ) p->nUuid = 0;
+      memcpy(p->zUuid, db_column_text(&q, 5), p->nUuid);
+      p->origSize = db_column_int64(&q, 6);
+      p->oldMtime = db_column_int64(&q, 7);
+      p->origPerm = db_column_int(&q, 8);
+      p->useMtime = useMtime;
+      if( db_column_bytes(&q, 9)==p->nUuid && p->nUuid>0 ){
+        p->hasSig = 1;
+        memcpy(p->zSigHash, db_column_text(&q, 9), p->nUuid);
+        p->sig.iSize = db_column_int64(&q, 10);
+        p->sig.iMtimeNs = db_column_int64(&q, 11);
+        p->sig.iCtimeNs = db_column_int64(&q, 12);
+        p->sig.iIno = db_column_int64(&q, 13);
+        p->sig.iDev = db_column_int64(&q, 14);
+        p->tSig = db_column_int64(&q, 15);
       }
-      chnged = 1;
+      workqueue_push(pQueue, p);
+      continue;
     }
-    if( origSize!=currentSize ){
-      if( chnged!=1 ){
-        /* A file size change is definitive - the file has changed.  No
-        ** need to check the mtime or hash */
-        chnged = 1;
-      }
-    }else if( chnged==1 && rid!=0 && !isDeleted ){
-      /* File is believed to have changed but it is the same size.
-      ** Double check that it really has changed by looking at content. */
-      const char *zUuid = db_column_text(&q, 5);
-      int nUuid = db_column_bytes(&q, 5);
-      assert( origSize==currentSize );
-      if( hname_verify_file_hash(zName, zUuid, nUuid) ) chnged = 0;
-    }else if( (chnged==0 || chnged==2 || chnged==4)
-           && (useMtime==0 || currentMtime!=oldMtime) ){
-      /* For files that were formerly believed to be unchanged or that were
-      ** changed by merging, if their mtime changes, or unconditionally
-      ** if --hash is used, check to see if they have been edited by
-      ** looking at their artifact hashes */
-      const char *zUuid = db_column_text(&q, 5);
-      int nUuid = db_column_bytes(&q, 5);
-      assert( origSize==currentSize );
-      if( !hname_verify_file_hash(zName, zUuid, nUuid) ) chnged = 1;
+    chnged = p->chnged;
+    if( p->notFile && (cksigFlags & CKSIG_ENOTFILE)!=0 ){
+      fossil_warning("not an ordinary file: %s", p->zName);
+      nErr++;
+    }
+    if( p->isHashed && p->cur.isFile ){
+      vfile_sig_save(p->zName, &p->cur, p->tCur, p->zHash);
     }
     if( (cksigFlags & CKSIG_SETMTIME) && (chnged==0 || chnged==2 || chnged==4)){
       i64 desiredMtime;
-      if( mtime_of_manifest_file(vid,rid,&desiredMtime)==0 ){
-        if( currentMtime!=desiredMtime ){
-          file_set_mtime(zName, desiredMtime);
-          currentMtime = file_mtime(zName, RepoFILE);
+      if( mtime_of_manifest_file(vid,p->rid,&desiredMtime)==0 ){
+        if( p->cur.iMtime!=desiredMtime ){
+          file_set_mtime(p->zName, desiredMtime);
+          p->cur.iMtime = file_mtime(p->zName, RepoFILE);
         }
       }
     }
 #ifndef _WIN32
-    if( origPerm!=PERM_LNK && currentPerm==PERM_LNK ){
+    if( p->origPerm!=PERM_LNK && p->cur.perm==PERM_LNK ){
        /* Changing to a symlink takes priority over all other change types. */
        chnged = 7;
     }else if( chnged==0 || chnged==6 || chnged==7 || chnged==8 || chnged==9 ){
        /* Confirm metadata change types. */
-      if( origPerm==currentPerm ){
+      if( p->origPerm==p->cur.perm ){
         chnged = 0;
-      }else if( currentPerm==PERM_EXE ){
+      }else if( p->cur.perm==PERM_EXE ){
         chnged = 6;
-      }else if( origPerm==PERM_EXE ){
+      }else if( p->origPerm==PERM_EXE ){
         chnged = 8;
-      }else if( origPerm==PERM_LNK ){
+      }else if( p->origPerm==PERM_LNK ){
         chnged = 9;
       }
     }
 #endif
-    if( currentMtime!=oldMtime || chnged!=oldChnged ){
+    if( p->cur.iMtime!=p->oldMtime || chnged!=p->oldChnged ){
       db_multi_exec("UPDATE vfile SET mtime=%lld, chnged=%d WHERE id=%d",
-                    currentMtime, chnged, id);
+                    p->cur.iMtime, chnged, p->id);
     }
+    vfile_check_free(p);
   }
   db_finalize(&q);
+  workqueue_free(pQueue, vfile_check_free);
   if( nErr ) fossil_fatal("abort due to prior errors");
+  db_multi_exec(
+    "DELETE FROM vsig WHERE pathname NOT IN (SELECT pathname FROM vfile)"
+  );
+  if( useFsm ) fsmonitor_end_scan(vid);
   db_end_transaction(0);
 }
 
+/*
+** COMMAND: test-vfile-check
+**
+** Usage: %fossil test-vfile-check ?OPTIONS?
+**
+** Check every file of the current check-out for changes, the same as
+** "fossil status" does, and report the number of files checked per
+** second.
+**
+** Options:
+**    --hash          Verify file status using hashing rather than
+**                    relying on file mtimes
+**    --repeat N      Run the check N times.  Default 1.
+**    --threads N     Use N threads rather than the "hash-threads" setting
+*/
+void test_vfile_check_cmd(void){
+  int useHash = find_option("hash",0,0)!=0;
+  const char *zRepeat = find_option("repeat",0,1);
+  const char *zThreads = find_option("threads",0,1);
+  int nRepeat = zRepeat ? atoi(zRepeat) : 1;
+  int vid, nFile, i;
+  sqlite3_int64 tm;
+  db_must_be_within_tree();
+  verify_all_options();
+  if( zThreads ) nVfileCheckThread = atoi(zThreads);
+  if( nRepeat<1 ) nRepeat = 1;
+  vid = db_lget_int("checkout", 0);
+  nFile = db_int(0, "SELECT count(*) FROM vfile WHERE vid=%d", vid);
+  tm = current_time_in_milliseconds();
+  for(i=0; i<nRepeat; i++){
+    vfile_check_signature(vid, useHash ? CKSIG_HASH : 0);
+  }
+  tm = current_time_in_milliseconds() - tm;
+  fossil_print("%d files in %.3f seconds: %.0f files/s\n",
+               nFile*nRepeat, tm/1000.0,
+               nFile*nRepeat*1000.0/(tm>0 ? tm : 1));
+}
+
 /*
 ** Write all files from vid to the disk.  Or if vid==0 and id!=0
 ** write just the specific file where VFILE.ID=id.
@@ -293,15 +583,20 @@ void vfile_to_disk(
   Stmt q;
   Blob content;
   int nRepos = strlen(g.zLocalRoot);
+  FileSig sig;
+  i64 tSig;
 
+  vfile_sig_init();
   if( vid>0 && id==0 ){
-    db_prepare(&q, "SELECT id, %Q || pathname, mrid, isexe, islink"
+    db_prepare(&q, "SELECT id, %Q || pathname, mrid, isexe, islink,"
+                   "       (SELECT uuid FROM blob WHERE rid=mrid)"
                    "  FROM vfile"
                    " WHERE vid=%d AND mrid>0",
                    g.zLocalRoot, vid);
   }else{
     assert( vid==0 && id>0 );
-    db_prepare(&q, "SELECT id, %Q || pathname, mrid, isexe, islink"
+    db_prepare(&q, "SELECT id, %Q || pathname, mrid, isexe, islink,"
+                   "       (SELECT uuid FROM blob WHERE rid=mrid)"
                    "  FROM vfile"
                    " WHERE id=%d AND mrid>0",
                    g.zLocalRoot, id);
@@ -309,18 +604,25 @@ void vfile_to_disk(
   while( db_step(&q)==SQLITE_ROW ){
     int id, rid, isExe, isLink;
     const char *zName;
+    const char *zUuid;
 
     id = db_column_int(&q, 0);
     zName = db_column_text(&q, 1);
     rid = db_column_int(&q, 2);
     isExe = db_column_int(&q, 3);
     isLink = db_column_int(&q, 4);
+    zUuid = db_column_text(&q, 5);
     content_get(rid, &content);
+    tSig = vfile_sig_stat(zName, &sig);
     if( file_is_the_same(&content, zName) ){
       blob_reset(&content);
       if( file_setexe(zName, isExe) ){
+        /* The chmod() changed the ctime, so sig is stale.  Let the next
+        ** status check rehash the file rather than record it. */
         db_multi_exec("UPDATE vfile SET mtime=%lld WHERE id=%d",
                       file_mtime(zName, RepoFILE), id);
+      }else{
+        vfile_sig_save(zName, &sig, tSig, zUuid);
       }
       continue;
     }
@@ -355,8 +657,10 @@ void vfile_to_disk(
     }
     file_setexe(zName, isExe);
     blob_reset(&content);
+    tSig = vfile_sig_stat(zName, &sig);
+    vfile_sig_save(zName, &sig, tSig, zUuid);
     db_multi_exec("UPDATE vfile SET mtime=%lld WHERE id=%d",
-                  file_mtime(zName, RepoFILE), id);
+                  sig.iMtime, id);
   }
   db_finalize(&q);
 }
@@ -0,0 +1,260 @@
+/*
+** Copyright (c) 2020 D. Richard Hipp
+**
+** This program is free software; you can redistribute it and/or
+** modify it under the terms of the Simplified BSD License (also
+** known as the "2-Clause License" or "FreeBSD License".)
+
+** This program is distributed in the hope that it will be useful,
+** but without any warranty; without even the implied warranty of
+** merchantability or fitness for a particular purpose.
+**
+** Author contact information:
+**   drh@hwaci.com
+**   http://www.hwaci.com/drh/
+**
+*******************************************************************************
+**
+** This file implements a simple work queue that runs jobs on a pool
+** of worker threads and hands the finished jobs back to the caller in
+** the same order in which they were submitted.
+**
+** Worker threads must never touch the database or any other global
+** state.  They are only used for pure computation such as zlib
+** decompression, delta application and hashing.  All SQL remains on
+** the thread that owns the queue.
+**
+** Typical usage:
+**
+**     pQueue = workqueue_new(nThread, nThread*4, xWork);
+**     while( more jobs ){
+**       if( workqueue_full(pQueue) ) finish(workqueue_pop(pQueue));
+**       workqueue_push(pQueue, pJob);
+**     }
+**     while( (pJob = workqueue_pop(pQueue))!=0 ) finish(pJob);
+**     workqueue_free(pQueue, 0);
+**
+** If threads are not available on the build platform, or if the
+** number of threads requested is less than two, then each job is run
+** synchronously inside of workqueue_push().
+*/
+#include "config.h"
+#include "workqueue.h"
+#include <assert.h>
+#if defined(HAVE_PTHREAD_CREATE) && !defined(_WIN32)
+# include <pthread.h>
+# include <unistd.h>
+# define WORKQUEUE_THREADS 1
+#else
+# define WORKQUEUE_THREADS 0
+#endif
+
+#if INTERFACE
+typedef struct WorkQueue WorkQueue;
+#endif
+
+/*
+** A work queue.  Jobs are held in the ring buffer aJob[] in the order
+** in which they were submitted.  The nWait jobs starting at iStart
+** have not yet been handed to a worker thread.
+*/
+struct WorkQueue {
+  void (*xWork)(void*);  /* Function run on each job */
+  int nThread;           /* Number of worker threads.  0 for synchronous */
+  int nSlot;             /* Number of slots in aJob[] */
+  int nJob;              /* Number of jobs submitted but not yet popped */
+  int iHead;             /* Oldest job not yet popped */
+  int iStart;            /* Next job to hand to a worker */
+  int nWait;             /* Number of jobs waiting for a worker */
+  int bShutdown;         /* True when worker threads should exit */
+  struct WorkQueueJob {
+    void *pArg;            /* The job */
+    int done;              /* True when xWork(pArg) has finished */
+  } *aJob;
+#if WORKQUEUE_THREADS
+  pthread_mutex_t mutex; /* Mutex protecting all of the above */
+  pthread_cond_t cWork;  /* Signalled when a new job is submitted */
+  pthread_cond_t cDone;  /* Signalled when a job finishes */
+  pthread_t *aThread;    /* The worker threads */
+#endif
+};
+
+/*
+** Return true if worker threads are supported by this build.
+*/
+int workqueue_has_threads(void){
+  return WORKQUEUE_THREADS;
+}
+
+/*
+** Return the number of worker threads to use when the user has not
+** asked for a specific number:  one per online CPU, but no more than
+** mxThread.  Return 1 if threads are not supported.
+*/
+int workqueue_default_nthread(int mxThread){
+  int n = 1;
+#if WORKQUEUE_THREADS && defined(_SC_NPROCESSORS_ONLN)
+  n = (int)sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+  if( n>mxThread ) n = mxThread;
+  if( n<1 ) n = 1;
+  return n;
+}
+
+#if WORKQUEUE_THREADS
+/*
+** The main routine for worker threads.
+*/
+static void *workqueue_main(void *pArg){
+  WorkQueue *p = (WorkQueue*)pArg;
+  pthread_mutex_lock(&p->mutex);
+  while( 1 ){
+    int iJob;
+    while( !p->bShutdown && p->nWait==0 ){
+      pthread_cond_wait(&p->cWork, &p->mutex);
+    }
+    if( p->bShutdown ) break;
+    iJob = p->iStart;
+    p->iStart = (p->iStart+1)%p->nSlot;
+    p->nWait--;
+    pthread_mutex_unlock(&p->mutex);
+    p->xWork(p->aJob[iJob].pArg);
+    pthread_mutex_lock(&p->mutex);
+    p->aJob[iJob].done = 1;
+    pthread_cond_broadcast(&p->cDone);
+  }
+  pthread_mutex_unlock(&p->mutex);
+  return 0;
+}
+#endif
+
+/*
+** Create a new work queue that runs xWork on each job using nThread
+** worker threads.  At most nSlot jobs may be submitted and not yet
+** popped at any one time.
+*/
+WorkQueue *workqueue_new(int nThread, int nSlot, void (*xWork)(void*)){
+  WorkQueue *p = fossil_malloc( sizeof(*p) );
+  memset(p, 0, sizeof(*p));
+  p->xWork = xWork;
+  if( nThread<2 || !WORKQUEUE_THREADS ){
+    nThread = 0;
+    nSlot = 1;
+  }
+  if( nSlot<nThread ) nSlot = nThread;
+  p->nSlot = nSlot;
+  p->aJob = fossil_malloc( sizeof(p->aJob[0])*nSlot );
+  memset(p->aJob, 0, sizeof(p->aJob[0])*nSlot);
+#if WORKQUEUE_THREADS
+  if( nThread>0 ){
+    int i;
+    pthread_mutex_init(&p->mutex, 0);
+    pthread_cond_init(&p->cWork, 0);
+    pthread_cond_init(&p->cDone, 0);
+    p->aThread = fossil_malloc( sizeof(p->aThread[0])*nThread );
+    for(i=0; i<nThread; i++){
+      if( pthread_create(&p->aThread[i], 0, workqueue_main, p) ) break;
+    }
+    p->nThread = i;
+  }
+#endif
+  return p;
+}
+
+/*
+** Return the number of worker threads used by the queue.  Zero means
+** that jobs run synchronously.
+*/
+int workqueue_nthread(WorkQueue *p){
+  return p->nThread;
+}
+
+/*
+** Return true if no more jobs can be pushed until a job is popped.
+*/
+int workqueue_full(WorkQueue *p){
+  return p->nJob>=p->nSlot;
+}
+
+/*
+** Submit a new job.  The queue must not be full.
+*/
+void workqueue_push(WorkQueue *p, void *pArg){
+  int i;
+  assert( !workqueue_full(p) );
+  i = (p->iHead+p->nJob)%p->nSlot;
+  if( p->nThread==0 ){
+    p->xWork(pArg);
+    p->aJob[i].pArg = pArg;
+    p->aJob[i].done = 1;
+    p->nJob++;
+    return;
+  }
+#if WORKQUEUE_THREADS
+  pthread_mutex_lock(&p->mutex);
+  p->aJob[i].pArg = pArg;
+  p->aJob[i].done = 0;
+  p->nJob++;
+  p->nWait++;
+  pthread_cond_signal(&p->cWork);
+  pthread_mutex_unlock(&p->mutex);
+#endif
+}
+
+/*
+** Wait for the oldest job to finish, then remove it from the queue and
+** return it.  Return NULL if the queue is empty.
+*/
+void *workqueue_pop(WorkQueue *p){
+  void *pArg;
+  if( p->nJob==0 ) return 0;
+#if WORKQUEUE_THREADS
+  if( p->nThread>0 ){
+    pthread_mutex_lock(&p->mutex);
+    while( !p->aJob[p->iHead].done ){
+      pthread_cond_wait(&p->cDone, &p->mutex);
+    }
+  }
+#endif
+  pArg = p->aJob[p->iHead].pArg;
+  p->aJob[p->iHead].done = 0;
+  p->iHead = (p->iHead+1)%p->nSlot;
+  p->nJob--;
+#if WORKQUEUE_THREADS
+  if( p->nThread>0 ){
+    pthread_mutex_unlock(&p->mutex);
+  }
+#endif
+  return pArg;
+}
+
+/*
+** Wait for all outstanding jobs to finish, stop the worker threads and
+** free the queue.  Jobs that have not been popped are passed to xFree,
+** if xFree is not NULL.
+*/
+void workqueue_free(WorkQueue *p, void (*xFree)(void*)){
+  void *pArg;
+  if( p==0 ) return;
+  while( (pArg = workqueue_pop(p))!=0 ){
+    if( xFree ) xFree(pArg);
+  }
+#if WORKQUEUE_THREADS
+  if( p->nThread>0 ){
+    int i;
+    pthread_mutex_lock(&p->mutex);
+    p->bShutdown = 1;
+    pthread_cond_broadcast(&p->cWork);
+    pthread_mutex_unlock(&p->mutex);
+    for(i=0; i<p->nThread; i++){
+      pthread_join(p->aThread[i], 0);
+    }
+    fossil_free(p->aThread);
+    pthread_cond_destroy(&p->cWork);
+    pthread_cond_destroy(&p->cDone);
+    pthread_mutex_destroy(&p->mutex);
+  }
+#endif
+  fossil_free(p->aJob);
+  fossil_free(p);
+}
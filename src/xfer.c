@@ -28,6 +28,45 @@
 */
 #define MAX_REDIRECTS 20
 
+/*
+** SETTING: sync-threads width=5 default=0
+** The number of threads used to check and compress the artifacts that
+** are received by "fossil sync" and "fossil pull", and by a server that
+** accepts a push.  A value of 0 means to use one thread per CPU, up to
+** a maximum of 8.  A value of 1 disables threading.
+*/
+
+/*
+** Artifacts received in "file" cards are expanded, checked against
+** their hashes and compressed on worker threads, in batches of up to
+** this many artifacts or about this many bytes of content.
+*/
+#define XFER_BATCH_FILES 64
+#define XFER_BATCH_BYTES 262144
+
+/*
+** A batch of artifacts received in "file" cards.  Everything that
+** touches the database, including fetching delta sources and storing
+** the results, is done by the thread that parses the cards, in the
+** order in which the cards arrived.
+*/
+typedef struct XferBatch XferBatch;
+struct XferBatch {
+  int nFile;                /* Number of artifacts in aFile[] */
+  int nByte;                /* Bytes of content received */
+  struct XferFile {
+    char zUuid[HNAME_MAX+1];  /* Hash of the artifact */
+    int nUuid;                /* Length of zUuid */
+    u8 isPriv;                /* True for a private artifact */
+    u8 hasSrc;                /* True if content is a delta against src */
+    u8 isVerified;            /* True if the content matches zUuid */
+    u8 isStored;              /* True if cmpr expands to the content */
+    Blob src;                 /* Delta source */
+    Blob content;             /* Content as received, then expanded */
+    Blob cmpr;                /* Compressed content, ready to be stored */
+  } aFile[XFER_BATCH_FILES];
+};
+
 /*
 ** This structure holds information about the current state of either
 ** a client or a server that is participating in xfer.
@@ -49,6 +88,12 @@ struct Xfer {
   int nDanglingFile;  /* Number of dangling deltas received */
   int mxSend;         /* Stop sending "file" when pOut reaches this size */
   int resync;         /* Send igot cards for all holdings */
+  int reconcile;      /* Other side understands rhash and rlist cards */
+  int nRangeSent;     /* Number of rhash and rlist cards sent */
+  int clonePack;      /* Client accepts "clonepack" cards */
+  char *zPackKey;     /* Clone pack the client already holds part of */
+  WorkQueue *pFileQueue; /* Worker threads that check received files */
+  XferBatch *pBatch;  /* Received files not yet given to pFileQueue */
   u8 syncPrivate;     /* True to enable syncing private content */
   u8 nextIsPrivate;   /* If true, next "file" received is a private */
   u32 clientVersion;  /* Version of the client software */
@@ -96,6 +141,151 @@ static void remote_has(int rid){
   }
 }
 
+/*
+** Expand, check and compress the artifacts of a batch.  This runs on a
+** worker thread and so must not use the database.
+*/
+static void xfer_check_batch(void *pArg){
+  XferBatch *p = (XferBatch*)pArg;
+  int i;
+  for(i=0; i<p->nFile; i++){
+    struct XferFile *pFile = &p->aFile[i];
+    Blob x;
+    if( pFile->hasSrc ){
+      blob_delta_apply(&pFile->src, &pFile->content, &x);
+      blob_reset(&pFile->src);
+      blob_reset(&pFile->content);
+      pFile->content = x;
+    }
+    pFile->isVerified =
+      hname_verify_hash(&pFile->content, pFile->zUuid, pFile->nUuid)!=0;
+    blob_compress(&pFile->content, &pFile->cmpr);
+    blob_zero(&x);
+    pFile->isStored = blob_uncompress(&pFile->cmpr, &x)==0
+                        && blob_compare(&x, &pFile->content)==0;
+    blob_reset(&x);
+  }
+}
+
+/*
+** Store the artifacts of a batch that has been through
+** xfer_check_batch(), then free the batch.  Return the number of
+** artifacts that could not be stored or did not match their hashes.
+*/
+static int xfer_store_batch(Xfer *pXfer, XferBatch *p){
+  int i, rid;
+  int nErr = 0;
+  for(i=0; i<p->nFile; i++){
+    struct XferFile *pFile = &p->aFile[i];
+    int priorRid;
+    if( !pFile->isVerified ){
+      blob_appendf(&pXfer->err, "wrong hash on received artifact: %s",
+                   pFile->zUuid);
+      nErr++;
+    }
+    if( blob_size(&pFile->content)==0 ){
+      rid = content_put_ex(&pFile->content, pFile->zUuid, 0, 0,
+                           pFile->isPriv);
+    }else{
+      priorRid = fast_uuid_to_rid(pFile->zUuid);
+      rid = content_put_ex(&pFile->cmpr, pFile->zUuid, 0,
+                           blob_size(&pFile->content), pFile->isPriv);
+      if( rid && pFile->isVerified && pFile->isStored
+       && (priorRid==0 || !verify_is_pending(priorRid))
+      ){
+        /* The worker thread has already done what verify_rid() would */
+        verify_skip(rid);
+      }
+    }
+    blob_reset(&pFile->cmpr);
+    if( rid==0 ){
+      blob_appendf(&pXfer->err, "%s", g.zErrMsg);
+      blob_reset(&pFile->content);
+      nErr++;
+    }else{
+      if( !pFile->isPriv ) content_make_public(rid);
+      manifest_crosslink(rid, &pFile->content, MC_NO_ERRORS);
+    }
+    assert( blob_is_reset(&pFile->content) );
+    remote_has(rid);
+  }
+  fossil_free(p);
+  return nErr;
+}
+
+/*
+** Hand the batch of received files that is being filled, if any, to
+** the worker threads.  If the worker threads already have as many
+** batches as they can hold, first store the oldest.
+*/
+static void xfer_submit_batch(Xfer *pXfer){
+  if( pXfer->pBatch==0 ) return;
+  if( pXfer->pFileQueue==0 ){
+    int nThread = db_get_int("sync-threads", 0);
+    if( nThread<=0 ) nThread = workqueue_default_nthread(8);
+    pXfer->pFileQueue = workqueue_new(nThread, nThread*2, xfer_check_batch);
+  }
+  if( workqueue_full(pXfer->pFileQueue) ){
+    xfer_store_batch(pXfer, workqueue_pop(pXfer->pFileQueue));
+  }
+  workqueue_push(pXfer->pFileQueue, pXfer->pBatch);
+  pXfer->pBatch = 0;
+}
+
+/*
+** Store all files received so far.  Return the number of them that
+** could not be stored or did not match their hashes.
+*/
+static int xfer_flush_files(Xfer *pXfer){
+  XferBatch *p;
+  int nErr = 0;
+  xfer_submit_batch(pXfer);
+  if( pXfer->pFileQueue==0 ) return 0;
+  while( (p = workqueue_pop(pXfer->pFileQueue))!=0 ){
+    nErr += xfer_store_batch(pXfer, p);
+  }
+  return nErr;
+}
+
+/*
+** Add a file received in a "file" card to the batch being filled.  If
+** pSrc is not NULL then pContent is a delta against pSrc, and this
+** routine takes over responsibility for freeing pSrc.
+*/
+static void xfer_queue_file(
+  Xfer *pXfer,            /* Transfer context */
+  Blob *pUuid,            /* Hash of the artifact */
+  Blob *pContent,         /* Content as received */
+  Blob *pSrc,             /* Delta source, or NULL */
+  int isPriv              /* True for a private artifact */
+){
+  XferBatch *p = pXfer->pBatch;
+  struct XferFile *pFile;
+  if( p==0 ){
+    p = pXfer->pBatch = fossil_malloc( sizeof(*p) );
+    p->nFile = 0;
+    p->nByte = 0;
+  }
+  pFile = &p->aFile[p->nFile++];
+  memset(pFile, 0, sizeof(*pFile));
+  blob_zero(&pFile->src);
+  blob_zero(&pFile->content);
+  blob_zero(&pFile->cmpr);
+  pFile->nUuid = blob_size(pUuid);
+  memcpy(pFile->zUuid, blob_buffer(pUuid), pFile->nUuid);
+  pFile->isPriv = isPriv!=0;
+  /* Copy the content, as the buffer it is in is reused for later cards */
+  blob_append(&pFile->content, blob_buffer(pContent), blob_size(pContent));
+  if( pSrc ){
+    pFile->hasSrc = 1;
+    pFile->src = *pSrc;
+  }
+  p->nByte += blob_size(pContent);
+  if( p->nFile>=XFER_BATCH_FILES || p->nByte>=XFER_BATCH_BYTES ){
+    xfer_submit_batch(pXfer);
+  }
+}
+
 /*
 ** The aToken[0..nToken-1] blob array is a parse of a "file" line
 ** message.  This routine finishes parsing that message and does
@@ -171,42 +361,33 @@ static void xfer_accept_file(
     return;
   }
   if( pXfer->nToken==4 ){
-    Blob src, next;
-    srcid = rid_from_uuid(&pXfer->aToken[2], 1, isPriv);
-    if( content_get(srcid, &src)==0 ){
-      rid = content_put_ex(&content, blob_str(pUuid), srcid,
-                           0, isPriv);
-      Th_AppendToList(pzUuidList, pnUuidList, blob_str(pUuid),
-                      blob_size(pUuid));
-      pXfer->nDanglingFile++;
-      db_multi_exec("DELETE FROM phantom WHERE rid=%d", rid);
-      if( !isPriv ) content_make_public(rid);
-      blob_reset(&src);
-      blob_reset(&content);
-      return;
+    Blob src;
+    srcid = rid_from_uuid(&pXfer->aToken[2], 0, isPriv);
+    if( srcid==0 || content_get(srcid, &src)==0 ){
+      /* The delta source might be one of the files not yet stored */
+      xfer_flush_files(pXfer);
+      srcid = rid_from_uuid(&pXfer->aToken[2], 1, isPriv);
+      if( content_get(srcid, &src)==0 ){
+        rid = content_put_ex(&content, blob_str(pUuid), srcid,
+                             0, isPriv);
+        Th_AppendToList(pzUuidList, pnUuidList, blob_str(pUuid),
+                        blob_size(pUuid));
+        pXfer->nDanglingFile++;
+        db_multi_exec("DELETE FROM phantom WHERE rid=%d", rid);
+        if( !isPriv ) content_make_public(rid);
+        blob_reset(&src);
+        blob_reset(&content);
+        return;
+      }
     }
     pXfer->nDeltaRcvd++;
-    blob_delta_apply(&src, &content, &next);
-    blob_reset(&src);
-    blob_reset(&content);
-    content = next;
+    xfer_queue_file(pXfer, pUuid, &content, &src, isPriv);
   }else{
     pXfer->nFileRcvd++;
+    xfer_queue_file(pXfer, pUuid, &content, 0, isPriv);
   }
-  if( hname_verify_hash(&content, blob_buffer(pUuid), blob_size(pUuid))==0 ){
-    blob_appendf(&pXfer->err, "wrong hash on received artifact: %b", pUuid);
-  }
-  rid = content_put_ex(&content, blob_str(pUuid), 0, 0, isPriv);
   Th_AppendToList(pzUuidList, pnUuidList, blob_str(pUuid), blob_size(pUuid));
-  if( rid==0 ){
-    blob_appendf(&pXfer->err, "%s", g.zErrMsg);
-    blob_reset(&content);
-  }else{
-    if( !isPriv ) content_make_public(rid);
-    manifest_crosslink(rid, &content, MC_NO_ERRORS);
-  }
-  assert( blob_is_reset(&content) );
-  remote_has(rid);
+  blob_reset(&content);
 }
 
 /*
@@ -283,6 +464,85 @@ static void xfer_accept_compressed_file(
   blob_reset(&content);
 }
 
+/*
+** The aToken[0..nToken-1] blob array is a parse of a "clonepack" line
+** message.  Load the records of the chunk that follows directly into
+** the BLOB and DELTA tables, keeping the RIDs that the server uses.
+** See send_clone_pack() for the format.
+**
+** *pzKey is the key of the pack received so far, or NULL if none.  If
+** the server has started over with a different pack, discard what was
+** received before.  Write the number of artifacts loaded into *pnLoad.
+** Return true if this was the last chunk of the pack.
+*/
+static int xfer_accept_clone_pack(Xfer *pXfer, char **pzKey, int *pnLoad){
+  static Stmt ins1, ins2;
+  Blob chunk, line, content;
+  Blob aTok[5];
+  int minRid, maxRid, lastRid, size;
+  int nLoad = 0;
+
+  if( !blob_is_int(&pXfer->aToken[2], &minRid)
+   || !blob_is_int(&pXfer->aToken[3], &maxRid)
+   || !blob_is_int(&pXfer->aToken[4], &lastRid)
+   || !blob_is_int(&pXfer->aToken[5], &size)
+  ){
+    blob_appendf(&pXfer->err, "malformed clonepack line");
+    return 0;
+  }
+  if( *pzKey==0 || !blob_eq_str(&pXfer->aToken[1], *pzKey, -1) ){
+    if( *pzKey ){
+      db_multi_exec("DELETE FROM blob; DELETE FROM delta;");
+      fossil_free(*pzKey);
+    }
+    *pzKey = fossil_strdup(blob_str(&pXfer->aToken[1]));
+  }
+  content_rcvid_init(0);
+  db_static_prepare(&ins1,
+    "INSERT INTO blob(rid,rcvid,size,uuid,content)"
+    "VALUES(:rid,:rcvid,:size,:uuid,:data)"
+  );
+  db_static_prepare(&ins2, "INSERT INTO delta(rid,srcid) VALUES(:rid,:src)");
+  blob_zero(&chunk);
+  blob_extract(pXfer->pIn, size, &chunk);
+  while( blob_line(&chunk, &line) ){
+    int rid, srcid, szU, szC;
+    if( blob_tokenize(&line, aTok, count(aTok))!=5
+     || !blob_is_int(&aTok[0], &rid)
+     || !blob_is_int(&aTok[1], &srcid)
+     || !blob_is_int(&aTok[2], &szU)
+     || !blob_is_int(&aTok[3], &szC)
+     || !blob_is_hname(&aTok[4])
+     || rid<minRid || rid>maxRid
+     || blob_extract(&chunk, szC, &content)!=szC
+    ){
+      blob_appendf(&pXfer->err, "malformed clonepack record");
+      break;
+    }
+    db_bind_int(&ins1, ":rid", rid);
+    db_bind_int(&ins1, ":rcvid", g.rcvid);
+    db_bind_int(&ins1, ":size", szU);
+    db_bind_str(&ins1, ":uuid", &aTok[4]);
+    db_bind_blob(&ins1, ":data", &content);
+    db_exec(&ins1);
+    if( srcid ){
+      db_bind_int(&ins2, ":rid", rid);
+      db_bind_int(&ins2, ":src", srcid);
+      db_exec(&ins2);
+      pXfer->nDeltaRcvd++;
+    }else{
+      pXfer->nFileRcvd++;
+    }
+    if( g.eHashPolicy==HPOLICY_AUTO && blob_size(&aTok[4])>HNAME_LEN_SHA1 ){
+      g.eHashPolicy = HPOLICY_SHA3;
+      db_set_int("hash-policy", HPOLICY_SHA3, 0);
+    }
+    nLoad++;
+  }
+  *pnLoad = nLoad;
+  return maxRid>=lastRid;
+}
+
 /*
 ** The aToken[0..nToken-1] blob array is a parse of a "uvfile" line
 ** message.  This routine finishes parsing that message and adds the
@@ -660,6 +920,164 @@ static void send_compressed_file(Xfer *pXfer, int rid){
   db_reset(&q1);
 }
 
+/*
+** Clone packs are sent in chunks of about this many bytes.
+*/
+#define CLONE_PACK_CHUNK 1048576
+
+/*
+** Write into pKey a string that identifies the content of the clone
+** pack that covers artifacts 1 through mxRid.
+**
+** Check-ins add artifacts beyond mxRid and turn older artifacts into
+** deltas against the new ones.  Neither changes the key, and a client
+** that loads a pack made before such changes still ends up with a
+** consistent repository.  Removing artifacts, making them private,
+** shunning them, filling in phantoms or delta-compressing artifacts
+** against each other all change the key, so a chunk of a pack made
+** before any such change is never mixed with one made after it, and a
+** pack never leaves out content that has since arrived.
+*/
+static void clone_pack_key(int mxRid, Blob *pKey){
+  Stmt q;
+  db_prepare(&q,
+    "SELECT (SELECT count(*) FROM blob WHERE rid<=%d),"
+    "       (SELECT count(*) FROM blob WHERE rid<=%d AND size<0),"
+    "       (SELECT count(*) FROM delta WHERE rid<=%d AND srcid<=%d),"
+    "       (SELECT total(srcid)+total(rid) FROM delta"
+    "         WHERE rid<=%d AND srcid<=%d),"
+    "       (SELECT count(*) FROM private), (SELECT count(*) FROM shun)",
+    mxRid, mxRid, mxRid, mxRid, mxRid, mxRid
+  );
+  if( db_step(&q)==SQLITE_ROW ){
+    blob_appendf(pKey, "%d-%d-%d-%d-%lld-%d-%d", mxRid, db_column_int(&q, 0),
+                 db_column_int(&q, 1), db_column_int(&q, 2),
+                 db_column_int64(&q, 3), db_column_int(&q, 4),
+                 db_column_int(&q, 5));
+  }
+  db_finalize(&q);
+}
+
+/*
+** Append to pOut one chunk of the clone pack, beginning with artifact
+** minRid and covering no artifact beyond mxRid.  Return the last RID
+** that the chunk covers.
+**
+** The chunk is a sequence of records in RID order, one for each public
+** artifact that is not a phantom and is not shunned:
+**
+**      RID SRCID USIZE CSIZE HASH \n CONTENT
+**
+** CONTENT is CSIZE bytes copied verbatim from BLOB.CONTENT.  If SRCID
+** is not zero then CONTENT is a delta against artifact SRCID, which is
+** also part of the pack.  An artifact whose delta source is not part of
+** the pack is sent in full.
+*/
+static int clone_pack_chunk(int minRid, int mxRid, Blob *pOut){
+  Stmt q;
+  int lastRid = mxRid;
+  db_prepare(&q,
+    "SELECT blob.rid, blob.uuid, blob.size, blob.content,"
+    "       CASE WHEN delta.srcid IS NULL THEN 0"
+    "            WHEN delta.srcid>%d OR delta.srcid IN private"
+    "              OR NOT EXISTS(SELECT 1 FROM blob AS src"
+    "                    WHERE src.rid=delta.srcid AND src.size>=0"
+    "                      AND src.uuid NOT IN (SELECT uuid FROM shun))"
+    "            THEN -1"
+    "            ELSE delta.srcid END"
+    "  FROM blob LEFT JOIN delta ON (delta.rid=blob.rid)"
+    " WHERE blob.rid BETWEEN %d AND %d"
+    "   AND blob.size>=0"
+    "   AND blob.rid NOT IN private"
+    "   AND blob.uuid NOT IN (SELECT uuid FROM shun)"
+    " ORDER BY blob.rid",
+    mxRid, minRid, mxRid
+  );
+  while( db_step(&q)==SQLITE_ROW ){
+    int rid = db_column_int(&q, 0);
+    int srcid = db_column_int(&q, 4);
+    if( srcid<0 ){
+      Blob full;
+      content_get(rid, &full);
+      blob_appendf(pOut, "%d 0 %d ", rid, blob_size(&full));
+      blob_compress(&full, &full);
+      blob_appendf(pOut, "%d %s\n", blob_size(&full), db_column_text(&q,1));
+      blob_append(pOut, blob_buffer(&full), blob_size(&full));
+      blob_reset(&full);
+    }else{
+      blob_appendf(pOut, "%d %d %d %d %s\n", rid, srcid, db_column_int(&q,2),
+                   db_column_bytes(&q, 3), db_column_text(&q, 1));
+      blob_append(pOut, db_column_raw(&q, 3), db_column_bytes(&q, 3));
+    }
+    if( blob_size(pOut)>=CLONE_PACK_CHUNK ){
+      lastRid = rid;
+      break;
+    }
+  }
+  db_finalize(&q);
+  return lastRid;
+}
+
+/*
+** Send "clonepack" cards for the chunks of the clone pack that begin
+** at artifact *pSeqno, until the reply reaches pXfer->mxSend bytes or
+** the pack is finished.  Set *pSeqno to the first artifact that has
+** not been sent.
+**
+**      clonepack KEY MINRID MAXRID LASTRID SIZE \n CONTENT
+**
+** KEY identifies the pack and LASTRID is the last artifact it covers.
+** Artifacts beyond LASTRID are sent afterwards as "cfile" cards.  If
+** the pack that the client holds part of is no longer valid, start
+** over with a new pack.
+**
+** Chunks are saved in the cache, when it exists, so that the work of
+** building a pack is shared by all the clients that fetch it.  A new
+** client is given the most recent cached pack for as long as that pack
+** is valid and covers most of the repository.
+*/
+static void send_clone_pack(Xfer *pXfer, int *pSeqno){
+  Blob key, chunk;
+  const char *zKey = pXfer->zPackKey;
+  char *zCached = 0;
+  int mxRid, minRid, lastRid;
+
+  blob_init(&key, 0, 0);
+  blob_init(&chunk, 0, 0);
+  minRid = *pSeqno;
+  if( zKey==0 ){
+    mxRid = db_int(0, "SELECT max(rid) FROM blob");
+    zKey = zCached = cache_clonepack_key();
+    if( zKey && atoi(zKey)<mxRid-mxRid/10 ) zKey = 0;
+    minRid = 1;
+  }
+  if( zKey ) mxRid = atoi(zKey);
+  clone_pack_key(mxRid, &key);
+  if( zKey && fossil_strcmp(zKey, blob_str(&key))!=0 ){
+    /* The pack is no longer valid.  Start over with a new one. */
+    mxRid = db_int(0, "SELECT max(rid) FROM blob");
+    blob_reset(&key);
+    clone_pack_key(mxRid, &key);
+    minRid = 1;
+  }
+  fossil_free(zCached);
+  while( minRid<=mxRid && pXfer->mxSend>blob_size(pXfer->pOut) ){
+    if( time(NULL) >= pXfer->maxTime ) break;
+    if( !cache_clonepack_read(blob_str(&key), minRid, &lastRid, &chunk) ){
+      lastRid = clone_pack_chunk(minRid, mxRid, &chunk);
+      cache_clonepack_write(blob_str(&key), minRid, lastRid, &chunk);
+    }
+    blob_appendf(pXfer->pOut, "clonepack %b %d %d %d %d\n",
+                 &key, minRid, lastRid, mxRid, blob_size(&chunk));
+    blob_append(pXfer->pOut, blob_buffer(&chunk), blob_size(&chunk));
+    blob_append(pXfer->pOut, "\n", 1);
+    blob_reset(&chunk);
+    minRid = lastRid+1;
+  }
+  *pSeqno = minRid;
+  blob_reset(&key);
+}
+
 /*
 ** Send the unversioned file identified by zName by generating the
 ** appropriate "uvfile" card.
@@ -784,7 +1202,7 @@ static int check_tail_hash(Blob *pHash, Blob *pMsg){
 ** If anything fails to check out, no changes are made to privileges.
 **
 ** Signature generation on the client side is handled by the
-** http_exchange() routine.
+** http_exchange_send() routine.
 **
 ** Return non-zero for a login failure and zero for success.
 */
@@ -871,18 +1289,84 @@ static void send_unsent(Xfer *pXfer){
   db_multi_exec("DELETE FROM unsent");
 }
 
+/*
+** Number of clusters gathered into each index cluster.
+*/
+#define CLUSTER_FANOUT  16
+
+/*
+** Return the level of cluster rid in the cluster tree.  Clusters that
+** list ordinary artifacts are level 0.  An index cluster, one whose
+** members are all clusters, is one level above its members.  Return -1
+** if rid is not a cluster.
+*/
+static int cluster_level(int rid){
+  Manifest *p;
+  int i;
+  int crid = 0;
+  int isIndex;
+  p = manifest_get(rid, CFTYPE_CLUSTER, 0);
+  if( p==0 ) return -1;
+  for(i=0; i<p->nCChild; i++){
+    int mid = uuid_to_rid(p->azCChild[i], 0);
+    if( mid==0
+     || !db_exists("SELECT 1 FROM tagxref WHERE tagid=%d AND rid=%d",
+                   TAG_CLUSTER, mid)
+    ){
+      break;
+    }
+    if( crid==0 ) crid = mid;
+  }
+  isIndex = i>=p->nCChild && crid>0;
+  manifest_destroy(p);
+  return isIndex ? cluster_level(crid)+1 : 0;
+}
+
+/*
+** Form a new cluster from the artifacts named in the temp table
+** "xmember", store it in the repository, and return its rid.
+*/
+static int cluster_from_members(void){
+  Blob cluster, cksum;
+  Stmt q;
+  int rid;
+  blob_zero(&cluster);
+  db_prepare(&q, "SELECT uuid FROM xmember, blob"
+                 " WHERE xmember.rid=blob.rid ORDER BY 1");
+  while( db_step(&q)==SQLITE_ROW ){
+    blob_appendf(&cluster, "M %s\n", db_column_text(&q, 0));
+  }
+  db_finalize(&q);
+  md5sum_blob(&cluster, &cksum);
+  blob_appendf(&cluster, "Z %b\n", &cksum);
+  blob_reset(&cksum);
+  rid = content_put(&cluster);
+  manifest_crosslink(rid, &cluster, MC_NONE);
+  blob_reset(&cluster);
+  return rid;
+}
+
 /*
 ** Check to see if the number of unclustered entries is greater than
 ** 100 and if it is, form a new cluster.  Unclustered phantoms do not
 ** count toward the 100 total.  And phantoms are never added to a new
 ** cluster.
+**
+** Clusters themselves are left unclustered by this first step and are
+** instead gathered into a tree of index clusters.  Whenever there are
+** CLUSTER_FANOUT unclustered clusters at the same level, they are
+** listed in a new index cluster one level up.  An index cluster is an
+** ordinary cluster as far as older versions of Fossil are concerned.
+** Because its name is a hash over the names of its members, it is also
+** a digest of its entire subtree:  a peer that holds an index cluster
+** and its subtree need look no further, and a peer that lacks it can
+** reach the bottom of the tree in a number of round trips that grows
+** only with the logarithm of the repository size, rather than walking
+** a chain of every cluster ever made.
 */
 void create_cluster(void){
-  Blob cluster, cksum;
-  Blob deleteWhere;
   Stmt q;
   int nUncl;
-  int nRow = 0;
   int rid;
 
 #if 0
@@ -893,49 +1377,87 @@ void create_cluster(void){
   );
 #endif
 
+  db_multi_exec(
+    "CREATE TEMP TABLE xmember(rid INTEGER PRIMARY KEY);"
+  );
   nUncl = db_int(0, "SELECT count(*) FROM unclustered /*scan*/"
                     " WHERE NOT EXISTS(SELECT 1 FROM phantom"
-                                      " WHERE rid=unclustered.rid)");
+                                      " WHERE rid=unclustered.rid)"
+                    "   AND NOT EXISTS(SELECT 1 FROM tagxref"
+                    "      WHERE tagid=%d AND rid=unclustered.rid)",
+                    TAG_CLUSTER);
   if( nUncl>=100 ){
-    blob_zero(&cluster);
-    blob_zero(&deleteWhere);
-    db_prepare(&q, "SELECT uuid FROM unclustered, blob"
+    int nRow = 0;
+    db_prepare(&q, "SELECT unclustered.rid FROM unclustered, blob"
                    " WHERE NOT EXISTS(SELECT 1 FROM phantom"
                    "                   WHERE rid=unclustered.rid)"
+                   "   AND NOT EXISTS(SELECT 1 FROM tagxref"
+                   "      WHERE tagid=%d AND rid=unclustered.rid)"
                    "   AND unclustered.rid=blob.rid"
                    "   AND NOT EXISTS(SELECT 1 FROM shun WHERE uuid=blob.uuid)"
-                   " ORDER BY 1");
+                   " ORDER BY blob.uuid", TAG_CLUSTER);
     while( db_step(&q)==SQLITE_ROW ){
-      blob_appendf(&cluster, "M %s\n", db_column_text(&q, 0));
+      db_multi_exec("INSERT INTO xmember VALUES(%d)", db_column_int(&q, 0));
       nRow++;
       if( nRow>=800 && nUncl>nRow+100 ){
-        md5sum_blob(&cluster, &cksum);
-        blob_appendf(&cluster, "Z %b\n", &cksum);
-        blob_reset(&cksum);
-        rid = content_put(&cluster);
-        manifest_crosslink(rid, &cluster, MC_NONE);
-        blob_reset(&cluster);
+        cluster_from_members();
+        db_multi_exec("DELETE FROM xmember");
         nUncl -= nRow;
         nRow = 0;
-        blob_append_sql(&deleteWhere, ",%d", rid);
       }
     }
     db_finalize(&q);
+    if( nRow>0 ){
+      cluster_from_members();
+      db_multi_exec("DELETE FROM xmember");
+    }
     db_multi_exec(
-      "DELETE FROM unclustered WHERE rid NOT IN (0 %s)"
-      "   AND NOT EXISTS(SELECT 1 FROM phantom WHERE rid=unclustered.rid)",
-      blob_sql_text(&deleteWhere)
+      "DELETE FROM unclustered"
+      " WHERE NOT EXISTS(SELECT 1 FROM phantom WHERE rid=unclustered.rid)"
+      "   AND NOT EXISTS(SELECT 1 FROM tagxref"
+      "      WHERE tagid=%d AND rid=unclustered.rid)",
+      TAG_CLUSTER
     );
-    blob_reset(&deleteWhere);
-    if( nRow>0 ){
-      md5sum_blob(&cluster, &cksum);
-      blob_appendf(&cluster, "Z %b\n", &cksum);
-      blob_reset(&cksum);
-      rid = content_put(&cluster);
-      manifest_crosslink(rid, &cluster, MC_NONE);
-      blob_reset(&cluster);
+  }
+
+  /* Gather unclustered clusters into index clusters */
+  if( db_int(0, "SELECT count(*) FROM unclustered, tagxref"
+                " WHERE tagxref.rid=unclustered.rid AND tagid=%d",
+                TAG_CLUSTER)>=CLUSTER_FANOUT ){
+    db_multi_exec(
+      "CREATE TEMP TABLE xlevel(rid INTEGER PRIMARY KEY, lvl INT);"
+    );
+    db_prepare(&q, "SELECT unclustered.rid FROM unclustered, tagxref, blob"
+                   " WHERE tagxref.rid=unclustered.rid AND tagid=%d"
+                   "   AND blob.rid=unclustered.rid"
+                   "   AND NOT EXISTS(SELECT 1 FROM shun WHERE uuid=blob.uuid)",
+                   TAG_CLUSTER);
+    while( db_step(&q)==SQLITE_ROW ){
+      rid = db_column_int(&q, 0);
+      db_multi_exec("INSERT INTO xlevel VALUES(%d,%d)", rid, cluster_level(rid));
+    }
+    db_finalize(&q);
+    while( 1 ){
+      int lvl = db_int(-1, "SELECT lvl FROM xlevel WHERE lvl>=0"
+                           " GROUP BY lvl HAVING count(*)>=%d"
+                           " ORDER BY lvl LIMIT 1", CLUSTER_FANOUT);
+      if( lvl<0 ) break;
+      db_multi_exec(
+        "INSERT INTO xmember"
+        "  SELECT rid FROM xlevel WHERE lvl=%d ORDER BY rid LIMIT %d;"
+        "DELETE FROM xlevel WHERE rid IN xmember;",
+        lvl, CLUSTER_FANOUT
+      );
+      rid = cluster_from_members();
+      db_multi_exec(
+        "DELETE FROM xmember;"
+        "INSERT INTO xlevel VALUES(%d,%d);",
+        rid, lvl+1
+      );
     }
+    db_multi_exec("DROP TABLE xlevel");
   }
+  db_multi_exec("DROP TABLE xmember");
 }
 
 /*
@@ -992,6 +1514,183 @@ static int send_unclustered(Xfer *pXfer){
   return cnt;
 }
 
+/*
+** Ranges of artifacts that hold no more than this many artifacts on
+** either side are reconciled by listing the artifacts in "igot" cards
+** rather than by splitting the range.
+*/
+#define XFER_RANGE_LIST  32
+
+/*
+** Return the value of the last 16 hexadecimal digits of artifact hash z.
+*/
+static u64 xfer_hash_value(const char *z, int n){
+  u64 v = 0;
+  int i;
+  for(i=n>16 ? n-16 : 0; i<n; i++){
+    char c = z[i];
+    v = (v<<4) + (c<='9' ? c-'0' : c-'a'+10);
+  }
+  return v;
+}
+
+/*
+** Count the public artifacts whose hashes begin with zPrefix, ignoring
+** phantoms and shunned artifacts, and compute their fingerprint, which
+** is the sum, modulo 2**64, of the xfer_hash_value() of each hash.  If
+** aN[] and aFp[] are not NULL, also compute the count and fingerprint
+** for each of the 16 ranges formed by adding one more digit to zPrefix.
+*/
+static void xfer_range_summary(
+  const char *zPrefix,      /* Hash prefix.  "" for all artifacts */
+  int *pN,                  /* OUT: Number of artifacts */
+  u64 *pFp,                 /* OUT: Fingerprint */
+  int *aN,                  /* OUT: Number of artifacts in each subrange */
+  u64 *aFp                  /* OUT: Fingerprint of each subrange */
+){
+  Stmt q;
+  int nPrefix = (int)strlen(zPrefix);
+  *pN = 0;
+  *pFp = 0;
+  if( aN ){
+    memset(aN, 0, sizeof(aN[0])*16);
+    memset(aFp, 0, sizeof(aFp[0])*16);
+  }
+  db_prepare(&q,
+    "SELECT uuid FROM blob"
+    " WHERE uuid>=%Q AND uuid<'%qg'"
+    "   AND NOT EXISTS(SELECT 1 FROM shun WHERE uuid=blob.uuid)"
+    "   AND NOT EXISTS(SELECT 1 FROM private WHERE rid=blob.rid)"
+    "   AND NOT EXISTS(SELECT 1 FROM phantom WHERE rid=blob.rid)",
+    zPrefix, zPrefix
+  );
+  while( db_step(&q)==SQLITE_ROW ){
+    const char *zUuid = db_column_text(&q, 0);
+    int n = db_column_bytes(&q, 0);
+    u64 v = xfer_hash_value(zUuid, n);
+    (*pN)++;
+    *pFp += v;
+    if( aN && n>nPrefix ){
+      char c = zUuid[nPrefix];
+      int i = c<='9' ? c-'0' : c-'a'+10;
+      if( i>=0 && i<16 ){
+        aN[i]++;
+        aFp[i] += v;
+      }
+    }
+  }
+  db_finalize(&q);
+}
+
+/*
+** Send an igot card for every public artifact whose hash begins with
+** zPrefix.  If omitRemote is true, omit artifacts that the other side
+** is known to have.
+*/
+static void xfer_range_list(Xfer *pXfer, const char *zPrefix, int omitRemote){
+  Stmt q;
+  db_prepare(&q,
+    "SELECT uuid FROM blob"
+    " WHERE uuid>=%Q AND uuid<'%qg'"
+    "   AND NOT EXISTS(SELECT 1 FROM shun WHERE uuid=blob.uuid)"
+    "   AND NOT EXISTS(SELECT 1 FROM private WHERE rid=blob.rid)"
+    "   AND NOT EXISTS(SELECT 1 FROM phantom WHERE rid=blob.rid)"
+    "   %s",
+    zPrefix, zPrefix,
+    omitRemote ? "AND blob.rid NOT IN onremote" : ""
+  );
+  while( db_step(&q)==SQLITE_ROW ){
+    blob_appendf(pXfer->pOut, "igot %s\n", db_column_text(&q, 0));
+    pXfer->nIGotSent++;
+  }
+  db_finalize(&q);
+}
+
+/*
+** Send the "rhash" card that starts the reconciliation of all public
+** artifacts between client and server.
+*/
+static void xfer_range_start(Xfer *pXfer){
+  int n;
+  u64 fp;
+  xfer_range_summary("", &n, &fp, 0, 0);
+  blob_appendf(pXfer->pOut, "rhash - %d %016llx\n", n, fp);
+  pXfer->nRangeSent++;
+}
+
+/*
+** The other side has sent the card "rhash PREFIX COUNT FINGERPRINT" to
+** say that it holds COUNT public artifacts whose hashes begin with
+** PREFIX, with the given fingerprint.  If they match ours, the range is
+** in sync.  Otherwise, if the range is small on either side, send igot
+** cards for all of our artifacts in the range followed by an "rlist"
+** card, so that the other side can send igot cards for just the
+** artifacts that we lack.  Or else split the range into 16 and send an
+** rhash card for each part.
+*/
+static void xfer_range_hash(
+  Xfer *pXfer,
+  const char *zPrefix,      /* The PREFIX argument, "" for "-" */
+  int nRemote,              /* The COUNT argument */
+  u64 fpRemote              /* The FINGERPRINT argument */
+){
+  int n, i;
+  u64 fp;
+  int aN[16];
+  u64 aFp[16];
+  xfer_range_summary(zPrefix, &n, &fp, aN, aFp);
+  if( n==nRemote && fp==fpRemote ) return;
+  if( n<=XFER_RANGE_LIST || nRemote<=XFER_RANGE_LIST
+   || strlen(zPrefix)>=HNAME_LEN_SHA1
+  ){
+    xfer_range_list(pXfer, zPrefix, 0);
+    blob_appendf(pXfer->pOut, "rlist %s\n", zPrefix[0] ? zPrefix : "-");
+  }else{
+    for(i=0; i<16; i++){
+      blob_appendf(pXfer->pOut, "rhash %s%c %d %016llx\n",
+                   zPrefix, "0123456789abcdef"[i], aN[i], aFp[i]);
+    }
+  }
+  pXfer->nRangeSent++;
+}
+
+/*
+** Return true if pBlob is a hash prefix for an "rhash" or "rlist"
+** card:  either "-" for all artifacts or up to HNAME_MAX lower-case
+** hexadecimal digits.
+*/
+static int blob_is_range_prefix(Blob *pBlob){
+  const char *z = blob_buffer(pBlob);
+  int n = blob_size(pBlob);
+  int i;
+  if( n==1 && z[0]=='-' ) return 1;
+  if( n==0 || n>HNAME_MAX ) return 0;
+  for(i=0; i<n; i++){
+    if( !((z[i]>='0' && z[i]<='9') || (z[i]>='a' && z[i]<='f')) ) return 0;
+  }
+  return 1;
+}
+
+/*
+** Process an "rhash PREFIX COUNT FINGERPRINT" or "rlist PREFIX" card,
+** already known to have a valid PREFIX, received from the other side.
+*/
+static void xfer_range_card(Xfer *pXfer){
+  const char *zPrefix = blob_str(&pXfer->aToken[1]);
+  if( zPrefix[0]=='-' ) zPrefix = "";
+  if( blob_eq(&pXfer->aToken[0], "rlist") ){
+    /* The other side has sent igot cards for all of its artifacts in
+    ** the range.  Send igot cards for the ones it lacks. */
+    xfer_range_list(pXfer, zPrefix, 1);
+  }else if( pXfer->nToken==4 ){
+    int nRemote = atoi(blob_str(&pXfer->aToken[2]));
+    u64 fpRemote = 0;
+    sqlite3_uint64 v;
+    if( sscanf(blob_str(&pXfer->aToken[3]), "%llx", &v)==1 ) fpRemote = v;
+    xfer_range_hash(pXfer, zPrefix, nRemote, fpRemote);
+  }
+}
+
 /*
 ** Send an igot message for every artifact.
 */
@@ -1189,6 +1888,15 @@ void page_xfer(void){
     if( blob_buffer(&xfer.line)[0]=='#' ) continue;
     if( blob_size(&xfer.line)==0 ) continue;
     xfer.nToken = blob_tokenize(&xfer.line, xfer.aToken, count(xfer.aToken));
+    if( !blob_eq(&xfer.aToken[0], "file")
+     && !blob_eq(&xfer.aToken[0], "private")
+     && xfer_flush_files(&xfer)
+    ){
+      cgi_reset_content();
+      @ error %T(blob_str(&xfer.err))
+      nErr++;
+      break;
+    }
 
     /*   file HASH SIZE \n CONTENT
     **   file HASH DELTASRC SIZE \n CONTENT
@@ -1285,15 +1993,30 @@ void page_xfer(void){
     ){
       if( isPush ){
         if( xfer.nToken==2 || blob_eq(&xfer.aToken[2],"1")==0 ){
-          rid_from_uuid(&xfer.aToken[1], 1, 0);
+          remote_has(rid_from_uuid(&xfer.aToken[1], 1, 0));
         }else if( g.perm.Private ){
           rid_from_uuid(&xfer.aToken[1], 1, 1);
         }else{
           server_private_xfer_not_authorized();
         }
+      }else if( isPull && xfer.nToken==2 ){
+        remote_has(rid_from_uuid(&xfer.aToken[1], 0, 0));
       }
     }else
 
+    /*   rhash PREFIX COUNT FINGERPRINT
+    **   rlist PREFIX
+    **
+    ** Reconcile the public artifacts of client and server, as started
+    ** by a "pragma set-reconcile" card.
+    */
+    if( xfer.nToken>=2
+     && (blob_eq(&xfer.aToken[0], "rhash") || blob_eq(&xfer.aToken[0], "rlist"))
+     && blob_is_range_prefix(&xfer.aToken[1])
+    ){
+      if( isPull ) xfer_range_card(&xfer);
+    }else
+
 
     /*    pull  SERVERCODE  PROJECTCODE
     **    push  SERVERCODE  PROJECTCODE
@@ -1368,6 +2091,9 @@ void page_xfer(void){
           cgi_set_content_type("application/x-fossil-uncompressed");
         }
         blob_is_int(&xfer.aToken[2], &seqno);
+        if( iVers>=3 && xfer.clonePack && !xfer.syncPrivate ){
+          send_clone_pack(&xfer, &seqno);
+        }
         max = db_int(0, "SELECT max(rid) FROM blob");
         while( xfer.mxSend>blob_size(xfer.pOut) && seqno<=max){
           if( time(NULL) >= xfer.maxTime ) break;
@@ -1519,6 +2245,30 @@ void page_xfer(void){
         xfer.resync = 0x7fffffff;
       }
 
+      /*   pragma set-reconcile
+      **
+      ** The client understands "rhash" and "rlist" cards and wants to
+      ** use them to reconcile its artifacts with ours, rather than
+      ** receiving a full catalog of igot cards.
+      */
+      if( blob_eq(&xfer.aToken[1], "set-reconcile") ){
+        xfer.reconcile = 1;
+      }
+
+      /*   pragma clone-pack ?KEY?
+      **
+      ** The client is cloning and accepts "clonepack" cards in place of
+      ** "cfile" cards.  KEY identifies the pack that the client has
+      ** received part of in prior rounds.  This card must come before
+      ** the "clone" card.
+      */
+      if( blob_eq(&xfer.aToken[1], "clone-pack") ){
+        xfer.clonePack = 1;
+        if( xfer.nToken>=3 ){
+          xfer.zPackKey = fossil_strdup(blob_str(&xfer.aToken[2]));
+        }
+      }
+
       /*   pragma client-version VERSION
       **
       ** Let the server know what version of Fossil is running on the client.
@@ -1558,6 +2308,11 @@ void page_xfer(void){
     blobarray_reset(xfer.aToken, xfer.nToken);
     blob_reset(&xfer.line);
   }
+  if( xfer_flush_files(&xfer) && nErr==0 ){
+    cgi_reset_content();
+    @ error %T(blob_str(&xfer.err))
+    nErr++;
+  }
   if( isPush ){
     if( rc==TH_OK ){
       rc = xfer_run_script(zScript, zUuidList, 1);
@@ -1584,8 +2339,13 @@ void page_xfer(void){
     if( xfer.syncPrivate ) send_private(&xfer);
   }else if( isPull ){
     create_cluster();
+    if( xfer.reconcile ) xfer.resync = 0;
     send_unclustered(&xfer);
     if( xfer.syncPrivate ) send_private(&xfer);
+    if( xfer.reconcile ){
+      @ pragma set-reconcile
+      xfer_range_start(&xfer);
+    }
   }
   db_multi_exec("DROP TABLE onremote");
   manifest_crosslink_end(MC_PERMIT_HOOKS);
@@ -1599,6 +2359,7 @@ void page_xfer(void){
 
   db_end_transaction(0);
   configure_rebuild();
+  workqueue_free(xfer.pFileQueue, 0);
 }
 
 /*
@@ -1665,6 +2426,90 @@ static double fossil_fabs(double x){
   return x>0.0 ? x : -x;
 }
 
+/*
+** The client receives replies from the server in chunks of this size,
+** and discards cards that have been processed once this many bytes
+** of them have built up.
+*/
+#define XFER_RECV_CHUNK  65536
+
+/*
+** z[0..n-1] is a card received from the server, without its trailing
+** newline.  Return the number of bytes of content that follow the card.
+*/
+static int xfer_content_size(const char *z, int n){
+  int aStart[7];           /* Start of each token */
+  int aLen[7];             /* Length of each token */
+  int nTok = 0;            /* Number of tokens */
+  int i = 0;
+  int sz = 0;
+  while( nTok<count(aStart) ){
+    while( i<n && fossil_isspace(z[i]) ) i++;
+    if( i>=n ) break;
+    aStart[nTok] = i;
+    while( i<n && !fossil_isspace(z[i]) ) i++;
+    aLen[nTok] = i - aStart[nTok];
+    nTok++;
+  }
+  if( nTok==0 ) return 0;
+  if( aLen[0]==4 && memcmp(z, "file", 4)==0 && (nTok==3 || nTok==4) ){
+    sz = atoi(&z[aStart[nTok-1]]);
+  }else if( aLen[0]==5 && memcmp(z, "cfile", 5)==0 && (nTok==4 || nTok==5) ){
+    sz = atoi(&z[aStart[nTok-1]]);
+  }else if( aLen[0]==9 && memcmp(z, "clonepack", 9)==0 && nTok==6 ){
+    sz = atoi(&z[aStart[5]]);
+  }else if( aLen[0]==6 && memcmp(z, "config", 6)==0 && nTok==3 ){
+    sz = atoi(&z[aStart[2]]);
+  }else if( aLen[0]==6 && memcmp(z, "uvfile", 6)==0 && nTok==6 ){
+    if( (atoi(&z[aStart[5]]) & 0x0005)==0 ) sz = atoi(&z[aStart[4]]);
+  }
+  return sz>0 ? sz : 0;
+}
+
+/*
+** Make sure that the whole of the next card of a reply that is being
+** received from the server, together with any content that follows
+** the card, is held in pXfer->pIn.  Return false if there are no more
+** cards.
+**
+** The reply is processed as it arrives rather than after all of it
+** has been received, so that storing artifacts overlaps with receiving
+** them and a large reply never needs to be held in memory at once.
+*/
+static int xfer_next_card(Xfer *pXfer, HttpReply *pReply){
+  Blob *pIn = pXfer->pIn;
+  int i, nContent;
+
+  /* Discard cards that have already been processed.  Nothing still
+  ** refers to them. */
+  if( pIn->iCursor>=XFER_RECV_CHUNK ){
+    int n = pIn->nUsed - pIn->iCursor;
+    memmove(pIn->aData, &pIn->aData[pIn->iCursor], n);
+    pIn->nUsed = n;
+    pIn->iCursor = 0;
+  }
+
+  /* Receive the whole of the card */
+  i = pIn->iCursor;
+  while( 1 ){
+    while( i<(int)pIn->nUsed && pIn->aData[i]!='\n' ) i++;
+    if( i<(int)pIn->nUsed ) break;
+    if( http_exchange_read(pReply, pIn, XFER_RECV_CHUNK)<=0 ){
+      return pIn->iCursor<pIn->nUsed;
+    }
+  }
+
+  /* Receive the content and the newline that follows it */
+  nContent = xfer_content_size(&pIn->aData[pIn->iCursor], i-pIn->iCursor);
+  if( nContent>0 ){
+    i64 iEnd = (i64)i + 1 + nContent + 1;
+    while( (i64)pIn->nUsed<iEnd ){
+      if( http_exchange_read(pReply, pIn, XFER_RECV_CHUNK)<=0 ) break;
+    }
+  }
+  return 1;
+}
+
 /*
 ** Sync to the host identified in g.url.name and g.url.path.  This
 ** routine is called by the client.
@@ -1691,6 +2536,7 @@ int client_sync(
   int cloneSeqno = 1;     /* Sequence number for clones */
   Blob send;              /* Text we are sending to the server */
   Blob recv;              /* Reply we got back from the server */
+  HttpReply reply;        /* The reply as it arrives from the server */
   Xfer xfer;              /* Transfer data */
   int pctDone;            /* Percentage done with a message */
   int lastPctDone = -1;   /* Last displayed pctDone */
@@ -1707,6 +2553,9 @@ int client_sync(
   int uvDoPush = 0;       /* Generate uvfile messages to send to server */
   int nUvGimmeSent = 0;   /* Number of uvgimme cards sent on this cycle */
   int nUvFileRcvd = 0;    /* Number of uvfile cards received on this cycle */
+  int bReconcile = 0;     /* Server understands rhash and rlist cards */
+  int bClonePack = 0;     /* Ask the server for a clone pack */
+  char *zPackKey = 0;     /* Key of the clone pack being received */
   sqlite3_int64 mtime;    /* Modification time on a UV file */
 
   if( db_get_boolean("dont-push", 0) ) syncFlags &= ~SYNC_PUSH;
@@ -1775,6 +2624,12 @@ int client_sync(
   */
   blob_appendf(&send, "pragma client-version %d\n", RELEASE_VERSION_NUMBER);
   if( syncFlags & SYNC_CLONE ){
+    /* A clone into an empty repository can take the server's artifacts
+    ** in bulk, RIDs and all.  A private clone cannot, as private
+    ** artifacts are not part of the pack. */
+    bClonePack = (syncFlags & SYNC_PRIVATE)==0
+                   && !db_exists("SELECT 1 FROM blob");
+    if( bClonePack ) blob_appendf(&send, "pragma clone-pack\n");
     blob_appendf(&send, "clone 3 %d\n", cloneSeqno);
     syncFlags &= ~(SYNC_PUSH|SYNC_PULL);
     nCardSent++;
@@ -1794,22 +2649,32 @@ int client_sync(
     blob_appendf(&send, "push %s %s\n", zSCode, zPCode);
     nCardSent++;
     if( (syncFlags & SYNC_PULL)==0 ) zOpType = "Push";
-    if( (syncFlags & SYNC_RESYNC)!=0 ) xfer.resync = 0x7fffffff;
+  }
+  if( syncFlags & SYNC_RESYNC ){
+    /* Ask to reconcile using rhash cards.  A server that does not
+    ** understand will ignore this and send a full catalog instead. */
+    blob_appendf(&send, "pragma set-reconcile\n");
+    nCardSent++;
   }
   if( syncFlags & SYNC_VERBOSE ){
     fossil_print(zLabelFormat /*works-like:"%s%s%s%s%d"*/,
                  "", "Bytes", "Cards", "Artifacts", "Deltas");
   }
 
+  /* Each round is processed in its own transaction.  A round is not
+  ** finished until the request for the next round has been sent, so
+  ** that the server can prepare its reply while crosslinking is
+  ** completed and the transaction is committed.
+  */
+  db_begin_transaction();
+  db_record_repository_filename(0);
+  db_multi_exec(
+    "CREATE TEMP TABLE onremote(rid INTEGER PRIMARY KEY);"
+  );
+  manifest_crosslink_begin();
   while( go ){
     int newPhantom = 0;
     char *zRandomness;
-    db_begin_transaction();
-    db_record_repository_filename(0);
-    db_multi_exec(
-      "CREATE TEMP TABLE onremote(rid INTEGER PRIMARY KEY);"
-    );
-    manifest_crosslink_begin();
 
 
     /* Send back the most recently received cookie.  Let the server
@@ -1924,9 +2789,27 @@ int client_sync(
       fossil_print("waiting for server...");
     }
     fflush(stdout);
-    /* Exchange messages with the server */
-    if( http_exchange(&send, &recv, (syncFlags & SYNC_CLONE)==0 || nCycle>0,
-        MAX_REDIRECTS) ){
+    /* Send the request to the server.  Then finish the previous round
+    ** while the server works on its reply, and start a new round.
+    */
+    if( http_exchange_send(&send, (syncFlags & SYNC_CLONE)==0 || nCycle>0) ){
+      nErr++;
+      go = 2;
+      break;
+    }
+    if( nCycle>0 ){
+      db_multi_exec("DROP TABLE onremote");
+      manifest_crosslink_end(MC_PERMIT_HOOKS);
+      db_end_transaction(0);
+      db_begin_transaction();
+      db_record_repository_filename(0);
+      db_multi_exec(
+        "CREATE TEMP TABLE onremote(rid INTEGER PRIMARY KEY);"
+      );
+      manifest_crosslink_begin();
+    }
+    if( http_exchange_begin(&send, (syncFlags & SYNC_CLONE)==0 || nCycle>0,
+                            MAX_REDIRECTS, &reply) ){
       nErr++;
       go = 2;
       break;
@@ -1974,9 +2857,10 @@ int client_sync(
     go = 0;
     nUvGimmeSent = 0;
     nUvFileRcvd = 0;
+    xfer.nRangeSent = 0;
 
-    /* Process the reply that came back from the server */
-    while( blob_line(&recv, &xfer.line) ){
+    /* Process the reply as it comes back from the server */
+    while( xfer_next_card(&xfer, &reply) && blob_line(&recv, &xfer.line) ){
       if( blob_buffer(&xfer.line)[0]=='#' ){
         const char *zLine = blob_buffer(&xfer.line);
         if( memcmp(zLine, "# timestamp ", 12)==0 ){
@@ -1986,7 +2870,7 @@ int client_sync(
           rDiff = db_double(9e99, "SELECT julianday('%q') - %.17g",
                             zTime, rArrivalTime);
           if( rDiff>9e98 || rDiff<-9e98 ) rDiff = 0.0;
-          if( rDiff*24.0*3600.0 >= -(blob_size(&recv)/5000.0 + 20) ){
+          if( rDiff*24.0*3600.0 >= -(reply.nTotal/5000.0 + 20) ){
             rDiff = 0.0;
           }
           if( fossil_fabs(rDiff)>fossil_fabs(rSkew) ) rSkew = rDiff;
@@ -1996,8 +2880,18 @@ int client_sync(
       }
       xfer.nToken = blob_tokenize(&xfer.line, xfer.aToken, count(xfer.aToken));
       nCardRcvd++;
-      if( (syncFlags & SYNC_VERBOSE)!=0 && recv.nUsed>0 ){
-        pctDone = (recv.iCursor*100)/recv.nUsed;
+      if( !blob_eq(&xfer.aToken[0], "file")
+       && !blob_eq(&xfer.aToken[0], "private")
+       && xfer_flush_files(&xfer)
+      ){
+        fossil_force_newline();
+        fossil_warning("%b", &xfer.err);
+        nErr++;
+        break;
+      }
+      if( (syncFlags & SYNC_VERBOSE)!=0 && reply.nTotal>0 ){
+        pctDone = (int)((reply.nRead - (i64)(recv.nUsed - recv.iCursor))*100
+                          / reply.nTotal);
         if( pctDone!=lastPctDone ){
           fossil_print("\rprocessed: %d%%         ", pctDone);
           lastPctDone = pctDone;
@@ -2025,6 +2919,20 @@ int client_sync(
         nArtifactRcvd++;
       }else
 
+      /*   clonepack KEY MINRID MAXRID LASTRID SIZE \n CONTENT
+      **
+      ** Receive a chunk of the clone pack from the server.
+      */
+      if( blob_eq(&xfer.aToken[0],"clonepack") && xfer.nToken==6
+       && bClonePack
+      ){
+        int nLoad = 0;
+        if( xfer_accept_clone_pack(&xfer, &zPackKey, &nLoad) ){
+          bClonePack = 0;
+        }
+        nArtifactRcvd += nLoad;
+      }else
+
       /*   uvfile NAME MTIME HASH SIZE FLAGS \n CONTENT
       **
       ** Accept an unversioned file from the server.
@@ -2085,6 +2993,20 @@ int client_sync(
         remote_has(rid);
       }else
 
+      /*   rhash PREFIX COUNT FINGERPRINT
+      **   rlist PREFIX
+      **
+      ** Reconcile the public artifacts of client and server.
+      */
+      if( xfer.nToken>=2
+       && bReconcile
+       && (blob_eq(&xfer.aToken[0], "rhash")
+           || blob_eq(&xfer.aToken[0], "rlist"))
+       && blob_is_range_prefix(&xfer.aToken[1])
+      ){
+        xfer_range_card(&xfer);
+      }else
+
       /*   uvigot NAME MTIME HASH SIZE
       **
       ** Server announces that it has a particular unversioned file.  The
@@ -2171,7 +3093,14 @@ int client_sync(
           zPCode = mprintf("%b", &xfer.aToken[2]);
           db_set("project-code", zPCode, 0);
         }
-        if( cloneSeqno>0 ) blob_appendf(&send, "clone 3 %d\n", cloneSeqno);
+        if( cloneSeqno>0 ){
+          if( bClonePack && zPackKey ){
+            blob_appendf(&send, "pragma clone-pack %s\n", zPackKey);
+          }else if( bClonePack ){
+            blob_appendf(&send, "pragma clone-pack\n");
+          }
+          blob_appendf(&send, "clone 3 %d\n", cloneSeqno);
+        }
         nCardSent++;
       }else
 
@@ -2271,6 +3200,15 @@ int client_sync(
         }else if( blob_eq(&xfer.aToken[1], "uv-push-ok") ){
           uvDoPush = 1;
         }
+
+        /* The server has agreed to reconcile artifacts using rhash
+        ** and rlist cards, and the rhash cards follow.
+        */
+        if( blob_eq(&xfer.aToken[1], "set-reconcile")
+         && (syncFlags & SYNC_RESYNC)!=0
+        ){
+          bReconcile = 1;
+        }
       }else
 
       /*   error MESSAGE
@@ -2333,10 +3271,21 @@ int client_sync(
       blobarray_reset(xfer.aToken, xfer.nToken);
       blob_reset(&xfer.line);
     }
+    if( xfer_flush_files(&xfer) && nErr==0 ){
+      fossil_force_newline();
+      fossil_warning("%b", &xfer.err);
+      nErr++;
+    }
+    if( http_exchange_end(&reply) ){
+      blob_reset(&recv);
+      nErr++;
+      go = 2;
+      break;
+    }
     origConfigRcvMask = 0;
     if( nCardRcvd>0 && (syncFlags & SYNC_VERBOSE) ){
       fossil_print(zValueFormat /*works-like:"%s%d%d%d%d"*/, "Received:",
-                   blob_size(&recv), nCardRcvd,
+                   reply.nRead, nCardRcvd,
                    xfer.nFileRcvd, xfer.nDeltaRcvd + xfer.nDanglingFile);
     }else{
       fossil_print(zBriefFormat /*works-like:"%d%d%d"*/,
@@ -2368,6 +3317,18 @@ int client_sync(
       go = 1;
     }
 
+    /* Keep going while artifacts are being reconciled.  If the server
+    ** did not agree to reconcile on a --verily push, fall back to
+    ** sending igot cards for every artifact.
+    */
+    if( xfer.nRangeSent>0 ) go = 1;
+    if( (syncFlags & (SYNC_RESYNC|SYNC_PUSH))==(SYNC_RESYNC|SYNC_PUSH)
+     && nCycle==1 && !bReconcile
+    ){
+      xfer.resync = 0x7fffffff;
+      go = 1;
+    }
+
     /* If this is a clone, the go at least two rounds */
     if( (syncFlags & SYNC_CLONE)!=0 && nCycle==1 ) go = 1;
 
@@ -2382,14 +3343,12 @@ int client_sync(
     ** and uvgimme cards are being sent. */
     if( nUvGimmeSent>0 && (nUvFileRcvd>0 || nCycle<3) ) go = 1;
 
-    db_multi_exec("DROP TABLE onremote");
-    if( go ){
-      manifest_crosslink_end(MC_PERMIT_HOOKS);
-    }else{
+    if( !go ){
+      db_multi_exec("DROP TABLE onremote");
       manifest_crosslink_end(MC_PERMIT_HOOKS);
       content_enable_dephantomize(1);
+      db_end_transaction(0);
     }
-    db_end_transaction(0);
   };
   transport_stats(&nSent, &nRcvd, 1);
   if( (rSkew*24.0*3600.0) > 10.0 ){
@@ -2418,5 +3377,7 @@ int client_sync(
     fossil_warning("***** WARNING: a fork has occurred *****\n"
                    "use \"fossil leaves -multiple\" for more details.");
   }
+  fossil_free(zPackKey);
+  workqueue_free(xfer.pFileQueue, 0);
   return nErr;
 }
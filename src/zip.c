@@ -48,9 +48,22 @@ static void put32(char *z, int v){
 }
 
 /*
-** Variables in which to accumulate a growing ZIP archive.
+** Return the current offset into the ZIP archive being written to pSink.
+** Offsets are stored in 32 bits and ZIP64 records are not generated, so
+** fail rather than write a corrupt archive once they no longer fit.
+*/
+static unsigned int zip_offset(ArchiveSink *pSink){
+  if( pSink->nByte>0xffffffff ){
+    fossil_fatal("ZIP archive exceeds 4GB; use a tarball instead");
+  }
+  return (unsigned int)pSink->nByte;
+}
+
+/*
+** Variables in which to accumulate a growing ZIP archive.  The body of
+** the archive is written out as it is generated.  Only the table of
+** contents is held in memory until the end.
 */
-static Blob body;    /* The body of the ZIP archive */
 static Blob toc;     /* The table of contents */
 static int nEntry;   /* Number of files */
 static int dosTime;  /* DOS-format time */
@@ -62,7 +75,8 @@ static char **azDir; /* Directory names already added to the archive */
 typedef struct Archive Archive;
 struct Archive {
   int eType;                      /* Type of archive (SQLAR or ZIP) */
-  Blob *pBlob;                    /* Output blob */
+  ArchiveSink *pSink;             /* Where the archive is written */
+  Blob sqlar;                     /* Image of the SQLAR database */
   Blob tmp;                       /* Blob used as temp space for compression */
   sqlite3 *db;                    /* Db used to assemble sqlar archive */
   sqlite3_stmt *pInsert;          /* INSERT statement for SQLAR */
@@ -211,7 +225,6 @@ static int archiveGetLastError(sqlite3_vfs *pVfs, int nBuf, char *aBuf){
 ** Initialize a new ZIP archive.
 */
 void zip_open(void){
-  blob_zero(&body);
   blob_zero(&toc);
   nEntry = 0;
   dosTime = 0;
@@ -251,6 +264,9 @@ void zip_set_timedate(double rDate){
 **
 ** pFile is the file to be appended.  zName is the name
 ** that the file should be saved as.
+**
+** The file is compressed into p->tmp first, so that its local header
+** can be written with the final sizes and CRC before its content.
 */
 static void zip_add_file_to_zip(
   Archive *p,
@@ -261,14 +277,13 @@ static void zip_add_file_to_zip(
   z_stream stream;
   int nameLen;
   int toOut = 0;
-  int iStart;
+  unsigned int iStart;
   int iCRC = 0;
   int nByte = 0;
   int nByteCompr = 0;
   int nBlob;                 /* Size of the blob */
   int iMethod;               /* Compression method. */
   int iMode = 0644;          /* Access permissions */
-  char *z;
   char zHdr[30];
   char zExTime[13];
   char zBuf[100];
@@ -307,16 +322,11 @@ static void zip_add_file_to_zip(
   put32(&zExTime[9], unixTime);
 
 
-  /* Write the header and filename.
-  */
-  iStart = blob_size(&body);
-  blob_append(&body, zHdr, 30);
-  blob_append(&body, zName, nameLen);
-  blob_append(&body, zExTime, 13);
-
+  iStart = zip_offset(p->pSink);
   if( nBlob>0 ){
-    /* Write the compressed file.  Compute the CRC as we progress.
+    /* Compress the file.  Compute the CRC as we progress.
     */
+    blob_resize(&p->tmp, 0);
     stream.zalloc = (alloc_func)0;
     stream.zfree = (free_func)0;
     stream.opaque = 0;
@@ -329,7 +339,7 @@ static void zip_add_file_to_zip(
     while( stream.avail_in>0 ){
       deflate(&stream, 0);
       toOut = sizeof(zOutBuf) - stream.avail_out;
-      blob_append(&body, zOutBuf, toOut);
+      blob_append(&p->tmp, zOutBuf, toOut);
       stream.avail_out = sizeof(zOutBuf);
       stream.next_out = (unsigned char*)zOutBuf;
     }
@@ -338,18 +348,27 @@ static void zip_add_file_to_zip(
       stream.next_out = (unsigned char*)zOutBuf;
       deflate(&stream, Z_FINISH);
       toOut = sizeof(zOutBuf) - stream.avail_out;
-      blob_append(&body, zOutBuf, toOut);
+      blob_append(&p->tmp, zOutBuf, toOut);
     }while( stream.avail_out==0 );
     nByte = stream.total_in;
     nByteCompr = stream.total_out;
     deflateEnd(&stream);
 
-    /* Go back and write the header, now that we know the compressed file size.
+    /* Fill in the rest of the header, now that we know the compressed
+    ** file size.
     */
-    z = &blob_buffer(&body)[iStart];
-    put32(&z[14], iCRC);
-    put32(&z[18], nByteCompr);
-    put32(&z[22], nByte);
+    put32(&zHdr[14], iCRC);
+    put32(&zHdr[18], nByteCompr);
+    put32(&zHdr[22], nByte);
+  }
+
+  /* Write the header, the filename and the compressed file.
+  */
+  archive_sink_write(p->pSink, zHdr, 30);
+  archive_sink_write(p->pSink, zName, nameLen);
+  archive_sink_write(p->pSink, zExTime, 13);
+  if( nBlob>0 ){
+    archive_sink_write(p->pSink, blob_buffer(&p->tmp), nByteCompr);
   }
 
   /* Make an entry in the tables of contents
@@ -393,7 +412,7 @@ static void zip_add_file_to_sqlar(
     p->vfs.iVersion = 1;
     p->vfs.szOsFile = sizeof(ArchiveFile);
     p->vfs.mxPathname = 512;
-    p->vfs.pAppData = (void*)p->pBlob;
+    p->vfs.pAppData = (void*)&p->sqlar;
     p->vfs.xOpen = archiveOpen;
     p->vfs.xDelete = archiveDelete;
     p->vfs.xAccess = archiveAccess;
@@ -428,7 +447,7 @@ static void zip_add_file_to_sqlar(
     assert( p->pInsert );
 
     sqlite3_bind_int64(p->pInsert, 3, unixTime);
-    blob_zero(p->pBlob);
+    blob_zero(&p->sqlar);
   }
 
   if( nName==0 ) return;
@@ -528,18 +547,21 @@ static void free_archive(Archive *p){
 }
 
 /*
-** Write the ZIP archive into the given BLOB.
+** Finish the archive and write out whatever remains of it.
+**
+** An SQLAR archive is assembled in memory by SQLite and so is only
+** written out here, all at once.
 */
 static void zip_close(Archive *p){
   int i;
   if( p->eType==ARCHIVE_ZIP ){
-    int iTocStart;
-    int iTocEnd;
+    unsigned int iTocStart;
+    unsigned int iTocEnd;
     char zBuf[30];
 
-    iTocStart = blob_size(&body);
-    blob_append(&body, blob_buffer(&toc), blob_size(&toc));
-    iTocEnd = blob_size(&body);
+    iTocStart = zip_offset(p->pSink);
+    archive_sink_write(p->pSink, blob_buffer(&toc), blob_size(&toc));
+    iTocEnd = zip_offset(p->pSink);
 
     memset(zBuf, 0, sizeof(zBuf));
     put32(&zBuf[0], 0x06054b50);
@@ -550,15 +572,15 @@ static void zip_close(Archive *p){
     put32(&zBuf[12], iTocEnd - iTocStart);
     put32(&zBuf[16], iTocStart);
     put16(&zBuf[20], 0);
-    blob_append(&body, zBuf, 22);
+    archive_sink_write(p->pSink, zBuf, 22);
     blob_reset(&toc);
-    *(p->pBlob) = body;
-    blob_zero(&body);
   }else{
     if( p->db ) sqlite3_exec(p->db, "COMMIT", 0, 0, 0);
     free_archive(p);
-    blob_reset(&p->tmp);
+    archive_sink_write(p->pSink, blob_buffer(&p->sqlar), blob_size(&p->sqlar));
+    blob_reset(&p->sqlar);
   }
+  blob_reset(&p->tmp);
 
   nEntry = 0;
   for(i=0; i<nDir; i++){
@@ -577,19 +599,20 @@ static void zip_close(Archive *p){
 */
 void filezip_cmd(void){
   int i;
-  Blob zip;
+  ArchiveSink sink;
   Blob file;
   int eFType = SymFILE;
   Archive sArchive;
   memset(&sArchive, 0, sizeof(Archive));
   sArchive.eType = ARCHIVE_ZIP;
-  sArchive.pBlob = &zip;
+  sArchive.pSink = &sink;
   if( g.argc<3 ){
     usage("ARCHIVE FILE....");
   }
   if( find_option("dereference","h",0)!=0 ){
     eFType = ExtFILE;
   }
+  archive_sink_open(&sink, g.argv[2], 0);
   zip_open();
   for(i=3; i<g.argc; i++){
     blob_zero(&file);
@@ -598,7 +621,7 @@ void filezip_cmd(void){
     blob_reset(&file);
   }
   zip_close(&sArchive);
-  blob_write_to_file(&zip, g.argv[2]);
+  archive_sink_close(&sink);
 }
 
 /*
@@ -609,8 +632,8 @@ void filezip_cmd(void){
 ** resulting ZIP archive contains a single file which is the RID
 ** object.  The pInclude and pExclude parameters are ignored in this case.
 **
-** If the RID object does not exist in the repository, then
-** pZip is zeroed.
+** The archive is written to pSink as it is generated.  If the RID
+** object does not exist in the repository, then nothing is written.
 **
 ** zDir is a "synthetic" subdirectory which all zipped files get
 ** added to as part of the zip file. It may be 0 or an empty string,
@@ -622,7 +645,7 @@ void filezip_cmd(void){
 static void zip_of_checkin(
   int eType,          /* Type of archive (ZIP or SQLAR) */
   int rid,            /* The RID of the checkin to build the archive from */
-  Blob *pZip,         /* Write the archive content into this blob */
+  ArchiveSink *pSink, /* Write the archive here */
   const char *zDir,   /* Top-level directory of the archive */
   Glob *pInclude,     /* Only include files that match this pattern */
   Glob *pExclude      /* Exclude files that match this pattern */
@@ -636,9 +659,8 @@ static void zip_of_checkin(
   Archive sArchive;
   memset(&sArchive, 0, sizeof(Archive));
   sArchive.eType = eType;
-  sArchive.pBlob = pZip;
+  sArchive.pSink = pSink;
   blob_zero(&sArchive.tmp);
-  blob_zero(pZip);
 
   content_get(rid, &mfile);
   if( blob_size(&mfile)==0 ){
@@ -734,7 +756,7 @@ static void zip_of_checkin(
 */
 static void archive_cmd(int eType){
   int rid;
-  Blob zip;
+  ArchiveSink sink;
   const char *zName;
   Glob *pInclude = 0;
   Glob *pExclude = 0;
@@ -772,11 +794,11 @@ static void archive_cmd(int eType){
        db_get("project-name", "unnamed"), rid, rid
     );
   }
-  zip_of_checkin(eType, rid, &zip, zName, pInclude, pExclude);
+  archive_sink_open(&sink, g.argv[3], 0);
+  zip_of_checkin(eType, rid, &sink, zName, pInclude, pExclude);
+  archive_sink_close(&sink);
   glob_free(pInclude);
   glob_free(pExclude);
-  blob_write_to_file(&zip, g.argv[3]);
-  blob_reset(&zip);
 }
 
 /*
@@ -837,6 +859,7 @@ void sqlar_cmd(void){
 **
 ** Generate a ZIP or SQL archive for the check-in specified by the "r"
 ** query parameter.  Return the archive as the HTTP reply content.
+** A ZIP archive is sent while it is being generated.
 **
 ** If the NAME contains one "/" then the part before the "/" is taken
 ** as the TAG and the part after the "/" becomes the true name.  Hence,
@@ -879,7 +902,7 @@ void baseline_zip_page(void){
   Blob cacheKey;                /* The key to cache */
   Glob *pInclude = 0;           /* The compiled in= glob pattern */
   Glob *pExclude = 0;           /* The compiled ex= glob pattern */
-  Blob zip;                     /* ZIP archive accumulated here */
+  Blob zip;                     /* Archive read from the cache */
   int eType = ARCHIVE_ZIP;      /* Type of archive to generate */
   char *zType;                  /* Human-readable archive type */
 
@@ -971,20 +994,27 @@ void baseline_zip_page(void){
     style_footer();
     return;
   }
+  if( eType==ARCHIVE_ZIP ){
+    cgi_set_content_type("application/zip");
+  }else{
+    cgi_set_content_type("application/sqlar");
+  }
   blob_zero(&zip);
-  if( cache_read(&zip, zKey)==0 ){
-    zip_of_checkin(eType, rid, &zip, zName, pInclude, pExclude);
-    cache_write(&zip, zKey);
+  if( cache_read(&zip, zKey) ){
+    cgi_set_content(&zip);
+  }else{
+    if( cgi_stream_begin() ){
+      ArchiveSink sink;
+      archive_sink_open(&sink, 0, cache_exists());
+      zip_of_checkin(eType, rid, &sink, zName, pInclude, pExclude);
+      if( sink.bCopy ) cache_write(&sink.copy, zKey);
+      blob_reset(&sink.copy);
+    }
+    cgi_stream_end();
   }
   glob_free(pInclude);
   glob_free(pExclude);
   fossil_free(zName);
   fossil_free(zRid);
   blob_reset(&cacheKey);
-  cgi_set_content(&zip);
-  if( eType==ARCHIVE_ZIP ){
-    cgi_set_content_type("application/zip");
-  }else{
-    cgi_set_content_type("application/sqlar");
-  }
 }
@@ -269,6 +269,8 @@ proc get_all_settings {} {
       access-log \
       admin-log \
       allow-symlinks \
+      annotate-threads \
+      artifact-cache-size \
       auto-captcha \
       auto-hyperlink \
       auto-shun \
@@ -278,9 +280,11 @@ proc get_all_settings {} {
       case-sensitive \
       clean-glob \
       clearsign \
+      content-cache-size \
       crlf-glob \
       crnl-glob \
       default-perms \
+      delta-effort \
       diff-binary \
       diff-command \
       dont-push \
@@ -292,6 +296,7 @@ proc get_all_settings {} {
       gdiff-command \
       gmerge-command \
       hash-digits \
+      hash-threads \
       http-port \
       https-login \
       ignore-glob \
@@ -299,6 +304,7 @@ proc get_all_settings {} {
       localauth \
       main-branch \
       manifest \
+      manifest-cache-size \
       max-loadavg \
       max-upload \
       mtime-changes \
@@ -306,10 +312,12 @@ proc get_all_settings {} {
       proxy \
       relative-paths \
       repo-cksum \
+      search-threads \
       self-register \
       ssh-command \
       ssl-ca-location \
       ssl-identity \
+      sync-threads \
       th1-setup \
       th1-uri-regexp \
       uv-sync \